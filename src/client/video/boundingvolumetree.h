@@ -0,0 +1,592 @@
+#ifndef BOUNDINGVOLUMETREE_H
+#define BOUNDINGVOLUMETREE_H
+
+#include <cstdint>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+struct BoundingBox
+{
+	float min[3];
+	float max[3];
+
+	bool Contains(const BoundingBox& box) const
+	{
+		for (int i = 0; i < 3; ++i) {
+			if (box.min[i] < min[i] || box.max[i] > max[i]) {
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	// Half of the surface area, the cost of a node in the tree.
+	float Area() const
+	{
+		float x = max[0] - min[0];
+		float y = max[1] - min[1];
+		float z = max[2] - min[2];
+
+		return x * y + y * z + z * x;
+	}
+
+	static BoundingBox Union(const BoundingBox& a, const BoundingBox& b)
+	{
+		BoundingBox box;
+
+		for (int i = 0; i < 3; ++i) {
+			box.min[i] = std::min(a.min[i], b.min[i]);
+			box.max[i] = std::max(a.max[i], b.max[i]);
+		}
+
+		return box;
+	}
+};
+
+// Planes of a view frustum, tested against boxes four at a time.
+class Frustum
+{
+public:
+	enum Result
+	{
+		Outside,
+		Intersecting,
+		Inside
+	};
+
+	// Takes a column-major projection-view matrix with depth in [0, 1].
+	Frustum(const float* matrix)
+	{
+		float rows[4][4];
+
+		for (int row = 0; row < 4; ++row) {
+			for (int column = 0; column < 4; ++column) {
+				rows[row][column] = matrix[column * 4 + row];
+			}
+		}
+
+		// Left, right, bottom, top, near, far.
+		float planes[6][4];
+
+		for (int i = 0; i < 4; ++i) {
+			planes[0][i] = rows[3][i] + rows[0][i];
+			planes[1][i] = rows[3][i] - rows[0][i];
+			planes[2][i] = rows[3][i] + rows[1][i];
+			planes[3][i] = rows[3][i] - rows[1][i];
+			planes[4][i] = rows[2][i];
+			planes[5][i] = rows[3][i] - rows[2][i];
+		}
+
+		// The last two planes accept everything.
+		for (int plane = 0; plane < PlaneCount; ++plane) {
+			bool real = plane < 6;
+
+			x[plane] = real ? planes[plane][0] : 0.0f;
+			y[plane] = real ? planes[plane][1] : 0.0f;
+			z[plane] = real ? planes[plane][2] : 0.0f;
+			w[plane] = real ? planes[plane][3] : 1.0f;
+
+			absX[plane] = std::fabs(x[plane]);
+			absY[plane] = std::fabs(y[plane]);
+			absZ[plane] = std::fabs(z[plane]);
+		}
+	}
+
+	Result Test(const BoundingBox& box) const
+	{
+		float center[3];
+		float extent[3];
+
+		for (int i = 0; i < 3; ++i) {
+			center[i] = (box.min[i] + box.max[i]) * 0.5f;
+			extent[i] = (box.max[i] - box.min[i]) * 0.5f;
+		}
+
+		// For every plane the box center distance s and the projected
+		// half size r: the box is outside if s + r < 0 and crosses the
+		// plane if s - r < 0.
+		int outside = 0;
+		int crossing = 0;
+
+#ifdef __SSE__
+		__m128 cx = _mm_set1_ps(center[0]);
+		__m128 cy = _mm_set1_ps(center[1]);
+		__m128 cz = _mm_set1_ps(center[2]);
+		__m128 ex = _mm_set1_ps(extent[0]);
+		__m128 ey = _mm_set1_ps(extent[1]);
+		__m128 ez = _mm_set1_ps(extent[2]);
+		__m128 zero = _mm_setzero_ps();
+
+		for (int plane = 0; plane < PlaneCount; plane += 4) {
+			__m128 s = _mm_add_ps(
+				_mm_add_ps(
+					_mm_mul_ps(_mm_load_ps(x + plane), cx),
+					_mm_mul_ps(_mm_load_ps(y + plane), cy)),
+				_mm_add_ps(
+					_mm_mul_ps(_mm_load_ps(z + plane), cz),
+					_mm_load_ps(w + plane)));
+			__m128 r = _mm_add_ps(
+				_mm_add_ps(
+					_mm_mul_ps(_mm_load_ps(absX + plane), ex),
+					_mm_mul_ps(_mm_load_ps(absY + plane), ey)),
+				_mm_mul_ps(_mm_load_ps(absZ + plane), ez));
+
+			outside |= _mm_movemask_ps(
+				_mm_cmplt_ps(_mm_add_ps(s, r), zero));
+			crossing |= _mm_movemask_ps(
+				_mm_cmplt_ps(_mm_sub_ps(s, r), zero));
+		}
+#else
+		for (int plane = 0; plane < PlaneCount; ++plane) {
+			float s =
+				x[plane] * center[0] +
+				y[plane] * center[1] +
+				z[plane] * center[2] +
+				w[plane];
+			float r =
+				absX[plane] * extent[0] +
+				absY[plane] * extent[1] +
+				absZ[plane] * extent[2];
+
+			outside |= s + r < 0.0f;
+			crossing |= s - r < 0.0f;
+		}
+#endif
+
+		if (outside) {
+			return Outside;
+		}
+
+		return crossing ? Intersecting : Inside;
+	}
+
+	// Plane index, left to far, as (a, b, c, d) with points inside where
+	// a * x + b * y + c * z + d >= 0.
+	void GetPlane(int index, float plane[4]) const
+	{
+		plane[0] = x[index];
+		plane[1] = y[index];
+		plane[2] = z[index];
+		plane[3] = w[index];
+	}
+
+private:
+	static const int PlaneCount = 8;
+
+	alignas(16) float x[PlaneCount];
+	alignas(16) float y[PlaneCount];
+	alignas(16) float z[PlaneCount];
+	alignas(16) float w[PlaneCount];
+	alignas(16) float absX[PlaneCount];
+	alignas(16) float absY[PlaneCount];
+	alignas(16) float absZ[PlaneCount];
+};
+
+// Dynamic bounding volume hierarchy of boxes with values.
+//
+// Leaves keep their box grown by a margin, so objects moving a little
+// do not change the tree. New leaves go next to the node that grows the
+// tree area the least and the tree is kept balanced with rotations, as
+// in Box2D's dynamic tree. Proxies, the handles of leaves, stay valid
+// until they are removed.
+template<typename Value>
+class BoundingVolumeTree
+{
+public:
+	static const uint32_t None = 0xffffffff;
+
+	BoundingVolumeTree(float margin = 0.1f)
+	{
+		this->margin = margin;
+		root = None;
+		leafCount = 0;
+	}
+
+	uint32_t Insert(const BoundingBox& box, Value value)
+	{
+		uint32_t leaf = NewNode();
+		Node& node = nodes[leaf];
+
+		node.box = Fatten(box);
+		node.value = value;
+		node.height = 0;
+
+		InsertLeaf(leaf);
+		++leafCount;
+
+		return leaf;
+	}
+
+	void Remove(uint32_t proxy)
+	{
+		CheckProxy(proxy);
+
+		RemoveLeaf(proxy);
+		nodes[proxy].height = -1;
+		unusedNodes.push_back(proxy);
+		--leafCount;
+	}
+
+	// Returns true if the box left the grown box of the leaf, which
+	// moves the leaf in the tree.
+	bool Move(uint32_t proxy, const BoundingBox& box)
+	{
+		CheckProxy(proxy);
+
+		if (nodes[proxy].box.Contains(box)) {
+			return false;
+		}
+
+		RemoveLeaf(proxy);
+		nodes[proxy].box = Fatten(box);
+		InsertLeaf(proxy);
+
+		return true;
+	}
+
+	Value GetValue(uint32_t proxy) const
+	{
+		CheckProxy(proxy);
+		return nodes[proxy].value;
+	}
+
+	// Grown box of the leaf.
+	const BoundingBox& GetBox(uint32_t proxy) const
+	{
+		CheckProxy(proxy);
+		return nodes[proxy].box;
+	}
+
+	uint32_t GetLeafCount() const
+	{
+		return leafCount;
+	}
+
+	int32_t GetHeight() const
+	{
+		return root == None ? 0 : nodes[root].height;
+	}
+
+	// Appends the values of the leaves whose grown box is not outside
+	// frustum. Subtrees inside the frustum are not tested further.
+	// Returns the number of tested nodes.
+	uint32_t Cull(const Frustum& frustum, std::vector<Value>& values) const
+	{
+		if (root == None) {
+			return 0;
+		}
+
+		uint32_t tested = 0;
+
+		stack.clear();
+		stack.push_back(root);
+
+		while (!stack.empty()) {
+			uint32_t index = stack.back();
+			stack.pop_back();
+
+			const Node& node = nodes[index];
+			Frustum::Result result = frustum.Test(node.box);
+			++tested;
+
+			if (result == Frustum::Outside) {
+				continue;
+			}
+
+			if (node.IsLeaf()) {
+				values.push_back(node.value);
+			} else if (result == Frustum::Inside) {
+				CollectLeaves(index, values);
+			} else {
+				stack.push_back(node.children[0]);
+				stack.push_back(node.children[1]);
+			}
+		}
+
+		return tested;
+	}
+
+private:
+	struct Node
+	{
+		BoundingBox box;
+		Value value;
+		uint32_t parent;
+		uint32_t children[2];
+		// 0 for leaves, -1 for unused nodes.
+		int32_t height;
+
+		bool IsLeaf() const
+		{
+			return children[0] == None;
+		}
+	};
+
+	float margin;
+	std::vector<Node> nodes;
+	std::vector<uint32_t> unusedNodes;
+	uint32_t root;
+	uint32_t leafCount;
+
+	mutable std::vector<uint32_t> stack;
+
+	BoundingBox Fatten(const BoundingBox& box) const
+	{
+		BoundingBox fat;
+
+		for (int i = 0; i < 3; ++i) {
+			fat.min[i] = box.min[i] - margin;
+			fat.max[i] = box.max[i] + margin;
+		}
+
+		return fat;
+	}
+
+	void CheckProxy(uint32_t proxy) const
+	{
+		if (proxy >= nodes.size() || nodes[proxy].height != 0) {
+			throw std::runtime_error("invalid bounding volume proxy");
+		}
+	}
+
+	uint32_t NewNode()
+	{
+		uint32_t index;
+
+		if (!unusedNodes.empty()) {
+			index = unusedNodes.back();
+			unusedNodes.pop_back();
+		} else {
+			nodes.push_back(Node());
+			index = nodes.size() - 1;
+		}
+
+		Node& node = nodes[index];
+		node.parent = None;
+		node.children[0] = None;
+		node.children[1] = None;
+		node.height = 0;
+
+		return index;
+	}
+
+	void FreeNode(uint32_t index)
+	{
+		nodes[index].height = -1;
+		unusedNodes.push_back(index);
+	}
+
+	void CollectLeaves(uint32_t index, std::vector<Value>& values) const
+	{
+		size_t bottom = stack.size();
+		stack.push_back(index);
+
+		while (stack.size() > bottom) {
+			const Node& node = nodes[stack.back()];
+			stack.pop_back();
+
+			if (node.IsLeaf()) {
+				values.push_back(node.value);
+			} else {
+				stack.push_back(node.children[0]);
+				stack.push_back(node.children[1]);
+			}
+		}
+	}
+
+	void InsertLeaf(uint32_t leaf)
+	{
+		if (root == None) {
+			root = leaf;
+			nodes[root].parent = None;
+			return;
+		}
+
+		// Descend to the sibling with the smallest area increase.
+		BoundingBox box = nodes[leaf].box;
+		uint32_t index = root;
+
+		while (!nodes[index].IsLeaf()) {
+			const Node& node = nodes[index];
+			float area = node.box.Area();
+			float combinedArea = BoundingBox::Union(node.box, box).Area();
+
+			// Cost of a new parent here and the least cost pushed down
+			// into the children.
+			float cost = 2.0f * combinedArea;
+			float inheritance = 2.0f * (combinedArea - area);
+
+			float childCosts[2];
+
+			for (int i = 0; i < 2; ++i) {
+				const Node& child = nodes[node.children[i]];
+				float grown = BoundingBox::Union(child.box, box).Area();
+
+				if (child.IsLeaf()) {
+					childCosts[i] = grown + inheritance;
+				} else {
+					childCosts[i] =
+						grown - child.box.Area() + inheritance;
+				}
+			}
+
+			if (cost < childCosts[0] && cost < childCosts[1]) {
+				break;
+			}
+
+			index = node.children[childCosts[0] < childCosts[1] ? 0 : 1];
+		}
+
+		uint32_t sibling = index;
+		uint32_t oldParent = nodes[sibling].parent;
+		uint32_t newParent = NewNode();
+
+		nodes[newParent].parent = oldParent;
+		nodes[newParent].box = BoundingBox::Union(box, nodes[sibling].box);
+		nodes[newParent].height = nodes[sibling].height + 1;
+		nodes[newParent].children[0] = sibling;
+		nodes[newParent].children[1] = leaf;
+		nodes[sibling].parent = newParent;
+		nodes[leaf].parent = newParent;
+
+		if (oldParent == None) {
+			root = newParent;
+		} else if (nodes[oldParent].children[0] == sibling) {
+			nodes[oldParent].children[0] = newParent;
+		} else {
+			nodes[oldParent].children[1] = newParent;
+		}
+
+		Refit(nodes[leaf].parent);
+	}
+
+	void RemoveLeaf(uint32_t leaf)
+	{
+		if (leaf == root) {
+			root = None;
+			return;
+		}
+
+		uint32_t parent = nodes[leaf].parent;
+		uint32_t grandParent = nodes[parent].parent;
+		uint32_t sibling = nodes[parent].children[0] == leaf ?
+			nodes[parent].children[1] :
+			nodes[parent].children[0];
+
+		FreeNode(parent);
+
+		if (grandParent == None) {
+			root = sibling;
+			nodes[sibling].parent = None;
+			return;
+		}
+
+		if (nodes[grandParent].children[0] == parent) {
+			nodes[grandParent].children[0] = sibling;
+		} else {
+			nodes[grandParent].children[1] = sibling;
+		}
+
+		nodes[sibling].parent = grandParent;
+
+		Refit(grandParent);
+	}
+
+	// Balances and refits the nodes from index up to the root.
+	void Refit(uint32_t index)
+	{
+		while (index != None) {
+			index = Balance(index);
+
+			Node& node = nodes[index];
+			const Node& left = nodes[node.children[0]];
+			const Node& right = nodes[node.children[1]];
+
+			node.height = 1 + std::max(left.height, right.height);
+			node.box = BoundingBox::Union(left.box, right.box);
+
+			index = node.parent;
+		}
+	}
+
+	// Rotates the higher child of a node up if the heights of its
+	// children differ by more than one. Returns the node now in its
+	// place.
+	uint32_t Balance(uint32_t a)
+	{
+		if (nodes[a].IsLeaf() || nodes[a].height < 2) {
+			return a;
+		}
+
+		uint32_t b = nodes[a].children[0];
+		uint32_t c = nodes[a].children[1];
+		int32_t balance = nodes[c].height - nodes[b].height;
+
+		if (balance > 1) {
+			return Rotate(a, c, 1);
+		}
+
+		if (balance < -1) {
+			return Rotate(a, b, 0);
+		}
+
+		return a;
+	}
+
+	// Swaps node a with its child up (at side of a) and hands the lower
+	// grandchild to a.
+	uint32_t Rotate(uint32_t a, uint32_t up, int side)
+	{
+		uint32_t f = nodes[up].children[0];
+		uint32_t g = nodes[up].children[1];
+		uint32_t other = nodes[a].children[1 - side];
+
+		nodes[up].children[0] = a;
+		nodes[up].parent = nodes[a].parent;
+		nodes[a].parent = up;
+
+		uint32_t parent = nodes[up].parent;
+
+		if (parent == None) {
+			root = up;
+		} else if (nodes[parent].children[0] == a) {
+			nodes[parent].children[0] = up;
+		} else {
+			nodes[parent].children[1] = up;
+		}
+
+		// The higher grandchild stays under up.
+		uint32_t high = f;
+		uint32_t low = g;
+
+		if (nodes[f].height < nodes[g].height) {
+			high = g;
+			low = f;
+		}
+
+		nodes[up].children[1] = high;
+		nodes[a].children[side] = low;
+		nodes[low].parent = a;
+
+		nodes[a].box = BoundingBox::Union(
+			nodes[other].box,
+			nodes[low].box);
+		nodes[a].height =
+			1 + std::max(nodes[other].height, nodes[low].height);
+
+		nodes[up].box = BoundingBox::Union(nodes[a].box, nodes[high].box);
+		nodes[up].height =
+			1 + std::max(nodes[a].height, nodes[high].height);
+
+		return up;
+	}
+};
+
+#endif
@@ -0,0 +1,390 @@
+#ifndef SECTORALLOCATOR_H
+#define SECTORALLOCATOR_H
+
+#include <cstdint>
+#include <vector>
+#include <stdexcept>
+
+// Two-level segregated fit (TLSF) allocator of sector ranges in
+// partitions.
+//
+// Free ranges are kept in lists by size class: the first level is the
+// power of two of the size and the second level splits each power of two
+// into SecondLevelCount steps. Bitmaps of non-empty lists make finding a
+// large enough range and freeing one (with merging of free neighbours)
+// constant time. The allocator only does bookkeeping, the owner backs
+// partitions with memory.
+class SectorAllocator
+{
+public:
+	struct Allocation
+	{
+		uint32_t partition;
+		// Offset and size in sectors.
+		uint32_t offset;
+		uint32_t size;
+		uint32_t block;
+	};
+
+	struct Statistics
+	{
+		uint32_t partitions;
+		uint64_t totalSectors;
+		uint64_t usedSectors;
+		uint32_t allocations;
+		uint32_t freeBlocks;
+		uint32_t largestFreeBlock;
+
+		// Share of free sectors outside the largest free range.
+		double Fragmentation() const
+		{
+			uint64_t freeSectors = totalSectors - usedSectors;
+
+			if (freeSectors == 0) {
+				return 0.0;
+			}
+
+			return 1.0 - double(largestFreeBlock) / double(freeSectors);
+		}
+	};
+
+private:
+	static const uint32_t SecondLevelBits = 4;
+	static const uint32_t SecondLevelCount = 1 << SecondLevelBits;
+	static const uint32_t FirstLevelCount = 32 - SecondLevelBits + 1;
+	static const uint32_t None = 0xffffffff;
+
+	struct Block
+	{
+		uint32_t partition;
+		uint32_t offset;
+		uint32_t size;
+		bool free;
+
+		// Neighbours in the partition.
+		uint32_t previous;
+		uint32_t next;
+
+		// Neighbours in the free list.
+		uint32_t previousFree;
+		uint32_t nextFree;
+	};
+
+	std::vector<Block> blocks;
+	std::vector<uint32_t> unusedBlocks;
+
+	uint32_t firstLevelMap;
+	uint32_t secondLevelMap[FirstLevelCount];
+	uint32_t freeLists[FirstLevelCount][SecondLevelCount];
+
+	std::vector<uint32_t> partitionSizes;
+	uint64_t totalSectors;
+	uint64_t usedSectors;
+	uint32_t allocations;
+	uint32_t freeBlocks;
+
+	static uint32_t HighestBit(uint32_t value)
+	{
+		return 31 - __builtin_clz(value);
+	}
+
+	static uint32_t LowestBit(uint32_t value)
+	{
+		return __builtin_ctz(value);
+	}
+
+	// Size class holding ranges of size sectors.
+	static void Mapping(uint32_t size, uint32_t& first, uint32_t& second)
+	{
+		if (size < SecondLevelCount) {
+			first = 0;
+			second = size;
+			return;
+		}
+
+		uint32_t bit = HighestBit(size);
+		first = bit - SecondLevelBits + 1;
+		second = (size >> (bit - SecondLevelBits)) ^ SecondLevelCount;
+	}
+
+	// Smallest size class whose every range fits size sectors. Sizes no
+	// class can hold map to first = FirstLevelCount.
+	static void SearchMapping(
+		uint32_t size,
+		uint32_t& first,
+		uint32_t& second)
+	{
+		if (size >= SecondLevelCount) {
+			uint32_t bit = HighestBit(size);
+			uint32_t step = (1u << (bit - SecondLevelBits)) - 1;
+
+			// Rounding up would wrap around.
+			if (size > None - step) {
+				first = FirstLevelCount;
+				second = 0;
+				return;
+			}
+
+			size += step;
+		}
+
+		Mapping(size, first, second);
+	}
+
+	uint32_t NewBlock()
+	{
+		if (!unusedBlocks.empty()) {
+			uint32_t block = unusedBlocks.back();
+			unusedBlocks.pop_back();
+			return block;
+		}
+
+		blocks.push_back(Block());
+		return blocks.size() - 1;
+	}
+
+	void InsertFree(uint32_t index)
+	{
+		Block& block = blocks[index];
+		uint32_t first;
+		uint32_t second;
+
+		Mapping(block.size, first, second);
+
+		block.free = true;
+		block.previousFree = None;
+		block.nextFree = freeLists[first][second];
+
+		if (block.nextFree != None) {
+			blocks[block.nextFree].previousFree = index;
+		}
+
+		freeLists[first][second] = index;
+		firstLevelMap |= 1u << first;
+		secondLevelMap[first] |= 1u << second;
+		++freeBlocks;
+	}
+
+	void RemoveFree(uint32_t index)
+	{
+		Block& block = blocks[index];
+		uint32_t first;
+		uint32_t second;
+
+		Mapping(block.size, first, second);
+
+		if (block.previousFree != None) {
+			blocks[block.previousFree].nextFree = block.nextFree;
+		} else {
+			freeLists[first][second] = block.nextFree;
+		}
+
+		if (block.nextFree != None) {
+			blocks[block.nextFree].previousFree = block.previousFree;
+		}
+
+		if (freeLists[first][second] == None) {
+			secondLevelMap[first] &= ~(1u << second);
+
+			if (secondLevelMap[first] == 0) {
+				firstLevelMap &= ~(1u << first);
+			}
+		}
+
+		block.free = false;
+		--freeBlocks;
+	}
+
+	// Returns the head of the first non-empty list at or above the size
+	// class, or None.
+	uint32_t FindFree(uint32_t first, uint32_t second) const
+	{
+		uint32_t secondMap = secondLevelMap[first] & (~0u << second);
+
+		if (secondMap == 0) {
+			uint32_t firstMap = firstLevelMap & (~0u << (first + 1));
+
+			if (firstMap == 0) {
+				return None;
+			}
+
+			first = LowestBit(firstMap);
+			secondMap = secondLevelMap[first];
+		}
+
+		return freeLists[first][LowestBit(secondMap)];
+	}
+
+	// Merges the block right after index into it. Neither may be in a
+	// free list.
+	void Merge(uint32_t index, uint32_t next)
+	{
+		Block& block = blocks[index];
+
+		block.size += blocks[next].size;
+		block.next = blocks[next].next;
+
+		if (block.next != None) {
+			blocks[block.next].previous = index;
+		}
+
+		unusedBlocks.push_back(next);
+	}
+
+public:
+	SectorAllocator()
+	{
+		firstLevelMap = 0;
+
+		for (uint32_t first = 0; first < FirstLevelCount; ++first) {
+			secondLevelMap[first] = 0;
+
+			for (uint32_t second = 0; second < SecondLevelCount; ++second) {
+				freeLists[first][second] = None;
+			}
+		}
+
+		totalSectors = 0;
+		usedSectors = 0;
+		allocations = 0;
+		freeBlocks = 0;
+	}
+
+	// Adds an empty partition of size sectors and returns its index.
+	uint32_t AddPartition(uint32_t size)
+	{
+		uint32_t index = NewBlock();
+		Block& block = blocks[index];
+
+		block.partition = partitionSizes.size();
+		block.offset = 0;
+		block.size = size;
+		block.previous = None;
+		block.next = None;
+
+		InsertFree(index);
+
+		partitionSizes.push_back(size);
+		totalSectors += size;
+
+		return block.partition;
+	}
+
+	// Returns false if no partition has size free sectors in a row.
+	bool Allocate(uint32_t size, Allocation& allocation)
+	{
+		if (size == 0) {
+			size = 1;
+		}
+
+		uint32_t first;
+		uint32_t second;
+
+		SearchMapping(size, first, second);
+
+		if (first >= FirstLevelCount) {
+			return false;
+		}
+
+		uint32_t index = FindFree(first, second);
+
+		if (index == None) {
+			return false;
+		}
+
+		RemoveFree(index);
+
+		if (blocks[index].size > size) {
+			uint32_t rest = NewBlock();
+			Block& block = blocks[index];
+			Block& remainder = blocks[rest];
+
+			remainder.partition = block.partition;
+			remainder.offset = block.offset + size;
+			remainder.size = block.size - size;
+			remainder.previous = index;
+			remainder.next = block.next;
+
+			if (remainder.next != None) {
+				blocks[remainder.next].previous = rest;
+			}
+
+			block.size = size;
+			block.next = rest;
+
+			InsertFree(rest);
+		}
+
+		const Block& block = blocks[index];
+
+		allocation.partition = block.partition;
+		allocation.offset = block.offset;
+		allocation.size = block.size;
+		allocation.block = index;
+
+		usedSectors += block.size;
+		++allocations;
+
+		return true;
+	}
+
+	void Free(const Allocation& allocation)
+	{
+		uint32_t index = allocation.block;
+
+		if (index >= blocks.size() || blocks[index].free ||
+			blocks[index].offset != allocation.offset ||
+			blocks[index].partition != allocation.partition)
+		{
+			throw std::runtime_error("failed to free invalid allocation");
+		}
+
+		usedSectors -= blocks[index].size;
+		--allocations;
+
+		uint32_t next = blocks[index].next;
+
+		if (next != None && blocks[next].free) {
+			RemoveFree(next);
+			Merge(index, next);
+		}
+
+		uint32_t previous = blocks[index].previous;
+
+		if (previous != None && blocks[previous].free) {
+			RemoveFree(previous);
+			Merge(previous, index);
+			index = previous;
+		}
+
+		InsertFree(index);
+	}
+
+	Statistics GetStatistics() const
+	{
+		Statistics statistics;
+		statistics.partitions = partitionSizes.size();
+		statistics.totalSectors = totalSectors;
+		statistics.usedSectors = usedSectors;
+		statistics.allocations = allocations;
+		statistics.freeBlocks = freeBlocks;
+		statistics.largestFreeBlock = 0;
+
+		if (firstLevelMap != 0) {
+			uint32_t first = HighestBit(firstLevelMap);
+			uint32_t second = HighestBit(secondLevelMap[first]);
+
+			for (uint32_t index = freeLists[first][second]; index != None;
+				index = blocks[index].nextFree)
+			{
+				if (blocks[index].size > statistics.largestFreeBlock) {
+					statistics.largestFreeBlock = blocks[index].size;
+				}
+			}
+		}
+
+		return statistics;
+	}
+};
+
+#endif
@@ -1,22 +1,22 @@
 #version 450
 #extension GL_ARB_separate_shader_objects : enable
 
-layout(binding = 0) uniform UniformBufferObject {
-	mat4 model;
+layout(binding = 0) uniform CameraUniform {
 	mat4 view;
 	mat4 proj;
-} ubo;
+} camera;
 
 layout(location = 0) in vec3 inPosition;
 layout(location = 1) in vec3 inColor;
 layout(location = 2) in vec2 inTexCoord;
+layout(location = 3) in mat4 inModel;
 
 layout(location = 0) out vec3 fragColor;
 layout(location = 1) out vec2 fragTexCoord;
 
 void main()
 {
-	gl_Position = ubo.proj * ubo.view * ubo.model *
+	gl_Position = camera.proj * camera.view * inModel *
 		vec4(inPosition, 1.0);
 	fragColor = inColor;
 	fragTexCoord = inTexCoord;
@@ -1,5 +1,6 @@
 #include <stdexcept>
 #include <cstring>
+#include <tuple>
 #include "video.h"
 
 #define STB_IMAGE_IMPLEMENTATION
@@ -10,6 +11,7 @@
 
 #include "shaders/vert.spv"
 #include "shaders/frag.spv"
+#include "shaders/cull.spv"
 
 // Validation layers
 #ifndef VALIDATE
@@ -77,10 +79,17 @@ void Video::InitVulkan()
 
 	vertexBufferMemoryManager = nullptr;
 	indexBufferMemoryManager = nullptr;
-	uniformBufferMemoryManager = nullptr;
 	textureImageMemoryManager = nullptr;
+	uniformCapacity = 0;
+	modelGeneration = 1;
+	indirectGeneration = 0;
+	indirectDrawing = false;
+	indirectDrawingRequested = false;
+	uploadSubmitted = 0;
+	uploadCompleted = 0;
+	stagingCapacity = StagingBufferSize;
+	cullingStatistics = {0, 0, 0};
 	allowDescriptorPoolCreation = false;
-	allowUniformBufferCreation = false;
 	allowVertexBufferCreation = false;
 	allowIndexBufferCreation = false;
 	allowDescriptorSetCreation = false;
@@ -92,24 +101,33 @@ void Video::InitVulkan()
 	PickPhysicalDevice();
 	CreateLogicalDevice();
 	CreateCommandPools();
+	StartRecordingThreads();
 	CreateSyncObjects();
+	CreateStagingBuffer();
 	CreateDescriptorSetLayout();
+	CreateCullPipeline();
 	CreateVertexBuffers();
 	CreateIndexBuffers();
 	CreateTextureImages();
+	SubmitUploads();
 
 	CreateSwapchain();
 }
 
 void Video::CloseVulkan()
 {
+	FreeAllRetiredAssets();
 	DestroySwapchain();
+	WaitUploads();
 
 	DestroyTextureImages();
 	DestroyIndexBuffers();
 	DestroyVertexBuffers();
+	DestroyCullPipeline();
 	DestroyDescriptorSetLayout();
+	DestroyStagingBuffer();
 	DestroySyncObjects();
+	StopRecordingThreads();
 	DestroyCommandPools();
 
 	if (vertexBufferMemoryManager) {
@@ -120,10 +138,6 @@ void Video::CloseVulkan()
 		delete indexBufferMemoryManager;
 	}
 
-	if (uniformBufferMemoryManager) {
-		delete uniformBufferMemoryManager;
-	}
-
 	if (textureImageMemoryManager) {
 		delete textureImageMemoryManager;
 	}
@@ -143,18 +157,22 @@ void Video::CreateSwapchain()
 	CreateDescriptorPools();
 	CreateUniformBuffers();
 	CreateDescriptorSets();
+	CreateCullDescriptorSets();
 	CreateRenderPass();
 	CreateGraphicsPipeline();
 	CreateFramebuffers();
 	CreateCommandBuffers();
+	CreateRecordingCommandBuffers();
 }
 
 void Video::DestroySwapchain()
 {
+	DestroyRecordingCommandBuffers();
 	DestroyCommandBuffers();
 	DestroyFramebuffers();
 	DestroyGraphicsPipeline();
 	DestroyRenderPass();
+	DestroyCullDescriptorSets();
 	DestroyUniformBuffers();
 	DestroyDescriptorPools();
 	DestroySwapchainSyncObjects();
@@ -176,7 +194,11 @@ void Video::RecreateSwapchain()
 		glfwWaitEvents();
 	}
 
+	queueMutex.lock();
 	vkDeviceWaitIdle(device);
+	queueMutex.unlock();
+
+	FreeAllRetiredAssets();
 
 	DestroySwapchain();
 	CreateSwapchain();
@@ -190,7 +212,7 @@ void Video::CreateInstance()
 	appInfo.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
 	appInfo.pEngineName = "No Engine";
 	appInfo.engineVersion = VK_MAKE_VERSION(1, 0, 0);
-	appInfo.apiVersion = VK_API_VERSION_1_0;
+	appInfo.apiVersion = VK_API_VERSION_1_2;
 
 	VkInstanceCreateInfo instanceInfo{};
 	instanceInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
@@ -255,10 +277,24 @@ void Video::PickPhysicalDevice()
 	std::vector<VkPhysicalDevice> devices(deviceCount);
 	vkEnumeratePhysicalDevices(instance, &deviceCount, devices.data());
 
+	// Prefer a discrete GPU, but take another device, such as a software
+	// driver, if there is none.
 	for (const auto& device : devices) {
-		if (IsDeviceSuitable(device)) {
+		if (!IsDeviceSuitable(device)) {
+			continue;
+		}
+
+		VkPhysicalDeviceProperties deviceProperties;
+		vkGetPhysicalDeviceProperties(device, &deviceProperties);
+
+		bool discrete = deviceProperties.deviceType ==
+			VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU;
+
+		if (physicalDevice == VK_NULL_HANDLE || discrete) {
 			physicalDevice = device;
-			msaaSamples = GetMaxUsableSampleCount();
+		}
+
+		if (discrete) {
 			break;
 		}
 	}
@@ -266,6 +302,8 @@ void Video::PickPhysicalDevice()
 	if (physicalDevice == VK_NULL_HANDLE) {
 		throw std::runtime_error("failed to find suitable GPU");
 	}
+
+	msaaSamples = GetMaxUsableSampleCount();
 }
 
 void Video::CreateLogicalDevice()
@@ -276,7 +314,8 @@ void Video::CreateLogicalDevice()
 
 	std::set<uint32_t> uniqueQueueFamilies = {
 		indices.graphicsFamily.value(),
-		indices.presentFamily.value()
+		indices.presentFamily.value(),
+		indices.transferFamily.value()
 	};
 
 	float queuePriority = 1.0f;
@@ -292,19 +331,34 @@ void Video::CreateLogicalDevice()
 		queueCreateInfos.push_back(queueCreateInfo);
 	}
 
+	indirectDrawingSupported = CheckIndirectDrawingSupport(physicalDevice);
+
+	std::vector<const char*> extensions = deviceExtensions;
+
 	VkPhysicalDeviceFeatures deviceFeatures{};
 	deviceFeatures.samplerAnisotropy = VK_TRUE;
 	deviceFeatures.sampleRateShading = VK_TRUE;
 
+	if (indirectDrawingSupported) {
+		deviceFeatures.multiDrawIndirect = VK_TRUE;
+		deviceFeatures.drawIndirectFirstInstance = VK_TRUE;
+	}
+
+	VkPhysicalDeviceVulkan12Features deviceFeatures12{};
+	deviceFeatures12.sType =
+		VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+	deviceFeatures12.timelineSemaphore = VK_TRUE;
+
 	VkDeviceCreateInfo deviceInfo{};
 	deviceInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+	deviceInfo.pNext = &deviceFeatures12;
 	deviceInfo.queueCreateInfoCount =
 		static_cast<uint32_t>(queueCreateInfos.size());
 	deviceInfo.pQueueCreateInfos = queueCreateInfos.data();
 	deviceInfo.pEnabledFeatures = &deviceFeatures;
 	deviceInfo.enabledExtensionCount =
-		static_cast<uint32_t>(deviceExtensions.size());
-	deviceInfo.ppEnabledExtensionNames = deviceExtensions.data();
+		static_cast<uint32_t>(extensions.size());
+	deviceInfo.ppEnabledExtensionNames = extensions.data();
 
 	if (validate) {
 		deviceInfo.enabledLayerCount =
@@ -335,6 +389,12 @@ void Video::CreateLogicalDevice()
 		indices.presentFamily.value(),
 		0,
 		&presentQueue);
+
+	vkGetDeviceQueue(
+		device,
+		indices.transferFamily.value(),
+		0,
+		&transferQueue);
 }
 
 void Video::DestroyLogicalDevice()
@@ -350,24 +410,25 @@ void Video::CreateCommandPools()
 	VkCommandPoolCreateInfo poolInfo{};
 	poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
 	poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
-	poolInfo.flags = 0;
+	poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
 
-	VkResult res =
-		vkCreateCommandPool(device, &poolInfo, nullptr, &commandPool);
+	VkResult res = vkCreateCommandPool(
+		device,
+		&poolInfo,
+		nullptr,
+		&transferCommandPool);
 
 	if (res != VK_SUCCESS) {
 		throw std::runtime_error("failed to create command pool");
 	}
 
-	poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-	poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
-	poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+	poolInfo.queueFamilyIndex = queueFamilyIndices.transferFamily.value();
 
 	res = vkCreateCommandPool(
 		device,
 		&poolInfo,
 		nullptr,
-		&transferCommandPool);
+		&uploadCommandPool);
 
 	if (res != VK_SUCCESS) {
 		throw std::runtime_error("failed to create command pool");
@@ -376,8 +437,8 @@ void Video::CreateCommandPools()
 
 void Video::DestroyCommandPools()
 {
+	vkDestroyCommandPool(device, uploadCommandPool, nullptr);
 	vkDestroyCommandPool(device, transferCommandPool, nullptr);
-	vkDestroyCommandPool(device, commandPool, nullptr);
 }
 
 void Video::CreateSyncObjects()
@@ -392,10 +453,30 @@ void Video::CreateSyncObjects()
 	if (res != VK_SUCCESS) {
 		throw std::runtime_error("failed to create fence");
 	}
+
+	VkSemaphoreTypeCreateInfo semaphoreTypeInfo{};
+	semaphoreTypeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+	semaphoreTypeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+	semaphoreTypeInfo.initialValue = 0;
+
+	VkSemaphoreCreateInfo semaphoreInfo{};
+	semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+	semaphoreInfo.pNext = &semaphoreTypeInfo;
+
+	res = vkCreateSemaphore(
+		device,
+		&semaphoreInfo,
+		nullptr,
+		&uploadSemaphore);
+
+	if (res != VK_SUCCESS) {
+		throw std::runtime_error("failed to create semaphore");
+	}
 }
 
 void Video::DestroySyncObjects()
 {
+	vkDestroySemaphore(device, uploadSemaphore, nullptr);
 	vkDestroyFence(device, bufferCopyFence, nullptr);
 }
 
@@ -443,7 +524,101 @@ void Video::DestroyDescriptorSetLayout()
 	vkDestroyDescriptorSetLayout(device, descriptorSetLayout, nullptr);
 }
 
-void Video::CreateTextureSampler(Model* model)
+void Video::CreateCullPipeline()
+{
+	if (!indirectDrawingSupported) {
+		return;
+	}
+
+	// Records, draw commands and instances.
+	std::vector<VkDescriptorSetLayoutBinding> bindings(3);
+
+	for (uint32_t i = 0; i < bindings.size(); ++i) {
+		bindings[i].binding = i;
+		bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		bindings[i].descriptorCount = 1;
+		bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+		bindings[i].pImmutableSamplers = nullptr;
+	}
+
+	VkDescriptorSetLayoutCreateInfo layoutInfo{};
+	layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+	layoutInfo.bindingCount = static_cast<uint32_t>(bindings.size());
+	layoutInfo.pBindings = bindings.data();
+
+	VkResult res = vkCreateDescriptorSetLayout(
+		device,
+		&layoutInfo,
+		nullptr,
+		&cullDescriptorSetLayout);
+
+	if (res != VK_SUCCESS) {
+		throw std::runtime_error(
+			"failed to create descriptor set layout");
+	}
+
+	VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+	pipelineLayoutInfo.sType =
+		VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	pipelineLayoutInfo.setLayoutCount = 1;
+	pipelineLayoutInfo.pSetLayouts = &cullDescriptorSetLayout;
+	pipelineLayoutInfo.pushConstantRangeCount = 0;
+	pipelineLayoutInfo.pPushConstantRanges = nullptr;
+
+	res = vkCreatePipelineLayout(
+		device,
+		&pipelineLayoutInfo,
+		nullptr,
+		&cullPipelineLayout);
+
+	if (res != VK_SUCCESS) {
+		throw std::runtime_error("failed to create pipeline layout");
+	}
+
+	VkShaderModule cullShaderModule =
+		CreateShaderModule(sizeof(CullShader), CullShader);
+
+	VkPipelineShaderStageCreateInfo cullShaderStageInfo{};
+	cullShaderStageInfo.sType =
+		VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	cullShaderStageInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+	cullShaderStageInfo.module = cullShaderModule;
+	cullShaderStageInfo.pName = "main";
+
+	VkComputePipelineCreateInfo pipelineInfo{};
+	pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+	pipelineInfo.stage = cullShaderStageInfo;
+	pipelineInfo.layout = cullPipelineLayout;
+	pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
+	pipelineInfo.basePipelineIndex = -1;
+
+	res = vkCreateComputePipelines(
+		device,
+		VK_NULL_HANDLE,
+		1,
+		&pipelineInfo,
+		nullptr,
+		&cullPipeline);
+
+	if (res != VK_SUCCESS) {
+		throw std::runtime_error("failed to create compute pipeline");
+	}
+
+	vkDestroyShaderModule(device, cullShaderModule, nullptr);
+}
+
+void Video::DestroyCullPipeline()
+{
+	if (!indirectDrawingSupported) {
+		return;
+	}
+
+	vkDestroyPipeline(device, cullPipeline, nullptr);
+	vkDestroyPipelineLayout(device, cullPipelineLayout, nullptr);
+	vkDestroyDescriptorSetLayout(device, cullDescriptorSetLayout, nullptr);
+}
+
+void Video::CreateTextureSampler(Texture* texture)
 {
 	VkSamplerCreateInfo samplerInfo{};
 	samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
@@ -465,28 +640,28 @@ void Video::CreateTextureSampler(Model* model)
 	samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
 	samplerInfo.mipLodBias = 0.0f;
 	samplerInfo.minLod = 0.0f;
-	samplerInfo.maxLod = static_cast<float>(model->textureMipLevels);
+	samplerInfo.maxLod = static_cast<float>(texture->mipLevels);
 
 	VkResult res = vkCreateSampler(
 		device,
 		&samplerInfo,
 		nullptr,
-		&model->textureSampler);
+		&texture->sampler);
 
 	if (res != VK_SUCCESS) {
 		throw std::runtime_error("failed to create texture sampler");
 	}
 }
 
-void Video::DestroyTextureSampler(Model* model)
+void Video::DestroyTextureSampler(Texture* texture)
 {
-	vkDestroySampler(device, model->textureSampler, nullptr);
+	vkDestroySampler(device, texture->sampler, nullptr);
 }
 
 void Video::CreateVertexBuffers()
 {
-	for (Model* model : models) {
-		CreateVertexBuffer(model);
+	for (auto& entry : meshes) {
+		CreateVertexBuffer(entry.second);
 	}
 
 	allowVertexBufferCreation = true;
@@ -496,71 +671,59 @@ void Video::DestroyVertexBuffers()
 {
 	allowVertexBufferCreation = false;
 
-	for (Model* model : models) {
-		DestroyVertexBuffer(model);
+	for (auto& entry : meshes) {
+		DestroyVertexBuffer(entry.second);
 	}
+
+	DestroyGeometryPools(
+		vertexPools,
+		vertexAllocator,
+		vertexBufferMemoryManager);
 }
 
-void Video::CreateVertexBuffer(Model* model)
+void Video::CreateVertexBuffer(Mesh* mesh)
 {
-	VkDeviceSize bufferSize =
-		sizeof(Model::Vertex) * model->vertices.size();
-
-	VkBuffer stagingBuffer;
-	VkDeviceMemory stagingBufferMemory;
-
-	CreateBuffer(
-		bufferSize,
-		VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-		VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-		stagingBuffer,
-		stagingBufferMemory);
+	uint32_t vertexCount =
+		static_cast<uint32_t>(mesh->data->vertices.size());
+
+	if (!vertexAllocator.Allocate(vertexCount, mesh->vertices)) {
+		AddGeometryPool(
+			vertexPools,
+			vertexAllocator,
+			std::max(VertexPoolSize, vertexCount),
+			sizeof(Model::Vertex),
+			VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+			MANAGER_VERTEX);
+
+		if (!vertexAllocator.Allocate(vertexCount, mesh->vertices)) {
+			throw std::runtime_error("failed to allocate vertex buffer");
+		}
+	}
 
-	void* data;
-	VkResult res = vkMapMemory(
-		device,
-		stagingBufferMemory,
-		0,
-		bufferSize,
-		0,
-		&data);
+	VkDeviceSize bufferSize = sizeof(Model::Vertex) * vertexCount;
 
-	if (res != VK_SUCCESS) {
-		throw std::runtime_error("fauled to map memory");
+	if (bufferSize == 0) {
+		return;
 	}
 
-	memcpy(data, model->vertices.data(), static_cast<size_t>(bufferSize));
-	vkUnmapMemory(device, stagingBufferMemory);
-
-	CreateBuffer(
+	uint64_t upload = UploadBuffer(
+		mesh->data->vertices.data(),
 		bufferSize,
-		VK_BUFFER_USAGE_TRANSFER_DST_BIT |
-		VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-		MANAGER_VERTEX,
-		model->vertexBuffer,
-		model->vertexBufferMemory);
-
-	CopyBuffer(
-		stagingBuffer,
-		model->vertexBuffer,
-		bufferSize);
+		vertexPools[mesh->vertices.partition].buffer,
+		sizeof(Model::Vertex) * mesh->vertices.offset);
 
-	vkDestroyBuffer(device, stagingBuffer, nullptr);
-	vkFreeMemory(device, stagingBufferMemory, nullptr);
+	mesh->upload = std::max(mesh->upload, upload);
 }
 
-void Video::DestroyVertexBuffer(Model* model)
+void Video::DestroyVertexBuffer(Mesh* mesh)
 {
-	vkDestroyBuffer(device, model->vertexBuffer, nullptr);
-	vertexBufferMemoryManager->Free(model->vertexBufferMemory);
+	vertexAllocator.Free(mesh->vertices);
 }
 
 void Video::CreateIndexBuffers()
 {
-	for (Model* model : models) {
-		CreateIndexBuffer(model);
+	for (auto& entry : meshes) {
+		CreateIndexBuffer(entry.second);
 	}
 
 	allowIndexBufferCreation = true;
@@ -570,71 +733,95 @@ void Video::DestroyIndexBuffers()
 {
 	allowIndexBufferCreation = false;
 
-	for (Model* model : models) {
-		DestroyIndexBuffer(model);
+	for (auto& entry : meshes) {
+		DestroyIndexBuffer(entry.second);
 	}
+
+	DestroyGeometryPools(
+		indexPools,
+		indexAllocator,
+		indexBufferMemoryManager);
 }
 
-void Video::CreateIndexBuffer(Model* model)
+void Video::CreateIndexBuffer(Mesh* mesh)
 {
-	VkDeviceSize bufferSize =
-		sizeof(Model::VertexIndexType) * model->indices.size();
+	uint32_t indexCount =
+		static_cast<uint32_t>(mesh->data->indices.size());
+
+	if (!indexAllocator.Allocate(indexCount, mesh->indices)) {
+		AddGeometryPool(
+			indexPools,
+			indexAllocator,
+			std::max(IndexPoolSize, indexCount),
+			sizeof(Model::VertexIndexType),
+			VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+			MANAGER_INDEX);
+
+		if (!indexAllocator.Allocate(indexCount, mesh->indices)) {
+			throw std::runtime_error("failed to allocate index buffer");
+		}
+	}
 
-	VkBuffer stagingBuffer;
-	VkDeviceMemory stagingBufferMemory;
+	VkDeviceSize bufferSize = sizeof(Model::VertexIndexType) * indexCount;
 
-	CreateBuffer(
-		bufferSize,
-		VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-		VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-		stagingBuffer,
-		stagingBufferMemory);
+	if (bufferSize == 0) {
+		return;
+	}
 
-	void* data;
-	VkResult res = vkMapMemory(
-		device,
-		stagingBufferMemory,
-		0,
+	uint64_t upload = UploadBuffer(
+		mesh->data->indices.data(),
 		bufferSize,
-		0,
-		&data);
+		indexPools[mesh->indices.partition].buffer,
+		sizeof(Model::VertexIndexType) * mesh->indices.offset);
 
-	if (res != VK_SUCCESS) {
-		throw std::runtime_error("failed to map memory");
-	}
+	mesh->upload = std::max(mesh->upload, upload);
+}
 
-	memcpy(data, model->indices.data(), static_cast<size_t>(bufferSize));
-	vkUnmapMemory(device, stagingBufferMemory);
+void Video::DestroyIndexBuffer(Mesh* mesh)
+{
+	indexAllocator.Free(mesh->indices);
+}
+
+void Video::AddGeometryPool(
+	std::vector<GeometryBuffer>& pools,
+	SectorAllocator& allocator,
+	uint32_t size,
+	VkDeviceSize elementSize,
+	VkBufferUsageFlags usage,
+	GPUMemoryManagerType managerType)
+{
+	GeometryBuffer pool;
 
 	CreateBuffer(
-		bufferSize,
-		VK_BUFFER_USAGE_TRANSFER_DST_BIT |
-		VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+		elementSize * size,
+		VK_BUFFER_USAGE_TRANSFER_DST_BIT | usage,
 		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-		MANAGER_INDEX,
-		model->indexBuffer,
-		model->indexBufferMemory);
-
-	CopyBuffer(
-		stagingBuffer,
-		model->indexBuffer,
-		bufferSize);
+		managerType,
+		pool.buffer,
+		pool.memory);
 
-	vkDestroyBuffer(device, stagingBuffer, nullptr);
-	vkFreeMemory(device, stagingBufferMemory, nullptr);
+	pools.push_back(pool);
+	allocator.AddPartition(size);
 }
 
-void Video::DestroyIndexBuffer(Model* model)
+void Video::DestroyGeometryPools(
+	std::vector<GeometryBuffer>& pools,
+	SectorAllocator& allocator,
+	GPUMemoryManager* memoryManager)
 {
-	vkDestroyBuffer(device, model->indexBuffer, nullptr);
-	indexBufferMemoryManager->Free(model->indexBufferMemory);
+	for (const GeometryBuffer& pool : pools) {
+		vkDestroyBuffer(device, pool.buffer, nullptr);
+		memoryManager->Free(pool.memory);
+	}
+
+	pools.clear();
+	allocator = SectorAllocator();
 }
 
 void Video::CreateTextureImages()
 {
-	for (Model* model : models) {
-		CreateTextureImage(model);
+	for (auto& entry : textures) {
+		CreateTextureImage(entry.second);
 	}
 
 	allowTextureImageCreation = true;
@@ -644,114 +831,60 @@ void Video::DestroyTextureImages()
 {
 	allowTextureImageCreation = false;
 
-	for (Model* model : models) {
-		DestroyTextureImage(model);
+	for (auto& entry : textures) {
+		DestroyTextureImage(entry.second);
 	}
 }
 
-void Video::CreateTextureImage(Model* model)
+void Video::CreateTextureImage(Texture* texture)
 {
-	int texWidth;
-	int texHeight;
-	int texChannels;
-
-	stbi_uc* pixels = stbi_load(
-		model->textureName.c_str(),
-		&texWidth,
-		&texHeight,
-		&texChannels,
-		STBI_rgb_alpha);
-
-	if (!pixels) {
-		throw std::runtime_error("failed to load texture image");
-	}
+	uint32_t texWidth = texture->data->width;
+	uint32_t texHeight = texture->data->height;
 
-	model->textureMipLevels = static_cast<uint32_t>(
+	texture->mipLevels = static_cast<uint32_t>(
 		std::floor(std::log2(std::max(texWidth, texHeight)))) + 1;
 
-	VkDeviceSize imageSize = texWidth * texHeight * 4;
-
-	VkBuffer stagingBuffer;
-	VkDeviceMemory stagingBufferMemory;
-
-	CreateBuffer(
-		imageSize,
-		VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-		VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-		stagingBuffer,
-		stagingBufferMemory);
-
-	void* data;
-	VkResult res = vkMapMemory(
-		device,
-		stagingBufferMemory,
-		0,
-		imageSize,
-		0,
-		&data);
-
-	if (res != VK_SUCCESS) {
-		throw std::runtime_error("failed to map memory");
-	}
-
-	memcpy(data, pixels, static_cast<size_t>(imageSize));
-	vkUnmapMemory(device, stagingBufferMemory);
+	// The transfer queue cannot blit, so the levels are made here.
+	std::vector<uint8_t> levels = texture->data->pixels;
 
-	stbi_image_free(pixels);
+	GenerateMipmaps(levels, texWidth, texHeight, texture->mipLevels);
 
 	CreateImage(
 		texWidth,
 		texHeight,
-		model->textureMipLevels,
+		texture->mipLevels,
 		VK_FORMAT_R8G8B8A8_SRGB,
 		VK_IMAGE_TILING_OPTIMAL,
-		VK_IMAGE_USAGE_TRANSFER_SRC_BIT |
 		VK_IMAGE_USAGE_TRANSFER_DST_BIT |
 		VK_IMAGE_USAGE_SAMPLED_BIT,
 		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
 		MANAGER_TEXTURE,
-		model->textureImage,
-		model->textureImageMemory);
-
-	TransitionImageLayout(
-		model->textureImage,
-		VK_FORMAT_R8G8B8A8_SRGB,
-		VK_IMAGE_LAYOUT_UNDEFINED,
-		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-		model->textureMipLevels);
-
-	CopyBufferToImage(
-		stagingBuffer,
-		model->textureImage,
-		static_cast<uint32_t>(texWidth),
-		static_cast<uint32_t>(texHeight));
+		texture->image,
+		texture->imageMemory);
 
-	GenerateMipmaps(
-		model->textureImage,
-		VK_FORMAT_R8G8B8A8_SRGB,
+	texture->upload = UploadImage(
+		levels.data(),
+		levels.size(),
+		texture->image,
 		texWidth,
 		texHeight,
-		model->textureMipLevels);
+		texture->mipLevels);
 
-	vkDestroyBuffer(device, stagingBuffer, nullptr);
-	vkFreeMemory(device, stagingBufferMemory, nullptr);
-
-	model->textureImageView = CreateImageView(
-		model->textureImage,
+	texture->imageView = CreateImageView(
+		texture->image,
 		VK_FORMAT_R8G8B8A8_SRGB,
 		VK_IMAGE_ASPECT_COLOR_BIT,
-		model->textureMipLevels);
+		texture->mipLevels);
 
-	CreateTextureSampler(model);
+	CreateTextureSampler(texture);
 }
 
-void Video::DestroyTextureImage(Model* model)
+void Video::DestroyTextureImage(Texture* texture)
 {
-	DestroyTextureSampler(model);
-	vkDestroyImageView(device, model->textureImageView, nullptr);
-	vkDestroyImage(device, model->textureImage, nullptr);
-	textureImageMemoryManager->Free(model->textureImageMemory);
+	DestroyTextureSampler(texture);
+	vkDestroyImageView(device, texture->imageView, nullptr);
+	vkDestroyImage(device, texture->image, nullptr);
+	textureImageMemoryManager->Free(texture->imageMemory);
 }
 
 // Swapchain methods
@@ -993,58 +1126,141 @@ void Video::DestroyDescriptorPool(VkDescriptorPool& descriptorPool)
 
 void Video::CreateUniformBuffers()
 {
-	for (Model* model : models) {
-		CreateUniformBuffers(model);
-	}
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(physicalDevice, &properties);
 
-	allowUniformBufferCreation = true;
-}
+	VkDeviceSize alignment =
+		properties.limits.minUniformBufferOffsetAlignment;
 
-void Video::DestroyUniformBuffers()
-{
-	allowUniformBufferCreation = false;
+	auto align = [alignment](VkDeviceSize size) {
+		return (size + alignment - 1) / alignment * alignment;
+	};
 
-	for (Model* model : models) {
-		DestroyUniformBuffers(model);
-	}
-}
+	uniformCameraSize = align(sizeof(CameraUniform));
 
-void Video::CreateUniformBuffers(Model* model)
-{
-	VkDeviceSize bufferSize = sizeof(Model::UniformBufferObject);
+	uniformCapacity = std::max(
+		uniformCapacity,
+		std::max(static_cast<uint32_t>(models.size()), 64u));
 
-	model->uniformBuffers.resize(swapchainImages.size());
-	model->uniformBufferMemory.resize(swapchainImages.size());
+	// Frames start at descriptor offsets, which must be aligned too.
+	uniformFrameSize = align(
+		uniformCameraSize + sizeof(Model::Instance) * uniformCapacity);
 
-	for (size_t i = 0; i < swapchainImages.size(); ++i) {
-		CreateBuffer(
-			bufferSize,
-			VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-			VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-			MANAGER_UNIFORM,
-			model->uniformBuffers[i],
-			model->uniformBufferMemory[i]);
-	}
-}
+	CreateBuffer(
+		uniformFrameSize * swapchainImages.size(),
+		VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT |
+		VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+		VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+		uniformBuffer,
+		uniformBufferMemory);
 
-void Video::DestroyUniformBuffers(Model* model)
-{
-	for (size_t i = 0; i < swapchainImages.size(); ++i) {
-		vkDestroyBuffer(device, model->uniformBuffers[i], nullptr);
-		uniformBufferMemoryManager->Free(
-			model->uniformBufferMemory[i]);
-	}
-}
+	void* data;
 
-void Video::CreateDescriptorSets()
-{
-	for (Model* model : models) {
-		CreateDescriptorSets(model);
+	VkResult res = vkMapMemory(
+		device,
+		uniformBufferMemory,
+		0,
+		VK_WHOLE_SIZE,
+		0,
+		&data);
+
+	if (res != VK_SUCCESS) {
+		throw std::runtime_error("failed to map memory");
 	}
 
-	allowDescriptorSetCreation = true;
-}
+	uniformBufferData = static_cast<char*>(data);
+
+	if (!indirectDrawingSupported) {
+		return;
+	}
+
+	VkDeviceSize storageAlignment =
+		properties.limits.minStorageBufferOffsetAlignment;
+
+	auto alignStorage = [storageAlignment](VkDeviceSize size) {
+		return (size + storageAlignment - 1) / storageAlignment *
+			storageAlignment;
+	};
+
+	indirectCommandsOffset = alignStorage(
+		sizeof(CullHeader) + sizeof(CullRecord) * uniformCapacity);
+	indirectInstancesOffset = indirectCommandsOffset + alignStorage(
+		sizeof(VkDrawIndexedIndirectCommand) * uniformCapacity);
+	indirectFrameSize = indirectInstancesOffset +
+		alignStorage(sizeof(Model::Instance) * uniformCapacity);
+
+	CreateBuffer(
+		indirectFrameSize * swapchainImages.size(),
+		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+		VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+		VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+		VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+		indirectBuffer,
+		indirectBufferMemory);
+
+	res = vkMapMemory(
+		device,
+		indirectBufferMemory,
+		0,
+		VK_WHOLE_SIZE,
+		0,
+		&data);
+
+	if (res != VK_SUCCESS) {
+		throw std::runtime_error("failed to map memory");
+	}
+
+	indirectBufferData = static_cast<char*>(data);
+	indirectRecordCounts.assign(swapchainImages.size(), 0);
+	indirectCommandCounts.assign(swapchainImages.size(), 0);
+}
+
+void Video::DestroyUniformBuffers()
+{
+	vkUnmapMemory(device, uniformBufferMemory);
+	vkDestroyBuffer(device, uniformBuffer, nullptr);
+	vkFreeMemory(device, uniformBufferMemory, nullptr);
+
+	if (!indirectDrawingSupported) {
+		return;
+	}
+
+	vkUnmapMemory(device, indirectBufferMemory);
+	vkDestroyBuffer(device, indirectBuffer, nullptr);
+	vkFreeMemory(device, indirectBufferMemory, nullptr);
+}
+
+void Video::GrowUniformBuffers(uint32_t capacity)
+{
+	queueMutex.lock();
+	vkDeviceWaitIdle(device);
+	queueMutex.unlock();
+
+	DestroyUniformBuffers();
+	uniformCapacity = std::max(capacity, uniformCapacity * 2);
+	CreateUniformBuffers();
+
+	if (allowDescriptorSetCreation) {
+		for (Model* model : models) {
+			UpdateDescriptorSets(model);
+		}
+
+		UpdateCullDescriptorSets();
+	}
+
+	++modelGeneration;
+}
+
+void Video::CreateDescriptorSets()
+{
+	for (Model* model : models) {
+		CreateDescriptorSets(model);
+	}
+
+	allowDescriptorSetCreation = true;
+}
 
 void Video::CreateDescriptorSets(Model* model)
 {
@@ -1069,17 +1285,22 @@ void Video::CreateDescriptorSets(Model* model)
 		throw std::runtime_error("failed to allocate descriptor sets");
 	}
 
+	UpdateDescriptorSets(model);
+}
+
+void Video::UpdateDescriptorSets(Model* model)
+{
 	for (size_t i = 0; i < model->descriptorSets.size(); ++i) {
 		VkDescriptorBufferInfo bufferInfo{};
-		bufferInfo.buffer = model->uniformBuffers[i];
-		bufferInfo.offset = 0;
-		bufferInfo.range = sizeof(Model::UniformBufferObject);
+		bufferInfo.buffer = uniformBuffer;
+		bufferInfo.offset = uniformFrameSize * i;
+		bufferInfo.range = sizeof(CameraUniform);
 
 		VkDescriptorImageInfo imageInfo{};
 		imageInfo.imageLayout =
 			VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-		imageInfo.imageView = model->textureImageView;
-		imageInfo.sampler = model->textureSampler;
+		imageInfo.imageView = model->texture->imageView;
+		imageInfo.sampler = model->texture->sampler;
 
 		std::vector<VkWriteDescriptorSet> descriptorWrites(2);
 
@@ -1116,6 +1337,116 @@ void Video::CreateDescriptorSets(Model* model)
 	}
 }
 
+void Video::CreateCullDescriptorSets()
+{
+	if (!indirectDrawingSupported) {
+		return;
+	}
+
+	VkDescriptorPoolSize poolSize{};
+	poolSize.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	poolSize.descriptorCount =
+		static_cast<uint32_t>(swapchainImages.size() * 3);
+
+	VkDescriptorPoolCreateInfo poolInfo{};
+	poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+	poolInfo.poolSizeCount = 1;
+	poolInfo.pPoolSizes = &poolSize;
+	poolInfo.maxSets = static_cast<uint32_t>(swapchainImages.size());
+
+	VkResult res = vkCreateDescriptorPool(
+		device,
+		&poolInfo,
+		nullptr,
+		&cullDescriptorPool);
+
+	if (res != VK_SUCCESS) {
+		throw std::runtime_error("failed to create descriptor pool");
+	}
+
+	std::vector<VkDescriptorSetLayout> layouts(
+		swapchainImages.size(),
+		cullDescriptorSetLayout);
+
+	VkDescriptorSetAllocateInfo allocInfo{};
+	allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+	allocInfo.descriptorPool = cullDescriptorPool;
+	allocInfo.descriptorSetCount = static_cast<uint32_t>(layouts.size());
+	allocInfo.pSetLayouts = layouts.data();
+
+	cullDescriptorSets.resize(swapchainImages.size());
+
+	res = vkAllocateDescriptorSets(
+		device,
+		&allocInfo,
+		cullDescriptorSets.data());
+
+	if (res != VK_SUCCESS) {
+		throw std::runtime_error("failed to allocate descriptor sets");
+	}
+
+	UpdateCullDescriptorSets();
+}
+
+void Video::DestroyCullDescriptorSets()
+{
+	if (!indirectDrawingSupported) {
+		return;
+	}
+
+	vkDestroyDescriptorPool(device, cullDescriptorPool, nullptr);
+	cullDescriptorSets.clear();
+}
+
+void Video::UpdateCullDescriptorSets()
+{
+	if (!indirectDrawingSupported) {
+		return;
+	}
+
+	for (size_t i = 0; i < cullDescriptorSets.size(); ++i) {
+		VkDeviceSize frame = indirectFrameSize * i;
+
+		VkDescriptorBufferInfo bufferInfos[3];
+
+		bufferInfos[0].buffer = indirectBuffer;
+		bufferInfos[0].offset = frame;
+		bufferInfos[0].range = indirectCommandsOffset;
+
+		bufferInfos[1].buffer = indirectBuffer;
+		bufferInfos[1].offset = frame + indirectCommandsOffset;
+		bufferInfos[1].range =
+			indirectInstancesOffset - indirectCommandsOffset;
+
+		bufferInfos[2].buffer = indirectBuffer;
+		bufferInfos[2].offset = frame + indirectInstancesOffset;
+		bufferInfos[2].range = indirectFrameSize - indirectInstancesOffset;
+
+		std::vector<VkWriteDescriptorSet> descriptorWrites(3);
+
+		for (uint32_t binding = 0; binding < 3; ++binding) {
+			descriptorWrites[binding].sType =
+				VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+			descriptorWrites[binding].dstSet = cullDescriptorSets[i];
+			descriptorWrites[binding].dstBinding = binding;
+			descriptorWrites[binding].dstArrayElement = 0;
+			descriptorWrites[binding].descriptorType =
+				VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+			descriptorWrites[binding].descriptorCount = 1;
+			descriptorWrites[binding].pBufferInfo = &bufferInfos[binding];
+			descriptorWrites[binding].pImageInfo = nullptr;
+			descriptorWrites[binding].pTexelBufferView = nullptr;
+		}
+
+		vkUpdateDescriptorSets(
+			device,
+			static_cast<uint32_t>(descriptorWrites.size()),
+			descriptorWrites.data(),
+			0,
+			nullptr);
+	}
+}
+
 void Video::CreateRenderPass()
 {
 	VkAttachmentDescription colorAttachment{};
@@ -1247,15 +1578,26 @@ void Video::CreateGraphicsPipeline()
 		fragShaderStageInfo
 	};
 
-	auto bindingDescription = Model::Vertex::GetBindingDescription();
+	VkVertexInputBindingDescription bindingDescriptions[] = {
+		Model::Vertex::GetBindingDescription(),
+		Model::Instance::GetBindingDescription()
+	};
+
 	auto attributeDescriptions =
 		Model::Vertex::GetAttributeDescriptions();
+	auto instanceAttributeDescriptions =
+		Model::Instance::GetAttributeDescriptions();
+
+	attributeDescriptions.insert(
+		attributeDescriptions.end(),
+		instanceAttributeDescriptions.begin(),
+		instanceAttributeDescriptions.end());
 
 	VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
 	vertexInputInfo.sType =
 		VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-	vertexInputInfo.vertexBindingDescriptionCount = 1;
-	vertexInputInfo.pVertexBindingDescriptions = &bindingDescription;
+	vertexInputInfo.vertexBindingDescriptionCount = 2;
+	vertexInputInfo.pVertexBindingDescriptions = bindingDescriptions;
 	vertexInputInfo.vertexAttributeDescriptionCount =
 		static_cast<uint32_t>(attributeDescriptions.size());
 	vertexInputInfo.pVertexAttributeDescriptions =
@@ -1459,6 +1801,7 @@ void Video::CreateSwapchainSyncObjects()
 	inFlightFences.resize(maxFramesInFlight);
 	imagesInFlight.clear();
 	imagesInFlight.resize(swapchainImages.size(), VK_NULL_HANDLE);
+	retiredAssets.resize(maxFramesInFlight);
 
 	VkFenceCreateInfo fenceInfo{};
 	fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
@@ -1502,6 +1845,8 @@ void Video::CreateSwapchainSyncObjects()
 
 void Video::DestroySwapchainSyncObjects()
 {
+	retiredAssets.clear();
+
 	for (size_t i = 0; i < maxFramesInFlight; ++i) {
 		vkDestroyFence(device, inFlightFences[i], nullptr);
 		vkDestroySemaphore(
@@ -1517,22 +1862,237 @@ void Video::DestroySwapchainSyncObjects()
 
 void Video::CreateCommandBuffers()
 {
-	commandBuffers.resize(swapchainImages.size(), VK_NULL_HANDLE);
+	QueueFamilyIndices queueFamilyIndices =
+		FindQueueFamilies(physicalDevice);
+
+	commandPools.resize(swapchainImages.size());
+	commandBuffers.resize(swapchainImages.size());
+	recordedModels.resize(swapchainImages.size());
+	recordedGenerations.resize(swapchainImages.size(), 0);
+
+	for (size_t i = 0; i < swapchainImages.size(); ++i) {
+		VkCommandPoolCreateInfo poolInfo{};
+		poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+		poolInfo.queueFamilyIndex =
+			queueFamilyIndices.graphicsFamily.value();
+		poolInfo.flags = 0;
+
+		VkResult res = vkCreateCommandPool(
+			device,
+			&poolInfo,
+			nullptr,
+			&commandPools[i]);
+
+		if (res != VK_SUCCESS) {
+			throw std::runtime_error("failed to create command pool");
+		}
+
+		VkCommandBufferAllocateInfo allocInfo{};
+		allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+		allocInfo.commandPool = commandPools[i];
+		allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+		allocInfo.commandBufferCount = 1;
+
+		res = vkAllocateCommandBuffers(
+			device,
+			&allocInfo,
+			&commandBuffers[i]);
+
+		if (res != VK_SUCCESS) {
+			throw std::runtime_error(
+				"failed to allocate command buffer");
+		}
+	}
 }
 
 void Video::DestroyCommandBuffers()
 {
-	for (auto commandBuffer : commandBuffers) {
-		if (commandBuffer != VK_NULL_HANDLE) {
-			vkFreeCommandBuffers(
+	for (auto commandPool : commandPools) {
+		vkDestroyCommandPool(device, commandPool, nullptr);
+	}
+
+	commandPools.clear();
+	commandBuffers.clear();
+	recordedModels.clear();
+	recordedGenerations.clear();
+}
+
+void Video::StartRecordingThreads()
+{
+	recordingWork = true;
+	recordingSequence = 0;
+	recordingPending = 0;
+	recordingFailed = false;
+
+	recordingThreads = std::vector<RecordingThread>(
+		std::max(1u, std::thread::hardware_concurrency()));
+
+	// Workers start from the sequence as it is now, not as it is when
+	// they first take the lock, so none can miss the first bump.
+	for (uint32_t i = 0; i < recordingThreads.size(); ++i) {
+		recordingThreads[i].thread = std::thread(
+			&Video::RecordingWorker,
+			this,
+			i,
+			recordingSequence);
+	}
+}
+
+void Video::StopRecordingThreads()
+{
+	recordingMutex.lock();
+	recordingWork = false;
+	recordingMutex.unlock();
+
+	recordingCondition.notify_all();
+
+	for (auto& recordingThread : recordingThreads) {
+		recordingThread.thread.join();
+	}
+
+	recordingThreads.clear();
+}
+
+void Video::CreateRecordingCommandBuffers()
+{
+	QueueFamilyIndices queueFamilyIndices =
+		FindQueueFamilies(physicalDevice);
+
+	for (auto& recordingThread : recordingThreads) {
+		recordingThread.commandPools.resize(swapchainImages.size());
+		recordingThread.commandBuffers.resize(swapchainImages.size());
+
+		for (size_t i = 0; i < swapchainImages.size(); ++i) {
+			VkCommandPoolCreateInfo poolInfo{};
+			poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+			poolInfo.queueFamilyIndex =
+				queueFamilyIndices.graphicsFamily.value();
+			poolInfo.flags = 0;
+
+			VkResult res = vkCreateCommandPool(
 				device,
-				commandPool,
-				1,
-				&commandBuffer);
+				&poolInfo,
+				nullptr,
+				&recordingThread.commandPools[i]);
+
+			if (res != VK_SUCCESS) {
+				throw std::runtime_error(
+					"failed to create command pool");
+			}
+
+			VkCommandBufferAllocateInfo allocInfo{};
+			allocInfo.sType =
+				VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+			allocInfo.commandPool = recordingThread.commandPools[i];
+			allocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+			allocInfo.commandBufferCount = 1;
+
+			res = vkAllocateCommandBuffers(
+				device,
+				&allocInfo,
+				&recordingThread.commandBuffers[i]);
+
+			if (res != VK_SUCCESS) {
+				throw std::runtime_error(
+					"failed to allocate command buffer");
+			}
 		}
 	}
+}
 
-	commandBuffers.clear();
+void Video::DestroyRecordingCommandBuffers()
+{
+	for (auto& recordingThread : recordingThreads) {
+		for (auto commandPool : recordingThread.commandPools) {
+			vkDestroyCommandPool(device, commandPool, nullptr);
+		}
+
+		recordingThread.commandPools.clear();
+		recordingThread.commandBuffers.clear();
+	}
+}
+
+void Video::RecordingWorker(uint32_t index, uint64_t sequence)
+{
+	std::unique_lock<std::mutex> lock(recordingMutex);
+
+	while (true) {
+		recordingCondition.wait(lock, [this, sequence]() {
+			return !recordingWork || recordingSequence != sequence;
+		});
+
+		if (!recordingWork) {
+			break;
+		}
+
+		sequence = recordingSequence;
+		uint32_t imageIndex = recordingImage;
+
+		lock.unlock();
+
+		// Each thread records a contiguous share of the groups, so
+		// executing the buffers in thread order keeps the draw order.
+		size_t threadCount = recordingThreads.size();
+		size_t begin = instanceGroups.size() * index / threadCount;
+		size_t end = instanceGroups.size() * (index + 1) / threadCount;
+
+		VkCommandBuffer commandBuffer =
+			recordingThreads[index].commandBuffers[imageIndex];
+		bool failed = false;
+
+		try {
+			VkResult res = vkResetCommandPool(
+				device,
+				recordingThreads[index].commandPools[imageIndex],
+				0);
+
+			if (res != VK_SUCCESS) {
+				throw std::runtime_error(
+					"failed to reset command pool");
+			}
+
+			VkCommandBufferInheritanceInfo inheritanceInfo{};
+			inheritanceInfo.sType =
+				VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+			inheritanceInfo.renderPass = renderPass;
+			inheritanceInfo.subpass = 0;
+			inheritanceInfo.framebuffer =
+				swapchainFramebuffers[imageIndex];
+
+			VkCommandBufferBeginInfo beginInfo{};
+			beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+			beginInfo.flags =
+				VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+			beginInfo.pInheritanceInfo = &inheritanceInfo;
+
+			res = vkBeginCommandBuffer(commandBuffer, &beginInfo);
+
+			if (res != VK_SUCCESS) {
+				throw std::runtime_error(
+					"failed to begin command buffer");
+			}
+
+			RecordDraws(commandBuffer, imageIndex, begin, end);
+
+			res = vkEndCommandBuffer(commandBuffer);
+
+			if (res != VK_SUCCESS) {
+				throw std::runtime_error(
+					"failed to end command buffer");
+			}
+		} catch (const std::exception&) {
+			failed = true;
+		}
+
+		lock.lock();
+
+		recordingFailed = recordingFailed || failed;
+		--recordingPending;
+
+		if (recordingPending == 0) {
+			recordingDoneCondition.notify_one();
+		}
+	}
 }
 
 // Rendering
@@ -1547,6 +2107,8 @@ void Video::DrawFrame()
 		VK_TRUE,
 		UINT64_MAX);
 
+	FreeRetiredAssets(currentFrame);
+
 	VkResult res = vkAcquireNextImageKHR(
 		device,
 		swapchain,
@@ -1583,19 +2145,32 @@ void Video::DrawFrame()
 	VkSubmitInfo submitInfo{};
 	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
 
+	// Waiting for the uploads the frame draws is already satisfied, it
+	// only makes their writes visible.
 	VkSemaphore waitSemaphores[] = {
-		imageAvailableSemaphores[currentFrame]
+		imageAvailableSemaphores[currentFrame],
+		uploadSemaphore
 	};
 
+	uint64_t waitValues[] = {0, uploadCompleted.load()};
+
 	VkSemaphore signalSemaphores[] = {
 		renderFinishedSemaphores[currentFrame]
 	};
 
 	VkPipelineStageFlags waitStages[] = {
-		VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT
+		VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+		VK_PIPELINE_STAGE_VERTEX_INPUT_BIT |
+			VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT
 	};
 
-	submitInfo.waitSemaphoreCount = 1;
+	VkTimelineSemaphoreSubmitInfo timelineInfo{};
+	timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+	timelineInfo.waitSemaphoreValueCount = 2;
+	timelineInfo.pWaitSemaphoreValues = waitValues;
+
+	submitInfo.pNext = &timelineInfo;
+	submitInfo.waitSemaphoreCount = 2;
 	submitInfo.pWaitSemaphores = waitSemaphores;
 	submitInfo.pWaitDstStageMask = waitStages;
 
@@ -1607,6 +2182,8 @@ void Video::DrawFrame()
 
 	vkResetFences(device, 1, &inFlightFences[currentFrame]);
 
+	queueMutex.lock();
+
 	res = vkQueueSubmit(
 		graphicsQueue,
 		1,
@@ -1614,6 +2191,7 @@ void Video::DrawFrame()
 		inFlightFences[currentFrame]);
 
 	if (res != VK_SUCCESS) {
+		queueMutex.unlock();
 		throw std::runtime_error("failed to submit command buffer");
 	}
 
@@ -1632,6 +2210,8 @@ void Video::DrawFrame()
 
 	res = vkQueuePresentKHR(presentQueue, &presentInfo);
 
+	queueMutex.unlock();
+
 	if (res != VK_SUCCESS || framebufferResized) {
 		if (res == VK_ERROR_OUT_OF_DATE_KHR || framebufferResized) {
 			framebufferResized = false;
@@ -1652,7 +2232,9 @@ void Video::MainLoop()
 		DrawFrame();
 	}
 
+	queueMutex.lock();
 	vkDeviceWaitIdle(device);
+	queueMutex.unlock();
 }
 
 // Helper functions
@@ -1732,10 +2314,26 @@ bool Video::IsDeviceSuitable(VkPhysicalDevice device)
 			!swapchainSupport.presentModes.empty();
 	}
 
-	bool res = deviceProperties.deviceType ==
-		VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU &&
-		extensionsSupported &&
+	// Uploads are tracked with timeline semaphores.
+	bool timelineSemaphoreSupported = false;
+
+	if (deviceProperties.apiVersion >= VK_API_VERSION_1_2) {
+		VkPhysicalDeviceVulkan12Features deviceFeatures12{};
+		deviceFeatures12.sType =
+			VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+
+		VkPhysicalDeviceFeatures2 deviceFeatures2{};
+		deviceFeatures2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+		deviceFeatures2.pNext = &deviceFeatures12;
+
+		vkGetPhysicalDeviceFeatures2(device, &deviceFeatures2);
+
+		timelineSemaphoreSupported = deviceFeatures12.timelineSemaphore;
+	}
+
+	bool res = extensionsSupported &&
 		swapchainAdequate &&
+		timelineSemaphoreSupported &&
 		deviceFeatures.geometryShader &&
 		deviceFeatures.samplerAnisotropy &&
 		FindQueueFamilies(device).graphicsFamily.has_value() &&
@@ -1782,6 +2380,35 @@ bool Video::CheckDeviceExtensionSupport(VkPhysicalDevice device)
 	return true;
 }
 
+bool Video::CheckIndirectDrawingSupport(VkPhysicalDevice device)
+{
+	VkPhysicalDeviceFeatures deviceFeatures;
+	vkGetPhysicalDeviceFeatures(device, &deviceFeatures);
+
+	if (!deviceFeatures.multiDrawIndirect ||
+		!deviceFeatures.drawIndirectFirstInstance)
+	{
+		return false;
+	}
+
+	// Culling runs on the graphics queue.
+	uint32_t queueFamilyCount = 0;
+	vkGetPhysicalDeviceQueueFamilyProperties(
+		device,
+		&queueFamilyCount,
+		nullptr);
+
+	std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+	vkGetPhysicalDeviceQueueFamilyProperties(
+		device,
+		&queueFamilyCount,
+		queueFamilies.data());
+
+	uint32_t graphicsFamily = FindQueueFamilies(device).graphicsFamily.value();
+
+	return (queueFamilies[graphicsFamily].queueFlags & VK_QUEUE_COMPUTE_BIT) != 0;
+}
+
 Video::SwapchainSupportDetails Video::QuerySwapchainSupport(
 	VkPhysicalDevice device)
 {
@@ -1850,6 +2477,16 @@ Video::QueueFamilyIndices Video::FindQueueFamilies(VkPhysicalDevice device)
 			indices.graphicsFamily = i;
 		}
 
+		// A dedicated transfer family is usually the copy engine, which
+		// runs beside the rendering.
+		bool transferOnly =
+			(queueFamily.queueFlags & VK_QUEUE_TRANSFER_BIT) &&
+			!(queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT);
+
+		if (transferOnly) {
+			indices.transferFamily = i;
+		}
+
 		VkBool32 presentSupport = false;
 		vkGetPhysicalDeviceSurfaceSupportKHR(
 			device,
@@ -1864,6 +2501,10 @@ Video::QueueFamilyIndices Video::FindQueueFamilies(VkPhysicalDevice device)
 		++i;
 	}
 
+	if (!indices.transferFamily.has_value()) {
+		indices.transferFamily = indices.graphicsFamily;
+	}
+
 	return indices;
 }
 
@@ -2202,7 +2843,11 @@ void Video::EndSingleTimeCommands(VkCommandBuffer commandBuffer)
 	submitInfo.pCommandBuffers = &commandBuffer;
 
 	vkResetFences(device, 1, &bufferCopyFence);
+
+	queueMutex.lock();
 	vkQueueSubmit(graphicsQueue, 1, &submitInfo, bufferCopyFence);
+	queueMutex.unlock();
+
 	vkWaitForFences(device, 1, &bufferCopyFence, VK_TRUE, UINT64_MAX);
 
 	vkFreeCommandBuffers(device, transferCommandPool, 1, &commandBuffer);
@@ -2222,12 +2867,26 @@ void Video::CreateBuffer(
 	VkBuffer& buffer,
 	GPUMemoryManager::MemoryAllocationProperties& memoryAllocation)
 {
+	QueueFamilyIndices indices = FindQueueFamilies(physicalDevice);
+
+	// Filled by the transfer queue and used by the graphics queue.
+	uint32_t queueFamilyIndices[] = {
+		indices.graphicsFamily.value(),
+		indices.transferFamily.value()
+	};
+
 	VkBufferCreateInfo bufferInfo{};
 	bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
 	bufferInfo.size = size;
 	bufferInfo.usage = usage;
 	bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
 
+	if (queueFamilyIndices[0] != queueFamilyIndices[1]) {
+		bufferInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+		bufferInfo.queueFamilyIndexCount = 2;
+		bufferInfo.pQueueFamilyIndices = queueFamilyIndices;
+	}
+
 	VkResult res = vkCreateBuffer(device, &bufferInfo, nullptr, &buffer);
 
 	if (res != VK_SUCCESS) {
@@ -2263,18 +2922,6 @@ void Video::CreateBuffer(
 		}
 
 		memoryManager = indexBufferMemoryManager;
-	} else if (managerType == MANAGER_UNIFORM) {
-		if (!uniformBufferMemoryManager) {
-			uniformBufferMemoryManager = new GPUMemoryManager(
-				device,
-				8192,
-				FindMemoryType(
-					memRequirements.memoryTypeBits,
-					properties),
-				memRequirements.alignment);
-		}
-
-		memoryManager = uniformBufferMemoryManager;
 	} else {
 		throw std::runtime_error("unsupported memory manager called");
 	}
@@ -2326,21 +2973,27 @@ void Video::CreateBuffer(
 	vkBindBufferMemory(device, buffer, bufferMemory, 0);
 }
 
-void Video::CopyBuffer(
-	VkBuffer srcBuffer,
+uint64_t Video::UploadBuffer(
+	const void* data,
+	VkDeviceSize size,
 	VkBuffer dstBuffer,
-	VkDeviceSize size)
+	VkDeviceSize dstOffset)
 {
-	VkCommandBuffer commandBuffer = BeginSingleTimeCommands();
+	std::lock_guard<std::mutex> lock(uploadMutex);
+
+	VkDeviceSize stagingOffset = AllocateStaging(size);
+	memcpy(stagingBufferData + stagingOffset, data, size);
+
+	VkCommandBuffer commandBuffer = BeginUpload();
 
 	VkBufferCopy copyRegion{};
-	copyRegion.srcOffset = 0;
-	copyRegion.dstOffset = 0;
+	copyRegion.srcOffset = stagingOffset;
+	copyRegion.dstOffset = dstOffset;
 	copyRegion.size = size;
 
-	vkCmdCopyBuffer(commandBuffer, srcBuffer, dstBuffer, 1, &copyRegion);
+	vkCmdCopyBuffer(commandBuffer, stagingBuffer, dstBuffer, 1, &copyRegion);
 
-	EndSingleTimeCommands(commandBuffer);
+	return uploadBatches.back().value;
 }
 
 void Video::CreateImage(
@@ -2355,6 +3008,14 @@ void Video::CreateImage(
 	VkImage& image,
 	GPUMemoryManager::MemoryAllocationProperties& memoryAllocation)
 {
+	QueueFamilyIndices indices = FindQueueFamilies(physicalDevice);
+
+	// Filled by the transfer queue and used by the graphics queue.
+	uint32_t queueFamilyIndices[] = {
+		indices.graphicsFamily.value(),
+		indices.transferFamily.value()
+	};
+
 	VkImageCreateInfo imageInfo{};
 	imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
 	imageInfo.imageType = VK_IMAGE_TYPE_2D;
@@ -2371,6 +3032,12 @@ void Video::CreateImage(
 	imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
 	imageInfo.flags = 0;
 
+	if (queueFamilyIndices[0] != queueFamilyIndices[1]) {
+		imageInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+		imageInfo.queueFamilyIndexCount = 2;
+		imageInfo.pQueueFamilyIndices = queueFamilyIndices;
+	}
+
 	VkResult res = vkCreateImage(device, &imageInfo, nullptr, &image);
 
 	if (res != VK_SUCCESS) {
@@ -2407,34 +3074,367 @@ void Video::CreateImage(
 		memoryAllocation.offset);
 }
 
-void Video::CopyBufferToImage(
-	VkBuffer buffer,
+uint64_t Video::UploadImage(
+	const void* data,
+	VkDeviceSize size,
 	VkImage image,
 	uint32_t width,
-	uint32_t height)
+	uint32_t height,
+	uint32_t mipLevels)
 {
-	VkCommandBuffer commandBuffer = BeginSingleTimeCommands();
+	std::lock_guard<std::mutex> lock(uploadMutex);
+
+	VkDeviceSize stagingOffset = AllocateStaging(size);
+	memcpy(stagingBufferData + stagingOffset, data, size);
+
+	VkCommandBuffer commandBuffer = BeginUpload();
+
+	VkImageMemoryBarrier barrier{};
+	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.image = image;
+	barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	barrier.subresourceRange.baseMipLevel = 0;
+	barrier.subresourceRange.levelCount = mipLevels;
+	barrier.subresourceRange.baseArrayLayer = 0;
+	barrier.subresourceRange.layerCount = 1;
+	barrier.srcAccessMask = 0;
+	barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+
+	vkCmdPipelineBarrier(
+		commandBuffer,
+		VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+		VK_PIPELINE_STAGE_TRANSFER_BIT,
+		0,
+		0,
+		nullptr,
+		0,
+		nullptr,
+		1,
+		&barrier);
 
-	VkBufferImageCopy region{};
-	region.bufferOffset = 0;
-	region.bufferRowLength = 0;
-	region.bufferImageHeight = 0;
-	region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-	region.imageSubresource.mipLevel = 0;
-	region.imageSubresource.baseArrayLayer = 0;
-	region.imageSubresource.layerCount = 1;
-	region.imageOffset = {0, 0, 0};
-	region.imageExtent = {width, height, 1};
+	// The levels follow each other in the buffer, four bytes a texel.
+	std::vector<VkBufferImageCopy> regions(mipLevels);
+	VkDeviceSize offset = stagingOffset;
+
+	for (uint32_t i = 0; i < mipLevels; ++i) {
+		regions[i].bufferOffset = offset;
+		regions[i].bufferRowLength = 0;
+		regions[i].bufferImageHeight = 0;
+		regions[i].imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		regions[i].imageSubresource.mipLevel = i;
+		regions[i].imageSubresource.baseArrayLayer = 0;
+		regions[i].imageSubresource.layerCount = 1;
+		regions[i].imageOffset = {0, 0, 0};
+		regions[i].imageExtent = {width, height, 1};
+
+		offset += VkDeviceSize(width) * height * 4;
+
+		if (width > 1) {
+			width /= 2;
+		}
+
+		if (height > 1) {
+			height /= 2;
+		}
+	}
 
 	vkCmdCopyBufferToImage(
 		commandBuffer,
-		buffer,
+		stagingBuffer,
 		image,
 		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		static_cast<uint32_t>(regions.size()),
+		regions.data());
+
+	// Transfer queues have no shader stages, the graphics queue waits
+	// for the upload semaphore before sampling.
+	barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = 0;
+
+	vkCmdPipelineBarrier(
+		commandBuffer,
+		VK_PIPELINE_STAGE_TRANSFER_BIT,
+		VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+		0,
+		0,
+		nullptr,
+		0,
+		nullptr,
 		1,
-		&region);
+		&barrier);
 
-	EndSingleTimeCommands(commandBuffer);
+	return uploadBatches.back().value;
+}
+
+VkCommandBuffer Video::BeginUpload()
+{
+	if (!uploadBatches.empty() &&
+		uploadBatches.back().value > uploadSubmitted)
+	{
+		return uploadBatches.back().commandBuffer;
+	}
+
+	VkCommandBufferAllocateInfo allocInfo{};
+	allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+	allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+	allocInfo.commandPool = uploadCommandPool;
+	allocInfo.commandBufferCount = 1;
+
+	UploadBatch batch;
+	batch.value = uploadSubmitted + 1;
+	batch.stagingEnd = stagingHead;
+
+	VkResult res = vkAllocateCommandBuffers(
+		device,
+		&allocInfo,
+		&batch.commandBuffer);
+
+	if (res != VK_SUCCESS) {
+		throw std::runtime_error("failed to allocate command buffer");
+	}
+
+	VkCommandBufferBeginInfo beginInfo{};
+	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+	res = vkBeginCommandBuffer(batch.commandBuffer, &beginInfo);
+
+	if (res != VK_SUCCESS) {
+		throw std::runtime_error("failed to begin command buffer");
+	}
+
+	uploadBatches.push_back(batch);
+
+	return batch.commandBuffer;
+}
+
+void Video::SubmitUploads()
+{
+	std::lock_guard<std::mutex> lock(uploadMutex);
+
+	SubmitBatch();
+}
+
+void Video::SubmitBatch()
+{
+	if (uploadBatches.empty() ||
+		uploadBatches.back().value <= uploadSubmitted)
+	{
+		return;
+	}
+
+	UploadBatch& batch = uploadBatches.back();
+
+	VkResult res = vkEndCommandBuffer(batch.commandBuffer);
+
+	if (res != VK_SUCCESS) {
+		throw std::runtime_error("failed to end command buffer");
+	}
+
+	VkTimelineSemaphoreSubmitInfo timelineInfo{};
+	timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+	timelineInfo.signalSemaphoreValueCount = 1;
+	timelineInfo.pSignalSemaphoreValues = &batch.value;
+
+	VkSubmitInfo submitInfo{};
+	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	submitInfo.pNext = &timelineInfo;
+	submitInfo.commandBufferCount = 1;
+	submitInfo.pCommandBuffers = &batch.commandBuffer;
+	submitInfo.signalSemaphoreCount = 1;
+	submitInfo.pSignalSemaphores = &uploadSemaphore;
+
+	queueMutex.lock();
+	res = vkQueueSubmit(transferQueue, 1, &submitInfo, VK_NULL_HANDLE);
+	queueMutex.unlock();
+
+	if (res != VK_SUCCESS) {
+		throw std::runtime_error("failed to submit upload");
+	}
+
+	uploadSubmitted = batch.value;
+}
+
+void Video::ReclaimUploads()
+{
+	std::lock_guard<std::mutex> lock(uploadMutex);
+
+	ReclaimBatches();
+}
+
+void Video::ReclaimBatches()
+{
+	uint64_t completed;
+
+	VkResult res = vkGetSemaphoreCounterValue(
+		device,
+		uploadSemaphore,
+		&completed);
+
+	if (res != VK_SUCCESS) {
+		throw std::runtime_error("failed to get semaphore value");
+	}
+
+	uploadCompleted = completed;
+
+	while (!uploadBatches.empty() &&
+		uploadBatches.front().value <= completed)
+	{
+		UploadBatch& batch = uploadBatches.front();
+
+		vkFreeCommandBuffers(
+			device,
+			uploadCommandPool,
+			1,
+			&batch.commandBuffer);
+
+		stagingTail = batch.stagingEnd;
+
+		uploadBatches.pop_front();
+	}
+}
+
+void Video::WaitUploads()
+{
+	SubmitUploads();
+
+	uint64_t submitted;
+
+	uploadMutex.lock();
+	submitted = uploadSubmitted;
+	uploadMutex.unlock();
+
+	VkSemaphoreWaitInfo waitInfo{};
+	waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+	waitInfo.semaphoreCount = 1;
+	waitInfo.pSemaphores = &uploadSemaphore;
+	waitInfo.pValues = &submitted;
+
+	VkResult res = vkWaitSemaphores(device, &waitInfo, UINT64_MAX);
+
+	if (res != VK_SUCCESS) {
+		throw std::runtime_error("failed to wait for uploads");
+	}
+
+	ReclaimUploads();
+}
+
+void Video::CreateStagingBuffer()
+{
+	CreateBuffer(
+		stagingCapacity,
+		VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+		VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+		stagingBuffer,
+		stagingBufferMemory);
+
+	void* data;
+
+	VkResult res = vkMapMemory(
+		device,
+		stagingBufferMemory,
+		0,
+		VK_WHOLE_SIZE,
+		0,
+		&data);
+
+	if (res != VK_SUCCESS) {
+		throw std::runtime_error("failed to map memory");
+	}
+
+	stagingBufferData = static_cast<char*>(data);
+	stagingHead = 0;
+	stagingTail = 0;
+}
+
+void Video::DestroyStagingBuffer()
+{
+	vkUnmapMemory(device, stagingBufferMemory);
+	vkDestroyBuffer(device, stagingBuffer, nullptr);
+	vkFreeMemory(device, stagingBufferMemory, nullptr);
+}
+
+VkDeviceSize Video::AllocateStaging(VkDeviceSize size)
+{
+	// Caller holds uploadMutex. The ring is empty when head and tail
+	// meet, so head never catches up with tail from behind.
+	size = (size + StagingAlignment - 1) / StagingAlignment *
+		StagingAlignment;
+
+	VkDeviceSize offset;
+
+	while (true) {
+		if (uploadBatches.empty()) {
+			stagingHead = 0;
+			stagingTail = 0;
+		}
+
+		if (stagingHead >= stagingTail) {
+			if (stagingHead + size <= stagingCapacity) {
+				offset = stagingHead;
+				break;
+			}
+
+			if (size < stagingTail) {
+				offset = 0;
+				break;
+			}
+		} else if (stagingHead + size < stagingTail) {
+			offset = stagingHead;
+			break;
+		}
+
+		if (uploadBatches.empty()) {
+			DestroyStagingBuffer();
+
+			while (stagingCapacity < size) {
+				stagingCapacity *= 2;
+			}
+
+			CreateStagingBuffer();
+			continue;
+		}
+
+		// Waits for the oldest batch, submitting it first if it is
+		// still being recorded.
+		if (uploadBatches.front().value > uploadSubmitted) {
+			SubmitBatch();
+		}
+
+		VkSemaphoreWaitInfo waitInfo{};
+		waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+		waitInfo.semaphoreCount = 1;
+		waitInfo.pSemaphores = &uploadSemaphore;
+		waitInfo.pValues = &uploadBatches.front().value;
+
+		VkResult res = vkWaitSemaphores(device, &waitInfo, UINT64_MAX);
+
+		if (res != VK_SUCCESS) {
+			throw std::runtime_error("failed to wait for uploads");
+		}
+
+		ReclaimBatches();
+	}
+
+	stagingHead = offset + size;
+
+	BeginUpload();
+	uploadBatches.back().stagingEnd = stagingHead;
+
+	return offset;
+}
+
+bool Video::IsUploaded(const Model* model)
+{
+	return model->mesh->upload <= uploadCompleted &&
+		model->texture->upload <= uploadCompleted;
 }
 
 VkShaderModule Video::CreateShaderModule(uint32_t size, const uint32_t* code)
@@ -2461,34 +3461,26 @@ VkShaderModule Video::CreateShaderModule(uint32_t size, const uint32_t* code)
 
 void Video::CreateCommandBuffer(uint32_t imageIndex)
 {
-	if (commandBuffers[imageIndex] != VK_NULL_HANDLE) {
-		vkFreeCommandBuffers(
-			device,
-			commandPool,
-			1,
-			&commandBuffers[imageIndex]);
+	if (recordedGenerations[imageIndex] == modelGeneration &&
+		recordedModels[imageIndex] == instanceModels)
+	{
+		return;
 	}
 
-	VkCommandBufferAllocateInfo allocInfo{};
-	allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-	allocInfo.commandPool = commandPool;
-	allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-	allocInfo.commandBufferCount = 1;
-
-	VkCommandBuffer commandBuffer;
-
-	VkResult res = vkAllocateCommandBuffers(
+	VkResult res = vkResetCommandPool(
 		device,
-		&allocInfo,
-		&commandBuffer);
+		commandPools[imageIndex],
+		0);
 
 	if (res != VK_SUCCESS) {
-		throw std::runtime_error("failed to allocate command buffer");
+		throw std::runtime_error("failed to reset command pool");
 	}
 
+	VkCommandBuffer commandBuffer = commandBuffers[imageIndex];
+
 	VkCommandBufferBeginInfo beginInfo{};
 	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	beginInfo.flags = 0;
 	beginInfo.pInheritanceInfo = nullptr;
 
 	res = vkBeginCommandBuffer(commandBuffer, &beginInfo);
@@ -2497,6 +3489,10 @@ void Video::CreateCommandBuffer(uint32_t imageIndex)
 		throw std::runtime_error("failed to begin command buffer");
 	}
 
+	if (indirectDrawing) {
+		RecordCulling(commandBuffer, imageIndex);
+	}
+
 	VkRenderPassBeginInfo renderPassInfo{};
 	renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
 	renderPassInfo.renderPass = renderPass;
@@ -2512,130 +3508,825 @@ void Video::CreateCommandBuffer(uint32_t imageIndex)
 	renderPassInfo.clearValueCount = 2;
 	renderPassInfo.pClearValues = clearValues;
 
-	vkCmdBeginRenderPass(
-		commandBuffer,
-		&renderPassInfo,
-		VK_SUBPASS_CONTENTS_INLINE);
+	if (indirectDrawing) {
+		vkCmdBeginRenderPass(
+			commandBuffer,
+			&renderPassInfo,
+			VK_SUBPASS_CONTENTS_INLINE);
 
-	vkCmdBindPipeline(
-		commandBuffer,
-		VK_PIPELINE_BIND_POINT_GRAPHICS,
-		graphicsPipeline);
+		RecordIndirectDraws(commandBuffer, imageIndex);
+	} else if (instanceGroups.size() < MinParallelDraws) {
+		vkCmdBeginRenderPass(
+			commandBuffer,
+			&renderPassInfo,
+			VK_SUBPASS_CONTENTS_INLINE);
 
-	for (Model* model : models) {
-		if (!model->active) {
-			continue;
+		RecordDraws(commandBuffer, imageIndex, 0, instanceGroups.size());
+	} else {
+		vkCmdBeginRenderPass(
+			commandBuffer,
+			&renderPassInfo,
+			VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+
+		std::unique_lock<std::mutex> lock(recordingMutex);
+
+		recordingImage = imageIndex;
+		recordingPending = recordingThreads.size();
+		recordingFailed = false;
+		++recordingSequence;
+
+		recordingCondition.notify_all();
+		recordingDoneCondition.wait(lock, [this]() {
+			return recordingPending == 0;
+		});
+
+		if (recordingFailed) {
+			throw std::runtime_error(
+				"failed to record secondary command buffer");
+		}
+
+		std::vector<VkCommandBuffer> secondaryBuffers;
+
+		for (const auto& recordingThread : recordingThreads) {
+			secondaryBuffers.push_back(
+				recordingThread.commandBuffers[imageIndex]);
+		}
+
+		vkCmdExecuteCommands(
+			commandBuffer,
+			static_cast<uint32_t>(secondaryBuffers.size()),
+			secondaryBuffers.data());
+	}
+
+	vkCmdEndRenderPass(commandBuffer);
+
+	res = vkEndCommandBuffer(commandBuffer);
+
+	if (res != VK_SUCCESS) {
+		throw std::runtime_error("failed to end command buffer");
+	}
+
+	recordedModels[imageIndex] = instanceModels;
+	recordedGenerations[imageIndex] = modelGeneration;
+}
+
+void Video::RecordDraws(
+	VkCommandBuffer commandBuffer,
+	uint32_t imageIndex,
+	size_t begin,
+	size_t end)
+{
+	vkCmdBindPipeline(
+		commandBuffer,
+		VK_PIPELINE_BIND_POINT_GRAPHICS,
+		graphicsPipeline);
+
+	VkBuffer instanceBuffers[] = {uniformBuffer};
+	VkDeviceSize instanceOffsets[] = {
+		uniformFrameSize * imageIndex + uniformCameraSize
+	};
+
+	vkCmdBindVertexBuffers(
+		commandBuffer,
+		1,
+		1,
+		instanceBuffers,
+		instanceOffsets);
+
+	// Most meshes share a pool, bind pools only when they change.
+	VkBuffer vertexPool = VK_NULL_HANDLE;
+	VkBuffer indexPool = VK_NULL_HANDLE;
+
+	for (size_t i = begin; i < end; ++i) {
+		const InstanceGroup& group = instanceGroups[i];
+		Model* model = group.model;
+		Mesh* mesh = model->mesh;
+
+		if (vertexPool != vertexPools[mesh->vertices.partition].buffer) {
+			vertexPool = vertexPools[mesh->vertices.partition].buffer;
+
+			VkBuffer vertexBuffers[] = {vertexPool};
+			VkDeviceSize offsets[] = {0};
+
+			vkCmdBindVertexBuffers(
+				commandBuffer,
+				0,
+				1,
+				vertexBuffers,
+				offsets);
+		}
+
+		if (indexPool != indexPools[mesh->indices.partition].buffer) {
+			indexPool = indexPools[mesh->indices.partition].buffer;
+
+			vkCmdBindIndexBuffer(
+				commandBuffer,
+				indexPool,
+				0,
+				VK_INDEX_TYPE_UINT32);
+		}
+
+		vkCmdBindDescriptorSets(
+			commandBuffer,
+			VK_PIPELINE_BIND_POINT_GRAPHICS,
+			pipelineLayout,
+			0,
+			1,
+			&model->descriptorSets[imageIndex],
+			0,
+			nullptr);
+
+		vkCmdDrawIndexed(
+			commandBuffer,
+			static_cast<uint32_t>(mesh->data->indices.size()),
+			group.instanceCount,
+			mesh->indices.offset,
+			static_cast<int32_t>(mesh->vertices.offset),
+			group.firstInstance);
+	}
+}
+
+void Video::RecordCulling(VkCommandBuffer commandBuffer, uint32_t imageIndex)
+{
+	vkCmdBindPipeline(
+		commandBuffer,
+		VK_PIPELINE_BIND_POINT_COMPUTE,
+		cullPipeline);
+
+	vkCmdBindDescriptorSets(
+		commandBuffer,
+		VK_PIPELINE_BIND_POINT_COMPUTE,
+		cullPipelineLayout,
+		0,
+		1,
+		&cullDescriptorSets[imageIndex],
+		0,
+		nullptr);
+
+	// Invocations past the record count return at once, so the buffer
+	// does not depend on the number of active models.
+	vkCmdDispatch(commandBuffer, (uniformCapacity + 63) / 64, 1, 1);
+
+	// Draws read the commands and instances the shader wrote, the host
+	// reads the instance counts once the frame is done.
+	VkMemoryBarrier barrier{};
+	barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	barrier.dstAccessMask =
+		VK_ACCESS_INDIRECT_COMMAND_READ_BIT |
+		VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT |
+		VK_ACCESS_HOST_READ_BIT;
+
+	vkCmdPipelineBarrier(
+		commandBuffer,
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT |
+		VK_PIPELINE_STAGE_VERTEX_INPUT_BIT |
+		VK_PIPELINE_STAGE_HOST_BIT,
+		0,
+		1,
+		&barrier,
+		0,
+		nullptr,
+		0,
+		nullptr);
+}
+
+void Video::RecordIndirectDraws(
+	VkCommandBuffer commandBuffer,
+	uint32_t imageIndex)
+{
+	vkCmdBindPipeline(
+		commandBuffer,
+		VK_PIPELINE_BIND_POINT_GRAPHICS,
+		graphicsPipeline);
+
+	VkDeviceSize frame = indirectFrameSize * imageIndex;
+
+	VkBuffer instanceBuffers[] = {indirectBuffer};
+	VkDeviceSize instanceOffsets[] = {frame + indirectInstancesOffset};
+
+	vkCmdBindVertexBuffers(
+		commandBuffer,
+		1,
+		1,
+		instanceBuffers,
+		instanceOffsets);
+
+	for (size_t i = 0; i < indirectBatches.size(); ++i) {
+		const IndirectBatch& batch = indirectBatches[i];
+		Mesh* mesh = batch.model->mesh;
+
+		VkBuffer vertexBuffers[] = {
+			vertexPools[mesh->vertices.partition].buffer
+		};
+		VkDeviceSize offsets[] = {0};
+
+		vkCmdBindVertexBuffers(
+			commandBuffer,
+			0,
+			1,
+			vertexBuffers,
+			offsets);
+
+		vkCmdBindIndexBuffer(
+			commandBuffer,
+			indexPools[mesh->indices.partition].buffer,
+			0,
+			VK_INDEX_TYPE_UINT32);
+
+		vkCmdBindDescriptorSets(
+			commandBuffer,
+			VK_PIPELINE_BIND_POINT_GRAPHICS,
+			pipelineLayout,
+			0,
+			1,
+			&batch.model->descriptorSets[imageIndex],
+			0,
+			nullptr);
+
+		// Commands whose models were all culled have no instances and
+		// draw nothing.
+		vkCmdDrawIndexedIndirect(
+			commandBuffer,
+			indirectBuffer,
+			frame + indirectCommandsOffset +
+			sizeof(VkDrawIndexedIndirectCommand) * batch.firstCommand,
+			batch.commandCount,
+			sizeof(VkDrawIndexedIndirectCommand));
+	}
+}
+
+void Video::UpdateUniformBuffers(uint32_t imageIndex)
+{
+	ReclaimUploads();
+
+	if (indirectDrawing != indirectDrawingRequested) {
+		indirectDrawing = indirectDrawingRequested;
+		++modelGeneration;
+	}
+
+	if (models.size() > uniformCapacity) {
+		GrowUniformBuffers(models.size());
+	}
+
+	char* frame = uniformBufferData + uniformFrameSize * imageIndex;
+
+	CameraUniform cameraUniform;
+
+	cameraMutex.lock();
+
+	cameraUniform.proj = glm::perspective(
+		glm::radians(45.0f),
+		float(swapchainExtent.width) /
+		float(swapchainExtent.height),
+		0.1f,
+		10.0f);
+	cameraUniform.proj[1][1] *= -1;
+
+	cameraUniform.view = glm::lookAt(
+		camera.position,
+		camera.target,
+		camera.up);
+
+	cameraMutex.unlock();
+
+	memcpy(frame, &cameraUniform, sizeof(cameraUniform));
+
+	if (indirectDrawing) {
+		instanceModels.clear();
+		instanceGroups.clear();
+
+		UpdateIndirectBuffers(
+			imageIndex,
+			cameraUniform.proj * cameraUniform.view);
+		return;
+	}
+
+	uint32_t activeModels = 0;
+
+	for (Model* model : models) {
+		cullingTree.Move(model->cullingProxy, GetWorldBounds(model));
+		activeModels += model->active && IsUploaded(model);
+	}
+
+	glm::mat4 viewProjection = cameraUniform.proj * cameraUniform.view;
+	Frustum frustum(&viewProjection[0][0]);
+
+	visibleModels.clear();
+	uint32_t testedNodes = cullingTree.Cull(frustum, visibleModels);
+
+	instanceModels.clear();
+
+	for (Model* model : visibleModels) {
+		if (model->active && IsUploaded(model)) {
+			instanceModels.push_back(model);
+		}
+	}
+
+	cullingMutex.lock();
+	cullingStatistics.visible = instanceModels.size();
+	cullingStatistics.culled = activeModels - instanceModels.size();
+	cullingStatistics.testedNodes = testedNodes;
+	cullingMutex.unlock();
+
+	// The culling order depends on the tree, sort by model as well so
+	// an unchanged set of models keeps its recorded command buffer.
+	std::sort(
+		instanceModels.begin(),
+		instanceModels.end(),
+		[](const Model* a, const Model* b) {
+			return std::less<std::tuple<Mesh*, Texture*, const Model*>>()(
+				std::make_tuple(a->mesh, a->texture, a),
+				std::make_tuple(b->mesh, b->texture, b));
+		});
+
+	instanceGroups.clear();
+
+	Model::Instance* instances =
+		reinterpret_cast<Model::Instance*>(frame + uniformCameraSize);
+
+	for (uint32_t i = 0; i < instanceModels.size(); ++i) {
+		Model* model = instanceModels[i];
+
+		instances[i].model = model->modelPosition;
+
+		if (instanceGroups.empty() ||
+			instanceGroups.back().model->mesh != model->mesh ||
+			instanceGroups.back().model->texture != model->texture)
+		{
+			InstanceGroup group;
+			group.model = model;
+			group.firstInstance = i;
+			group.instanceCount = 0;
+
+			instanceGroups.push_back(group);
+		}
+
+		++instanceGroups.back().instanceCount;
+	}
+}
+
+void Video::UpdateIndirectBatches()
+{
+	indirectModels.assign(models.begin(), models.end());
+
+	std::sort(
+		indirectModels.begin(),
+		indirectModels.end(),
+		[](const Model* a, const Model* b) {
+			return std::less<std::tuple<
+				Texture*,
+				uint32_t,
+				uint32_t,
+				Mesh*,
+				const Model*>>()(
+				std::make_tuple(
+					a->texture,
+					a->mesh->vertices.partition,
+					a->mesh->indices.partition,
+					a->mesh,
+					a),
+				std::make_tuple(
+					b->texture,
+					b->mesh->vertices.partition,
+					b->mesh->indices.partition,
+					b->mesh,
+					b));
+		});
+
+	indirectCommands.clear();
+	indirectBatches.clear();
+
+	Model* previous = nullptr;
+
+	// Every command has room for the instances of all models using it,
+	// starting at the position of its first model.
+	for (uint32_t i = 0; i < indirectModels.size(); ++i) {
+		Model* model = indirectModels[i];
+		Mesh* mesh = model->mesh;
+
+		bool batch = previous == nullptr ||
+			previous->texture != model->texture ||
+			previous->mesh->vertices.partition != mesh->vertices.partition ||
+			previous->mesh->indices.partition != mesh->indices.partition;
+
+		if (batch) {
+			IndirectBatch indirectBatch;
+			indirectBatch.model = model;
+			indirectBatch.firstCommand = indirectCommands.size();
+			indirectBatch.commandCount = 0;
+
+			indirectBatches.push_back(indirectBatch);
+		}
+
+		if (batch || previous->mesh != mesh) {
+			VkDrawIndexedIndirectCommand command;
+			command.indexCount =
+				static_cast<uint32_t>(mesh->data->indices.size());
+			command.instanceCount = 0;
+			command.firstIndex = mesh->indices.offset;
+			command.vertexOffset = static_cast<int32_t>(mesh->vertices.offset);
+			command.firstInstance = i;
+
+			indirectCommands.push_back(command);
+			++indirectBatches.back().commandCount;
+		}
+
+		model->indirectCommand = indirectCommands.size() - 1;
+		previous = model;
+	}
+
+	indirectGeneration = modelGeneration;
+}
+
+void Video::UpdateIndirectBuffers(uint32_t imageIndex, const glm::mat4& matrix)
+{
+	char* frame = indirectBufferData + indirectFrameSize * imageIndex;
+
+	VkDrawIndexedIndirectCommand* commands =
+		reinterpret_cast<VkDrawIndexedIndirectCommand*>(
+			frame + indirectCommandsOffset);
+
+	// The frame that used the region last is done, its culling results
+	// are the newest available.
+	uint32_t visible = 0;
+
+	for (uint32_t i = 0; i < indirectCommandCounts[imageIndex]; ++i) {
+		visible += commands[i].instanceCount;
+	}
+
+	cullingMutex.lock();
+	cullingStatistics.visible = visible;
+	cullingStatistics.culled = indirectRecordCounts[imageIndex] - visible;
+	cullingStatistics.testedNodes = 0;
+	cullingMutex.unlock();
+
+	if (indirectGeneration != modelGeneration) {
+		UpdateIndirectBatches();
+	}
+
+	memcpy(
+		commands,
+		indirectCommands.data(),
+		sizeof(VkDrawIndexedIndirectCommand) * indirectCommands.size());
+
+	CullHeader* header = reinterpret_cast<CullHeader*>(frame);
+	CullRecord* records =
+		reinterpret_cast<CullRecord*>(frame + sizeof(CullHeader));
+
+	Frustum frustum(&matrix[0][0]);
+
+	for (int i = 0; i < 6; ++i) {
+		float plane[4];
+		frustum.GetPlane(i, plane);
+
+		header->planes[i] = glm::vec4(plane[0], plane[1], plane[2], plane[3]);
+	}
+
+	uint32_t recordCount = 0;
+
+	for (Model* model : indirectModels) {
+		if (!model->active || !IsUploaded(model)) {
+			continue;
+		}
+
+		const BoundingBox& bounds = model->mesh->data->bounds;
+		CullRecord& record = records[recordCount];
+
+		record.model = model->modelPosition;
+		record.boundsMin =
+			glm::vec4(bounds.min[0], bounds.min[1], bounds.min[2], 1.0f);
+		record.boundsMax =
+			glm::vec4(bounds.max[0], bounds.max[1], bounds.max[2], 1.0f);
+		record.command = model->indirectCommand;
+
+		++recordCount;
+	}
+
+	header->recordCount = recordCount;
+
+	indirectRecordCounts[imageIndex] = recordCount;
+	indirectCommandCounts[imageIndex] = indirectCommands.size();
+}
+
+namespace std
+{
+
+	template<>
+	struct hash<Model::Vertex>
+	{
+		size_t operator()(const Model::Vertex& vertex) const
+		{
+			return
+				((hash<glm::vec3>()(vertex.pos) ^
+				(hash<glm::vec3>()(vertex.color) << 1)) >> 1) ^
+				(hash<glm::vec2>()(vertex.texCoord) << 1);
+		}
+	};
+}
+
+Video::MeshData::MeshData(
+	std::vector<Model::Vertex> vertices,
+	std::vector<Model::VertexIndexType> indices)
+{
+	this->vertices = std::move(vertices);
+	this->indices = std::move(indices);
+
+	hash = 14695981039346656037ull;
+
+	auto mix = [this](uint64_t value) {
+		hash = (hash ^ value) * 1099511628211ull;
+	};
+
+	for (const Model::Vertex& vertex : this->vertices) {
+		mix(std::hash<Model::Vertex>()(vertex));
+	}
+
+	for (Model::VertexIndexType index : this->indices) {
+		mix(index);
+	}
+
+	for (int i = 0; i < 3; ++i) {
+		bounds.min[i] = 0.0f;
+		bounds.max[i] = 0.0f;
+	}
+
+	for (size_t vertex = 0; vertex < this->vertices.size(); ++vertex) {
+		const glm::vec3& pos = this->vertices[vertex].pos;
+
+		for (int i = 0; i < 3; ++i) {
+			if (vertex == 0 || pos[i] < bounds.min[i]) {
+				bounds.min[i] = pos[i];
+			}
+
+			if (vertex == 0 || pos[i] > bounds.max[i]) {
+				bounds.max[i] = pos[i];
+			}
+		}
+	}
+}
+
+Video::TextureData::TextureData(
+	std::vector<uint8_t> pixels,
+	uint32_t width,
+	uint32_t height)
+{
+	this->pixels = std::move(pixels);
+	this->width = width;
+	this->height = height;
+
+	hash = 14695981039346656037ull;
+
+	auto mix = [this](uint64_t value) {
+		hash = (hash ^ value) * 1099511628211ull;
+	};
+
+	mix(width);
+	mix(height);
+
+	// Eight bytes at a time, the tail padded with zeros.
+	for (size_t i = 0; i < this->pixels.size(); i += 8) {
+		uint64_t word = 0;
+		memcpy(
+			&word,
+			this->pixels.data() + i,
+			std::min<size_t>(8, this->pixels.size() - i));
+		mix(word);
+	}
+}
+
+Video::Mesh* Video::AcquireMesh(const std::shared_ptr<const MeshData>& data)
+{
+	auto range = meshes.equal_range(data->hash);
+
+	for (auto it = range.first; it != range.second; ++it) {
+		Mesh* mesh = it->second;
+
+		bool equal = mesh->data == data ||
+			(mesh->data->vertices == data->vertices &&
+			mesh->data->indices == data->indices);
+
+		if (equal) {
+			++mesh->references;
+			return mesh;
+		}
+	}
+
+	Mesh* mesh = new Mesh();
+	mesh->data = data;
+	mesh->references = 1;
+	mesh->upload = 0;
+
+	if (allowVertexBufferCreation) {
+		CreateVertexBuffer(mesh);
+	}
+
+	if (allowIndexBufferCreation) {
+		CreateIndexBuffer(mesh);
+	}
+
+	meshes.insert(std::make_pair(data->hash, mesh));
+
+	return mesh;
+}
+
+void Video::ReleaseMesh(Mesh* mesh)
+{
+	--mesh->references;
+
+	if (mesh->references > 0) {
+		return;
+	}
+
+	auto range = meshes.equal_range(mesh->data->hash);
+
+	for (auto it = range.first; it != range.second; ++it) {
+		if (it->second == mesh) {
+			meshes.erase(it);
+			break;
+		}
+	}
+
+	if (retiredAssets.empty()) {
+		FreeMesh(mesh);
+		return;
+	}
+
+	uint32_t frame =
+		(currentFrame + maxFramesInFlight - 1) % maxFramesInFlight;
+	retiredAssets[frame].meshes.push_back(mesh);
+}
+
+void Video::FreeMesh(Mesh* mesh)
+{
+	if (mesh->upload > uploadCompleted) {
+		WaitUploads();
+	}
+
+	if (allowIndexBufferCreation) {
+		DestroyIndexBuffer(mesh);
+	}
+
+	if (allowVertexBufferCreation) {
+		DestroyVertexBuffer(mesh);
+	}
+
+	delete mesh;
+}
+
+Video::Texture* Video::AcquireTexture(const std::string& name)
+{
+	std::shared_ptr<const TextureData> data = LoadTextureFromFile(name);
+	auto range = textures.equal_range(data->hash);
+
+	for (auto it = range.first; it != range.second; ++it) {
+		Texture* texture = it->second;
+
+		bool equal = texture->data == data ||
+			(texture->data->width == data->width &&
+			texture->data->height == data->height &&
+			texture->data->pixels == data->pixels);
+
+		if (equal) {
+			++texture->references;
+			return texture;
 		}
+	}
 
-		VkBuffer vertexBuffers[] = {model->vertexBuffer};
-		VkDeviceSize offsets[] = {0};
+	Texture* texture = new Texture();
+	texture->data = data;
+	texture->references = 1;
+	texture->upload = 0;
 
-		vkCmdBindVertexBuffers(
-			commandBuffer,
-			0,
-			1,
-			vertexBuffers,
-			offsets);
+	if (allowTextureImageCreation) {
+		CreateTextureImage(texture);
+	}
 
-		vkCmdBindIndexBuffer(
-			commandBuffer,
-			model->indexBuffer,
-			0,
-			VK_INDEX_TYPE_UINT32);
+	textures.insert(std::make_pair(data->hash, texture));
 
-		vkCmdBindDescriptorSets(
-			commandBuffer,
-			VK_PIPELINE_BIND_POINT_GRAPHICS,
-			pipelineLayout,
-			0,
-			1,
-			&model->descriptorSets[imageIndex],
-			0,
-			nullptr);
+	return texture;
+}
 
-		vkCmdDrawIndexed(
-			commandBuffer,
-			static_cast<uint32_t>(model->indices.size()),
-			1,
-			0,
-			0,
-			0);
+void Video::ReleaseTexture(Texture* texture)
+{
+	--texture->references;
+
+	if (texture->references > 0) {
+		return;
 	}
 
-	vkCmdEndRenderPass(commandBuffer);
+	auto range = textures.equal_range(texture->data->hash);
 
-	res = vkEndCommandBuffer(commandBuffer);
+	for (auto it = range.first; it != range.second; ++it) {
+		if (it->second == texture) {
+			textures.erase(it);
+			break;
+		}
+	}
 
-	if (res != VK_SUCCESS) {
-		throw std::runtime_error("failed to end command buffer");
+	if (retiredAssets.empty()) {
+		FreeTexture(texture);
+		return;
 	}
 
-	commandBuffers[imageIndex] = commandBuffer;
+	uint32_t frame =
+		(currentFrame + maxFramesInFlight - 1) % maxFramesInFlight;
+	retiredAssets[frame].textures.push_back(texture);
 }
 
-void Video::UpdateUniformBuffers(uint32_t imageIndex)
+void Video::FreeTexture(Texture* texture)
 {
-	cameraMutex.lock();
+	if (texture->upload > uploadCompleted) {
+		WaitUploads();
+	}
 
-	Model::UniformBufferObject ubo;
+	if (allowTextureImageCreation) {
+		DestroyTextureImage(texture);
+	}
 
-	ubo.proj = glm::perspective(
-		glm::radians(45.0f),
-		float(swapchainExtent.width) /
-		float(swapchainExtent.height),
-		0.1f,
-		10.0f);
-	ubo.proj[1][1] *= -1;
+	delete texture;
+}
 
-	ubo.view = glm::lookAt(
-		camera.position,
-		camera.target,
-		camera.up);
+// The pool's sets stay bound in the command buffers of the frames in
+// flight, so it is destroyed with the other assets retired on them.
+void Video::ReleaseDescriptorPool(VkDescriptorPool& descriptorPool)
+{
+	if (retiredAssets.empty()) {
+		DestroyDescriptorPool(descriptorPool);
+		return;
+	}
 
-	for (Model* model : models) {
-		
-		ubo.model = model->modelPosition;
+	uint32_t frame =
+		(currentFrame + maxFramesInFlight - 1) % maxFramesInFlight;
+	retiredAssets[frame].descriptorPools.push_back(descriptorPool);
+	descriptorPool = VK_NULL_HANDLE;
+}
 
-		void* data;
-		VkResult res = vkMapMemory(
-			device,
-			model->uniformBufferMemory[imageIndex].memory,
-			model->uniformBufferMemory[imageIndex].offset,
-			sizeof(ubo),
-			0,
-			&data);
+// Called once the fence of frame has signalled. The frames submitted
+// before it were waited for earlier, so nothing in flight reads the
+// assets retired on it.
+void Video::FreeRetiredAssets(uint32_t frame)
+{
+	RetiredAssets& retired = retiredAssets[frame];
 
-		if (res != VK_SUCCESS) {
-			throw std::runtime_error("failed to map memory");
-		}
+	for (Mesh* mesh : retired.meshes) {
+		FreeMesh(mesh);
+	}
 
-		memcpy(data, &ubo, sizeof(ubo));
-		vkUnmapMemory(
-			device, 
-			model->uniformBufferMemory[imageIndex].memory);
+	for (Texture* texture : retired.textures) {
+		FreeTexture(texture);
 	}
 
-	cameraMutex.unlock();
+	for (VkDescriptorPool& descriptorPool : retired.descriptorPools) {
+		DestroyDescriptorPool(descriptorPool);
+	}
+
+	retired.meshes.clear();
+	retired.textures.clear();
+	retired.descriptorPools.clear();
 }
 
-namespace std
+// Called with the device idle.
+void Video::FreeAllRetiredAssets()
 {
+	for (uint32_t frame = 0; frame < retiredAssets.size(); ++frame) {
+		FreeRetiredAssets(frame);
+	}
+}
 
-	template<>
-	struct hash<Model::Vertex>
-	{
-		size_t operator()(const Model::Vertex& vertex) const
-		{
-			return
-				((hash<glm::vec3>()(vertex.pos) ^
-				(hash<glm::vec3>()(vertex.color) << 1)) >> 1) ^
-				(hash<glm::vec2>()(vertex.texCoord) << 1);
+BoundingBox Video::GetWorldBounds(const Model* model)
+{
+	// Transforms the box extents by the absolute matrix (Arvo).
+	const BoundingBox& local = model->mesh->data->bounds;
+	const glm::mat4& matrix = model->modelPosition;
+	BoundingBox box;
+
+	for (int i = 0; i < 3; ++i) {
+		box.min[i] = matrix[3][i];
+		box.max[i] = matrix[3][i];
+
+		for (int j = 0; j < 3; ++j) {
+			float a = matrix[j][i] * local.min[j];
+			float b = matrix[j][i] * local.max[j];
+
+			box.min[i] += std::min(a, b);
+			box.max[i] += std::max(a, b);
 		}
-	};
+	}
+
+	return box;
 }
 
-void Video::LoadModelFromObj(Model* model, const std::string& fileName)
+std::shared_ptr<const Video::MeshData> Video::LoadModelFromObj(
+	const std::string& fileName)
 {
+	std::shared_ptr<const MeshData> data = meshFiles[fileName].lock();
+
+	if (data) {
+		return data;
+	}
+
 	tinyobj::attrib_t attrib;
 	std::vector<tinyobj::shape_t> shapes;
 	std::vector<tinyobj::material_t> materials;
@@ -2653,8 +4344,8 @@ void Video::LoadModelFromObj(Model* model, const std::string& fileName)
 		throw std::runtime_error(warn + err);
 	}
 
-	model->vertices.clear();
-	model->indices.clear();
+	std::vector<Model::Vertex> vertices;
+	std::vector<Model::VertexIndexType> indices;
 
 	std::unordered_map<Model::Vertex, Model::VertexIndexType>
 		uniqueVertices;
@@ -2680,150 +4371,164 @@ void Video::LoadModelFromObj(Model* model, const std::string& fileName)
 			if (uniqueVertices.count(vertex) == 0) {
 				uniqueVertices[vertex] =
 					static_cast<Model::VertexIndexType>(
-						model->vertices.size());
-				model->vertices.push_back(vertex);
+						vertices.size());
+				vertices.push_back(vertex);
 			}
 
-			model->indices.push_back(uniqueVertices[vertex]);
+			indices.push_back(uniqueVertices[vertex]);
+		}
+	}
+
+	data = std::make_shared<const MeshData>(
+		std::move(vertices),
+		std::move(indices));
+
+	// Forget files no model refers to any more.
+	for (auto it = meshFiles.begin(); it != meshFiles.end();) {
+		if (it->second.expired()) {
+			it = meshFiles.erase(it);
+		} else {
+			++it;
+		}
+	}
+
+	meshFiles[fileName] = data;
+
+	return data;
+}
+
+std::shared_ptr<const Video::TextureData> Video::LoadTextureFromFile(
+	const std::string& fileName)
+{
+	std::shared_ptr<const TextureData> data = textureFiles[fileName].lock();
+
+	if (data) {
+		return data;
+	}
+
+	int texWidth;
+	int texHeight;
+	int texChannels;
+
+	stbi_uc* pixels = stbi_load(
+		fileName.c_str(),
+		&texWidth,
+		&texHeight,
+		&texChannels,
+		STBI_rgb_alpha);
+
+	if (!pixels) {
+		throw std::runtime_error("failed to load texture image");
+	}
+
+	std::vector<uint8_t> copy(pixels, pixels + texWidth * texHeight * 4);
+	stbi_image_free(pixels);
+
+	data = std::make_shared<const TextureData>(
+		std::move(copy),
+		static_cast<uint32_t>(texWidth),
+		static_cast<uint32_t>(texHeight));
+
+	// Forget files no model refers to any more.
+	for (auto it = textureFiles.begin(); it != textureFiles.end();) {
+		if (it->second.expired()) {
+			it = textureFiles.erase(it);
+		} else {
+			++it;
 		}
 	}
+
+	textureFiles[fileName] = data;
+
+	return data;
 }
 
 void Video::GenerateMipmaps(
-	VkImage image,
-	VkFormat imageFormat,
+	std::vector<uint8_t>& pixels,
 	uint32_t texWidth,
 	uint32_t texHeight,
 	uint32_t mipLevels)
 {
-	VkFormatProperties formatProperties;
-	vkGetPhysicalDeviceFormatProperties(
-		physicalDevice,
-		imageFormat,
-		&formatProperties);
+	// Every level averages 2x2 texels of the one before in linear color,
+	// as a linear blit of the sRGB image would. The levels are appended
+	// to pixels, which holds the first one.
+	float toLinear[256];
 
-	bool success = formatProperties.optimalTilingFeatures &
-		VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+	for (int i = 0; i < 256; ++i) {
+		float value = i / 255.0f;
 
-	if (!success) {
-		throw std::runtime_error(
-			"image format does not support linear blitting");
+		toLinear[i] = value <= 0.04045f ?
+			value / 12.92f :
+			std::pow((value + 0.055f) / 1.055f, 2.4f);
 	}
 
-	VkCommandBuffer commandBuffer = BeginSingleTimeCommands();
+	const int toSrgbSize = 4096;
+	uint8_t toSrgb[toSrgbSize];
 
-	VkImageMemoryBarrier barrier{};
-	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-	barrier.image = image;
-	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-	barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-	barrier.subresourceRange.baseArrayLayer = 0;
-	barrier.subresourceRange.layerCount = 1;
-	barrier.subresourceRange.levelCount = 1;
+	for (int i = 0; i < toSrgbSize; ++i) {
+		float value = float(i) / (toSrgbSize - 1);
 
-	uint32_t mipWidth = texWidth;
-	uint32_t mipHeight = texHeight;
+		value = value <= 0.0031308f ?
+			value * 12.92f :
+			1.055f * std::pow(value, 1.0f / 2.4f) - 0.055f;
 
-	for (uint32_t i = 1; i < mipLevels; ++i) {
-		barrier.subresourceRange.baseMipLevel = i - 1;
-		barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-		barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-		barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-		barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+		toSrgb[i] = static_cast<uint8_t>(value * 255.0f + 0.5f);
+	}
 
-		vkCmdPipelineBarrier(
-			commandBuffer,
-			VK_PIPELINE_STAGE_TRANSFER_BIT,
-			VK_PIPELINE_STAGE_TRANSFER_BIT,
-			0,
-			0,
-			nullptr,
-			0,
-			nullptr,
-			1,
-			&barrier);
-
-		VkImageBlit blit{};
-		blit.srcOffsets[0] = {0, 0, 0};
-		blit.srcOffsets[1] = {
-			static_cast<int32_t>(mipWidth),
-			static_cast<int32_t>(mipHeight),
-			1
-		};
+	size_t source = 0;
+	uint32_t width = texWidth;
+	uint32_t height = texHeight;
 
-		blit.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-		blit.srcSubresource.mipLevel = i - 1;
-		blit.srcSubresource.baseArrayLayer = 0;
-		blit.srcSubresource.layerCount = 1;
+	for (uint32_t level = 1; level < mipLevels; ++level) {
+		uint32_t mipWidth = width > 1 ? width / 2 : 1;
+		uint32_t mipHeight = height > 1 ? height / 2 : 1;
+		size_t destination = pixels.size();
 
-		blit.dstOffsets[0] = {0, 0, 0};
-		blit.dstOffsets[1] = {
-			static_cast<int32_t>(mipWidth > 1 ? mipWidth / 2 : 1),
-			static_cast<int32_t>(mipHeight > 1 ? mipHeight / 2 : 1),
-			1
-		};
+		pixels.resize(destination + size_t(mipWidth) * mipHeight * 4);
 
-		blit.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-		blit.dstSubresource.mipLevel = i;
-		blit.dstSubresource.baseArrayLayer = 0;
-		blit.dstSubresource.layerCount = 1;
+		for (uint32_t y = 0; y < mipHeight; ++y) {
+			uint32_t y0 = std::min(y * 2, height - 1);
+			uint32_t y1 = std::min(y * 2 + 1, height - 1);
 
-		vkCmdBlitImage(
-			commandBuffer,
-			image,
-			VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-			image,
-			VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-			1,
-			&blit,
-			VK_FILTER_LINEAR);
+			for (uint32_t x = 0; x < mipWidth; ++x) {
+				uint32_t x0 = std::min(x * 2, width - 1);
+				uint32_t x1 = std::min(x * 2 + 1, width - 1);
 
-		barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-		barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-		barrier.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
-		barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+				const uint8_t* texels[4] = {
+					&pixels[source + (size_t(y0) * width + x0) * 4],
+					&pixels[source + (size_t(y0) * width + x1) * 4],
+					&pixels[source + (size_t(y1) * width + x0) * 4],
+					&pixels[source + (size_t(y1) * width + x1) * 4]
+				};
 
-		vkCmdPipelineBarrier(
-			commandBuffer,
-			VK_PIPELINE_STAGE_TRANSFER_BIT,
-			VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
-			0,
-			0,
-			nullptr,
-			0,
-			nullptr,
-			1,
-			&barrier);
+				uint8_t* texel =
+					&pixels[destination + (size_t(y) * mipWidth + x) * 4];
 
-		if (mipWidth > 1) {
-			mipWidth /= 2;
-		}
+				for (int channel = 0; channel < 3; ++channel) {
+					float sum = 0.0f;
 
-		if (mipHeight > 1) {
-			mipHeight /= 2;
-		}
-	}
+					for (const uint8_t* sample : texels) {
+						sum += toLinear[sample[channel]];
+					}
 
-	barrier.subresourceRange.baseMipLevel = mipLevels - 1;
-	barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-	barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-	barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+					texel[channel] = toSrgb[
+						static_cast<int>(sum / 4.0f * (toSrgbSize - 1) + 0.5f)];
+				}
 
-	vkCmdPipelineBarrier(
-		commandBuffer,
-		VK_PIPELINE_STAGE_TRANSFER_BIT,
-		VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
-		0,
-		0,
-		nullptr,
-		0,
-		nullptr,
-		1,
-		&barrier);
+				uint32_t alpha = 0;
 
-	EndSingleTimeCommands(commandBuffer);
+				for (const uint8_t* sample : texels) {
+					alpha += sample[3];
+				}
+
+				texel[3] = static_cast<uint8_t>((alpha + 2) / 4);
+			}
+		}
+
+		source = destination;
+		width = mipWidth;
+		height = mipHeight;
+	}
 }
 
 VkSampleCountFlagBits Video::GetMaxUsableSampleCount()
@@ -2861,11 +4566,19 @@ Model* Video::CreateModel(std::string* fileName)
 	Model* model = new Model();
 
 	if (fileName) {
-		LoadModelFromObj(model, *fileName);
+		model->meshData = LoadModelFromObj(*fileName);
+	} else {
+		model->meshData = std::make_shared<const MeshData>(
+			std::vector<Model::Vertex>(),
+			std::vector<Model::VertexIndexType>());
 	}
 
 	model->loaded = false;
 	model->active = false;
+	model->mesh = nullptr;
+	model->texture = nullptr;
+	model->cullingProxy = BoundingVolumeTree<Model*>::None;
+	model->indirectCommand = 0;
 
 	return model;
 }
@@ -2877,21 +4590,8 @@ void Video::DestroyModel(Model* model)
 
 void Video::LoadModel(Model* model)
 {
-	if (allowVertexBufferCreation) {
-		CreateVertexBuffer(model);
-	}
-
-	if (allowIndexBufferCreation) {
-		CreateIndexBuffer(model);
-	}
-
-	if (allowTextureImageCreation) {
-		CreateTextureImage(model);
-	}
-
-	if (allowUniformBufferCreation) {
-		CreateUniformBuffers(model);
-	}
+	model->mesh = AcquireMesh(model->meshData);
+	model->texture = AcquireTexture(model->textureName);
 
 	if (allowDescriptorPoolCreation) {
 		CreateDescriptorPool(model->descriptorPool);
@@ -2902,35 +4602,32 @@ void Video::LoadModel(Model* model)
 	}
 
 	model->loaded = true;
+	model->cullingProxy = cullingTree.Insert(GetWorldBounds(model), model);
 
 	models.insert(model);
+	++modelGeneration;
+
+	SubmitUploads();
 }
 
 void Video::UnloadModel(Model* model)
 {
 	if (allowDescriptorPoolCreation) {
-		DestroyDescriptorPool(model->descriptorPool);
-	}
-
-	if (allowUniformBufferCreation) {
-		DestroyUniformBuffers(model);
-	}
-
-	if (allowTextureImageCreation) {
-		DestroyTextureImage(model);
+		ReleaseDescriptorPool(model->descriptorPool);
 	}
 
-	if (allowIndexBufferCreation) {
-		DestroyIndexBuffer(model);
-	}
+	ReleaseTexture(model->texture);
+	ReleaseMesh(model->mesh);
+	model->texture = nullptr;
+	model->mesh = nullptr;
 
-	if (allowVertexBufferCreation) {
-		DestroyVertexBuffer(model);
-	}
+	cullingTree.Remove(model->cullingProxy);
+	model->cullingProxy = BoundingVolumeTree<Model*>::None;
 
 	model->loaded = false;
 
 	models.erase(model);
+	++modelGeneration;
 }
 
 void Video::Start()
@@ -2987,6 +4684,29 @@ void Video::ClearKeyBindings()
 	keyBindings.clear();
 }
 
+Video::CullingStatistics Video::GetCullingStatistics()
+{
+	cullingMutex.lock();
+	CullingStatistics statistics = cullingStatistics;
+	cullingMutex.unlock();
+
+	return statistics;
+}
+
+bool Video::IsIndirectDrawingSupported()
+{
+	return indirectDrawingSupported;
+}
+
+void Video::SetIndirectDrawing(bool enable)
+{
+	if (enable && !indirectDrawingSupported) {
+		throw std::runtime_error("indirect drawing is not supported");
+	}
+
+	indirectDrawingRequested = enable;
+}
+
 // GPUMemoryManager
 Video::GPUMemoryManager::GPUMemoryManager(
 	VkDevice device,
@@ -2999,7 +4719,7 @@ Video::GPUMemoryManager::GPUMemoryManager(
 	this->partSize = partSize;
 	this->memoryTypeIndex = memoryTypeIndex;
 
-	AddPartition();
+	AddPartition(partSize);
 }
 
 Video::GPUMemoryManager::~GPUMemoryManager()
@@ -3009,11 +4729,11 @@ Video::GPUMemoryManager::~GPUMemoryManager()
 	}
 }
 
-void Video::GPUMemoryManager::AddPartition()
+void Video::GPUMemoryManager::AddPartition(uint32_t sectors)
 {
 	VkMemoryAllocateInfo allocInfo{};
 	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	allocInfo.allocationSize = alignment * partSize;
+	allocInfo.allocationSize = VkDeviceSize(alignment) * sectors;
 	allocInfo.memoryTypeIndex = memoryTypeIndex;
 
 	VkDeviceMemory memory;
@@ -3025,66 +4745,27 @@ void Video::GPUMemoryManager::AddPartition()
 	}
 
 	partitions.push_back(memory);
-	partitionData.push_back(std::vector<bool>(partSize, false));
+	allocator.AddPartition(sectors);
 }
 
 Video::GPUMemoryManager::MemoryAllocationProperties
 Video::GPUMemoryManager::Allocate(uint32_t size)
 {
-	uint32_t sizeInSectors = size / alignment + 1;
-
-	uint32_t partitionNum = 0;
-	uint32_t sectorNum = 0;
-
-	bool goodPart = false;
+	uint32_t sizeInSectors = (size + alignment - 1) / alignment;
 
-	for (size_t partIdx = 0; partIdx < partitionData.size(); ++partIdx) {
-		std::vector<bool>& partDesc = partitionData[partIdx];
-		goodPart = false;
-
-		size_t lim = partDesc.size() + 1 - sizeInSectors;
-
-		for (size_t i = 0; i < lim; ++i) {
-			goodPart = true;
-			size_t j;
-
-			for (j = 0; j < sizeInSectors;) {
-				if (partDesc[i + j]) {
-					goodPart = false;
-					break;
-				}
-
-				++j;
-			}
+	MemoryAllocationProperties props;
 
-			if (goodPart) {
-				partitionNum = partIdx;
-				sectorNum = i;
-				break;
-			} else {
-				i = i + j;
-			}
-		}
+	if (!allocator.Allocate(sizeInSectors, props.sectors)) {
+		AddPartition(std::max(partSize, sizeInSectors));
 
-		if (goodPart) {
-			break;
+		if (!allocator.Allocate(sizeInSectors, props.sectors)) {
+			throw std::runtime_error("failed to allocate memory");
 		}
 	}
 
-	if (!goodPart) {
-		AddPartition();
-		sectorNum = 0;
-		partitionNum = partitions.size() - 1;
-	}
-
-	MemoryAllocationProperties props;
 	props.size = size;
-	props.offset = alignment * sectorNum;
-	props.memory = partitions[partitionNum];
-
-	for (size_t i = 0; i < sizeInSectors; ++i) {
-		partitionData[partitionNum][i + sectorNum] = true;
-	}
+	props.offset = alignment * props.sectors.offset;
+	props.memory = partitions[props.sectors.partition];
 
 	return props;
 }
@@ -3092,22 +4773,12 @@ Video::GPUMemoryManager::Allocate(uint32_t size)
 void Video::GPUMemoryManager::Free(
 	Video::GPUMemoryManager::MemoryAllocationProperties allocation)
 {
-	size_t partIdx = 0;
-
-	for (const auto& memory : partitions) {
-		if (memory == allocation.memory) {
-			break;
-		}
-
-		++partIdx;
-	}
-
-	uint32_t sizeInSectors = allocation.size / alignment + 1;
-	uint32_t sectorNum = allocation.offset / alignment;
+	allocator.Free(allocation.sectors);
+}
 
-	for (size_t i = 0; i < sizeInSectors; ++i) {
-		partitionData[partIdx][i + sectorNum] = false;
-	}
+SectorAllocator::Statistics Video::GPUMemoryManager::GetStatistics() const
+{
+	return allocator.GetStatistics();
 }
 
 // Model
@@ -3119,8 +4790,7 @@ void Model::UpdateBuffers(
 		throw std::runtime_error("model is loaded");
 	}
 
-	this->vertices = vertices;
-	this->indices = indices;
+	meshData = std::make_shared<const Video::MeshData>(vertices, indices);
 }
 
 void Model::SetTextureName(const std::string& name)
@@ -3160,3 +4830,30 @@ Model::Vertex::GetAttributeDescriptions()
 
 	return attributeDescriptions;
 }
+
+VkVertexInputBindingDescription Model::Instance::GetBindingDescription()
+{
+	VkVertexInputBindingDescription bindingDescription{};
+	bindingDescription.binding = 1;
+	bindingDescription.stride = sizeof(Model::Instance);
+	bindingDescription.inputRate = VK_VERTEX_INPUT_RATE_INSTANCE;
+
+	return bindingDescription;
+}
+
+std::vector<VkVertexInputAttributeDescription>
+Model::Instance::GetAttributeDescriptions()
+{
+	// A matrix takes one location per column.
+	std::vector<VkVertexInputAttributeDescription> attributeDescriptions(4);
+
+	for (uint32_t i = 0; i < 4; ++i) {
+		attributeDescriptions[i].binding = 1;
+		attributeDescriptions[i].location = 3 + i;
+		attributeDescriptions[i].format = VK_FORMAT_R32G32B32A32_SFLOAT;
+		attributeDescriptions[i].offset =
+			offsetof(Instance, model) + sizeof(glm::vec4) * i;
+	}
+
+	return attributeDescriptions;
+}
@@ -6,8 +6,13 @@
 #include <string>
 #include <optional>
 #include <set>
+#include <map>
+#include <memory>
 #include <algorithm>
 #include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
 
 #include <vulkan/vulkan.h>
 #define GLFW_INCLUDE_VULKAN
@@ -20,6 +25,8 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtx/hash.hpp>
 
+#include "sectorallocator.h"
+#include "boundingvolumetree.h"
 
 class Model;
 
@@ -35,7 +42,7 @@ public:
 			uint32_t size;
 			uint32_t offset;
 			VkDeviceMemory memory;
-
+			SectorAllocator::Allocation sectors;
 		};
 
 	private:
@@ -44,9 +51,9 @@ public:
 		uint32_t alignment;
 		VkDevice device;
 		std::vector<VkDeviceMemory> partitions;
-		std::vector<std::vector<bool>> partitionData;
+		SectorAllocator allocator;
 
-		void AddPartition();
+		void AddPartition(uint32_t sectors);
 
 	public:
 		GPUMemoryManager(
@@ -58,6 +65,8 @@ public:
 
 		MemoryAllocationProperties Allocate(uint32_t size);
 		void Free(MemoryAllocationProperties properties);
+
+		SectorAllocator::Statistics GetStatistics() const;
 	};
 
 	class Camera
@@ -68,12 +77,31 @@ public:
 		glm::vec3 up;
 	};
 
+	// Loaded models inside and outside the view in the last frame,
+	// active ones only. Tree nodes are not tested when culling on the
+	// GPU, the counts then come from an earlier frame.
+	struct CullingStatistics
+	{
+		uint32_t visible;
+		uint32_t culled;
+		uint32_t testedNodes;
+	};
+
+	// Assets shared by models, defined after Model.
+	struct MeshData;
+	struct Mesh;
+	struct TextureData;
+	struct Texture;
+
 private:
 	// Types
 	struct QueueFamilyIndices
 	{
 		std::optional<uint32_t> graphicsFamily;
 		std::optional<uint32_t> presentFamily;
+		// A family only for transfers if there is one, the graphics
+		// family otherwise.
+		std::optional<uint32_t> transferFamily;
 	};
 
 	struct SwapchainSupportDetails
@@ -86,10 +114,66 @@ private:
 	enum GPUMemoryManagerType {
 		MANAGER_VERTEX,
 		MANAGER_INDEX,
-		MANAGER_UNIFORM,
 		MANAGER_TEXTURE
 	};
 
+	struct CameraUniform
+	{
+		glm::mat4 view;
+		glm::mat4 proj;
+	};
+
+	// Run of instanceModels drawn with one call.
+	struct InstanceGroup
+	{
+		Model* model;
+		uint32_t firstInstance;
+		uint32_t instanceCount;
+	};
+
+	// Buffer of a vertex or index pool.
+	struct GeometryBuffer
+	{
+		VkBuffer buffer;
+		GPUMemoryManager::MemoryAllocationProperties memory;
+	};
+
+	// Layout of the culling shader input, see shaders/cull.comp.
+	struct CullHeader
+	{
+		glm::vec4 planes[6];
+		uint32_t recordCount;
+		uint32_t padding[3];
+	};
+
+	struct CullRecord
+	{
+		glm::mat4 model;
+		// Box around the mesh in model space.
+		glm::vec4 boundsMin;
+		glm::vec4 boundsMax;
+		uint32_t command;
+		uint32_t padding[3];
+	};
+
+	// Copies submitted to the transfer queue together.
+	struct UploadBatch
+	{
+		uint64_t value;
+		VkCommandBuffer commandBuffer;
+		// Staging position after the bytes the copies read.
+		VkDeviceSize stagingEnd;
+	};
+
+	// Run of indirect draw commands with the same texture and pools,
+	// drawn with one call.
+	struct IndirectBatch
+	{
+		Model* model;
+		uint32_t firstCommand;
+		uint32_t commandCount;
+	};
+
 	// Global objects
 	std::string ApplicationName;
 	std::vector<const char*> deviceExtensions;
@@ -104,6 +188,38 @@ private:
 
 	std::set<Model*> models;
 
+	// GPU assets of loaded models, counted by the models using them.
+	// Meshes and textures are found by the hash of their contents, so
+	// models with equal geometry or pixels share them even if they did
+	// not come from the same file.
+	std::multimap<uint64_t, Mesh*> meshes;
+	std::multimap<uint64_t, Texture*> textures;
+	Mesh* AcquireMesh(const std::shared_ptr<const MeshData>& data);
+	void ReleaseMesh(Mesh* mesh);
+	void FreeMesh(Mesh* mesh);
+	Texture* AcquireTexture(const std::string& name);
+	void ReleaseTexture(Texture* texture);
+	void FreeTexture(Texture* texture);
+
+	// Assets no model uses any more, by the frame in flight submitted
+	// last when they were released. Earlier frames may still read them,
+	// so they are freed once that frame's fence has signalled.
+	struct RetiredAssets
+	{
+		std::vector<Mesh*> meshes;
+		std::vector<Texture*> textures;
+		std::vector<VkDescriptorPool> descriptorPools;
+	};
+
+	std::vector<RetiredAssets> retiredAssets;
+	void ReleaseDescriptorPool(VkDescriptorPool& descriptorPool);
+	void FreeRetiredAssets(uint32_t frame);
+	void FreeAllRetiredAssets();
+
+	// Parsed OBJ and image files, kept while a model refers to them.
+	std::map<std::string, std::weak_ptr<const MeshData>> meshFiles;
+	std::map<std::string, std::weak_ptr<const TextureData>> textureFiles;
+
 	uint32_t maxFramesInFlight;
 	uint32_t currentFrame;
 
@@ -112,7 +228,6 @@ private:
 	GPUMemoryManager* vertexBufferMemoryManager;
 	GPUMemoryManager* indexBufferMemoryManager;
 	GPUMemoryManager* textureImageMemoryManager;
-	GPUMemoryManager* uniformBufferMemoryManager;
 
 	VkSampleCountFlagBits msaaSamples;
 
@@ -133,22 +248,73 @@ private:
 	VkDevice device;
 	VkQueue graphicsQueue;
 	VkQueue presentQueue;
+	VkQueue transferQueue;
+	// Queues may be the same, submits and waits for idle hold the lock.
+	std::mutex queueMutex;
 	void CreateLogicalDevice();
 	void DestroyLogicalDevice();
 
-	VkCommandPool commandPool;
 	VkCommandPool transferCommandPool;
+	VkCommandPool uploadCommandPool;
 	void CreateCommandPools();
 	void DestroyCommandPools();
 
 	VkFence bufferCopyFence;
+	VkSemaphore uploadSemaphore;
 	void CreateSyncObjects();
 	void DestroySyncObjects();
 
+	// Uploads of vertices, indices and textures are recorded into a
+	// batch that is submitted to the transfer queue without waiting. A
+	// batch signals its value on uploadSemaphore, a timeline semaphore,
+	// when done. Meshes and textures remember the value of their upload
+	// and models are drawn once it is reached, so loading never blocks
+	// the caller or a frame. uploadCompleted is written under uploadMutex
+	// but read by the render thread without it.
+	std::list<UploadBatch> uploadBatches;
+	uint64_t uploadSubmitted;
+	std::atomic<uint64_t> uploadCompleted;
+	std::mutex uploadMutex;
+	VkCommandBuffer BeginUpload();
+	void SubmitUploads();
+	void SubmitBatch();
+	void ReclaimUploads();
+	void ReclaimBatches();
+	void WaitUploads();
+	bool IsUploaded(const Model* model);
+
+	// Uploads are staged in a ring that stays mapped. Bytes from
+	// stagingTail to stagingHead belong to unfinished batches; when the
+	// ring is full, loading waits for the oldest batch. The ring only
+	// grows for data larger than all of it.
+	static constexpr VkDeviceSize StagingBufferSize = 1 << 26;
+	static constexpr VkDeviceSize StagingAlignment = 16;
+	VkBuffer stagingBuffer;
+	VkDeviceMemory stagingBufferMemory;
+	char* stagingBufferData;
+	VkDeviceSize stagingCapacity;
+	VkDeviceSize stagingHead;
+	VkDeviceSize stagingTail;
+	void CreateStagingBuffer();
+	void DestroyStagingBuffer();
+	VkDeviceSize AllocateStaging(VkDeviceSize size);
+
 	VkDescriptorSetLayout descriptorSetLayout;
 	void CreateDescriptorSetLayout();
 	void DestroyDescriptorSetLayout();
 
+	// Culling on the GPU and indirect drawing, used when the device
+	// supports multiple draws per indirect call and indirectDrawing is set.
+	bool indirectDrawingSupported;
+	bool indirectDrawing;
+	std::atomic<bool> indirectDrawingRequested;
+
+	VkDescriptorSetLayout cullDescriptorSetLayout;
+	VkPipelineLayout cullPipelineLayout;
+	VkPipeline cullPipeline;
+	void CreateCullPipeline();
+	void DestroyCullPipeline();
+
 	// Swapchain objects
 	void CreateSwapchain();
 	void DestroySwapchain();
@@ -188,32 +354,106 @@ private:
 	void DestroyDescriptorSets();
 	void CreateDescriptorSets(Model* model);
 	void DestroyDescriptorSets(Model* model);
+	void UpdateDescriptorSets(Model* model);
+
+	VkDescriptorPool cullDescriptorPool;
+	std::vector<VkDescriptorSet> cullDescriptorSets;
+	void CreateCullDescriptorSets();
+	void DestroyCullDescriptorSets();
+	void UpdateCullDescriptorSets();
+
+	// Persistently mapped per-frame data. Every swapchain image has a
+	// region with the camera matrices followed by the instance data of
+	// the active models, which is bound as a vertex buffer.
+	VkBuffer uniformBuffer;
+	VkDeviceMemory uniformBufferMemory;
+	char* uniformBufferData;
+	uint32_t uniformCapacity;
+	VkDeviceSize uniformCameraSize;
+	VkDeviceSize uniformFrameSize;
+
+	// Visible active models sorted by mesh and texture and their draws,
+	// rebuilt with the instance data every frame.
+	std::vector<Model*> instanceModels;
+	std::vector<InstanceGroup> instanceGroups;
+
+	// Persistently mapped culling data with the same capacity. Every
+	// swapchain image has a region with the culling header and records
+	// of the active models, the draw commands, and the instance data the
+	// culling shader writes for the visible models.
+	VkBuffer indirectBuffer;
+	VkDeviceMemory indirectBufferMemory;
+	char* indirectBufferData;
+	VkDeviceSize indirectCommandsOffset;
+	VkDeviceSize indirectInstancesOffset;
+	VkDeviceSize indirectFrameSize;
+
+	// Loaded models sorted by texture, pools and mesh, one command per
+	// mesh and texture, rebuilt when modelGeneration changes.
+	std::vector<Model*> indirectModels;
+	std::vector<VkDrawIndexedIndirectCommand> indirectCommands;
+	std::vector<IndirectBatch> indirectBatches;
+	uint64_t indirectGeneration;
+	// Records and commands written to the region of every swapchain
+	// image.
+	std::vector<uint32_t> indirectRecordCounts;
+	std::vector<uint32_t> indirectCommandCounts;
+	void UpdateIndirectBatches();
+	void UpdateIndirectBuffers(uint32_t imageIndex, const glm::mat4& matrix);
 
-	bool allowUniformBufferCreation;
 	void CreateUniformBuffers();
 	void DestroyUniformBuffers();
-	void CreateUniformBuffers(Model* model);
-	void DestroyUniformBuffers(Model* model);
+	void GrowUniformBuffers(uint32_t capacity);
+
+	// World bounds of loaded models, tested against the view frustum
+	// before drawing.
+	BoundingVolumeTree<Model*> cullingTree;
+	std::vector<Model*> visibleModels;
+	CullingStatistics cullingStatistics;
+	std::mutex cullingMutex;
+	BoundingBox GetWorldBounds(const Model* model);
+
+	// Meshes share a few large vertex and index buffers, a pool sector
+	// is one vertex or index. Pools are added when the existing ones
+	// are full.
+	static constexpr uint32_t VertexPoolSize = 1 << 16;
+	static constexpr uint32_t IndexPoolSize = 1 << 18;
+
+	std::vector<GeometryBuffer> vertexPools;
+	SectorAllocator vertexAllocator;
+	std::vector<GeometryBuffer> indexPools;
+	SectorAllocator indexAllocator;
+	void AddGeometryPool(
+		std::vector<GeometryBuffer>& pools,
+		SectorAllocator& allocator,
+		uint32_t size,
+		VkDeviceSize elementSize,
+		VkBufferUsageFlags usage,
+		GPUMemoryManagerType managerType);
+	void DestroyGeometryPools(
+		std::vector<GeometryBuffer>& pools,
+		SectorAllocator& allocator,
+		GPUMemoryManager* memoryManager);
 
 	bool allowVertexBufferCreation;
 	void CreateVertexBuffers();
 	void DestroyVertexBuffers();
-	void CreateVertexBuffer(Model* model);
-	void DestroyVertexBuffer(Model* model);
+	void CreateVertexBuffer(Mesh* mesh);
+	void DestroyVertexBuffer(Mesh* mesh);
 
 	bool allowIndexBufferCreation;
 	void CreateIndexBuffers();
 	void DestroyIndexBuffers();
-	void CreateIndexBuffer(Model* model);
-	void DestroyIndexBuffer(Model* model);
+	void CreateIndexBuffer(Mesh* mesh);
+	void DestroyIndexBuffer(Mesh* mesh);
 
 	bool allowTextureImageCreation;
 	void CreateTextureImages();
 	void DestroyTextureImages();
-	void CreateTextureImage(Model* model);
-	void DestroyTextureImage(Model* model);
-	void CreateTextureSampler(Model* model);
-	void DestroyTextureSampler(Model* model);
+	void CreateTextureImage(Texture* texture);
+	void DestroyTextureImage(Texture* texture);
+	void CreateTextureSampler(Texture* texture);
+	void DestroyTextureSampler(Texture* texture);
 
 	VkRenderPass renderPass;
 	void CreateRenderPass();
@@ -228,10 +468,54 @@ private:
 	void CreateFramebuffers();
 	void DestroyFramebuffers();
 
+	// Every swapchain image has a pool with one command buffer, reset as
+	// a whole when the buffer is recorded again. A recorded buffer is
+	// submitted again as long as the same models are active and no model
+	// was loaded or unloaded.
+	std::vector<VkCommandPool> commandPools;
 	std::vector<VkCommandBuffer> commandBuffers;
+	std::vector<std::vector<Model*>> recordedModels;
+	std::vector<uint64_t> recordedGenerations;
+	uint64_t modelGeneration;
 	void CreateCommandBuffers();
 	void DestroyCommandBuffers();
 
+	// With many draws, recording is split between threads. Each thread
+	// records a secondary command buffer from its own pool per
+	// swapchain image and the primary buffer executes them.
+	struct RecordingThread
+	{
+		std::thread thread;
+		std::vector<VkCommandPool> commandPools;
+		std::vector<VkCommandBuffer> commandBuffers;
+	};
+
+	static const uint32_t MinParallelDraws = 512;
+
+	std::vector<RecordingThread> recordingThreads;
+	std::mutex recordingMutex;
+	std::condition_variable recordingCondition;
+	std::condition_variable recordingDoneCondition;
+	bool recordingWork;
+	uint64_t recordingSequence;
+	uint32_t recordingImage;
+	uint32_t recordingPending;
+	bool recordingFailed;
+	void StartRecordingThreads();
+	void StopRecordingThreads();
+	void CreateRecordingCommandBuffers();
+	void DestroyRecordingCommandBuffers();
+	void RecordingWorker(uint32_t index, uint64_t sequence);
+	void RecordDraws(
+		VkCommandBuffer commandBuffer,
+		uint32_t imageIndex,
+		size_t begin,
+		size_t end);
+	void RecordCulling(VkCommandBuffer commandBuffer, uint32_t imageIndex);
+	void RecordIndirectDraws(
+		VkCommandBuffer commandBuffer,
+		uint32_t imageIndex);
+
 	std::vector<VkSemaphore> imageAvailableSemaphores;
 	std::vector<VkSemaphore> renderFinishedSemaphores;
 	std::vector<VkFence> inFlightFences;
@@ -272,6 +556,7 @@ private:
 	std::vector<const char*> GetValidationLayers();
 	bool IsDeviceSuitable(VkPhysicalDevice device);
 	bool CheckDeviceExtensionSupport(VkPhysicalDevice device);
+	bool CheckIndirectDrawingSupport(VkPhysicalDevice device);
 	SwapchainSupportDetails QuerySwapchainSupport(VkPhysicalDevice device);
 	QueueFamilyIndices FindQueueFamilies(VkPhysicalDevice device);
 	VkSurfaceFormatKHR ChooseSwapchainSurfaceFormat(
@@ -326,10 +611,11 @@ private:
 		VkMemoryPropertyFlags properties,
 		VkBuffer& buffer,
 		VkDeviceMemory& bufferMemory);
-	void CopyBuffer(
-		VkBuffer srcBuffer,
+	uint64_t UploadBuffer(
+		const void* data,
+		VkDeviceSize size,
 		VkBuffer dstBuffer,
-		VkDeviceSize size);
+		VkDeviceSize dstOffset);
 	void CreateImage(
 		uint32_t width,
 		uint32_t height,
@@ -341,18 +627,22 @@ private:
 		GPUMemoryManagerType managerType,
 		VkImage& image,
 		GPUMemoryManager::MemoryAllocationProperties& memoryAllocation);
-	void CopyBufferToImage(
-		VkBuffer buffer,
+	uint64_t UploadImage(
+		const void* data,
+		VkDeviceSize size,
 		VkImage image,
 		uint32_t width,
-		uint32_t height);
+		uint32_t height,
+		uint32_t mipLevels);
 	VkShaderModule CreateShaderModule(uint32_t size, const uint32_t* code);
 	void CreateCommandBuffer(uint32_t imageIndex);
 	void UpdateUniformBuffers(uint32_t imageIndex);
-	void LoadModelFromObj(Model* model, const std::string& fileName);
+	std::shared_ptr<const MeshData> LoadModelFromObj(
+		const std::string& fileName);
+	std::shared_ptr<const TextureData> LoadTextureFromFile(
+		const std::string& fileName);
 	void GenerateMipmaps(
-		VkImage image,
-		VkFormat imageFormat,
+		std::vector<uint8_t>& pixels,
 		uint32_t texWidth,
 		uint32_t texHeight,
 		uint32_t mipLevels);
@@ -387,6 +677,14 @@ public:
 		void (*callback)(int, int, void*));
 
 	void ClearKeyBindings();
+
+	CullingStatistics GetCullingStatistics();
+
+	// Switches between culling on the CPU with a draw call per group of
+	// instances and culling on the GPU with indirect draws, from the
+	// next frame on. Throws if the device cannot draw indirectly.
+	bool IsIndirectDrawingSupported();
+	void SetIndirectDrawing(bool enable);
 };
 
 class Model
@@ -415,40 +713,33 @@ public:
 		}
 	};
 
-private:
-	struct UniformBufferObject
+	// Per-instance vertex data, read from the second vertex binding.
+	struct Instance
 	{
 		glm::mat4 model;
-		glm::mat4 view;
-		glm::mat4 proj;
+
+		static VkVertexInputBindingDescription GetBindingDescription();
+		static std::vector<VkVertexInputAttributeDescription>
+			GetAttributeDescriptions();
 	};
 
-	std::vector<Vertex> vertices;
-	std::vector<VertexIndexType> indices;
+private:
+	std::shared_ptr<const Video::MeshData> meshData;
 
 	std::string textureName;
 
-	VkBuffer vertexBuffer;
-	Video::GPUMemoryManager::MemoryAllocationProperties vertexBufferMemory;
-
-	VkBuffer indexBuffer;
-	Video::GPUMemoryManager::MemoryAllocationProperties indexBufferMemory;
-
 	bool loaded;
 
+	// Set while the model is loaded.
+	Video::Mesh* mesh;
+	Video::Texture* texture;
+	uint32_t cullingProxy;
+	// Draw command of the mesh and texture in indirect drawing.
+	uint32_t indirectCommand;
+
 	VkDescriptorPool descriptorPool;
 	std::vector<VkDescriptorSet> descriptorSets;
 
-	uint32_t textureMipLevels;
-	VkImage textureImage;
-	VkSampler textureSampler;
-	VkImageView textureImageView;
-	Video::GPUMemoryManager::MemoryAllocationProperties textureImageMemory;
-
-	std::vector<VkBuffer> uniformBuffers;
-	std::vector<Video::GPUMemoryManager::MemoryAllocationProperties>
-		uniformBufferMemory;
-
 	Model()
 	{ }
 
@@ -466,4 +757,54 @@ public:
 	void SetTextureName(const std::string& name);
 };
 
+// Vertices and indices of a model, immutable once created.
+struct Video::MeshData
+{
+	std::vector<Model::Vertex> vertices;
+	std::vector<Model::VertexIndexType> indices;
+	uint64_t hash;
+	// Box around the vertices in model space.
+	BoundingBox bounds;
+
+	MeshData(
+		std::vector<Model::Vertex> vertices,
+		std::vector<Model::VertexIndexType> indices);
+};
+
+struct Video::Mesh
+{
+	std::shared_ptr<const MeshData> data;
+	uint32_t references;
+
+	// Ranges in the vertex and index pools.
+	SectorAllocator::Allocation vertices;
+	SectorAllocator::Allocation indices;
+	// Upload batch value after which the data is on the device.
+	uint64_t upload;
+};
+
+// Pixels of the first level of a texture, RGBA, immutable once created.
+struct Video::TextureData
+{
+	std::vector<uint8_t> pixels;
+	uint32_t width;
+	uint32_t height;
+	uint64_t hash;
+
+	TextureData(std::vector<uint8_t> pixels, uint32_t width, uint32_t height);
+};
+
+struct Video::Texture
+{
+	std::shared_ptr<const TextureData> data;
+	uint32_t references;
+
+	uint32_t mipLevels;
+	uint64_t upload;
+	VkImage image;
+	VkSampler sampler;
+	VkImageView imageView;
+	GPUMemoryManager::MemoryAllocationProperties imageMemory;
+};
+
 #endif
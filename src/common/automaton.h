@@ -0,0 +1,191 @@
+#ifndef AUTOMATON_H
+#define AUTOMATON_H
+
+#include <cstdint>
+#include <cstddef>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define AUTOMATON_X86
+#endif
+
+#include "map.h"
+
+// Cellular automaton step used by chunk generation.
+//
+// The input grid is stored with a one-cell halo around it, so every cell
+// of the chunk has all 8 neighbours at fixed offsets and the inner loop
+// needs no edge branches. The output is one byte per tile: 1 when the
+// neighbour sum is in (3, 13), which the generator turns into Grass.
+
+#define AUTOMATON_STRIDE (CHUNKSIZE + 2)
+#define AUTOMATON_PADDED_SIZE (AUTOMATON_STRIDE * (CHUNKSIZE + 2))
+
+// Copies a CHUNKSIZE x CHUNKSIZE grid into the padded layout, filling the
+// halo by wrapping around the chunk edges.
+inline void AutomatonPadToroidal(const uint8_t* grid, uint8_t* padded)
+{
+	for (int y = 0; y < CHUNKSIZE + 2; y++) {
+		int srcY = (y + CHUNKSIZE - 1) % CHUNKSIZE;
+		const uint8_t* src = grid + srcY * CHUNKSIZE;
+		uint8_t* dst = padded + y * AUTOMATON_STRIDE;
+
+		dst[0] = src[CHUNKSIZE - 1];
+
+		for (int x = 0; x < CHUNKSIZE; x++) {
+			dst[x + 1] = src[x];
+		}
+
+		dst[CHUNKSIZE + 1] = src[0];
+	}
+}
+
+inline uint8_t AutomatonCell(const uint8_t* padded, int x, int y)
+{
+	const uint8_t* up = padded + y * AUTOMATON_STRIDE + x;
+	const uint8_t* mid = up + AUTOMATON_STRIDE;
+	const uint8_t* down = mid + AUTOMATON_STRIDE;
+
+	int sum = up[0] + up[1] + up[2] + mid[0] + mid[2] +
+		down[0] + down[1] + down[2];
+
+	return sum > 3 && sum < 13;
+}
+
+inline void AutomatonStepScalar(const uint8_t* padded, uint8_t* result)
+{
+	for (int y = 0; y < CHUNKSIZE; y++) {
+		for (int x = 0; x < CHUNKSIZE; x++) {
+			result[y * CHUNKSIZE + x] = AutomatonCell(padded, x, y);
+		}
+	}
+}
+
+#ifdef AUTOMATON_X86
+
+// Neighbour sums fit in a byte (8 * 2 at most), so a whole row of the
+// chunk is summed with byte adds over three shifted loads per halo row.
+__attribute__((target("sse2")))
+inline void AutomatonStepSSE2(const uint8_t* padded, uint8_t* result)
+{
+	const __m128i low = _mm_set1_epi8(3);
+	const __m128i high = _mm_set1_epi8(13);
+	const __m128i one = _mm_set1_epi8(1);
+
+	for (int y = 0; y < CHUNKSIZE; y++) {
+		const uint8_t* up = padded + y * AUTOMATON_STRIDE;
+		const uint8_t* mid = up + AUTOMATON_STRIDE;
+		const uint8_t* down = mid + AUTOMATON_STRIDE;
+		uint8_t* out = result + y * CHUNKSIZE;
+
+		int x = 0;
+
+		for (; x + 16 <= CHUNKSIZE; x += 16) {
+			__m128i sum = _mm_loadu_si128((const __m128i*)(up + x));
+			sum = _mm_add_epi8(sum,
+				_mm_loadu_si128((const __m128i*)(up + x + 1)));
+			sum = _mm_add_epi8(sum,
+				_mm_loadu_si128((const __m128i*)(up + x + 2)));
+			sum = _mm_add_epi8(sum,
+				_mm_loadu_si128((const __m128i*)(mid + x)));
+			sum = _mm_add_epi8(sum,
+				_mm_loadu_si128((const __m128i*)(mid + x + 2)));
+			sum = _mm_add_epi8(sum,
+				_mm_loadu_si128((const __m128i*)(down + x)));
+			sum = _mm_add_epi8(sum,
+				_mm_loadu_si128((const __m128i*)(down + x + 1)));
+			sum = _mm_add_epi8(sum,
+				_mm_loadu_si128((const __m128i*)(down + x + 2)));
+
+			__m128i mask = _mm_and_si128(
+				_mm_cmpgt_epi8(sum, low),
+				_mm_cmpgt_epi8(high, sum));
+
+			_mm_storeu_si128(
+				(__m128i*)(out + x),
+				_mm_and_si128(mask, one));
+		}
+
+		for (; x < CHUNKSIZE; x++) {
+			out[x] = AutomatonCell(padded, x, y);
+		}
+	}
+}
+
+__attribute__((target("avx2")))
+inline void AutomatonStepAVX2(const uint8_t* padded, uint8_t* result)
+{
+	const __m256i low = _mm256_set1_epi8(3);
+	const __m256i high = _mm256_set1_epi8(13);
+	const __m256i one = _mm256_set1_epi8(1);
+
+	for (int y = 0; y < CHUNKSIZE; y++) {
+		const uint8_t* up = padded + y * AUTOMATON_STRIDE;
+		const uint8_t* mid = up + AUTOMATON_STRIDE;
+		const uint8_t* down = mid + AUTOMATON_STRIDE;
+		uint8_t* out = result + y * CHUNKSIZE;
+
+		int x = 0;
+
+		for (; x + 32 <= CHUNKSIZE; x += 32) {
+			__m256i sum = _mm256_loadu_si256(
+				(const __m256i*)(up + x));
+			sum = _mm256_add_epi8(sum, _mm256_loadu_si256(
+				(const __m256i*)(up + x + 1)));
+			sum = _mm256_add_epi8(sum, _mm256_loadu_si256(
+				(const __m256i*)(up + x + 2)));
+			sum = _mm256_add_epi8(sum, _mm256_loadu_si256(
+				(const __m256i*)(mid + x)));
+			sum = _mm256_add_epi8(sum, _mm256_loadu_si256(
+				(const __m256i*)(mid + x + 2)));
+			sum = _mm256_add_epi8(sum, _mm256_loadu_si256(
+				(const __m256i*)(down + x)));
+			sum = _mm256_add_epi8(sum, _mm256_loadu_si256(
+				(const __m256i*)(down + x + 1)));
+			sum = _mm256_add_epi8(sum, _mm256_loadu_si256(
+				(const __m256i*)(down + x + 2)));
+
+			__m256i mask = _mm256_and_si256(
+				_mm256_cmpgt_epi8(sum, low),
+				_mm256_cmpgt_epi8(high, sum));
+
+			_mm256_storeu_si256(
+				(__m256i*)(out + x),
+				_mm256_and_si256(mask, one));
+		}
+
+		for (; x < CHUNKSIZE; x++) {
+			out[x] = AutomatonCell(padded, x, y);
+		}
+	}
+}
+
+#endif
+
+typedef void (*AutomatonKernel)(const uint8_t* padded, uint8_t* result);
+
+// Picks the widest kernel the CPU supports. Resolved once per process.
+inline AutomatonKernel AutomatonSelectKernel()
+{
+#ifdef AUTOMATON_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2")) {
+		return AutomatonStepAVX2;
+	}
+
+	if (__builtin_cpu_supports("sse2")) {
+		return AutomatonStepSSE2;
+	}
+#endif
+
+	return AutomatonStepScalar;
+}
+
+inline void AutomatonStep(const uint8_t* padded, uint8_t* result)
+{
+	static const AutomatonKernel kernel = AutomatonSelectKernel();
+	kernel(padded, result);
+}
+
+#endif
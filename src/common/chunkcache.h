@@ -0,0 +1,505 @@
+#ifndef CHUNKCACHE_H
+#define CHUNKCACHE_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include <zlib.h>
+
+#include "map.h"
+#include "generator.h"
+#include "chunkformat.h"
+#include "random.h"
+
+// Cache of the chunks of one generator, keyed by (seed, x, y).
+//
+// Chunks are kept zlib-compressed in memory, up to a byte limit, and the
+// least recently used ones are evicted. With a spill directory set,
+// evicted chunks are written there instead of being dropped, one file per
+// key, and looked up on a memory miss. Spill files carry the generator id
+// and version, so caches of different generators can share a directory.
+// Files written by another generator version or in an older file layout
+// are deleted when the cache is opened.
+// Spill files are written outside the cache lock, to a temporary file that
+// is renamed into place, so readers never see a partly written chunk.
+//
+// Returned chunks are fresh copies, so callers may modify them.
+class ChunkCache
+{
+public:
+	struct Statistics
+	{
+		uint64_t memoryHits;
+		uint64_t diskHits;
+		uint64_t misses;
+		uint64_t evictions;
+		size_t memoryBytes;
+		size_t entries;
+
+		double HitRate() const
+		{
+			uint64_t total = memoryHits + diskHits + misses;
+
+			if (total == 0) {
+				return 0.0;
+			}
+
+			return double(memoryHits + diskHits) / double(total);
+		}
+	};
+
+	// generatorId tells the chunks of generate apart from those of other
+	// generators in the spill directory, see GENERATOR_ID_TILED.
+	ChunkCache(
+		size_t memoryLimit,
+		const std::string& spillDirectory = "",
+		ChunkGenerator generate = generator,
+		uint32_t generatorId = GENERATOR_ID_TILED,
+		uint32_t version = GENERATOR_VERSION)
+	{
+		_memoryLimit = memoryLimit;
+		_spillDirectory = spillDirectory;
+		_generate = generate;
+		_generatorId = generatorId;
+		_version = version;
+		_memoryBytes = 0;
+		_memoryHits = 0;
+		_diskHits = 0;
+		_misses = 0;
+		_evictions = 0;
+		_spillSequence = 0;
+
+		if (!_spillDirectory.empty()) {
+			std::filesystem::create_directories(_spillDirectory);
+			DropStaleFiles();
+		}
+	}
+
+	ChunkCache(const ChunkCache&) = delete;
+	ChunkCache& operator=(const ChunkCache&) = delete;
+
+	// Returns nullptr and counts a miss if the chunk is not cached.
+	std::shared_ptr<Chunk> Get(uint64_t seed, int32_t x, int32_t y)
+	{
+		Key key(seed, x, y);
+		std::vector<char> data;
+
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+
+			auto it = _entries.find(key);
+
+			if (it != _entries.end()) {
+				_order.splice(_order.begin(), _order, it->second.order);
+				data = it->second.data;
+				++_memoryHits;
+			}
+		}
+
+		if (!data.empty()) {
+			return Decode(data);
+		}
+
+		std::shared_ptr<Chunk> chunk;
+
+		if (ReadSpill(key, data)) {
+			chunk = Decode(data);
+		}
+
+		Evicted evicted;
+
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+
+			if (!chunk) {
+				++_misses;
+				return nullptr;
+			}
+
+			++_diskHits;
+			Insert(key, std::move(data), evicted);
+		}
+
+		Spill(evicted);
+
+		return chunk;
+	}
+
+	void Put(
+		uint64_t seed,
+		int32_t x,
+		int32_t y,
+		const std::shared_ptr<Chunk>& chunk)
+	{
+		std::vector<char> data = Encode(*chunk);
+		Evicted evicted;
+
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			Insert(Key(seed, x, y), std::move(data), evicted);
+		}
+
+		Spill(evicted);
+	}
+
+	std::shared_ptr<Chunk> GetOrGenerate(uint64_t seed, int32_t x, int32_t y)
+	{
+		std::shared_ptr<Chunk> chunk = Get(seed, x, y);
+
+		if (chunk) {
+			return chunk;
+		}
+
+		chunk = _generate(seed, x, y);
+		Put(seed, x, y, chunk);
+
+		return chunk;
+	}
+
+	ChunkGenerator GetGenerator() const
+	{
+		return _generate;
+	}
+
+	// Drops the in-memory entries. Spilled files are kept.
+	void Clear()
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+
+		_entries.clear();
+		_order.clear();
+		_memoryBytes = 0;
+	}
+
+	Statistics GetStatistics()
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+
+		Statistics statistics;
+		statistics.memoryHits = _memoryHits;
+		statistics.diskHits = _diskHits;
+		statistics.misses = _misses;
+		statistics.evictions = _evictions;
+		statistics.memoryBytes = _memoryBytes;
+		statistics.entries = _entries.size();
+
+		return statistics;
+	}
+
+	// Compressed representation: uncompressed size, then the deflated
+	// chunk in the binary chunk format.
+	static std::vector<char> Encode(const Chunk& chunk)
+	{
+		std::vector<char> raw;
+		ChunkFormatEncode(chunk, raw);
+
+		uint32_t rawSize = raw.size();
+		uLongf compressedSize = compressBound(rawSize);
+		std::vector<char> data(sizeof(rawSize) + compressedSize);
+
+		memcpy(data.data(), &rawSize, sizeof(rawSize));
+
+		int status = compress2(
+			reinterpret_cast<Bytef*>(data.data() + sizeof(rawSize)),
+			&compressedSize,
+			reinterpret_cast<const Bytef*>(raw.data()),
+			rawSize,
+			Z_BEST_SPEED);
+
+		if (status != Z_OK) {
+			throw std::runtime_error("failed to compress chunk");
+		}
+
+		data.resize(sizeof(rawSize) + compressedSize);
+		return data;
+	}
+
+	// Returns nullptr if data is not a valid encoded chunk.
+	static std::shared_ptr<Chunk> Decode(const std::vector<char>& data)
+	{
+		uint32_t rawSize;
+
+		if (data.size() < sizeof(rawSize)) {
+			return nullptr;
+		}
+
+		memcpy(&rawSize, data.data(), sizeof(rawSize));
+
+		// The size is not trusted before it is allocated: it can not
+		// exceed the largest encoded chunk, nor what deflate can expand
+		// the data to (at most 1032 times).
+		uint64_t compressedSize = data.size() - sizeof(rawSize);
+
+		if (rawSize > CHUNK_FORMAT_MAX_SIZE ||
+			rawSize > compressedSize * 1032)
+		{
+			return nullptr;
+		}
+
+		std::vector<char> raw(rawSize);
+		uLongf size = rawSize;
+
+		int status = uncompress(
+			reinterpret_cast<Bytef*>(raw.data()),
+			&size,
+			reinterpret_cast<const Bytef*>(data.data() + sizeof(rawSize)),
+			data.size() - sizeof(rawSize));
+
+		ChunkView view;
+
+		if (status != Z_OK || size != rawSize ||
+			!view.Open(raw.data(), raw.size()))
+		{
+			return nullptr;
+		}
+
+		return view.ToChunk();
+	}
+
+private:
+	struct Key
+	{
+		uint64_t seed;
+		int32_t x;
+		int32_t y;
+
+		Key(uint64_t seed, int32_t x, int32_t y):
+			seed(seed),
+			x(x),
+			y(y)
+		{ }
+
+		bool operator<(const Key& key) const
+		{
+			return std::tie(seed, x, y) < std::tie(key.seed, key.x, key.y);
+		}
+	};
+
+	struct Entry
+	{
+		std::vector<char> data;
+		std::list<Key>::iterator order;
+	};
+
+	// Header of a spilled chunk file, followed by the encoded chunk.
+	struct SpillHeader
+	{
+		char magic[4];
+		uint32_t version;
+		uint32_t generator;
+		uint32_t size;
+		uint64_t seed;
+		int32_t x;
+		int32_t y;
+	};
+
+	size_t _memoryLimit;
+	std::string _spillDirectory;
+	ChunkGenerator _generate;
+	uint32_t _generatorId;
+	uint32_t _version;
+
+	size_t _memoryBytes;
+	uint64_t _memoryHits;
+	uint64_t _diskHits;
+	uint64_t _misses;
+	uint64_t _evictions;
+
+	typedef std::vector<std::pair<Key, std::vector<char>>> Evicted;
+
+	std::map<Key, Entry> _entries;
+	std::list<Key> _order;
+	std::mutex _mutex;
+	std::atomic<uint64_t> _spillSequence;
+
+	// Called with _mutex held. Evicted entries are moved to evicted, to be
+	// spilled once the lock is released.
+	void Insert(const Key& key, std::vector<char>&& data, Evicted& evicted)
+	{
+		auto it = _entries.find(key);
+
+		if (it != _entries.end()) {
+			_memoryBytes -= it->second.data.size();
+			_order.erase(it->second.order);
+			_entries.erase(it);
+		}
+
+		_memoryBytes += data.size();
+		_order.push_front(key);
+
+		Entry& entry = _entries[key];
+		entry.data = std::move(data);
+		entry.order = _order.begin();
+
+		while (_memoryBytes > _memoryLimit && !_order.empty()) {
+			auto victim = _entries.find(_order.back());
+
+			_memoryBytes -= victim->second.data.size();
+
+			if (!_spillDirectory.empty()) {
+				evicted.emplace_back(
+					victim->first,
+					std::move(victim->second.data));
+			}
+
+			_entries.erase(victim);
+			_order.pop_back();
+			++_evictions;
+		}
+	}
+
+	std::filesystem::path SpillPath(const Key& key) const
+	{
+		uint64_t position =
+			(uint64_t(uint32_t(key.x)) << 32) | uint64_t(uint32_t(key.y));
+		uint64_t generator = (uint64_t(_generatorId) << 32) | _version;
+		uint64_t hash = SplitMix64(
+			SplitMix64(SplitMix64(key.seed) ^ position) ^ generator);
+
+		char name[32];
+		snprintf(name, sizeof(name), "%016llx.chunk",
+			static_cast<unsigned long long>(hash));
+
+		return std::filesystem::path(_spillDirectory) / name;
+	}
+
+	void Spill(const Evicted& evicted)
+	{
+		for (const auto& item : evicted) {
+			WriteSpill(item.first, item.second);
+		}
+	}
+
+	void WriteSpill(const Key& key, const std::vector<char>& data)
+	{
+		SpillHeader header{};
+		memcpy(header.magic, "CHK3", 4);
+		header.version = _version;
+		header.generator = _generatorId;
+		header.size = data.size();
+		header.seed = key.seed;
+		header.x = key.x;
+		header.y = key.y;
+
+		std::filesystem::path path = SpillPath(key);
+		std::filesystem::path temporary = path;
+		temporary += "." + std::to_string(++_spillSequence) + ".tmp";
+
+		bool written;
+
+		{
+			std::ofstream file(temporary, std::ios::binary);
+
+			file.write(
+				reinterpret_cast<const char*>(&header),
+				sizeof(header));
+			file.write(data.data(), data.size());
+			file.close();
+
+			written = bool(file);
+		}
+
+		std::error_code error;
+
+		if (written) {
+			std::filesystem::rename(temporary, path, error);
+		}
+
+		if (!written || error) {
+			std::filesystem::remove(temporary, error);
+		}
+	}
+
+	bool ReadSpill(const Key& key, std::vector<char>& data) const
+	{
+		if (_spillDirectory.empty()) {
+			return false;
+		}
+
+		std::ifstream file(SpillPath(key), std::ios::binary);
+		SpillHeader header;
+
+		if (!ReadHeader(file, header)) {
+			return false;
+		}
+
+		// Different keys may share a file name; the header tells them
+		// apart.
+		if (header.version != _version ||
+			header.generator != _generatorId ||
+			header.seed != key.seed || header.x != key.x ||
+			header.y != key.y)
+		{
+			return false;
+		}
+
+		// The size is not trusted before it is allocated: it can not
+		// exceed what Encode() makes of the largest encoded chunk.
+		if (header.size >
+			sizeof(uint32_t) + compressBound(CHUNK_FORMAT_MAX_SIZE))
+		{
+			return false;
+		}
+
+		data.resize(header.size);
+		file.read(data.data(), data.size());
+
+		return bool(file);
+	}
+
+	static bool ReadHeader(std::ifstream& file, SpillHeader& header)
+	{
+		if (!file) {
+			return false;
+		}
+
+		file.read(reinterpret_cast<char*>(&header), sizeof(header));
+
+		return file && memcmp(header.magic, "CHK3", 4) == 0;
+	}
+
+	void DropStaleFiles()
+	{
+		for (const auto& item :
+			std::filesystem::directory_iterator(_spillDirectory))
+		{
+			// Leftovers of spills that were interrupted.
+			if (item.path().extension() == ".tmp") {
+				std::filesystem::remove(item.path());
+				continue;
+			}
+
+			if (item.path().extension() != ".chunk") {
+				continue;
+			}
+
+			SpillHeader header;
+			bool valid;
+
+			{
+				std::ifstream file(item.path(), std::ios::binary);
+				valid = ReadHeader(file, header) &&
+					header.version == _version;
+			}
+
+			if (!valid) {
+				std::filesystem::remove(item.path());
+			}
+		}
+	}
+};
+
+#endif
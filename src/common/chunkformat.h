@@ -0,0 +1,924 @@
+#ifndef CHUNKFORMAT_H
+#define CHUNKFORMAT_H
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "map.h"
+
+// Binary chunk format for the network and for disk.
+//
+// All fields are little-endian and every section starts at a multiple of
+// four bytes, so a ChunkView reads tiles straight out of a received
+// Connection buffer or a mapped file without copying or parsing it first.
+//
+//     header        magic "CHKF", u16 version, u16 layer count,
+//                   u32 heightmap offset (0 if none),
+//                   u32 occupancy offset (0 if none), u32 total size
+//     layer table   per layer: u8 encoding, u8 index bits,
+//                   u16 palette size, u16 run count, u16 reserved,
+//                   u32 offset, u32 size
+//     layers        see ChunkFormatEncoding
+//     heightmap     CHUNKSIZE * CHUNKSIZE floats, row by row
+//     occupancy     CHUNKSIZE rows of the small build grid, bit x for
+//                   tile x, each as its low then its high u32 word
+//
+// A palette entry is a u32 attribute word, a u8 tile type and three bytes
+// of padding. Tiles are numbered row by row. Occupancy is only written
+// when a tile is occupied; the big build grid follows from it.
+
+#define CHUNK_FORMAT_VERSION 2
+#define CHUNK_FORMAT_HEADER_SIZE 20
+#define CHUNK_FORMAT_LAYER_ENTRY_SIZE 16
+#define CHUNK_FORMAT_PALETTE_ENTRY_SIZE 8
+#define CHUNK_FORMAT_TILES (CHUNKSIZE * CHUNKSIZE)
+#define CHUNK_FORMAT_OCCUPANCY_SIZE (8 * CHUNKSIZE)
+
+// Size of the largest encoding: every layer raw, a heightmap and
+// occupancy.
+#define CHUNK_FORMAT_MAX_SIZE (CHUNK_FORMAT_HEADER_SIZE + \
+	UINT16_MAX * (CHUNK_FORMAT_LAYER_ENTRY_SIZE + 5 * CHUNK_FORMAT_TILES) + \
+	4 * CHUNK_FORMAT_TILES + CHUNK_FORMAT_OCCUPANCY_SIZE)
+
+static_assert(
+	CHUNK_FORMAT_TILES % 32 == 0,
+	"packed tile indices must fill whole words");
+
+
+enum ChunkFormatEncoding
+{
+	// u32 attributes[TILES], then u8 types[TILES].
+	ChunkFormatRaw = 0,
+	// 2^bits palette entries, then TILES indices of bits bits each,
+	// packed into u32 words from the low bit up.
+	ChunkFormatPalette = 1,
+	// Palette entries, u16 run ends[runs] and u8 palette indices[runs],
+	// each padded to four bytes. Run r covers tiles [end[r - 1], end[r]).
+	ChunkFormatRunLength = 2
+};
+
+inline uint32_t ChunkFormatAlign(uint32_t size)
+{
+	return (size + 3) & ~uint32_t(3);
+}
+
+inline uint16_t ChunkFormatLoad16(const char* data)
+{
+	uint16_t value;
+	memcpy(&value, data, sizeof(value));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	value = __builtin_bswap16(value);
+#endif
+	return value;
+}
+
+inline uint32_t ChunkFormatLoad32(const char* data)
+{
+	uint32_t value;
+	memcpy(&value, data, sizeof(value));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	value = __builtin_bswap32(value);
+#endif
+	return value;
+}
+
+inline void ChunkFormatStore16(char* data, uint16_t value)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	value = __builtin_bswap16(value);
+#endif
+	memcpy(data, &value, sizeof(value));
+}
+
+inline void ChunkFormatStore32(char* data, uint32_t value)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	value = __builtin_bswap32(value);
+#endif
+	memcpy(data, &value, sizeof(value));
+}
+
+// Tile type bytes are cast to Tile::Type when read, so each must name one
+// of the types.
+inline bool ChunkFormatCheckTypes(
+	const char* types,
+	uint32_t count,
+	uint32_t stride)
+{
+	for (uint32_t i = 0; i < count; ++i) {
+		if (uint8_t(types[i * stride]) >= Tile::TypeCount) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Read-only view of one encoded layer.
+class LayerView
+{
+public:
+	LayerView()
+	{
+		_data = nullptr;
+		_encoding = ChunkFormatRaw;
+		_bits = 0;
+		_runs = 0;
+	}
+
+	LayerView(
+		const char* data,
+		ChunkFormatEncoding encoding,
+		int bits,
+		uint32_t paletteSize,
+		uint32_t runs)
+	{
+		_data = data;
+		_encoding = encoding;
+		_bits = bits;
+		_runs = runs;
+
+		uint32_t palette = paletteSize * CHUNK_FORMAT_PALETTE_ENTRY_SIZE;
+		_indices = data + palette;
+		_runIndices = _indices + ChunkFormatAlign(2 * runs);
+	}
+
+	ChunkFormatEncoding GetEncoding() const
+	{
+		return _encoding;
+	}
+
+	Tile GetTile(size_t x, size_t y) const
+	{
+		uint32_t index = y * CHUNKSIZE + x;
+
+		if (_encoding == ChunkFormatRaw) {
+			Tile tile(static_cast<Tile::Type>(
+				uint8_t(_data[4 * CHUNK_FORMAT_TILES + index])));
+			tile.SetAttributes(ChunkFormatLoad32(_data + 4 * index));
+			return tile;
+		}
+
+		if (_encoding == ChunkFormatPalette) {
+			uint32_t bit = index * _bits;
+			uint32_t word = ChunkFormatLoad32(_indices + bit / 32 * 4);
+			uint32_t entry = (word >> (bit % 32)) & ((1u << _bits) - 1);
+			return PaletteTile(entry);
+		}
+
+		// Binary search for the first run ending after index.
+		uint32_t low = 0;
+		uint32_t high = _runs - 1;
+
+		while (low < high) {
+			uint32_t middle = (low + high) / 2;
+
+			if (ChunkFormatLoad16(_indices + 2 * middle) <= index) {
+				low = middle + 1;
+			} else {
+				high = middle;
+			}
+		}
+
+		return PaletteTile(uint8_t(_runIndices[low]));
+	}
+
+	// Decodes every tile in one pass. The layer is left clean.
+	void CopyTo(Layer& layer) const
+	{
+		if (_encoding == ChunkFormatRunLength) {
+			uint32_t index = 0;
+
+			for (uint32_t run = 0; run < _runs; ++run) {
+				uint32_t end = ChunkFormatLoad16(_indices + 2 * run);
+				Tile tile = PaletteTile(uint8_t(_runIndices[run]));
+
+				for (; index < end; ++index) {
+					layer.SetTile(index % CHUNKSIZE, index / CHUNKSIZE, tile);
+				}
+			}
+		} else {
+			for (int y = 0; y < CHUNKSIZE; ++y) {
+				for (int x = 0; x < CHUNKSIZE; ++x) {
+					layer.SetTile(x, y, GetTile(x, y));
+				}
+			}
+		}
+
+		layer.ClearDirty();
+	}
+
+private:
+	const char* _data;
+	const char* _indices;
+	const char* _runIndices;
+	ChunkFormatEncoding _encoding;
+	int _bits;
+	uint32_t _runs;
+
+	Tile PaletteTile(uint32_t entry) const
+	{
+		const char* data = _data + entry * CHUNK_FORMAT_PALETTE_ENTRY_SIZE;
+
+		Tile tile(static_cast<Tile::Type>(uint8_t(data[4])));
+		tile.SetAttributes(ChunkFormatLoad32(data));
+		return tile;
+	}
+};
+
+// Read-only view of an encoded chunk. The viewed buffer must outlive the
+// view and its layer views.
+class ChunkView
+{
+public:
+	ChunkView()
+	{
+		_data = nullptr;
+		_layers = 0;
+		_heightmap = 0;
+		_occupancy = 0;
+	}
+
+	// Checks the header and the bounds of every section. Returns false,
+	// leaving the view empty, if data is not a valid chunk of this format
+	// version or is not aligned to four bytes.
+	bool Open(const char* data, size_t size)
+	{
+		_data = nullptr;
+		_layers = 0;
+		_heightmap = 0;
+		_occupancy = 0;
+
+		if (reinterpret_cast<uintptr_t>(data) % 4 != 0 ||
+			size < CHUNK_FORMAT_HEADER_SIZE ||
+			memcmp(data, "CHKF", 4) != 0 ||
+			ChunkFormatLoad16(data + 4) != CHUNK_FORMAT_VERSION)
+		{
+			return false;
+		}
+
+		uint32_t layers = ChunkFormatLoad16(data + 6);
+		uint32_t heightmap = ChunkFormatLoad32(data + 8);
+		uint32_t occupancy = ChunkFormatLoad32(data + 12);
+		uint32_t total = ChunkFormatLoad32(data + 16);
+		uint32_t table = CHUNK_FORMAT_HEADER_SIZE +
+			layers * CHUNK_FORMAT_LAYER_ENTRY_SIZE;
+
+		if (total > size || table > total) {
+			return false;
+		}
+
+		for (uint32_t l = 0; l < layers; ++l) {
+			if (!CheckLayer(data, total, data + CHUNK_FORMAT_HEADER_SIZE +
+				l * CHUNK_FORMAT_LAYER_ENTRY_SIZE))
+			{
+				return false;
+			}
+		}
+
+		if (heightmap != 0 && (heightmap % 4 != 0 || heightmap < table ||
+			heightmap > total ||
+			total - heightmap < 4 * CHUNK_FORMAT_TILES))
+		{
+			return false;
+		}
+
+		if (occupancy != 0 && !CheckOccupancy(data, total, table, occupancy)) {
+			return false;
+		}
+
+		_data = data;
+		_layers = layers;
+		_heightmap = heightmap;
+		_occupancy = occupancy;
+
+		return true;
+	}
+
+	size_t LayerCount() const
+	{
+		return _layers;
+	}
+
+	LayerView GetLayer(size_t index) const
+	{
+		const char* entry = _data + CHUNK_FORMAT_HEADER_SIZE +
+			index * CHUNK_FORMAT_LAYER_ENTRY_SIZE;
+
+		return LayerView(
+			_data + ChunkFormatLoad32(entry + 8),
+			static_cast<ChunkFormatEncoding>(uint8_t(entry[0])),
+			uint8_t(entry[1]),
+			ChunkFormatLoad16(entry + 2),
+			ChunkFormatLoad16(entry + 4));
+	}
+
+	bool HasHeightmap() const
+	{
+		return _heightmap != 0;
+	}
+
+	float GetHeight(size_t x, size_t y) const
+	{
+		uint32_t bits = ChunkFormatLoad32(
+			_data + _heightmap + 4 * (y * CHUNKSIZE + x));
+		float height;
+		memcpy(&height, &bits, sizeof(height));
+		return height;
+	}
+
+	bool HasOccupancy() const
+	{
+		return _occupancy != 0;
+	}
+
+	// Occupied tiles of a row of the small build grid, none without
+	// occupancy.
+	uint64_t GetOccupancyRow(size_t y) const
+	{
+		if (!HasOccupancy()) {
+			return 0;
+		}
+
+		const char* row = _data + _occupancy + 8 * y;
+		return ChunkFormatLoad32(row) |
+			(uint64_t(ChunkFormatLoad32(row + 4)) << 32);
+	}
+
+	// Builds a clean Chunk holding a copy of the viewed data.
+	std::shared_ptr<Chunk> ToChunk() const
+	{
+		auto chunk = std::make_shared<Chunk>();
+
+		for (size_t l = 0; l < _layers; ++l) {
+			auto layer = std::make_shared<Layer>();
+			GetLayer(l).CopyTo(*layer);
+			chunk->AddLayer(layer);
+		}
+
+		if (HasHeightmap()) {
+			auto heightmap = std::make_shared<Heightmap>();
+			float* heights = heightmap->Data();
+
+			for (int i = 0; i < CHUNK_FORMAT_TILES; ++i) {
+				heights[i] = GetHeight(i % CHUNKSIZE, i / CHUNKSIZE);
+			}
+
+			heightmap->UpdateSummary();
+
+			chunk->SetHeightmap(heightmap);
+		}
+
+		if (HasOccupancy()) {
+			Occupancy& occupancy = chunk->GetOccupancy();
+
+			for (int y = 0; y < CHUNKSIZE; ++y) {
+				occupancy.SetRow(y, GetOccupancyRow(y));
+			}
+
+			occupancy.ClearDirty();
+		}
+
+		return chunk;
+	}
+
+private:
+	const char* _data;
+	uint32_t _layers;
+	uint32_t _heightmap;
+	uint32_t _occupancy;
+
+	// Rows must not occupy tiles past the chunk.
+	static bool CheckOccupancy(
+		const char* data,
+		uint32_t total,
+		uint32_t table,
+		uint32_t offset)
+	{
+		if (offset % 4 != 0 || offset < table || offset > total ||
+			total - offset < CHUNK_FORMAT_OCCUPANCY_SIZE)
+		{
+			return false;
+		}
+
+		uint64_t outside = ~Occupancy::RowMask(0, CHUNKSIZE);
+
+		for (int y = 0; y < CHUNKSIZE; ++y) {
+			const char* row = data + offset + 8 * y;
+			uint64_t bits = ChunkFormatLoad32(row) |
+				(uint64_t(ChunkFormatLoad32(row + 4)) << 32);
+
+			if (bits & outside) {
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	static bool CheckLayer(const char* data, uint32_t total, const char* entry)
+	{
+		uint32_t encoding = uint8_t(entry[0]);
+		uint32_t bits = uint8_t(entry[1]);
+		uint32_t paletteSize = ChunkFormatLoad16(entry + 2);
+		uint32_t runs = ChunkFormatLoad16(entry + 4);
+		uint32_t offset = ChunkFormatLoad32(entry + 8);
+		uint32_t size = ChunkFormatLoad32(entry + 12);
+
+		if (offset % 4 != 0 || offset > total || total - offset < size) {
+			return false;
+		}
+
+		uint32_t palette = paletteSize * CHUNK_FORMAT_PALETTE_ENTRY_SIZE;
+
+		if (encoding == ChunkFormatRaw) {
+			return size == 5 * CHUNK_FORMAT_TILES &&
+				ChunkFormatCheckTypes(
+					data + offset + 4 * CHUNK_FORMAT_TILES,
+					CHUNK_FORMAT_TILES,
+					1);
+		}
+
+		if (encoding == ChunkFormatPalette) {
+			// The palette is padded to 2^bits entries, so every
+			// packed index is valid.
+			return (bits == 1 || bits == 2 || bits == 4 || bits == 8) &&
+				paletteSize == (1u << bits) &&
+				size == palette + CHUNK_FORMAT_TILES * bits / 8 &&
+				ChunkFormatCheckTypes(
+					data + offset + 4,
+					paletteSize,
+					CHUNK_FORMAT_PALETTE_ENTRY_SIZE);
+		}
+
+		if (encoding != ChunkFormatRunLength || runs == 0 ||
+			runs > CHUNK_FORMAT_TILES ||
+			size != palette + ChunkFormatAlign(2 * runs) +
+			ChunkFormatAlign(runs) ||
+			!ChunkFormatCheckTypes(
+				data + offset + 4,
+				paletteSize,
+				CHUNK_FORMAT_PALETTE_ENTRY_SIZE))
+		{
+			return false;
+		}
+
+		const char* ends = data + offset + palette;
+		const char* indices = ends + ChunkFormatAlign(2 * runs);
+		uint32_t previous = 0;
+
+		for (uint32_t run = 0; run < runs; ++run) {
+			uint32_t end = ChunkFormatLoad16(ends + 2 * run);
+
+			if (end <= previous || uint8_t(indices[run]) >= paletteSize) {
+				return false;
+			}
+
+			previous = end;
+		}
+
+		return previous == CHUNK_FORMAT_TILES;
+	}
+
+};
+
+// Appends the encoding of chunk to data. Each layer is stored in whichever
+// of the encodings is smallest for it.
+inline void ChunkFormatEncode(const Chunk& chunk, std::vector<char>& data)
+{
+	size_t start = data.size();
+	uint32_t layers = chunk.LayerCount();
+	uint32_t offset = CHUNK_FORMAT_HEADER_SIZE +
+		layers * CHUNK_FORMAT_LAYER_ENTRY_SIZE;
+
+	data.resize(start + offset);
+
+	for (uint32_t l = 0; l < layers; ++l) {
+		const Layer& layer = *chunk.GetLayer(l);
+
+		// Palette of distinct tiles, given up past 256 entries.
+		uint32_t types[256];
+		uint32_t attributes[256];
+		uint32_t paletteSize = 0;
+		uint8_t indices[CHUNK_FORMAT_TILES];
+		uint32_t runs = 0;
+		bool fitsPalette = true;
+
+		for (uint32_t i = 0; i < CHUNK_FORMAT_TILES; ++i) {
+			const Tile& tile = layer.GetTile(i % CHUNKSIZE, i / CHUNKSIZE);
+			uint32_t entry = 0;
+
+			while (entry < paletteSize &&
+				(types[entry] != uint32_t(tile.GetType()) ||
+				attributes[entry] != tile.GetAttributes()))
+			{
+				++entry;
+			}
+
+			if (entry == paletteSize) {
+				if (paletteSize == 256) {
+					fitsPalette = false;
+					break;
+				}
+
+				types[entry] = tile.GetType();
+				attributes[entry] = tile.GetAttributes();
+				++paletteSize;
+			}
+
+			indices[i] = entry;
+
+			if (i == 0 || indices[i - 1] != entry) {
+				++runs;
+			}
+		}
+
+		uint32_t bits = 8;
+
+		if (paletteSize <= 2) {
+			bits = 1;
+		} else if (paletteSize <= 4) {
+			bits = 2;
+		} else if (paletteSize <= 16) {
+			bits = 4;
+		}
+
+		uint32_t rawSize = 5 * CHUNK_FORMAT_TILES;
+		uint32_t paletteBytes = (1u << bits) * CHUNK_FORMAT_PALETTE_ENTRY_SIZE +
+			CHUNK_FORMAT_TILES * bits / 8;
+		uint32_t runBytes = paletteSize * CHUNK_FORMAT_PALETTE_ENTRY_SIZE +
+			ChunkFormatAlign(2 * runs) + ChunkFormatAlign(runs);
+
+		ChunkFormatEncoding encoding = ChunkFormatRaw;
+		uint32_t size = rawSize;
+
+		if (fitsPalette && paletteBytes < size) {
+			encoding = ChunkFormatPalette;
+			size = paletteBytes;
+		}
+
+		if (fitsPalette && runBytes < size) {
+			encoding = ChunkFormatRunLength;
+			size = runBytes;
+		}
+
+		char* entry = data.data() + start + CHUNK_FORMAT_HEADER_SIZE +
+			l * CHUNK_FORMAT_LAYER_ENTRY_SIZE;
+
+		entry[0] = char(encoding);
+		entry[1] = char(encoding == ChunkFormatPalette ? bits : 0);
+		ChunkFormatStore16(entry + 2, encoding == ChunkFormatPalette ?
+			1u << bits : (encoding == ChunkFormatRaw ? 0 : paletteSize));
+		ChunkFormatStore16(
+			entry + 4,
+			encoding == ChunkFormatRunLength ? runs : 0);
+		ChunkFormatStore16(entry + 6, 0);
+		ChunkFormatStore32(entry + 8, offset);
+		ChunkFormatStore32(entry + 12, size);
+
+		data.resize(start + offset + size, 0);
+		char* out = data.data() + start + offset;
+
+		if (encoding == ChunkFormatRaw) {
+			for (uint32_t i = 0; i < CHUNK_FORMAT_TILES; ++i) {
+				const Tile& tile =
+					layer.GetTile(i % CHUNKSIZE, i / CHUNKSIZE);
+
+				ChunkFormatStore32(out + 4 * i, tile.GetAttributes());
+				out[4 * CHUNK_FORMAT_TILES + i] = char(tile.GetType());
+			}
+		} else {
+			uint32_t entries = encoding == ChunkFormatPalette ?
+				1u << bits : paletteSize;
+
+			// Padding entries repeat the last tile.
+			for (uint32_t e = 0; e < entries; ++e) {
+				uint32_t source = e < paletteSize ? e : paletteSize - 1;
+				char* item = out + e * CHUNK_FORMAT_PALETTE_ENTRY_SIZE;
+
+				ChunkFormatStore32(item, attributes[source]);
+				item[4] = char(types[source]);
+			}
+
+			out += entries * CHUNK_FORMAT_PALETTE_ENTRY_SIZE;
+
+			if (encoding == ChunkFormatPalette) {
+				for (uint32_t w = 0; w < CHUNK_FORMAT_TILES * bits / 32;
+					++w)
+				{
+					uint32_t word = 0;
+
+					for (uint32_t k = 0; k < 32 / bits; ++k) {
+						word |= uint32_t(indices[w * 32 / bits + k]) <<
+							(k * bits);
+					}
+
+					ChunkFormatStore32(out + 4 * w, word);
+				}
+			} else {
+				char* runIndices = out + ChunkFormatAlign(2 * runs);
+				uint32_t run = 0;
+
+				for (uint32_t i = 1; i <= CHUNK_FORMAT_TILES; ++i) {
+					if (i == CHUNK_FORMAT_TILES ||
+						indices[i] != indices[i - 1])
+					{
+						ChunkFormatStore16(out + 2 * run, i);
+						runIndices[run] = char(indices[i - 1]);
+						++run;
+					}
+				}
+			}
+		}
+
+		offset += size;
+	}
+
+	const Heightmap* heightmap = chunk.GetHeightmap();
+	uint32_t heightmapOffset = 0;
+
+	if (heightmap) {
+		heightmapOffset = offset;
+		offset += 4 * CHUNK_FORMAT_TILES;
+		data.resize(start + offset);
+
+		const float* heights = heightmap->Data();
+
+		for (int i = 0; i < CHUNK_FORMAT_TILES; ++i) {
+			uint32_t bits;
+			memcpy(&bits, &heights[i], sizeof(bits));
+			ChunkFormatStore32(
+				data.data() + start + heightmapOffset + 4 * i,
+				bits);
+		}
+	}
+
+	const Occupancy& occupancy = chunk.GetOccupancy();
+	uint32_t occupancyOffset = 0;
+	bool occupied = false;
+
+	for (int y = 0; y < CHUNKSIZE; ++y) {
+		occupied = occupied || occupancy.GetRow(y) != 0;
+	}
+
+	if (occupied) {
+		occupancyOffset = offset;
+		offset += CHUNK_FORMAT_OCCUPANCY_SIZE;
+		data.resize(start + offset);
+
+		for (int y = 0; y < CHUNKSIZE; ++y) {
+			char* row = data.data() + start + occupancyOffset + 8 * y;
+			uint64_t bits = occupancy.GetRow(y);
+
+			ChunkFormatStore32(row, uint32_t(bits));
+			ChunkFormatStore32(row + 4, uint32_t(bits >> 32));
+		}
+	}
+
+	char* header = data.data() + start;
+
+	memcpy(header, "CHKF", 4);
+	ChunkFormatStore16(header + 4, CHUNK_FORMAT_VERSION);
+	ChunkFormatStore16(header + 6, layers);
+	ChunkFormatStore32(header + 8, heightmapOffset);
+	ChunkFormatStore32(header + 12, occupancyOffset);
+	ChunkFormatStore32(header + 16, offset);
+}
+
+// Region deltas carry the tiles, heights and occupancy of the dirty
+// regions of a chunk, so edits are sent or saved without the rest of it.
+// They are applied to a chunk with the same layers and heightmap as the
+// one they were made from.
+//
+//     header        magic "CHKD", u16 version, u16 layer count,
+//                   u32 low and u32 high word of the region mask,
+//                   u32 flags (ChunkFormatDeltaHeights), u32 total size
+//     regions       per region in the mask, lowest bit first:
+//                   per layer u32 attributes[REGION_TILES] and
+//                   u8 types[REGION_TILES], f32 heights[REGION_TILES]
+//                   with the heights flag, and u32 occupancy[rows]
+//
+// Tiles of a region are numbered row by row. Occupancy bit x of a row is
+// the tile x columns from the left edge of the region.
+
+#define CHUNK_FORMAT_DELTA_HEADER_SIZE 24
+#define CHUNK_FORMAT_REGION_TILES (DIRTY_REGION_SIZE * DIRTY_REGION_SIZE)
+
+static_assert(
+	DIRTY_REGION_SIZE <= 32,
+	"region occupancy rows must fit a 32-bit word");
+
+enum ChunkFormatDeltaFlags
+{
+	ChunkFormatDeltaHeights = 1
+};
+
+inline uint64_t ChunkFormatAllRegions()
+{
+	return DIRTY_REGIONS == 64 ? ~uint64_t(0) :
+		(uint64_t(1) << (DIRTY_REGIONS % 64)) - 1;
+}
+
+inline uint32_t ChunkFormatRegionSize(uint32_t layers, bool heights)
+{
+	return layers * 5 * CHUNK_FORMAT_REGION_TILES +
+		(heights ? 4 * CHUNK_FORMAT_REGION_TILES : 0) +
+		4 * DIRTY_REGION_SIZE;
+}
+
+// Appends a delta of the regions of chunk marked in GetDirty() to data.
+// The caller clears them once the delta has been sent or saved.
+inline void ChunkFormatEncodeDelta(const Chunk& chunk, std::vector<char>& data)
+{
+	size_t start = data.size();
+	uint64_t regions = chunk.GetDirty();
+	uint32_t layers = chunk.LayerCount();
+	const Heightmap* heightmap = chunk.GetHeightmap();
+	uint32_t regionSize = ChunkFormatRegionSize(layers, heightmap != nullptr);
+	uint32_t total = CHUNK_FORMAT_DELTA_HEADER_SIZE +
+		__builtin_popcountll(regions) * regionSize;
+
+	data.resize(start + total, 0);
+
+	char* header = data.data() + start;
+
+	memcpy(header, "CHKD", 4);
+	ChunkFormatStore16(header + 4, CHUNK_FORMAT_VERSION);
+	ChunkFormatStore16(header + 6, layers);
+	ChunkFormatStore32(header + 8, uint32_t(regions));
+	ChunkFormatStore32(header + 12, uint32_t(regions >> 32));
+	ChunkFormatStore32(header + 16, heightmap ? ChunkFormatDeltaHeights : 0);
+	ChunkFormatStore32(header + 20, total);
+
+	char* out = header + CHUNK_FORMAT_DELTA_HEADER_SIZE;
+
+	for (int region = 0; region < DIRTY_REGIONS; ++region) {
+		if (!(regions & (uint64_t(1) << region))) {
+			continue;
+		}
+
+		size_t x0;
+		size_t y0;
+		DirtyRegionOrigin(region, x0, y0);
+
+		for (uint32_t l = 0; l < layers; ++l) {
+			const Layer& layer = *chunk.GetLayer(l);
+
+			for (int i = 0; i < CHUNK_FORMAT_REGION_TILES; ++i) {
+				const Tile& tile = layer.GetTile(
+					x0 + i % DIRTY_REGION_SIZE,
+					y0 + i / DIRTY_REGION_SIZE);
+
+				ChunkFormatStore32(out + 4 * i, tile.GetAttributes());
+				out[4 * CHUNK_FORMAT_REGION_TILES + i] =
+					char(tile.GetType());
+			}
+
+			out += 5 * CHUNK_FORMAT_REGION_TILES;
+		}
+
+		if (heightmap) {
+			for (int i = 0; i < CHUNK_FORMAT_REGION_TILES; ++i) {
+				float height = heightmap->GetHeight(
+					x0 + i % DIRTY_REGION_SIZE,
+					y0 + i / DIRTY_REGION_SIZE);
+				uint32_t bits;
+				memcpy(&bits, &height, sizeof(bits));
+				ChunkFormatStore32(out + 4 * i, bits);
+			}
+
+			out += 4 * CHUNK_FORMAT_REGION_TILES;
+		}
+
+		for (int j = 0; j < DIRTY_REGION_SIZE; ++j) {
+			uint64_t row = chunk.GetOccupancy().GetRow(y0 + j) >> x0;
+			ChunkFormatStore32(
+				out + 4 * j,
+				uint32_t(row & Occupancy::RowMask(0, DIRTY_REGION_SIZE)));
+		}
+
+		out += 4 * DIRTY_REGION_SIZE;
+	}
+}
+
+// Writes the regions of a delta into chunk, marking them dirty there like
+// any other edit. Returns false, changing nothing, if data is not a valid
+// delta for chunk.
+inline bool ChunkFormatApplyDelta(const char* data, size_t size, Chunk& chunk)
+{
+	if (size < CHUNK_FORMAT_DELTA_HEADER_SIZE ||
+		memcmp(data, "CHKD", 4) != 0 ||
+		ChunkFormatLoad16(data + 4) != CHUNK_FORMAT_VERSION)
+	{
+		return false;
+	}
+
+	uint32_t layers = ChunkFormatLoad16(data + 6);
+	uint64_t regions = ChunkFormatLoad32(data + 8) |
+		(uint64_t(ChunkFormatLoad32(data + 12)) << 32);
+	uint32_t flags = ChunkFormatLoad32(data + 16);
+	uint32_t total = ChunkFormatLoad32(data + 20);
+	bool heights = flags & ChunkFormatDeltaHeights;
+	uint32_t regionSize = ChunkFormatRegionSize(layers, heights);
+
+	if (layers != chunk.LayerCount() ||
+		heights != bool(chunk.GetHeightmap()) ||
+		(flags & ~uint32_t(ChunkFormatDeltaHeights)) ||
+		(regions & ~ChunkFormatAllRegions()) ||
+		total > size ||
+		total != CHUNK_FORMAT_DELTA_HEADER_SIZE +
+		uint64_t(__builtin_popcountll(regions)) * regionSize)
+	{
+		return false;
+	}
+
+	// Everything is checked before the first change.
+	const char* region = data + CHUNK_FORMAT_DELTA_HEADER_SIZE;
+
+	for (int r = __builtin_popcountll(regions); r > 0; --r) {
+		for (uint32_t l = 0; l < layers; ++l) {
+			if (!ChunkFormatCheckTypes(
+				region + 5 * l * CHUNK_FORMAT_REGION_TILES +
+				4 * CHUNK_FORMAT_REGION_TILES,
+				CHUNK_FORMAT_REGION_TILES,
+				1))
+			{
+				return false;
+			}
+		}
+
+		const char* occupancy = region + regionSize - 4 * DIRTY_REGION_SIZE;
+
+		for (int j = 0; j < DIRTY_REGION_SIZE; ++j) {
+			if (ChunkFormatLoad32(occupancy + 4 * j) &
+				~Occupancy::RowMask(0, DIRTY_REGION_SIZE))
+			{
+				return false;
+			}
+		}
+
+		region += regionSize;
+	}
+
+	region = data + CHUNK_FORMAT_DELTA_HEADER_SIZE;
+
+	for (int r = 0; r < DIRTY_REGIONS; ++r) {
+		if (!(regions & (uint64_t(1) << r))) {
+			continue;
+		}
+
+		size_t x0;
+		size_t y0;
+		DirtyRegionOrigin(r, x0, y0);
+
+		for (uint32_t l = 0; l < layers; ++l) {
+			Layer* layer = chunk.EditLayer(l);
+
+			for (int i = 0; i < CHUNK_FORMAT_REGION_TILES; ++i) {
+				Tile tile(static_cast<Tile::Type>(
+					uint8_t(region[4 * CHUNK_FORMAT_REGION_TILES + i])));
+				tile.SetAttributes(ChunkFormatLoad32(region + 4 * i));
+				layer->SetTile(
+					x0 + i % DIRTY_REGION_SIZE,
+					y0 + i / DIRTY_REGION_SIZE,
+					tile);
+			}
+
+			region += 5 * CHUNK_FORMAT_REGION_TILES;
+		}
+
+		if (heights) {
+			Heightmap* heightmap = chunk.EditHeightmap();
+
+			for (int i = 0; i < CHUNK_FORMAT_REGION_TILES; ++i) {
+				uint32_t bits = ChunkFormatLoad32(region + 4 * i);
+				float height;
+				memcpy(&height, &bits, sizeof(height));
+				heightmap->SetHeight(
+					x0 + i % DIRTY_REGION_SIZE,
+					y0 + i / DIRTY_REGION_SIZE,
+					height);
+			}
+
+			region += 4 * CHUNK_FORMAT_REGION_TILES;
+		}
+
+		Occupancy& occupancy = chunk.GetOccupancy();
+		uint64_t mask = Occupancy::RowMask(x0, DIRTY_REGION_SIZE);
+
+		for (int j = 0; j < DIRTY_REGION_SIZE; ++j) {
+			uint64_t row = uint64_t(ChunkFormatLoad32(region + 4 * j)) << x0;
+			occupancy.SetRow(
+				y0 + j,
+				(occupancy.GetRow(y0 + j) & ~mask) | row);
+		}
+
+		region += 4 * DIRTY_REGION_SIZE;
+	}
+
+	return true;
+}
+
+#endif
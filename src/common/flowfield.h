@@ -0,0 +1,383 @@
+#ifndef FLOWFIELD_H
+#define FLOWFIELD_H
+
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "map.h"
+
+// Distances to one target tile and the direction to move in from every
+// tile of a square of chunks around it.
+//
+// The integration field is the number of steps between neighbouring
+// walkable tiles (see Chunk::GetWalkableRows()) to the target. The target
+// itself need not be walkable, so a field may lead to a building. The
+// direction field points at the neighbour, diagonals included, with the
+// smallest distance; diagonal moves are only allowed if both tiles beside
+// them are walkable. Following the directions from any tile with a
+// distance reaches the target.
+//
+// Distances are 16-bit. A path crosses every tile at most once, so they
+// can not overflow in fields of up to FLOW_FIELD_MAX_TILES tiles, which
+// bounds the radius. A field takes three bytes a tile, about 150 KB at
+// FLOW_FIELD_MAX_RADIUS; farther targets are left to the Pathfinder.
+#define FLOW_FIELD_MAX_TILES 65534
+#define FLOW_FIELD_MAX_RADIUS 3
+
+static_assert(
+	(2 * FLOW_FIELD_MAX_RADIUS + 1) * CHUNKSIZE *
+	(2 * FLOW_FIELD_MAX_RADIUS + 1) * CHUNKSIZE <= FLOW_FIELD_MAX_TILES,
+	"flow field distances must fit 16 bits at the largest radius");
+
+class FlowField
+{
+public:
+	// World tile coordinates.
+	typedef std::pair<int64_t, int64_t> Point;
+
+	enum Direction
+	{
+		None,
+		West,
+		East,
+		North,
+		South,
+		NorthWest,
+		NorthEast,
+		SouthWest,
+		SouthEast
+	};
+
+	static constexpr int StepX[9] = {0, -1, 1, 0, 0, -1, 1, -1, 1};
+	static constexpr int StepY[9] = {0, 0, 0, -1, 1, -1, -1, 1, 1};
+
+	// Covers the chunks within radius of the chunk holding target, at
+	// most FLOW_FIELD_MAX_RADIUS.
+	FlowField(const MapSnapshot& snapshot, Point target, int32_t radius)
+	{
+		if (radius < 0 || radius > FLOW_FIELD_MAX_RADIUS) {
+			throw std::invalid_argument("flow field radius out of range");
+		}
+
+		_target = target;
+		_chunkX = FloorDivide(target.first, CHUNKSIZE) - radius;
+		_chunkY = FloorDivide(target.second, CHUNKSIZE) - radius;
+		_chunks = 2 * radius + 1;
+		_side = _chunks * CHUNKSIZE;
+		_stride = _side + 2;
+
+		std::vector<uint64_t> rows(_chunks * _chunks * CHUNKSIZE, 0);
+		_versions.assign(_chunks * _chunks, 0);
+
+		for (int32_t cy = 0; cy < _chunks; ++cy) {
+			for (int32_t cx = 0; cx < _chunks; ++cx) {
+				std::shared_ptr<const Chunk> chunk =
+					snapshot.GetChunk(_chunkX + cx, _chunkY + cy);
+
+				if (!chunk) {
+					continue;
+				}
+
+				_versions[cy * _chunks + cx] = chunk->GetVersion();
+				chunk->GetWalkableRows(
+					&rows[(cy * _chunks + cx) * CHUNKSIZE]);
+			}
+		}
+
+		Integrate(rows);
+		Orient();
+	}
+
+	Point GetTarget() const
+	{
+		return _target;
+	}
+
+	bool Contains(Point point) const
+	{
+		int64_t x = point.first - int64_t(_chunkX) * CHUNKSIZE;
+		int64_t y = point.second - int64_t(_chunkY) * CHUNKSIZE;
+
+		return x >= 0 && y >= 0 && x < _side && y < _side;
+	}
+
+	// Steps to the target, -1 if it cannot be reached or point is
+	// outside the field.
+	int32_t GetCost(Point point) const
+	{
+		if (!Contains(point)) {
+			return -1;
+		}
+
+		uint16_t cost = _costs[Index(point)];
+		return cost >= Unreachable ? -1 : cost;
+	}
+
+	// None at the target, outside the field and where the target
+	// cannot be reached.
+	Direction GetDirection(Point point) const
+	{
+		if (!Contains(point)) {
+			return None;
+		}
+
+		return Direction(_directions[Index(point)]);
+	}
+
+	// Whether no chunk under the field changed, appeared or disappeared
+	// in snapshot since the field was built.
+	bool IsCurrent(const MapSnapshot& snapshot) const
+	{
+		for (int32_t cy = 0; cy < _chunks; ++cy) {
+			for (int32_t cx = 0; cx < _chunks; ++cx) {
+				std::shared_ptr<const Chunk> chunk =
+					snapshot.GetChunk(_chunkX + cx, _chunkY + cy);
+				uint64_t version = chunk ? chunk->GetVersion() : 0;
+
+				if (version != _versions[cy * _chunks + cx]) {
+					return false;
+				}
+			}
+		}
+
+		return true;
+	}
+
+private:
+	static constexpr uint16_t Blocked = 0xFFFF;
+	static constexpr uint16_t Unreachable = 0xFFFE;
+
+	Point _target;
+	// First chunk of the field and its side in chunks and tiles.
+	int32_t _chunkX;
+	int32_t _chunkY;
+	int32_t _chunks;
+	int64_t _side;
+
+	// Rows of _side tiles with a blocked tile around them, so
+	// neighbours never need bounds checks.
+	int64_t _stride;
+	std::vector<uint16_t> _costs;
+	std::vector<uint8_t> _directions;
+	// Chunk versions the field was built from, 0 for missing chunks.
+	std::vector<uint64_t> _versions;
+
+	size_t Index(Point point) const
+	{
+		int64_t x = point.first - int64_t(_chunkX) * CHUNKSIZE;
+		int64_t y = point.second - int64_t(_chunkY) * CHUNKSIZE;
+
+		return (y + 1) * _stride + x + 1;
+	}
+
+	// Breadth-first distances from the target over the walkable rows of
+	// the chunks.
+	void Integrate(const std::vector<uint64_t>& rows)
+	{
+		const uint32_t stride = _stride;
+
+		_costs.assign(stride * stride, Blocked);
+
+		for (int64_t y = 0; y < _side; ++y) {
+			for (int32_t cx = 0; cx < _chunks; ++cx) {
+				uint64_t row = rows[
+					((y / CHUNKSIZE) * _chunks + cx) * CHUNKSIZE +
+					y % CHUNKSIZE];
+				uint16_t* costs =
+					&_costs[(y + 1) * stride + cx * CHUNKSIZE + 1];
+
+				for (int x = 0; x < CHUNKSIZE; ++x) {
+					if ((row >> x) & 1) {
+						costs[x] = Unreachable;
+					}
+				}
+			}
+		}
+
+		std::vector<uint32_t> queue;
+		queue.reserve(_side * _side);
+
+		uint32_t target = Index(_target);
+		_costs[target] = 0;
+		queue.push_back(target);
+
+		for (size_t head = 0; head < queue.size(); ++head) {
+			uint32_t tile = queue[head];
+			uint16_t cost = _costs[tile] + 1;
+			uint32_t neighbours[4] = {
+				tile - 1,
+				tile + 1,
+				tile - stride,
+				tile + stride
+			};
+
+			for (uint32_t neighbour : neighbours) {
+				if (_costs[neighbour] == Unreachable) {
+					_costs[neighbour] = cost;
+					queue.push_back(neighbour);
+				}
+			}
+		}
+	}
+
+	void Orient()
+	{
+		_directions.assign(_stride * _stride, None);
+
+		int64_t offsets[9];
+
+		for (int d = None; d <= SouthEast; ++d) {
+			offsets[d] = StepY[d] * _stride + StepX[d];
+		}
+
+		for (int64_t y = 1; y <= _side; ++y) {
+			for (int64_t tile = y * _stride + 1; tile <= y * _stride + _side;
+				++tile)
+			{
+				uint16_t best = _costs[tile];
+
+				if (best == 0 || best >= Unreachable) {
+					continue;
+				}
+
+				uint8_t direction = None;
+
+				for (int d = West; d <= SouthEast; ++d) {
+					// Blocked and unreachable tiles are never smaller.
+					uint16_t value = _costs[tile + offsets[d]];
+
+					if (value >= best) {
+						continue;
+					}
+
+					// No cutting corners past blocked tiles.
+					if (d >= NorthWest &&
+						(_costs[tile + StepX[d]] >= Unreachable ||
+						_costs[tile + StepY[d] * _stride] >= Unreachable))
+					{
+						continue;
+					}
+
+					best = value;
+					direction = d;
+				}
+
+				_directions[tile] = direction;
+			}
+		}
+	}
+};
+
+// Flow fields by target, kept until a chunk they cover changes.
+//
+// With the defaults the cache holds at most 16 fields of the largest
+// radius, about 2.5 MB. The cache belongs to one thread, like the Map. Returned fields are
+// immutable and stay valid after they are dropped from the cache, so
+// other threads may read them.
+class FlowFieldCache
+{
+public:
+	struct Statistics
+	{
+		uint64_t hits;
+		uint64_t builds;
+		uint64_t invalidations;
+		size_t fields;
+	};
+
+	// Fields cover the chunks within radius of the target chunk; at most
+	// fieldLimit fields are kept, the least recently used are dropped.
+	FlowFieldCache(
+		int32_t radius = FLOW_FIELD_MAX_RADIUS,
+		size_t fieldLimit = 16)
+	{
+		_radius = radius;
+		_fieldLimit = fieldLimit;
+		_hits = 0;
+		_builds = 0;
+		_invalidations = 0;
+	}
+
+	// Switches to snapshot and drops the fields it made stale.
+	void Update(const std::shared_ptr<const MapSnapshot>& snapshot)
+	{
+		_snapshot = snapshot;
+
+		for (auto it = _fields.begin(); it != _fields.end();) {
+			if (it->second.field->IsCurrent(*_snapshot)) {
+				++it;
+				continue;
+			}
+
+			_order.erase(it->second.order);
+			it = _fields.erase(it);
+			++_invalidations;
+		}
+	}
+
+	// Returns the field leading to target, building it if needed.
+	// Requires a snapshot set with Update().
+	std::shared_ptr<const FlowField> Get(FlowField::Point target)
+	{
+		auto it = _fields.find(target);
+
+		if (it != _fields.end()) {
+			_order.splice(_order.begin(), _order, it->second.order);
+			++_hits;
+			return it->second.field;
+		}
+
+		std::shared_ptr<const FlowField> field =
+			std::make_shared<FlowField>(*_snapshot, target, _radius);
+		++_builds;
+
+		_order.push_front(target);
+
+		Entry& entry = _fields[target];
+		entry.field = field;
+		entry.order = _order.begin();
+
+		while (_fields.size() > _fieldLimit) {
+			_fields.erase(_order.back());
+			_order.pop_back();
+		}
+
+		return field;
+	}
+
+	Statistics GetStatistics() const
+	{
+		Statistics statistics;
+		statistics.hits = _hits;
+		statistics.builds = _builds;
+		statistics.invalidations = _invalidations;
+		statistics.fields = _fields.size();
+
+		return statistics;
+	}
+
+private:
+	struct Entry
+	{
+		std::shared_ptr<const FlowField> field;
+		std::list<FlowField::Point>::iterator order;
+	};
+
+	int32_t _radius;
+	size_t _fieldLimit;
+	std::shared_ptr<const MapSnapshot> _snapshot;
+
+	std::map<FlowField::Point, Entry> _fields;
+	std::list<FlowField::Point> _order;
+
+	uint64_t _hits;
+	uint64_t _builds;
+	uint64_t _invalidations;
+};
+
+#endif
@@ -0,0 +1,345 @@
+#ifndef GENERATION_H
+#define GENERATION_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <limits>
+#include <mutex>
+#include <queue>
+#include <set>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "map.h"
+#include "generator.h"
+#include "chunkcache.h"
+
+// Generates chunks on a pool of worker threads.
+//
+// Coordinates are queued in batches and handed to workers closest-first
+// relative to the current focus points (usually player positions, in
+// chunk coordinates). Finished chunks go to a completion queue which the
+// owner of the Map drains with Deliver(), so the Map itself is only ever
+// touched from one thread. With a cache, which must be tied to the same
+// generator, workers look chunks up there before generating them and
+// store what they generate. A chunk whose generator throws is dropped
+// and the exception is rethrown by Wait().
+class GenerationService
+{
+public:
+	typedef std::pair<int32_t, int32_t> Position;
+	typedef ChunkGenerator Generator;
+
+	struct Result
+	{
+		int32_t x;
+		int32_t y;
+		std::shared_ptr<Chunk> chunk;
+	};
+
+	GenerationService(
+		uint64_t seed,
+		Generator generate = generator,
+		ChunkCache* cache = nullptr)
+	{
+		if (cache && cache->GetGenerator() != generate) {
+			throw std::invalid_argument(
+				"cache is tied to another generator");
+		}
+
+		_seed = seed;
+		_generate = generate;
+		_cache = cache;
+		_work = false;
+		_busy = 0;
+		_sequence = 0;
+	}
+
+	~GenerationService()
+	{
+		Stop();
+	}
+
+	void Start(size_t threadCount = 0)
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+
+		if (_work) {
+			return;
+		}
+
+		if (threadCount == 0) {
+			threadCount = std::max(
+				1u,
+				std::thread::hardware_concurrency());
+		}
+
+		_work = true;
+
+		for (size_t i = 0; i < threadCount; ++i) {
+			_workers.emplace_back(Worker, this);
+		}
+	}
+
+	void Stop()
+	{
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+
+			if (!_work) {
+				return;
+			}
+
+			_work = false;
+		}
+
+		_queueCondition.notify_all();
+		_idleCondition.notify_all();
+
+		for (auto& worker : _workers) {
+			worker.join();
+		}
+
+		_workers.clear();
+	}
+
+	// Queues chunks for generation. Chunks that are already queued,
+	// being generated or waiting for delivery are skipped.
+	void Request(const std::vector<Position>& positions)
+	{
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+
+			for (const Position& position : positions) {
+				if (!_scheduled.insert(position).second) {
+					continue;
+				}
+
+				Task task;
+				task.position = position;
+				task.priority = Priority(position);
+				task.sequence = _sequence++;
+
+				_queue.push_back(task);
+				std::push_heap(_queue.begin(), _queue.end());
+			}
+		}
+
+		_queueCondition.notify_all();
+	}
+
+	// Queues the square of chunks within radius around (x, y) that are
+	// not present in the map yet.
+	void RequestArea(const Map* map, int32_t x, int32_t y, int32_t radius)
+	{
+		std::vector<Position> positions;
+
+		for (int32_t dy = -radius; dy <= radius; ++dy) {
+			for (int32_t dx = -radius; dx <= radius; ++dx) {
+				if (map && map->GetChunk(x + dx, y + dy)) {
+					continue;
+				}
+
+				positions.push_back(Position(x + dx, y + dy));
+			}
+		}
+
+		Request(positions);
+	}
+
+	// Replaces the focus points and reorders the pending queue.
+	void SetFocus(const std::vector<Position>& focus)
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+
+		_focus = focus;
+
+		for (Task& task : _queue) {
+			task.priority = Priority(task.position);
+		}
+
+		std::make_heap(_queue.begin(), _queue.end());
+	}
+
+	bool TakeResult(Result& result)
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+
+		if (_results.empty()) {
+			return false;
+		}
+
+		result = _results.front();
+		_results.pop();
+		_scheduled.erase(Position(result.x, result.y));
+
+		return true;
+	}
+
+	// Moves up to limit finished chunks into the map. Returns the
+	// number of chunks added.
+	size_t Deliver(
+		Map* map,
+		size_t limit = std::numeric_limits<size_t>::max())
+	{
+		size_t count = 0;
+		Result result;
+
+		while (count < limit && TakeResult(result)) {
+			map->AddChunk(result.x, result.y, result.chunk);
+			++count;
+		}
+
+		return count;
+	}
+
+	// Blocks until every queued chunk has been generated, returns at
+	// once if the service is not running. Rethrows the first exception
+	// a generator threw since the last call.
+	void Wait()
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+
+		_idleCondition.wait(lock, [this]() {
+			return !_work || _error || (_queue.empty() && _busy == 0);
+		});
+
+		if (_error) {
+			std::exception_ptr error = _error;
+			_error = nullptr;
+			std::rethrow_exception(error);
+		}
+	}
+
+	size_t Pending()
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		return _queue.size() + _busy;
+	}
+
+private:
+	struct Task
+	{
+		Position position;
+		int64_t priority;
+		uint64_t sequence;
+
+		// Max-heap order: the closest and then oldest task on top.
+		bool operator<(const Task& task) const
+		{
+			if (priority != task.priority) {
+				return priority > task.priority;
+			}
+
+			return sequence > task.sequence;
+		}
+	};
+
+	uint64_t _seed;
+	Generator _generate;
+	ChunkCache* _cache;
+
+	bool _work;
+	size_t _busy;
+	uint64_t _sequence;
+	std::exception_ptr _error;
+
+	std::vector<Position> _focus;
+	std::vector<Task> _queue;
+	std::set<Position> _scheduled;
+	std::queue<Result> _results;
+
+	std::mutex _mutex;
+	std::condition_variable _queueCondition;
+	std::condition_variable _idleCondition;
+	std::vector<std::thread> _workers;
+
+	int64_t Priority(const Position& position) const
+	{
+		int64_t best = 0;
+
+		for (size_t i = 0; i < _focus.size(); ++i) {
+			int64_t dx = int64_t(position.first) - _focus[i].first;
+			int64_t dy = int64_t(position.second) - _focus[i].second;
+			int64_t distance = dx * dx + dy * dy;
+
+			if (i == 0 || distance < best) {
+				best = distance;
+			}
+		}
+
+		return best;
+	}
+
+	static void Worker(GenerationService* service)
+	{
+		std::unique_lock<std::mutex> lock(service->_mutex);
+
+		while (true) {
+			service->_queueCondition.wait(lock, [service]() {
+				return !service->_work || !service->_queue.empty();
+			});
+
+			if (!service->_work) {
+				break;
+			}
+
+			std::pop_heap(service->_queue.begin(), service->_queue.end());
+			Task task = service->_queue.back();
+			service->_queue.pop_back();
+			++service->_busy;
+
+			lock.unlock();
+
+			Result result;
+			result.x = task.position.first;
+			result.y = task.position.second;
+
+			std::exception_ptr error;
+
+			try {
+				if (service->_cache) {
+					result.chunk = service->_cache->GetOrGenerate(
+						service->_seed,
+						result.x,
+						result.y);
+				} else {
+					result.chunk = service->_generate(
+						service->_seed,
+						result.x,
+						result.y);
+				}
+			} catch (...) {
+				error = std::current_exception();
+			}
+
+			lock.lock();
+
+			--service->_busy;
+
+			if (error) {
+				// Unscheduled so a later request can retry it.
+				service->_scheduled.erase(task.position);
+
+				if (!service->_error) {
+					service->_error = error;
+				}
+
+				service->_idleCondition.notify_all();
+				continue;
+			}
+
+			service->_results.push(result);
+
+			if (service->_queue.empty() && service->_busy == 0) {
+				service->_idleCondition.notify_all();
+			}
+		}
+	}
+};
+
+#endif
@@ -2,57 +2,115 @@
 #define GENERATOR_H
 
 #include "map.h"
-#include <random>
-#include <vector>
-
-std::shared_ptr<Chunk> generator (uint64_t seed, int32_t x, int32_t y) {
-    uint64_t ChunkSeed = seed;
-    ChunkSeed = ChunkSeed ^ (int64_t(x) << 32);
-    ChunkSeed = ChunkSeed ^ (int64_t(y) & 0xFFFFFFFF);
-    std::srand(ChunkSeed);
-    
-    std::vector<int> Pregen(CHUNKSIZE * CHUNKSIZE);
-    for (int i = 0; i < CHUNKSIZE * CHUNKSIZE; i++) {
-        Pregen[i] = std::rand() % 3;
-    }
+#include "automaton.h"
+#include "random.h"
+#include "noise.h"
+
+// Bump whenever the output of the generators below changes, so cached
+// chunks from older versions are dropped.
+#define GENERATOR_VERSION 2
+
+typedef std::shared_ptr<Chunk> (*ChunkGenerator)(
+        uint64_t seed,
+        int32_t x,
+        int32_t y);
+
+// Ids of generator() and seamlessGenerator(), stored with cached chunks
+// so the chunks of one are never taken for the other. Never reuse an id.
+#define GENERATOR_ID_TILED 1
+#define GENERATOR_ID_SEAMLESS 2
+
+// Pre-noise of a single chunk tile, a pure function of (seed, x, y, index).
+inline uint8_t pregenCell(const CounterRandom& Random, int index) {
+    return Random.GetBelow(index, 3);
+}
+
+// Elevation from multi-octave gradient noise in world coordinates, so it is
+// continuous across chunk borders in either generation mode.
+inline std::shared_ptr<Heightmap> heightmapGenerator(uint64_t seed, int32_t x, int32_t y) {
+    auto H = std::make_shared<Heightmap>();
+    GenerateHeights(seed, x, y, H->Data());
+    H->UpdateSummary();
+    return H;
+}
+
+inline std::shared_ptr<Chunk> buildChunk(uint64_t seed, int32_t x, int32_t y, const uint8_t* Padded) {
+    uint8_t Postgen[CHUNKSIZE * CHUNKSIZE];
+    AutomatonStep(Padded, Postgen);
 
-    std::vector<int> Postgen(CHUNKSIZE * CHUNKSIZE);
     Layer L;
     for (int i = 0; i < CHUNKSIZE * CHUNKSIZE; i++) {
-        int lu = i - CHUNKSIZE - 1, mu = i - CHUNKSIZE, ru = i - CHUNKSIZE + 1, 
-                rm = i + 1, rd = i + CHUNKSIZE + 1, md = i + CHUNKSIZE, 
-                ld = i + CHUNKSIZE - 1, lm = i - 1;
-        if (i % CHUNKSIZE == 0) {
-            lu += CHUNKSIZE;
-            lm += CHUNKSIZE;
-            ld += CHUNKSIZE;
-        } else if (i % CHUNKSIZE == CHUNKSIZE - 1) {
-            ru -= CHUNKSIZE;
-            rm -= CHUNKSIZE;
-            rd -= CHUNKSIZE;
-        }
-        if (i / CHUNKSIZE == 0) {
-            lu += CHUNKSIZE * CHUNKSIZE;
-            mu += CHUNKSIZE * CHUNKSIZE;
-            ru += CHUNKSIZE * CHUNKSIZE;
-        } else if (i / CHUNKSIZE == CHUNKSIZE - 1) {
-            ld -= CHUNKSIZE * CHUNKSIZE;
-            md -= CHUNKSIZE * CHUNKSIZE;
-            rd -= CHUNKSIZE * CHUNKSIZE;
-        }
-        Postgen[i] = Pregen[lu] + Pregen[mu] + Pregen[ru] + Pregen[rm] + 
-                Pregen[rd] + Pregen[md] + Pregen[ld] + Pregen[lm];
-        if (Postgen[i] > 3 && Postgen[i] < 13) {
+        if (Postgen[i]) {
             L.SetTile(i % CHUNKSIZE, i / CHUNKSIZE, Tile(Tile::Grass));
         } else {
             L.SetTile(i % CHUNKSIZE, i / CHUNKSIZE, Tile(Tile::Stone));
         }
     }
+    // Generated tiles can always be regenerated, so they start clean.
+    L.ClearDirty();
     auto C = std::make_shared<Chunk>();
     C->AddLayer(std::make_shared<Layer>(L));
+    C->SetHeightmap(heightmapGenerator(seed, x, y));
     return C;
 }
 
+// Neighbours wrap around inside the chunk, so borders of adjacent chunks
+// do not line up.
+inline std::shared_ptr<Chunk> generator (uint64_t seed, int32_t x, int32_t y) {
+    CounterRandom Random(seed, x, y);
+
+    uint8_t Pregen[CHUNKSIZE * CHUNKSIZE];
+    for (int i = 0; i < CHUNKSIZE * CHUNKSIZE; i++) {
+        Pregen[i] = pregenCell(Random, i);
+    }
+
+    uint8_t Padded[AUTOMATON_PADDED_SIZE];
+    AutomatonPadToroidal(Pregen, Padded);
+    return buildChunk(seed, x, y, Padded);
+}
+
+// Same pre-noise as generator(), but the halo is sampled from the
+// neighbouring chunks' pre-noise instead of wrapping. Only the 4 * CHUNKSIZE
+// + 4 halo cells are hashed for the neighbours; they are never generated,
+// and terrain is continuous across chunk borders.
+inline std::shared_ptr<Chunk> seamlessGenerator (uint64_t seed, int32_t x, int32_t y) {
+    CounterRandom Random(seed, x, y);
+
+    uint8_t Padded[AUTOMATON_PADDED_SIZE];
+    for (int j = 0; j < CHUNKSIZE; j++) {
+        uint8_t* Row = Padded + (j + 1) * AUTOMATON_STRIDE + 1;
+        for (int i = 0; i < CHUNKSIZE; i++) {
+            Row[i] = pregenCell(Random, j * CHUNKSIZE + i);
+        }
+    }
+
+    for (int dy = -1; dy <= 1; dy++) {
+        for (int dx = -1; dx <= 1; dx++) {
+            if (dx == 0 && dy == 0) {
+                continue;
+            }
+            CounterRandom Neighbour(seed, x + dx, y + dy);
+
+            // Halo cells covered by this neighbour, in padded coordinates.
+            int FromX = dx < 0 ? 0 : (dx == 0 ? 1 : CHUNKSIZE + 1);
+            int ToX = dx < 0 ? 1 : (dx == 0 ? CHUNKSIZE + 1 : CHUNKSIZE + 2);
+            int FromY = dy < 0 ? 0 : (dy == 0 ? 1 : CHUNKSIZE + 1);
+            int ToY = dy < 0 ? 1 : (dy == 0 ? CHUNKSIZE + 1 : CHUNKSIZE + 2);
+
+            for (int py = FromY; py < ToY; py++) {
+                int LocalY = (py - 1 + CHUNKSIZE) % CHUNKSIZE;
+                for (int px = FromX; px < ToX; px++) {
+                    int LocalX = (px - 1 + CHUNKSIZE) % CHUNKSIZE;
+                    Padded[py * AUTOMATON_STRIDE + px] =
+                            pregenCell(Neighbour, LocalY * CHUNKSIZE + LocalX);
+                }
+            }
+        }
+    }
+
+    return buildChunk(seed, x, y, Padded);
+}
+
 
 
 
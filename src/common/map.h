@@ -1,6 +1,10 @@
 #ifndef MAP_H
 #define MAP_H
 
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
 #include <utility>
 #include <vector>
 #include <iostream>
@@ -8,19 +12,113 @@
 
 #define CHUNKSIZE 32
 
+// Quotient rounded down, for mapping world coordinates to chunks and
+// blocks on both sides of zero.
+inline int64_t FloorDivide(int64_t value, int64_t divisor)
+{
+	int64_t quotient = value / divisor;
+
+	if ((value % divisor != 0) && ((value < 0) != (divisor < 0))) {
+		--quotient;
+	}
+
+	return quotient;
+}
+
+// Modified tiles are tracked in square regions of DIRTY_REGION_SIZE tiles,
+// one bit per region, so saving and syncing only have to touch the regions
+// that changed.
+#define DIRTY_REGION_SIZE 8
+#define DIRTY_REGIONS_PER_SIDE (CHUNKSIZE / DIRTY_REGION_SIZE)
+#define DIRTY_REGIONS (DIRTY_REGIONS_PER_SIDE * DIRTY_REGIONS_PER_SIDE)
+
+static_assert(
+	CHUNKSIZE % DIRTY_REGION_SIZE == 0,
+	"chunks must split into whole dirty regions");
+static_assert(DIRTY_REGIONS <= 64, "dirty regions must fit a 64-bit mask");
+
+// Bit of the dirty region holding tile (x, y).
+inline uint64_t DirtyRegionBit(size_t x, size_t y)
+{
+	return uint64_t(1) << (y / DIRTY_REGION_SIZE * DIRTY_REGIONS_PER_SIDE +
+		x / DIRTY_REGION_SIZE);
+}
+
+// Downsampled summaries for distant views and coarse queries. Each level
+// covers blocks SUMMARY_FACTOR times wider than the one below: 4x4 and
+// 16x16 tiles inside a chunk, and 64x64 tiles spanning several chunks,
+// which only Map can answer.
+#define SUMMARY_FACTOR 4
+#define SUMMARY_LEVELS 3
+#define SUMMARY_CHUNK_LEVELS 2
+#define SUMMARY_FINE_SIDE (CHUNKSIZE / SUMMARY_FACTOR)
+#define SUMMARY_COARSE_SIDE (CHUNKSIZE / (SUMMARY_FACTOR * SUMMARY_FACTOR))
+#define SUMMARY_BLOCKS (SUMMARY_FINE_SIDE * SUMMARY_FINE_SIDE + \
+	SUMMARY_COARSE_SIDE * SUMMARY_COARSE_SIDE)
+
+static_assert(
+	CHUNKSIZE % (SUMMARY_FACTOR * SUMMARY_FACTOR) == 0,
+	"chunks must split into whole summary blocks");
+static_assert(
+	SUMMARY_FACTOR * SUMMARY_FACTOR <= 16,
+	"fine summary blocks must fit a 16-bit tile mask");
+static_assert(
+	(SUMMARY_FACTOR * SUMMARY_FACTOR * SUMMARY_FACTOR) % CHUNKSIZE == 0,
+	"top summary blocks must cover whole chunks");
+
+// Width in tiles of a block at level.
+inline size_t SummaryBlockSize(int level)
+{
+	size_t size = SUMMARY_FACTOR;
+
+	for (int i = 0; i < level; ++i) {
+		size *= SUMMARY_FACTOR;
+	}
+
+	return size;
+}
+
+// Index of the block at (bx, by) of a chunk level in per-block arrays.
+inline size_t SummaryBlockIndex(int level, size_t bx, size_t by)
+{
+	if (level == 0) {
+		return by * SUMMARY_FINE_SIDE + bx;
+	}
+
+	return SUMMARY_FINE_SIDE * SUMMARY_FINE_SIDE +
+		by * SUMMARY_COARSE_SIDE + bx;
+}
+
+struct TileSummary
+{
+	int dominantType;
+	float minHeight;
+	float maxHeight;
+};
+
+// Tile coordinates of the top left corner of a dirty region.
+inline void DirtyRegionOrigin(int region, size_t& x, size_t& y)
+{
+	x = region % DIRTY_REGIONS_PER_SIDE * DIRTY_REGION_SIZE;
+	y = region / DIRTY_REGIONS_PER_SIDE * DIRTY_REGION_SIZE;
+}
+
 class Tile
 {
 public:
 	enum Type { Grass, Stone };
+	static const int TypeCount = 2;
 
 	Tile()
 	{
 		_type = Type::Grass;
+		_attributes = 0;
 	}
 
 	Tile(Type type)
 	{
 		_type = type;
+		_attributes = 0;
 	}
 
 	void Draw() const;
@@ -39,11 +137,21 @@ public:
 		}
 	}
 
-	Type GetType()
+	Type GetType() const
 	{
 		return _type;
 	}
 
+	uint32_t GetAttributes() const
+	{
+		return _attributes;
+	}
+
+	void SetAttributes(uint32_t attributes)
+	{
+		_attributes = attributes;
+	}
+
 private:
 	Type _type;
 	uint32_t _attributes;
@@ -54,11 +162,202 @@ class Layer
 public:
 	Layer():
 		_tiles(CHUNKSIZE * CHUNKSIZE)
-	{ }
+	{
+		_dirty = 0;
+		_attributesOr = 0;
+		_attributesAnd = 0;
+
+		for (int y = 0; y < CHUNKSIZE; ++y) {
+			_rowOr[y] = 0;
+			_rowAnd[y] = 0;
+		}
+
+		for (size_t i = 0; i < SUMMARY_FINE_SIDE * SUMMARY_FINE_SIDE; ++i) {
+			for (int type = 0; type < Tile::TypeCount; ++type) {
+				_typeMasks[i][type] = 0;
+			}
+
+			_typeMasks[i][Tile::Grass] = 0xFFFF;
+		}
+	}
 
 	void SetTile(size_t x, size_t y, const Tile& tile)
 	{
-		_tiles[y * CHUNKSIZE + x] = tile;
+		Tile& current = _tiles[y * CHUNKSIZE + x];
+		uint16_t* masks = _typeMasks[SummaryBlockIndex(
+			0,
+			x / SUMMARY_FACTOR,
+			y / SUMMARY_FACTOR)];
+		uint16_t bit = 1 << (y % SUMMARY_FACTOR * SUMMARY_FACTOR +
+			x % SUMMARY_FACTOR);
+
+		masks[current.GetType()] &= ~bit;
+		masks[tile.GetType()] |= bit;
+
+		uint32_t before = current.GetAttributes();
+
+		current = tile;
+		_dirty |= DirtyRegionBit(x, y);
+
+		if (before != tile.GetAttributes()) {
+			UpdateAttributes(y, before, tile.GetAttributes());
+		}
+	}
+
+	void SetAttr(size_t x, size_t y, int attr, bool value)
+	{
+		Tile& tile = _tiles[y * CHUNKSIZE + x];
+		uint32_t before = tile.GetAttributes();
+
+		tile.SetAttr(attr, value);
+		_dirty |= DirtyRegionBit(x, y);
+
+		if (before != tile.GetAttributes()) {
+			UpdateAttributes(y, before, tile.GetAttributes());
+		}
+	}
+
+	const Tile& GetTile(size_t x, size_t y) const
+	{
+		return _tiles[y * CHUNKSIZE + x];
+	}
+
+	// Mask of the regions modified since the last ClearDirty().
+	uint64_t GetDirty() const
+	{
+		return _dirty;
+	}
+
+	void ClearDirty()
+	{
+		_dirty = 0;
+	}
+
+	// Attribute bits set on any and on every tile of the layer or of a
+	// row.
+	uint32_t GetAttributesOr() const
+	{
+		return _attributesOr;
+	}
+
+	uint32_t GetAttributesAnd() const
+	{
+		return _attributesAnd;
+	}
+
+	uint32_t GetRowOr(size_t y) const
+	{
+		return _rowOr[y];
+	}
+
+	uint32_t GetRowAnd(size_t y) const
+	{
+		return _rowAnd[y];
+	}
+
+	// True if any tile of the rectangle has attr. Rows without it are
+	// skipped from their summaries; tiles are only read in rows that
+	// have it on some tiles but not all.
+	bool AnyAttr(int attr, size_t x, size_t y, size_t width, size_t height)
+		const
+	{
+		uint32_t bit = uint32_t(1) << attr;
+
+		if (!(_attributesOr & bit)) {
+			return false;
+		}
+
+		for (size_t j = y; j < y + height; ++j) {
+			if (!(_rowOr[j] & bit)) {
+				continue;
+			}
+
+			if (_rowAnd[j] & bit) {
+				return true;
+			}
+
+			for (size_t i = x; i < x + width; ++i) {
+				if (_tiles[j * CHUNKSIZE + i].GetAttributes() & bit) {
+					return true;
+				}
+			}
+		}
+
+		return false;
+	}
+
+	// True if every tile of the rectangle has attr.
+	bool AllAttr(int attr, size_t x, size_t y, size_t width, size_t height)
+		const
+	{
+		uint32_t bit = uint32_t(1) << attr;
+
+		if (_attributesAnd & bit) {
+			return true;
+		}
+
+		if (!(_attributesOr & bit)) {
+			return false;
+		}
+
+		for (size_t j = y; j < y + height; ++j) {
+			if (_rowAnd[j] & bit) {
+				continue;
+			}
+
+			if (!(_rowOr[j] & bit)) {
+				return false;
+			}
+
+			for (size_t i = x; i < x + width; ++i) {
+				if (!(_tiles[j * CHUNKSIZE + i].GetAttributes() & bit)) {
+					return false;
+				}
+			}
+		}
+
+		return true;
+	}
+
+	// Number of tiles of type in a summary block of a chunk level.
+	size_t GetTypeCount(int level, size_t bx, size_t by, int type) const
+	{
+		if (level == 0) {
+			return __builtin_popcount(
+				_typeMasks[SummaryBlockIndex(0, bx, by)][type]);
+		}
+
+		size_t count = 0;
+
+		for (size_t j = 0; j < SUMMARY_FACTOR; ++j) {
+			for (size_t i = 0; i < SUMMARY_FACTOR; ++i) {
+				count += __builtin_popcount(_typeMasks[SummaryBlockIndex(
+					0,
+					bx * SUMMARY_FACTOR + i,
+					by * SUMMARY_FACTOR + j)][type]);
+			}
+		}
+
+		return count;
+	}
+
+	// Most common tile type of a summary block; ties go to the lower
+	// type.
+	int GetDominantType(int level, size_t bx, size_t by) const
+	{
+		int dominant = 0;
+		size_t best = GetTypeCount(level, bx, by, 0);
+
+		for (int type = 1; type < Tile::TypeCount; ++type) {
+			size_t count = GetTypeCount(level, bx, by, type);
+
+			if (count > best) {
+				dominant = type;
+				best = count;
+			}
+		}
+
+		return dominant;
 	}
 	
 	void PrintLayer()
@@ -79,14 +378,364 @@ public:
 
 private:
 	std::vector<Tile> _tiles;
+	uint64_t _dirty;
+	uint32_t _attributesOr;
+	uint32_t _attributesAnd;
+	uint32_t _rowOr[CHUNKSIZE];
+	uint32_t _rowAnd[CHUNKSIZE];
+
+	// Per fine summary block and type, one bit per tile of the block.
+	uint16_t _typeMasks[SUMMARY_FINE_SIDE * SUMMARY_FINE_SIDE]
+		[Tile::TypeCount];
+
+	// A row summary only needs a rescan when the change can shrink it:
+	// cleared bits for the OR, set bits for the AND.
+	void UpdateAttributes(size_t y, uint32_t before, uint32_t after)
+	{
+		const Tile* row = _tiles.data() + y * CHUNKSIZE;
+		uint32_t rowOr = _rowOr[y] | after;
+		uint32_t rowAnd = _rowAnd[y] & after;
+
+		if (before & ~after) {
+			rowOr = 0;
+
+			for (int i = 0; i < CHUNKSIZE; ++i) {
+				rowOr |= row[i].GetAttributes();
+			}
+		}
+
+		if (after & ~before) {
+			rowAnd = ~uint32_t(0);
+
+			for (int i = 0; i < CHUNKSIZE; ++i) {
+				rowAnd &= row[i].GetAttributes();
+			}
+		}
+
+		if (rowOr == _rowOr[y] && rowAnd == _rowAnd[y]) {
+			return;
+		}
+
+		_rowOr[y] = rowOr;
+		_rowAnd[y] = rowAnd;
+		_attributesOr = 0;
+		_attributesAnd = ~uint32_t(0);
+
+		for (int j = 0; j < CHUNKSIZE; ++j) {
+			_attributesOr |= _rowOr[j];
+			_attributesAnd &= _rowAnd[j];
+		}
+	}
+};
+
+class Heightmap
+{
+public:
+	Heightmap():
+		_heights(CHUNKSIZE * CHUNKSIZE, 0.0f)
+	{
+		_dirty = 0;
+
+		for (size_t i = 0; i < SUMMARY_BLOCKS; ++i) {
+			_minHeights[i] = 0.0f;
+			_maxHeights[i] = 0.0f;
+		}
+	}
+
+	float GetHeight(size_t x, size_t y) const
+	{
+		return _heights[y * CHUNKSIZE + x];
+	}
+
+	void SetHeight(size_t x, size_t y, float height)
+	{
+		_heights[y * CHUNKSIZE + x] = height;
+		_dirty |= DirtyRegionBit(x, y);
+		UpdateBlock(x / SUMMARY_FACTOR, y / SUMMARY_FACTOR);
+	}
+
+	// Writes through Data() bypass the summaries and the dirty regions;
+	// call UpdateSummary() afterwards. They are meant for filling in a
+	// whole new heightmap, which is not an edit.
+	float* Data()
+	{
+		return _heights.data();
+	}
+
+	const float* Data() const
+	{
+		return _heights.data();
+	}
+
+	void UpdateSummary()
+	{
+		for (size_t by = 0; by < SUMMARY_FINE_SIDE; ++by) {
+			for (size_t bx = 0; bx < SUMMARY_FINE_SIDE; ++bx) {
+				UpdateFineBlock(bx, by);
+			}
+		}
+
+		for (size_t cy = 0; cy < SUMMARY_COARSE_SIDE; ++cy) {
+			for (size_t cx = 0; cx < SUMMARY_COARSE_SIDE; ++cx) {
+				UpdateCoarseBlock(cx, cy);
+			}
+		}
+	}
+
+	// Mask of the regions modified by SetHeight() since the last
+	// ClearDirty().
+	uint64_t GetDirty() const
+	{
+		return _dirty;
+	}
+
+	void ClearDirty()
+	{
+		_dirty = 0;
+	}
+
+	float GetMinHeight(int level, size_t bx, size_t by) const
+	{
+		return _minHeights[SummaryBlockIndex(level, bx, by)];
+	}
+
+	float GetMaxHeight(int level, size_t bx, size_t by) const
+	{
+		return _maxHeights[SummaryBlockIndex(level, bx, by)];
+	}
+
+private:
+	std::vector<float> _heights;
+	float _minHeights[SUMMARY_BLOCKS];
+	float _maxHeights[SUMMARY_BLOCKS];
+	uint64_t _dirty;
+
+	// Recomputes the range of a fine block and of the coarse block
+	// holding it.
+	void UpdateBlock(size_t bx, size_t by)
+	{
+		UpdateFineBlock(bx, by);
+		UpdateCoarseBlock(bx / SUMMARY_FACTOR, by / SUMMARY_FACTOR);
+	}
+
+	void UpdateFineBlock(size_t bx, size_t by)
+	{
+		const float* row = _heights.data() +
+			by * SUMMARY_FACTOR * CHUNKSIZE + bx * SUMMARY_FACTOR;
+		float low = row[0];
+		float high = row[0];
+
+		for (int j = 0; j < SUMMARY_FACTOR; ++j) {
+			for (int i = 0; i < SUMMARY_FACTOR; ++i) {
+				low = std::min(low, row[j * CHUNKSIZE + i]);
+				high = std::max(high, row[j * CHUNKSIZE + i]);
+			}
+		}
+
+		size_t fine = SummaryBlockIndex(0, bx, by);
+		_minHeights[fine] = low;
+		_maxHeights[fine] = high;
+	}
+
+	void UpdateCoarseBlock(size_t cx, size_t cy)
+	{
+		size_t first = SummaryBlockIndex(
+			0,
+			cx * SUMMARY_FACTOR,
+			cy * SUMMARY_FACTOR);
+		float low = _minHeights[first];
+		float high = _maxHeights[first];
+
+		for (int j = 0; j < SUMMARY_FACTOR; ++j) {
+			for (int i = 0; i < SUMMARY_FACTOR; ++i) {
+				size_t block = SummaryBlockIndex(
+					0,
+					cx * SUMMARY_FACTOR + i,
+					cy * SUMMARY_FACTOR + j);
+
+				low = std::min(low, _minHeights[block]);
+				high = std::max(high, _maxHeights[block]);
+			}
+		}
+
+		size_t coarse = SummaryBlockIndex(1, cx, cy);
+		_minHeights[coarse] = low;
+		_maxHeights[coarse] = high;
+	}
 };
 
+// Occupancy of the two build grids of a chunk: a small grid of single
+// tiles for equipment and a big grid of BUILD_CELL x BUILD_CELL tile cells
+// for buildings. Tile rows are 64-bit words and the whole big grid is one
+// word, so a footprint is tested with one AND per tile row or a single
+// AND for a building.
+#define BUILD_CELL 4
+#define BUILD_CELLS_PER_SIDE (CHUNKSIZE / BUILD_CELL)
+
+static_assert(CHUNKSIZE <= 64, "tile rows must fit a 64-bit word");
+static_assert(
+	CHUNKSIZE % BUILD_CELL == 0 &&
+	BUILD_CELLS_PER_SIDE * BUILD_CELLS_PER_SIDE <= 64,
+	"build cells must fit a 64-bit word");
+
+class Occupancy
+{
+public:
+	Occupancy()
+	{
+		for (int y = 0; y < CHUNKSIZE; ++y) {
+			_rows[y] = 0;
+		}
+
+		_cells = 0;
+		_dirty = 0;
+	}
+
+	// Bits of tiles [x, x + width) of a row.
+	static uint64_t RowMask(size_t x, size_t width)
+	{
+		uint64_t bits = width >= 64 ? ~uint64_t(0) :
+			(uint64_t(1) << width) - 1;
+		return bits << x;
+	}
+
+	// Bits of the big cells [cx, cx + width) x [cy, cy + height).
+	static uint64_t CellMask(
+		size_t cx,
+		size_t cy,
+		size_t width,
+		size_t height)
+	{
+		uint64_t row = RowMask(cx, width);
+		uint64_t mask = 0;
+
+		for (size_t j = cy; j < cy + height; ++j) {
+			mask |= row << (j * BUILD_CELLS_PER_SIDE);
+		}
+
+		return mask;
+	}
+
+	bool IsFree(size_t x, size_t y, size_t width, size_t height) const
+	{
+		uint64_t mask = RowMask(x, width);
+
+		for (size_t j = y; j < y + height; ++j) {
+			if (_rows[j] & mask) {
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	// True if no tile of the big cells is occupied.
+	bool IsCellFree(size_t cx, size_t cy, size_t width, size_t height) const
+	{
+		return !(_cells & CellMask(cx, cy, width, height));
+	}
+
+	void Set(size_t x, size_t y, size_t width, size_t height, bool occupied)
+	{
+		uint64_t mask = RowMask(x, width);
+
+		for (size_t j = y; j < y + height; ++j) {
+			if (occupied) {
+				_rows[j] |= mask;
+			} else {
+				_rows[j] &= ~mask;
+			}
+
+			MarkDirty(j, mask);
+		}
+
+		for (size_t cy = y / BUILD_CELL; cy <= (y + height - 1) / BUILD_CELL;
+			++cy)
+		{
+			UpdateCellRow(cy);
+		}
+	}
+
+	uint64_t GetRow(size_t y) const
+	{
+		return _rows[y];
+	}
+
+	// Replaces the occupied tiles of a row, for loading saved chunks.
+	void SetRow(size_t y, uint64_t row)
+	{
+		MarkDirty(y, _rows[y] ^ row);
+		_rows[y] = row;
+		UpdateCellRow(y / BUILD_CELL);
+	}
+
+	// One bit per big cell holding any occupied tile, row by row.
+	uint64_t GetCells() const
+	{
+		return _cells;
+	}
+
+	// Mask of the regions whose tiles were set or released since the
+	// last ClearDirty().
+	uint64_t GetDirty() const
+	{
+		return _dirty;
+	}
+
+	void ClearDirty()
+	{
+		_dirty = 0;
+	}
+
+private:
+	uint64_t _rows[CHUNKSIZE];
+	uint64_t _cells;
+	uint64_t _dirty;
+
+	// Marks the regions of the tiles of row y in mask.
+	void MarkDirty(size_t y, uint64_t mask)
+	{
+		for (size_t x = 0; x < CHUNKSIZE; x += DIRTY_REGION_SIZE) {
+			if (mask & RowMask(x, DIRTY_REGION_SIZE)) {
+				_dirty |= DirtyRegionBit(x, y);
+			}
+		}
+	}
+
+	void UpdateCellRow(size_t cy)
+	{
+		uint64_t any = 0;
+
+		for (int j = 0; j < BUILD_CELL; ++j) {
+			any |= _rows[cy * BUILD_CELL + j];
+		}
+
+		uint64_t cells = 0;
+
+		for (int cx = 0; cx < BUILD_CELLS_PER_SIDE; ++cx) {
+			if (any & RowMask(cx * BUILD_CELL, BUILD_CELL)) {
+				cells |= uint64_t(1) << cx;
+			}
+		}
+
+		uint64_t row = RowMask(0, BUILD_CELLS_PER_SIDE) <<
+			(cy * BUILD_CELLS_PER_SIDE);
+		_cells = (_cells & ~row) | (cells << (cy * BUILD_CELLS_PER_SIDE));
+	}
+};
+
+// Chunks are copy-on-write: copying a Chunk shares its layers and
+// heightmap, and EditLayer() / EditHeightmap() clone them before the first
+// change while they are still shared. Map::Publish() uses this to hand
+// out immutable snapshots that other threads read without locking.
 class Chunk
 {
 public:
 	Chunk():
 		_layers(0)
-	{ }
+	{
+		Touch();
+	}
 
 //	~Chunk()
 //	{
@@ -98,8 +747,152 @@ public:
 	void AddLayer(const std::shared_ptr<Layer>& layer)
 	{
 		_layers.push_back(layer);
+		Touch();
+	}
+
+	size_t LayerCount() const
+	{
+		return _layers.size();
+	}
+
+	const Layer* GetLayer(size_t index) const
+	{
+		return _layers[index].get();
+	}
+
+	// Layer for modification. The pointer must not be kept across
+	// Map::Publish(), as the layer may be shared with a snapshot after.
+	Layer* EditLayer(size_t index)
+	{
+		// Readers only take references from snapshots that already
+		// hold one, so a single owner cannot gain sharers meanwhile.
+		if (_layers[index].use_count() > 1) {
+			_layers[index] = std::make_shared<Layer>(*_layers[index]);
+		}
+
+		Touch();
+		return _layers[index].get();
 	}
 	
+	void SetHeightmap(const std::shared_ptr<Heightmap>& heightmap)
+	{
+		_heightmap = heightmap;
+		Touch();
+	}
+
+	const Heightmap* GetHeightmap() const
+	{
+		return _heightmap.get();
+	}
+
+	Heightmap* EditHeightmap()
+	{
+		if (_heightmap && _heightmap.use_count() > 1) {
+			_heightmap = std::make_shared<Heightmap>(*_heightmap);
+		}
+
+		Touch();
+		return _heightmap.get();
+	}
+
+	// Changes whenever the chunk is modified. Versions are unique across
+	// chunks, so equal versions mean equal contents.
+	uint64_t GetVersion() const
+	{
+		return _version;
+	}
+
+	// Summary of a block of a chunk level from the first layer and the
+	// heightmap. Heights are zero without a heightmap.
+	TileSummary GetSummary(int level, size_t bx, size_t by) const
+	{
+		TileSummary summary;
+		summary.dominantType = _layers.empty() ?
+			int(Tile::Grass) : _layers[0]->GetDominantType(level, bx, by);
+		summary.minHeight = 0.0f;
+		summary.maxHeight = 0.0f;
+
+		if (_heightmap) {
+			summary.minHeight = _heightmap->GetMinHeight(level, bx, by);
+			summary.maxHeight = _heightmap->GetMaxHeight(level, bx, by);
+		}
+
+		return summary;
+	}
+
+	// Regions modified in any layer, the heightmap or the build grids.
+	uint64_t GetDirty() const
+	{
+		uint64_t dirty = _occupancy.GetDirty();
+
+		for (const auto& layer : _layers) {
+			dirty |= layer->GetDirty();
+		}
+
+		if (_heightmap) {
+			dirty |= _heightmap->GetDirty();
+		}
+
+		return dirty;
+	}
+
+	void ClearDirty()
+	{
+		for (size_t i = 0; i < _layers.size(); ++i) {
+			if (_layers[i]->GetDirty()) {
+				EditLayer(i)->ClearDirty();
+			}
+		}
+
+		if (_heightmap && _heightmap->GetDirty()) {
+			EditHeightmap()->ClearDirty();
+		}
+
+		_occupancy.ClearDirty();
+	}
+
+	// Attribute bits set on any tile of any layer.
+	uint32_t GetAttributesOr() const
+	{
+		uint32_t attributes = 0;
+
+		for (const auto& layer : _layers) {
+			attributes |= layer->GetAttributesOr();
+		}
+
+		return attributes;
+	}
+
+	Occupancy& GetOccupancy()
+	{
+		Touch();
+		return _occupancy;
+	}
+
+	const Occupancy& GetOccupancy() const
+	{
+		return _occupancy;
+	}
+
+	// Fills rows with one bit per tile units can walk on: grass in the
+	// first layer that no building or equipment occupies.
+	void GetWalkableRows(uint64_t* rows) const
+	{
+		for (int y = 0; y < CHUNKSIZE; ++y) {
+			uint64_t row = 0;
+
+			if (!_layers.empty()) {
+				for (int x = 0; x < CHUNKSIZE; ++x) {
+					if (_layers[0]->GetTile(x, y).GetType() == Tile::Grass) {
+						row |= uint64_t(1) << x;
+					}
+				}
+			}
+
+			rows[y] = row & ~_occupancy.GetRow(y);
+		}
+	}
+
 	void PrintChunk()
 	{
 		for (const auto& layer : _layers) {
@@ -109,12 +902,72 @@ public:
 
 private:
 	std::vector<std::shared_ptr<Layer>> _layers;
+	std::shared_ptr<Heightmap> _heightmap;
+	Occupancy _occupancy;
+	uint64_t _version;
+
+	void Touch()
+	{
+		static std::atomic<uint64_t> versions(0);
+		_version = ++versions;
+	}
+};
+
+// Immutable view of every chunk of a Map at one point in time.
+class MapSnapshot
+{
+public:
+	MapSnapshot()
+	{
+		_epoch = 0;
+	}
+
+	std::shared_ptr<const Chunk> GetChunk(int32_t x, int32_t y) const
+	{
+		auto it = _chunks.find(std::pair<int32_t, int32_t>(x, y));
+
+		if (it == _chunks.end()) {
+			return nullptr;
+		}
+
+		return it->second;
+	}
+
+	size_t ChunkCount() const
+	{
+		return _chunks.size();
+	}
+
+	const std::map<std::pair<int32_t, int32_t>, std::shared_ptr<const Chunk>>&
+		GetChunks() const
+	{
+		return _chunks;
+	}
+
+	// Number of the Map::Publish() call that made the snapshot.
+	uint64_t GetEpoch() const
+	{
+		return _epoch;
+	}
+
+	friend class Map;
+
+private:
+	std::map<std::pair<int32_t, int32_t>, std::shared_ptr<const Chunk>>
+		_chunks;
+	uint64_t _epoch;
 };
 
 
+// The Map itself belongs to one thread (the tick thread). Other threads
+// read the snapshots it publishes.
 class Map
 {
 public:
+	Map():
+		_snapshot(std::make_shared<MapSnapshot>())
+	{ }
+
 //	~Map()
 //	{
 //		for (std::pair<std::pair<int32_t, int32_t>, std::shared_ptr<Chunk>> chunk : _chunks) {
@@ -127,8 +980,375 @@ public:
 		_chunks[std::pair<int32_t, int32_t>(x, y)] = chunk;
 	}
 
+	std::shared_ptr<Chunk> GetChunk(int32_t x, int32_t y) const
+	{
+		auto it = _chunks.find(std::pair<int32_t, int32_t>(x, y));
+
+		if (it == _chunks.end()) {
+			return nullptr;
+		}
+
+		return it->second;
+	}
+
+	size_t ChunkCount() const
+	{
+		return _chunks.size();
+	}
+
+	// Publishes the current state of the map for GetSnapshot() and
+	// returns it. Only chunks modified since the last call are copied,
+	// and the copies share every layer that has not been edited; a
+	// snapshot is freed once its last reader drops it.
+	std::shared_ptr<const MapSnapshot> Publish()
+	{
+		std::shared_ptr<const MapSnapshot> previous = GetSnapshot();
+		auto snapshot = std::make_shared<MapSnapshot>();
+		auto old = previous->_chunks.begin();
+		bool changed = previous->_chunks.size() != _chunks.size();
+
+		for (const auto& item : _chunks) {
+			while (old != previous->_chunks.end() &&
+				old->first < item.first)
+			{
+				++old;
+			}
+
+			if (old != previous->_chunks.end() &&
+				old->first == item.first &&
+				old->second->GetVersion() == item.second->GetVersion())
+			{
+				snapshot->_chunks.emplace_hint(
+					snapshot->_chunks.end(),
+					item.first,
+					old->second);
+				continue;
+			}
+
+			snapshot->_chunks.emplace_hint(
+				snapshot->_chunks.end(),
+				item.first,
+				std::make_shared<const Chunk>(*item.second));
+			changed = true;
+		}
+
+		if (!changed) {
+			return previous;
+		}
+
+		snapshot->_epoch = previous->_epoch + 1;
+
+		std::shared_ptr<const MapSnapshot> result = snapshot;
+		std::atomic_store(&_snapshot, result);
+		return result;
+	}
+
+	// Latest published snapshot. Safe to call from any thread.
+	std::shared_ptr<const MapSnapshot> GetSnapshot() const
+	{
+		return std::atomic_load(&_snapshot);
+	}
+
+	// Placement queries on the build grids, in world coordinates: tiles
+	// for equipment and big cells for buildings. Footprints may span
+	// chunks; a footprint touching a chunk that is not loaded never fits.
+	bool CanPlace(int64_t x, int64_t y, int64_t width, int64_t height) const
+	{
+		return ForEachPart(x, y, width, height, [](
+			const Chunk& chunk,
+			size_t px,
+			size_t py,
+			size_t pw,
+			size_t ph)
+		{
+			return chunk.GetOccupancy().IsFree(px, py, pw, ph);
+		});
+	}
+
+	bool CanPlaceBuilding(
+		int64_t cx,
+		int64_t cy,
+		int64_t width,
+		int64_t height) const
+	{
+		return ForEachPart(
+			cx * BUILD_CELL,
+			cy * BUILD_CELL,
+			width * BUILD_CELL,
+			height * BUILD_CELL,
+			[](
+				const Chunk& chunk,
+				size_t px,
+				size_t py,
+				size_t pw,
+				size_t ph)
+			{
+				return chunk.GetOccupancy().IsCellFree(
+					px / BUILD_CELL,
+					py / BUILD_CELL,
+					pw / BUILD_CELL,
+					ph / BUILD_CELL);
+			});
+	}
+
+	// Occupies the footprint if it is free. Returns false, changing
+	// nothing, otherwise.
+	bool Place(int64_t x, int64_t y, int64_t width, int64_t height)
+	{
+		if (!CanPlace(x, y, width, height)) {
+			return false;
+		}
+
+		SetOccupied(x, y, width, height, true);
+		return true;
+	}
+
+	bool PlaceBuilding(int64_t cx, int64_t cy, int64_t width, int64_t height)
+	{
+		if (!CanPlaceBuilding(cx, cy, width, height)) {
+			return false;
+		}
+
+		SetOccupied(
+			cx * BUILD_CELL,
+			cy * BUILD_CELL,
+			width * BUILD_CELL,
+			height * BUILD_CELL,
+			true);
+		return true;
+	}
+
+	void Release(int64_t x, int64_t y, int64_t width, int64_t height)
+	{
+		SetOccupied(x, y, width, height, false);
+	}
+
+	void ReleaseBuilding(
+		int64_t cx,
+		int64_t cy,
+		int64_t width,
+		int64_t height)
+	{
+		SetOccupied(
+			cx * BUILD_CELL,
+			cy * BUILD_CELL,
+			width * BUILD_CELL,
+			height * BUILD_CELL,
+			false);
+	}
+
+	// Attribute queries over a rectangle of world tiles of one layer.
+	// Chunks are rejected from their layer summaries before any row is
+	// looked at. Missing chunks and layers have no attributes.
+	bool AnyAttr(
+		int attr,
+		int64_t x,
+		int64_t y,
+		int64_t width,
+		int64_t height,
+		size_t layer = 0) const
+	{
+		bool found = false;
+
+		ForEachPart(x, y, width, height, [&](
+			const Chunk& chunk,
+			size_t px,
+			size_t py,
+			size_t pw,
+			size_t ph)
+		{
+			found = layer < chunk.LayerCount() &&
+				chunk.GetLayer(layer)->AnyAttr(attr, px, py, pw, ph);
+			return !found;
+		}, true);
+
+		return found;
+	}
+
+	bool AllAttr(
+		int attr,
+		int64_t x,
+		int64_t y,
+		int64_t width,
+		int64_t height,
+		size_t layer = 0) const
+	{
+		return ForEachPart(x, y, width, height, [&](
+			const Chunk& chunk,
+			size_t px,
+			size_t py,
+			size_t pw,
+			size_t ph)
+		{
+			return layer < chunk.LayerCount() &&
+				chunk.GetLayer(layer)->AllAttr(attr, px, py, pw, ph);
+		});
+	}
+
+	// Summary of the block (bx, by) of a level in world block
+	// coordinates. Blocks of the top level combine several chunks;
+	// missing chunks are left out. Returns false if no chunk covers the
+	// block.
+	bool GetSummary(
+		int level,
+		int64_t bx,
+		int64_t by,
+		TileSummary& summary) const
+	{
+		int64_t size = SummaryBlockSize(level);
+
+		if (level < SUMMARY_CHUNK_LEVELS) {
+			int64_t perChunk = CHUNKSIZE / size;
+			auto chunk = GetChunk(
+				FloorDivide(bx, perChunk),
+				FloorDivide(by, perChunk));
+
+			if (!chunk) {
+				return false;
+			}
+
+			summary = chunk->GetSummary(
+				level,
+				bx - FloorDivide(bx, perChunk) * perChunk,
+				by - FloorDivide(by, perChunk) * perChunk);
+			return true;
+		}
+
+		int64_t chunks = size / CHUNKSIZE;
+		int level1 = SUMMARY_CHUNK_LEVELS - 1;
+		size_t counts[Tile::TypeCount] = {};
+		bool found = false;
+
+		for (int64_t cy = by * chunks; cy < (by + 1) * chunks; ++cy) {
+			for (int64_t cx = bx * chunks; cx < (bx + 1) * chunks; ++cx) {
+				auto chunk = GetChunk(cx, cy);
+
+				if (!chunk) {
+					continue;
+				}
+
+				for (size_t j = 0; j < SUMMARY_COARSE_SIDE; ++j) {
+					for (size_t i = 0; i < SUMMARY_COARSE_SIDE; ++i) {
+						TileSummary part =
+							chunk->GetSummary(level1, i, j);
+
+						if (!found) {
+							summary.minHeight = part.minHeight;
+							summary.maxHeight = part.maxHeight;
+							found = true;
+						}
+
+						summary.minHeight =
+							std::min(summary.minHeight, part.minHeight);
+						summary.maxHeight =
+							std::max(summary.maxHeight, part.maxHeight);
+
+						if (chunk->LayerCount() == 0) {
+							continue;
+						}
+
+						for (int type = 0; type < Tile::TypeCount; ++type) {
+							counts[type] += chunk->GetLayer(0)->
+								GetTypeCount(level1, i, j, type);
+						}
+					}
+				}
+			}
+		}
+
+		summary.dominantType = 0;
+
+		for (int type = 1; type < Tile::TypeCount; ++type) {
+			if (counts[type] > counts[summary.dominantType]) {
+				summary.dominantType = type;
+			}
+		}
+
+		return found;
+	}
+
 private:
 	std::map<std::pair<int32_t, int32_t>, std::shared_ptr<Chunk>> _chunks;
+	std::shared_ptr<const MapSnapshot> _snapshot;
+
+	void SetOccupied(
+		int64_t x,
+		int64_t y,
+		int64_t width,
+		int64_t height,
+		bool occupied)
+	{
+		ForEachPart(x, y, width, height, [occupied](
+			Chunk& chunk,
+			size_t px,
+			size_t py,
+			size_t pw,
+			size_t ph)
+		{
+			chunk.GetOccupancy().Set(
+				px,
+				py,
+				pw,
+				ph,
+				occupied);
+			return true;
+		});
+	}
+
+	// Calls visit(chunk, x, y, width, height) with the part of a world
+	// tile rectangle inside each chunk it touches, in chunk tile
+	// coordinates. Stops and returns false when visit returns false or,
+	// unless skipMissing is set, when a chunk is missing.
+	template<typename Visit>
+	bool ForEachPart(
+		int64_t x,
+		int64_t y,
+		int64_t width,
+		int64_t height,
+		Visit visit,
+		bool skipMissing = false) const
+	{
+		if (width <= 0 || height <= 0) {
+			return true;
+		}
+
+		int64_t firstX = FloorDivide(x, CHUNKSIZE);
+		int64_t firstY = FloorDivide(y, CHUNKSIZE);
+		int64_t lastX = FloorDivide(x + width - 1, CHUNKSIZE);
+		int64_t lastY = FloorDivide(y + height - 1, CHUNKSIZE);
+
+		for (int64_t cy = firstY; cy <= lastY; ++cy) {
+			for (int64_t cx = firstX; cx <= lastX; ++cx) {
+				auto it = _chunks.find(
+					std::pair<int32_t, int32_t>(cx, cy));
+
+				if (it == _chunks.end()) {
+					if (skipMissing) {
+						continue;
+					}
+
+					return false;
+				}
+
+				int64_t fromX = std::max(x, cx * CHUNKSIZE);
+				int64_t fromY = std::max(y, cy * CHUNKSIZE);
+				int64_t toX = std::min(x + width, (cx + 1) * CHUNKSIZE);
+				int64_t toY = std::min(y + height, (cy + 1) * CHUNKSIZE);
+
+				if (!visit(
+					*it->second,
+					fromX - cx * CHUNKSIZE,
+					fromY - cy * CHUNKSIZE,
+					toX - fromX,
+					toY - fromY))
+				{
+					return false;
+				}
+			}
+		}
+
+		return true;
+	}
 };
 
 #endif
@@ -0,0 +1,531 @@
+#ifndef NOISE_H
+#define NOISE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cmath>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NOISE_X86
+#endif
+
+#include "map.h"
+#include "random.h"
+
+#pragma GCC push_options
+#pragma GCC optimize("fp-contract=off")
+
+// Multi-octave gradient noise for chunk heightmaps.
+//
+// Every octave is a gradient noise lattice with a power of two cell size,
+// evaluated at integer world tile coordinates, so the result depends only
+// on (seed, x, y) and is continuous across chunk borders. Inside one
+// lattice cell the noise splits into per-column and per-row terms:
+//
+//     n = p + fy * q + v * (r + fy * e),   v = fade(fy),
+//
+// where p, q, r and e depend only on the column (and the cell row). Cells
+// are at least NOISE_SMALLEST_CELL rows high, so in every band of that
+// many rows each octave stays in one cell row and fy grows linearly. The
+// p + fy * q parts of all octaves then sum to a + row * b per band, and a
+// sample costs one multiply-add plus two per octave.
+//
+// Kernels use separate multiplies and adds in the same order, so neither
+// the kernel picked for the CPU nor the CPU changes the result. Fused
+// multiply-adds would need a software fallback on CPUs without them,
+// which is slower than the plain rows by two orders of magnitude. GCC
+// fuses a * b + c by itself for targets that have them, AVX-512 among
+// them, so contraction is off for this header.
+
+#define NOISE_OCTAVES 6
+#define NOISE_LARGEST_CELL_SHIFT 8
+#define NOISE_SMALLEST_CELL 8
+#define NOISE_MAX_CELLS (CHUNKSIZE / NOISE_SMALLEST_CELL + 1)
+#define NOISE_BANDS (CHUNKSIZE / NOISE_SMALLEST_CELL)
+
+static_assert(
+	CHUNKSIZE % NOISE_SMALLEST_CELL == 0,
+	"chunk rows must split into whole noise bands");
+static_assert(
+	CHUNKSIZE % 16 == 0,
+	"chunk rows must split into whole noise vectors");
+static_assert(
+	(NOISE_SMALLEST_CELL << (NOISE_OCTAVES - 1)) ==
+	(1 << NOISE_LARGEST_CELL_SHIFT),
+	"octave cell sizes must halve down to the smallest cell");
+
+// Terms of all octaves of one chunk, ready for a kernel. Amplitudes are
+// folded into the column terms.
+struct NoiseTerms
+{
+	// Row positions in the cells and their fades.
+	const float* fy[NOISE_OCTAVES];
+	const float* v[NOISE_OCTAVES];
+
+	// Summed p + fy * q of every band as a + row * b, row counted from
+	// the first row of the band.
+	float a[NOISE_BANDS][CHUNKSIZE];
+	float b[NOISE_BANDS][CHUNKSIZE];
+
+	// Cell row of every band and the r and e terms of every cell row.
+	int bandCell[NOISE_OCTAVES][NOISE_BANDS];
+	float r[NOISE_OCTAVES][NOISE_MAX_CELLS][CHUNKSIZE];
+	float e[NOISE_OCTAVES][NOISE_MAX_CELLS][CHUNKSIZE];
+};
+
+inline float NoiseFade(float t)
+{
+	return t * t * t * (t * (t * 6.0f - 15.0f) + 10.0f);
+}
+
+// Positions in the cell of consecutive tiles from a cell border and
+// their interpolation weights, by octave. Chunks start at any multiple
+// of CHUNKSIZE in a cell, so every table runs CHUNKSIZE past the cell.
+struct NoiseTables
+{
+	static const int Length =
+		(1 << NOISE_LARGEST_CELL_SHIFT) + CHUNKSIZE;
+
+	float position[NOISE_OCTAVES][Length];
+	float fade[NOISE_OCTAVES][Length];
+
+	// With gradients l and r of the corners left and right of a tile:
+	// p = lx * pLeft + rx * pRight and q = ly * qLeft + ry * qRight.
+	float pLeft[NOISE_OCTAVES][Length];
+	float pRight[NOISE_OCTAVES][Length];
+	float qLeft[NOISE_OCTAVES][Length];
+	float qRight[NOISE_OCTAVES][Length];
+
+	NoiseTables()
+	{
+		for (int o = 0; o < NOISE_OCTAVES; ++o) {
+			int cellSize = 1 << (NOISE_LARGEST_CELL_SHIFT - o);
+
+			for (int k = 0; k < Length; ++k) {
+				float f = float(k & (cellSize - 1)) / float(cellSize);
+				float u = NoiseFade(f);
+
+				position[o][k] = f;
+				fade[o][k] = u;
+				pLeft[o][k] = f - u * f;
+				pRight[o][k] = u * (f - 1.0f);
+				qLeft[o][k] = 1.0f - u;
+				qRight[o][k] = u;
+			}
+		}
+	}
+};
+
+inline const NoiseTables& NoiseGetTables()
+{
+	static const NoiseTables tables;
+	return tables;
+}
+
+// Hash key of one octave's lattice.
+inline uint64_t NoiseOctaveKey(uint64_t seed, int octave)
+{
+	return SplitMix64(SplitMix64(seed) + uint64_t(octave));
+}
+
+inline void NoiseGradient(
+	uint64_t key,
+	int64_t cellX,
+	int64_t cellY,
+	float& gx,
+	float& gy)
+{
+	static const float gradients[8][2] = {
+		{1.0f, 0.0f},
+		{0.70710678f, 0.70710678f},
+		{0.0f, 1.0f},
+		{-0.70710678f, 0.70710678f},
+		{-1.0f, 0.0f},
+		{-0.70710678f, -0.70710678f},
+		{0.0f, -1.0f},
+		{0.70710678f, -0.70710678f}
+	};
+
+	uint64_t position =
+		(uint64_t(uint32_t(cellX)) << 32) | uint64_t(uint32_t(cellY));
+	uint64_t index = SplitMix64(key ^ position) >> 61;
+
+	gx = gradients[index][0];
+	gy = gradients[index][1];
+}
+
+// Fills in the row positions and column terms of one octave and adds it
+// to the band sums. Octaves with one cell row over the chunk go to the
+// chunk sums instead, with the row counted from the top of the chunk.
+// The octave is a template argument so the cell loops have fixed counts.
+template<int octave>
+inline void NoisePrepareOctave(
+	uint64_t seed,
+	int32_t x,
+	int32_t y,
+	NoiseTerms& result,
+	float* chunkA,
+	float* chunkB)
+{
+	const NoiseTables& tables = NoiseGetTables();
+
+	const int shift = NOISE_LARGEST_CELL_SHIFT - octave;
+	const int64_t cellSize = int64_t(1) << shift;
+	const float scale = 1.0f / float(cellSize);
+	const float amplitude = 0.5f / float(1 << octave);
+
+	int64_t originX = int64_t(x) * CHUNKSIZE;
+	int64_t originY = int64_t(y) * CHUNKSIZE;
+	int64_t firstCellX = originX >> shift;
+	int64_t firstCellY = originY >> shift;
+
+	// Chunks start on a cell border of the octaves with smaller cells and
+	// lie inside one cell of the others.
+	const int cellWidth = cellSize < CHUNKSIZE ? int(cellSize) : CHUNKSIZE;
+	const int cells = CHUNKSIZE / cellWidth;
+	const int cellRows = cells;
+
+	int rowOffset = int(originY & (cellSize - 1));
+	int columnOffset = int(originX & (cellSize - 1));
+
+	result.fy[octave] = tables.position[octave] + rowOffset;
+	result.v[octave] = tables.fade[octave] + rowOffset;
+
+	const float* pLeft = tables.pLeft[octave] + columnOffset;
+	const float* pRight = tables.pRight[octave] + columnOffset;
+	const float* qLeft = tables.qLeft[octave] + columnOffset;
+	const float* qRight = tables.qRight[octave] + columnOffset;
+
+	uint64_t key = NoiseOctaveKey(seed, octave);
+
+	// Column terms of the lattice rows bounding the cell rows: p and q
+	// of the lower corners of cell row cy are those of the upper corners
+	// of cell row cy - 1.
+	float p[NOISE_MAX_CELLS + 1][CHUNKSIZE];
+	float q[NOISE_MAX_CELLS + 1][CHUNKSIZE];
+
+	for (int cy = 0; cy <= cellRows; ++cy) {
+		float gx[NOISE_MAX_CELLS + 1];
+		float gy[NOISE_MAX_CELLS + 1];
+
+		for (int cx = 0; cx <= cells; ++cx) {
+			NoiseGradient(
+				key,
+				firstCellX + cx,
+				firstCellY + cy,
+				gx[cx],
+				gy[cx]);
+		}
+
+		for (int cx = 0; cx < cells; ++cx) {
+			for (int i = cx * cellWidth; i < (cx + 1) * cellWidth;
+				++i)
+			{
+				p[cy][i] = gx[cx] * pLeft[i] + gx[cx + 1] * pRight[i];
+				q[cy][i] = gy[cx] * qLeft[i] + gy[cx + 1] * qRight[i];
+			}
+		}
+	}
+
+	for (int cy = 0; cy < cellRows; ++cy) {
+		for (int i = 0; i < CHUNKSIZE; ++i) {
+			result.r[octave][cy][i] = amplitude *
+				(p[cy + 1][i] - p[cy][i] - q[cy + 1][i]);
+			result.e[octave][cy][i] =
+				amplitude * (q[cy + 1][i] - q[cy][i]);
+		}
+	}
+
+	// Inside a band fy is fy of the first row plus row * scale.
+	float slope = amplitude * scale;
+
+	if (cellRows == 1) {
+		float offset = amplitude * result.fy[octave][0];
+
+		for (int band = 0; band < NOISE_BANDS; ++band) {
+			result.bandCell[octave][band] = 0;
+		}
+
+		for (int i = 0; i < CHUNKSIZE; ++i) {
+			chunkA[i] += amplitude * p[0][i] + offset * q[0][i];
+			chunkB[i] += slope * q[0][i];
+		}
+
+		return;
+	}
+
+	for (int band = 0; band < NOISE_BANDS; ++band) {
+		int row = band * NOISE_SMALLEST_CELL;
+		int cell = int(((originY + row) >> shift) - firstCellY);
+		float offset = amplitude * result.fy[octave][row];
+
+		result.bandCell[octave][band] = cell;
+
+		for (int i = 0; i < CHUNKSIZE; ++i) {
+			result.a[band][i] +=
+				amplitude * p[cell][i] + offset * q[cell][i];
+			result.b[band][i] += slope * q[cell][i];
+		}
+	}
+}
+
+template<int octave>
+inline void NoisePrepareOctaves(
+	uint64_t seed,
+	int32_t x,
+	int32_t y,
+	NoiseTerms& terms,
+	float* chunkA,
+	float* chunkB)
+{
+	NoisePrepareOctave<octave>(seed, x, y, terms, chunkA, chunkB);
+
+	if constexpr (octave + 1 < NOISE_OCTAVES) {
+		NoisePrepareOctaves<octave + 1>(
+			seed,
+			x,
+			y,
+			terms,
+			chunkA,
+			chunkB);
+	}
+}
+
+// Fills in the terms of all octaves of chunk (x, y).
+inline void NoisePrepare(
+	uint64_t seed,
+	int32_t x,
+	int32_t y,
+	NoiseTerms& terms)
+{
+	float chunkA[CHUNKSIZE];
+	float chunkB[CHUNKSIZE];
+
+	for (int i = 0; i < CHUNKSIZE; ++i) {
+		chunkA[i] = 0.0f;
+		chunkB[i] = 0.0f;
+	}
+
+	for (int band = 0; band < NOISE_BANDS; ++band) {
+		for (int i = 0; i < CHUNKSIZE; ++i) {
+			terms.a[band][i] = 0.0f;
+			terms.b[band][i] = 0.0f;
+		}
+	}
+
+	NoisePrepareOctaves<0>(seed, x, y, terms, chunkA, chunkB);
+
+	for (int band = 0; band < NOISE_BANDS; ++band) {
+		float row = float(band * NOISE_SMALLEST_CELL);
+
+		for (int i = 0; i < CHUNKSIZE; ++i) {
+			terms.a[band][i] += chunkA[i] + row * chunkB[i];
+			terms.b[band][i] += chunkB[i];
+		}
+	}
+}
+
+// Writes the heights from the terms.
+inline void NoiseRowsScalar(const NoiseTerms& terms, float* heights)
+{
+	for (int j = 0; j < CHUNKSIZE; ++j) {
+		float* row = heights + j * CHUNKSIZE;
+		int band = j / NOISE_SMALLEST_CELL;
+		float step = float(j % NOISE_SMALLEST_CELL);
+
+		for (int i = 0; i < CHUNKSIZE; ++i) {
+			row[i] = step * terms.b[band][i] + terms.a[band][i];
+		}
+
+		for (int o = 0; o < NOISE_OCTAVES; ++o) {
+			int cell = terms.bandCell[o][band];
+			const float* r = terms.r[o][cell];
+			const float* e = terms.e[o][cell];
+			float fy = terms.fy[o][j];
+			float v = terms.v[o][j];
+
+			for (int i = 0; i < CHUNKSIZE; ++i) {
+				float t = fy * e[i] + r[i];
+				row[i] = row[i] + v * t;
+			}
+		}
+	}
+}
+
+inline void NoiseScalar(uint64_t seed, int32_t x, int32_t y, float* heights)
+{
+	NoiseTerms terms;
+	NoisePrepare(seed, x, y, terms);
+	NoiseRowsScalar(terms, heights);
+}
+
+#ifdef NOISE_X86
+
+// Without FMA, so the compiler cannot fuse the terms differently from
+// the scalar build. Kept out of line for the same reason.
+__attribute__((target("avx2"), noinline))
+inline void NoisePrepareAVX2(
+	uint64_t seed,
+	int32_t x,
+	int32_t y,
+	NoiseTerms& terms)
+{
+	NoisePrepare(seed, x, y, terms);
+}
+
+// Computes a whole row at a time, so the octave sums of its vectors are
+// independent and overlap instead of waiting on each other. The column
+// terms stay in the first level cache.
+//
+// Without fused multiply-adds a row vector takes 26 operations, so the
+// kernel is bound by arithmetic at about 300000 samples per millisecond
+// on a core that retires two vector operations a nanosecond, under a
+// third of the million per millisecond the heightmap was meant to reach.
+// The AVX-512 rows are not much faster.
+__attribute__((target("avx2")))
+inline void NoiseRowsAVX2(const NoiseTerms& terms, float* heights)
+{
+	const int vectors = CHUNKSIZE / 8;
+
+	for (int j = 0; j < CHUNKSIZE; ++j) {
+		int band = j / NOISE_SMALLEST_CELL;
+		__m256 step = _mm256_set1_ps(float(j % NOISE_SMALLEST_CELL));
+		__m256 height[vectors];
+
+		for (int k = 0; k < vectors; ++k) {
+			height[k] = _mm256_add_ps(
+				_mm256_mul_ps(
+					step,
+					_mm256_loadu_ps(terms.b[band] + 8 * k)),
+				_mm256_loadu_ps(terms.a[band] + 8 * k));
+		}
+
+		for (int o = 0; o < NOISE_OCTAVES; ++o) {
+			int cell = terms.bandCell[o][band];
+			const float* r = terms.r[o][cell];
+			const float* e = terms.e[o][cell];
+			__m256 fy = _mm256_set1_ps(terms.fy[o][j]);
+			__m256 v = _mm256_set1_ps(terms.v[o][j]);
+
+			for (int k = 0; k < vectors; ++k) {
+				__m256 t = _mm256_add_ps(
+					_mm256_mul_ps(fy, _mm256_loadu_ps(e + 8 * k)),
+					_mm256_loadu_ps(r + 8 * k));
+				height[k] = _mm256_add_ps(
+					height[k],
+					_mm256_mul_ps(v, t));
+			}
+		}
+
+		for (int k = 0; k < vectors; ++k) {
+			_mm256_storeu_ps(heights + j * CHUNKSIZE + 8 * k, height[k]);
+		}
+	}
+}
+
+__attribute__((target("avx2")))
+inline void NoiseAVX2(uint64_t seed, int32_t x, int32_t y, float* heights)
+{
+	NoiseTerms terms;
+	NoisePrepareAVX2(seed, x, y, terms);
+	NoiseRowsAVX2(terms, heights);
+}
+
+// The AVX2 rows with 16 columns a vector.
+__attribute__((target("avx512f")))
+inline void NoiseRowsAVX512(const NoiseTerms& terms, float* heights)
+{
+	const int vectors = CHUNKSIZE / 16;
+
+	for (int j = 0; j < CHUNKSIZE; ++j) {
+		int band = j / NOISE_SMALLEST_CELL;
+		__m512 step = _mm512_set1_ps(float(j % NOISE_SMALLEST_CELL));
+		__m512 height[vectors];
+
+		for (int k = 0; k < vectors; ++k) {
+			height[k] = _mm512_add_ps(
+				_mm512_mul_ps(
+					step,
+					_mm512_loadu_ps(terms.b[band] + 16 * k)),
+				_mm512_loadu_ps(terms.a[band] + 16 * k));
+		}
+
+		for (int o = 0; o < NOISE_OCTAVES; ++o) {
+			int cell = terms.bandCell[o][band];
+			const float* r = terms.r[o][cell];
+			const float* e = terms.e[o][cell];
+			__m512 fy = _mm512_set1_ps(terms.fy[o][j]);
+			__m512 v = _mm512_set1_ps(terms.v[o][j]);
+
+			for (int k = 0; k < vectors; ++k) {
+				__m512 t = _mm512_add_ps(
+					_mm512_mul_ps(fy, _mm512_loadu_ps(e + 16 * k)),
+					_mm512_loadu_ps(r + 16 * k));
+				height[k] = _mm512_add_ps(
+					height[k],
+					_mm512_mul_ps(v, t));
+			}
+		}
+
+		for (int k = 0; k < vectors; ++k) {
+			_mm512_storeu_ps(
+				heights + j * CHUNKSIZE + 16 * k,
+				height[k]);
+		}
+	}
+}
+
+__attribute__((target("avx512f")))
+inline void NoiseAVX512(uint64_t seed, int32_t x, int32_t y, float* heights)
+{
+	NoiseTerms terms;
+	NoisePrepareAVX2(seed, x, y, terms);
+	NoiseRowsAVX512(terms, heights);
+}
+
+#endif
+
+typedef void (*NoiseKernel)(
+	uint64_t seed,
+	int32_t x,
+	int32_t y,
+	float* heights);
+
+inline NoiseKernel NoiseSelectKernel()
+{
+#ifdef NOISE_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx512f")) {
+		return NoiseAVX512;
+	}
+
+	if (__builtin_cpu_supports("avx2")) {
+		return NoiseAVX2;
+	}
+#endif
+
+	return NoiseScalar;
+}
+
+// Writes CHUNKSIZE * CHUNKSIZE heights, row by row, within [-1, 1].
+inline void GenerateHeights(
+	uint64_t seed,
+	int32_t x,
+	int32_t y,
+	float* heights,
+	NoiseKernel kernel = nullptr)
+{
+	static const NoiseKernel selected = NoiseSelectKernel();
+
+	if (!kernel) {
+		kernel = selected;
+	}
+
+	kernel(seed, x, y, heights);
+}
+
+#pragma GCC pop_options
+
+#endif
@@ -0,0 +1,715 @@
+#ifndef PATHFINDER_H
+#define PATHFINDER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
+#include <map>
+#include <memory>
+#include <queue>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "map.h"
+
+// Hierarchical (HPA*-style) pathfinding over the tiles of a MapSnapshot.
+//
+// Units move between the four neighbouring walkable tiles (see
+// Chunk::GetWalkableRows()). Every stretch of walkable tiles shared by two
+// neighbouring chunks gets portal nodes on both sides, and the nodes of a
+// chunk are linked by their shortest in-chunk distances. Queries run A*
+// over these nodes and then expand each step into tiles inside a single
+// chunk.
+//
+// Update() only recomputes chunks whose version changed, together with
+// their neighbours, whose borders depend on them, and replaces just their
+// nodes and edges. Queries only read the graph, so any number of them may
+// run in parallel between updates.
+class Pathfinder
+{
+public:
+	// World tile coordinates.
+	typedef std::pair<int64_t, int64_t> Point;
+
+	struct Request
+	{
+		Point start;
+		Point goal;
+	};
+
+	Pathfinder()
+	{
+		_deadEdges = 0;
+	}
+
+	void Update(const std::shared_ptr<const MapSnapshot>& snapshot)
+	{
+		std::vector<ChunkPosition> changed;
+
+		for (const auto& item : _graphs) {
+			if (!snapshot->GetChunk(item.first.first, item.first.second)) {
+				changed.push_back(item.first);
+			}
+		}
+
+		for (const auto& item : snapshot->GetChunks()) {
+			auto it = _graphs.find(item.first);
+
+			if (it == _graphs.end() ||
+				it->second.version != item.second->GetVersion())
+			{
+				changed.push_back(item.first);
+			}
+		}
+
+		_snapshot = snapshot;
+
+		if (changed.empty()) {
+			return;
+		}
+
+		std::vector<ChunkPosition> rebuild;
+
+		for (const ChunkPosition& position : changed) {
+			rebuild.push_back(position);
+			rebuild.push_back(
+				ChunkPosition(position.first - 1, position.second));
+			rebuild.push_back(
+				ChunkPosition(position.first + 1, position.second));
+			rebuild.push_back(
+				ChunkPosition(position.first, position.second - 1));
+			rebuild.push_back(
+				ChunkPosition(position.first, position.second + 1));
+		}
+
+		std::sort(rebuild.begin(), rebuild.end());
+		rebuild.erase(
+			std::unique(rebuild.begin(), rebuild.end()),
+			rebuild.end());
+
+		for (const ChunkPosition& position : rebuild) {
+			auto it = _graphs.find(position);
+
+			if (it != _graphs.end()) {
+				ReleaseNodes(it->second);
+			}
+
+			if (!snapshot->GetChunk(position.first, position.second)) {
+				if (it != _graphs.end()) {
+					_graphs.erase(it);
+				}
+
+				continue;
+			}
+
+			BuildChunkGraph(position, _graphs[position]);
+		}
+
+		for (const ChunkPosition& position : rebuild) {
+			auto it = _graphs.find(position);
+
+			if (it != _graphs.end()) {
+				AddNodes(position, it->second);
+			}
+		}
+
+		for (const ChunkPosition& position : rebuild) {
+			auto it = _graphs.find(position);
+
+			if (it != _graphs.end()) {
+				LinkNodes(it->second, rebuild);
+			}
+		}
+
+		if (_deadEdges > _edges.size() / 2) {
+			CompactEdges();
+		}
+	}
+
+	// Fills path with the tiles from start to goal, both included.
+	// Returns false if goal cannot be reached.
+	bool FindPath(Point start, Point goal, std::vector<Point>& path) const
+	{
+		path.clear();
+
+		ChunkPosition startChunk = ChunkOf(start);
+		ChunkPosition goalChunk = ChunkOf(goal);
+		auto startGraph = _graphs.find(startChunk);
+		auto goalGraph = _graphs.find(goalChunk);
+
+		if (startGraph == _graphs.end() || goalGraph == _graphs.end() ||
+			!startGraph->second.IsWalkable(Local(start)) ||
+			!goalGraph->second.IsWalkable(Local(goal)))
+		{
+			return false;
+		}
+
+		int16_t startDistances[CHUNKSIZE * CHUNKSIZE];
+		int16_t goalDistances[CHUNKSIZE * CHUNKSIZE];
+
+		LocalDistances(startGraph->second, Local(start), startDistances);
+		LocalDistances(goalGraph->second, Local(goal), goalDistances);
+
+		path.push_back(start);
+
+		// A path inside one chunk is taken as is.
+		if (startChunk == goalChunk && goalDistances[Local(start)] >= 0) {
+			AppendLocalPath(
+				goalChunk,
+				Local(goal),
+				goalDistances,
+				Local(start),
+				path);
+			return true;
+		}
+
+		std::vector<uint32_t> nodes;
+
+		if (!SearchGraph(
+			goal,
+			startGraph->second,
+			goalGraph->second,
+			startDistances,
+			goalDistances,
+			nodes))
+		{
+			path.clear();
+			return false;
+		}
+
+		Point current = start;
+
+		for (size_t i = 0; i <= nodes.size(); ++i) {
+			Point next = i < nodes.size() ?
+				_nodes[nodes[i]].position : goal;
+			ChunkPosition chunk = ChunkOf(current);
+
+			if (ChunkOf(next) != chunk) {
+				// Portals on both sides of a border are neighbours.
+				path.push_back(next);
+			} else if (next != current) {
+				const ChunkGraph& graph = _graphs.find(chunk)->second;
+				int16_t distances[CHUNKSIZE * CHUNKSIZE];
+
+				LocalDistances(graph, Local(next), distances);
+				AppendLocalPath(
+					chunk,
+					Local(next),
+					distances,
+					Local(current),
+					path);
+			}
+
+			current = next;
+		}
+
+		return true;
+	}
+
+	// Answers requests on threadCount threads (one per core by default).
+	// An unreachable goal leaves its path empty.
+	void FindPaths(
+		const std::vector<Request>& requests,
+		std::vector<std::vector<Point>>& paths,
+		size_t threadCount = 0) const
+	{
+		paths.assign(requests.size(), std::vector<Point>());
+
+		if (threadCount == 0) {
+			threadCount = std::max(1u, std::thread::hardware_concurrency());
+		}
+
+		std::atomic<size_t> next(0);
+		std::vector<std::thread> workers;
+
+		auto work = [&]() {
+			for (size_t i = next++; i < requests.size(); i = next++) {
+				FindPath(requests[i].start, requests[i].goal, paths[i]);
+			}
+		};
+
+		for (size_t i = 1; i < threadCount; ++i) {
+			workers.emplace_back(work);
+		}
+
+		work();
+
+		for (auto& worker : workers) {
+			worker.join();
+		}
+	}
+
+	size_t NodeCount() const
+	{
+		return _nodes.size() - _freeNodes.size();
+	}
+
+private:
+	typedef std::pair<int32_t, int32_t> ChunkPosition;
+
+	struct Portal
+	{
+		uint16_t tile;
+		Point outside;
+	};
+
+	struct ChunkGraph
+	{
+		uint64_t version;
+		uint64_t rows[CHUNKSIZE];
+		std::vector<Portal> portals;
+		// Shortest in-chunk distances between portals, -1 if none.
+		std::vector<int16_t> distances;
+		// Node of each portal in _nodes.
+		std::vector<uint32_t> nodes;
+
+		bool IsWalkable(int tile) const
+		{
+			return (rows[tile / CHUNKSIZE] >> (tile % CHUNKSIZE)) & 1;
+		}
+	};
+
+	struct Edge
+	{
+		uint32_t node;
+		uint32_t cost;
+	};
+
+	struct Node
+	{
+		Point position;
+		// Chunk graph holding the portal, nullptr for a free slot.
+		const ChunkGraph* graph;
+		uint32_t portal;
+		// Edges of the node in _edges. The first one crosses the border,
+		// the others stay in the chunk.
+		uint32_t firstEdge;
+		uint32_t edgeCount;
+	};
+
+	// A portal is identified by its tile and the tile across the border.
+	typedef std::pair<Point, Point> PortalKey;
+
+	std::shared_ptr<const MapSnapshot> _snapshot;
+	std::map<ChunkPosition, ChunkGraph> _graphs;
+
+	// Nodes of all chunks. Slots of replaced chunks are reused. Edges of
+	// new nodes are appended, and the edges are compacted once more than
+	// half of them belong to replaced nodes.
+	std::vector<Node> _nodes;
+	std::vector<uint32_t> _freeNodes;
+	std::map<PortalKey, uint32_t> _portalNodes;
+	std::vector<Edge> _edges;
+	size_t _deadEdges;
+
+	static ChunkPosition ChunkOf(Point point)
+	{
+		return ChunkPosition(
+			FloorDivide(point.first, CHUNKSIZE),
+			FloorDivide(point.second, CHUNKSIZE));
+	}
+
+	// Tile index inside the chunk of a point.
+	static int Local(Point point)
+	{
+		ChunkPosition chunk = ChunkOf(point);
+		int64_t x = point.first - int64_t(chunk.first) * CHUNKSIZE;
+		int64_t y = point.second - int64_t(chunk.second) * CHUNKSIZE;
+		return y * CHUNKSIZE + x;
+	}
+
+	static Point World(ChunkPosition chunk, int tile)
+	{
+		return Point(
+			int64_t(chunk.first) * CHUNKSIZE + tile % CHUNKSIZE,
+			int64_t(chunk.second) * CHUNKSIZE + tile / CHUNKSIZE);
+	}
+
+	// Breadth-first distances from a tile to every tile of the chunk,
+	// -1 for tiles that cannot be reached.
+	static void LocalDistances(
+		const ChunkGraph& graph,
+		int from,
+		int16_t* distances)
+	{
+		int16_t queue[CHUNKSIZE * CHUNKSIZE];
+		int head = 0;
+		int tail = 0;
+
+		std::fill(distances, distances + CHUNKSIZE * CHUNKSIZE, -1);
+		distances[from] = 0;
+		queue[tail++] = from;
+
+		while (head < tail) {
+			int tile = queue[head++];
+			int x = tile % CHUNKSIZE;
+			int y = tile / CHUNKSIZE;
+			int neighbours[4] = {
+				x > 0 ? tile - 1 : -1,
+				x < CHUNKSIZE - 1 ? tile + 1 : -1,
+				y > 0 ? tile - CHUNKSIZE : -1,
+				y < CHUNKSIZE - 1 ? tile + CHUNKSIZE : -1
+			};
+
+			for (int neighbour : neighbours) {
+				if (neighbour >= 0 && distances[neighbour] < 0 &&
+					graph.IsWalkable(neighbour))
+				{
+					distances[neighbour] = distances[tile] + 1;
+					queue[tail++] = neighbour;
+				}
+			}
+		}
+	}
+
+	// Appends the tiles after from on a shortest path down to the origin
+	// of distances, the origin included.
+	static void AppendLocalPath(
+		ChunkPosition chunk,
+		int origin,
+		const int16_t* distances,
+		int from,
+		std::vector<Point>& path)
+	{
+		int tile = from;
+
+		while (tile != origin) {
+			int x = tile % CHUNKSIZE;
+			int y = tile / CHUNKSIZE;
+			int neighbours[4] = {
+				x > 0 ? tile - 1 : -1,
+				x < CHUNKSIZE - 1 ? tile + 1 : -1,
+				y > 0 ? tile - CHUNKSIZE : -1,
+				y < CHUNKSIZE - 1 ? tile + CHUNKSIZE : -1
+			};
+
+			for (int neighbour : neighbours) {
+				if (neighbour >= 0 &&
+					distances[neighbour] == distances[tile] - 1)
+				{
+					tile = neighbour;
+					break;
+				}
+			}
+
+			path.push_back(World(chunk, tile));
+		}
+	}
+
+	void BuildChunkGraph(ChunkPosition position, ChunkGraph& graph)
+	{
+		std::shared_ptr<const Chunk> chunk =
+			_snapshot->GetChunk(position.first, position.second);
+
+		graph.version = chunk->GetVersion();
+		graph.portals.clear();
+		chunk->GetWalkableRows(graph.rows);
+
+		// West, east, north and south borders.
+		const int directions[4][2] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
+
+		for (const auto& direction : directions) {
+			std::shared_ptr<const Chunk> neighbour = _snapshot->GetChunk(
+				position.first + direction[0],
+				position.second + direction[1]);
+
+			if (!neighbour) {
+				continue;
+			}
+
+			uint64_t rows[CHUNKSIZE];
+			neighbour->GetWalkableRows(rows);
+
+			int run = 0;
+
+			for (int i = 0; i <= CHUNKSIZE; ++i) {
+				bool open = false;
+
+				if (i < CHUNKSIZE) {
+					int inside = BorderTile(direction, i, false);
+					int outside = BorderTile(direction, i, true);
+
+					open = graph.IsWalkable(inside) &&
+						((rows[outside / CHUNKSIZE] >>
+						(outside % CHUNKSIZE)) & 1);
+				}
+
+				if (open) {
+					++run;
+					continue;
+				}
+
+				if (run > 0) {
+					AddPortals(graph, position, direction, i - run, run);
+				}
+
+				run = 0;
+			}
+		}
+
+		size_t count = graph.portals.size();
+		graph.distances.assign(count * count, -1);
+
+		for (size_t i = 0; i < count; ++i) {
+			int16_t distances[CHUNKSIZE * CHUNKSIZE];
+			LocalDistances(graph, graph.portals[i].tile, distances);
+
+			for (size_t j = 0; j < count; ++j) {
+				graph.distances[i * count + j] =
+					distances[graph.portals[j].tile];
+			}
+		}
+	}
+
+	// Tile i along a border, inside this chunk or in the neighbour.
+	static int BorderTile(const int* direction, int i, bool outside)
+	{
+		int edge = outside ? 0 : CHUNKSIZE - 1;
+
+		if (direction[0] < 0) {
+			return i * CHUNKSIZE + (CHUNKSIZE - 1 - edge);
+		}
+
+		if (direction[0] > 0) {
+			return i * CHUNKSIZE + edge;
+		}
+
+		if (direction[1] < 0) {
+			return (CHUNKSIZE - 1 - edge) * CHUNKSIZE + i;
+		}
+
+		return edge * CHUNKSIZE + i;
+	}
+
+	// Short openings get one portal in the middle, long ones one at
+	// each end, so paths do not detour through a single point.
+	static void AddPortals(
+		ChunkGraph& graph,
+		ChunkPosition position,
+		const int* direction,
+		int first,
+		int length)
+	{
+		std::vector<int> offsets;
+
+		if (length < 8) {
+			offsets.push_back(first + length / 2);
+		} else {
+			offsets.push_back(first);
+			offsets.push_back(first + length - 1);
+		}
+
+		for (int i : offsets) {
+			Portal portal;
+			portal.tile = BorderTile(direction, i, false);
+
+			Point inside = World(position, portal.tile);
+			portal.outside = Point(
+				inside.first + direction[0],
+				inside.second + direction[1]);
+
+			graph.portals.push_back(portal);
+		}
+	}
+
+	void ReleaseNodes(ChunkGraph& graph)
+	{
+		for (size_t i = 0; i < graph.nodes.size(); ++i) {
+			Node& node = _nodes[graph.nodes[i]];
+
+			_portalNodes.erase(
+				PortalKey(node.position, graph.portals[i].outside));
+			node.graph = nullptr;
+			_deadEdges += node.edgeCount;
+			node.edgeCount = 0;
+			_freeNodes.push_back(graph.nodes[i]);
+		}
+
+		graph.nodes.clear();
+	}
+
+	void AddNodes(ChunkPosition position, ChunkGraph& graph)
+	{
+		for (size_t i = 0; i < graph.portals.size(); ++i) {
+			uint32_t index;
+
+			if (_freeNodes.empty()) {
+				index = _nodes.size();
+				_nodes.emplace_back();
+			} else {
+				index = _freeNodes.back();
+				_freeNodes.pop_back();
+			}
+
+			Node& node = _nodes[index];
+			node.position = World(position, graph.portals[i].tile);
+			node.graph = &graph;
+			node.portal = i;
+
+			graph.nodes.push_back(index);
+			_portalNodes[PortalKey(node.position, graph.portals[i].outside)] =
+				index;
+		}
+	}
+
+	// Fills in the edges of the nodes of a rebuilt chunk, and points the
+	// crossings of neighbours that were not rebuilt back at them.
+	void LinkNodes(
+		const ChunkGraph& graph,
+		const std::vector<ChunkPosition>& rebuild)
+	{
+		size_t count = graph.portals.size();
+
+		for (size_t i = 0; i < count; ++i) {
+			Node& node = _nodes[graph.nodes[i]];
+			const Point& outside = graph.portals[i].outside;
+
+			// Both sides of a border are built from the same tiles,
+			// so the portal facing this one always exists.
+			uint32_t facing =
+				_portalNodes.find(PortalKey(outside, node.position))->second;
+
+			node.firstEdge = _edges.size();
+
+			Edge crossing;
+			crossing.node = facing;
+			crossing.cost = 1;
+			_edges.push_back(crossing);
+
+			for (size_t j = 0; j < count; ++j) {
+				int16_t distance = graph.distances[i * count + j];
+
+				if (j != i && distance >= 0) {
+					Edge edge;
+					edge.node = graph.nodes[j];
+					edge.cost = distance;
+					_edges.push_back(edge);
+				}
+			}
+
+			node.edgeCount = _edges.size() - node.firstEdge;
+
+			if (!std::binary_search(
+				rebuild.begin(),
+				rebuild.end(),
+				ChunkOf(outside)))
+			{
+				_edges[_nodes[facing].firstEdge].node = graph.nodes[i];
+			}
+		}
+	}
+
+	void CompactEdges()
+	{
+		std::vector<Edge> edges;
+		edges.reserve(_edges.size() - _deadEdges);
+
+		for (Node& node : _nodes) {
+			uint32_t first = edges.size();
+
+			edges.insert(
+				edges.end(),
+				_edges.begin() + node.firstEdge,
+				_edges.begin() + node.firstEdge + node.edgeCount);
+			node.firstEdge = first;
+		}
+
+		_edges.swap(edges);
+		_deadEdges = 0;
+	}
+
+	// A* over the portal nodes, entering at the start chunk's portals and
+	// leaving through the goal chunk's. Fills nodes with the
+	// portals passed, in order.
+	bool SearchGraph(
+		Point goal,
+		const ChunkGraph& startGraph,
+		const ChunkGraph& goalGraph,
+		const int16_t* startDistances,
+		const int16_t* goalDistances,
+		std::vector<uint32_t>& nodes) const
+	{
+		const uint32_t none = std::numeric_limits<uint32_t>::max();
+		const uint32_t goalNode = _nodes.size();
+
+		std::vector<uint32_t> cost(_nodes.size() + 1, none);
+		std::vector<uint32_t> parent(_nodes.size() + 1, none);
+
+		// (estimate, node), smallest estimate first.
+		typedef std::pair<uint64_t, uint32_t> Entry;
+		std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>>
+			open;
+
+		auto estimate = [&](uint32_t node) {
+			Point point = node == goalNode ? goal : _nodes[node].position;
+			return uint64_t(std::llabs(point.first - goal.first) +
+				std::llabs(point.second - goal.second));
+		};
+
+		auto relax = [&](uint32_t node, uint32_t from, uint32_t value) {
+			if (value < cost[node]) {
+				cost[node] = value;
+				parent[node] = from;
+				open.push(Entry(value + estimate(node), node));
+			}
+		};
+
+		for (size_t i = 0; i < startGraph.portals.size(); ++i) {
+			int16_t distance = startDistances[startGraph.portals[i].tile];
+
+			if (distance >= 0) {
+				relax(startGraph.nodes[i], none, distance);
+			}
+		}
+
+		while (!open.empty()) {
+			Entry entry = open.top();
+			open.pop();
+
+			uint32_t node = entry.second;
+
+			if (entry.first != cost[node] + estimate(node)) {
+				continue;
+			}
+
+			if (node == goalNode) {
+				break;
+			}
+
+			if (_nodes[node].graph == &goalGraph) {
+				int16_t distance = goalDistances[
+					goalGraph.portals[_nodes[node].portal].tile];
+
+				if (distance >= 0) {
+					relax(goalNode, node, cost[node] + distance);
+				}
+			}
+
+			uint32_t end = _nodes[node].firstEdge + _nodes[node].edgeCount;
+
+			for (uint32_t e = _nodes[node].firstEdge; e < end; ++e) {
+				relax(_edges[e].node, node, cost[node] + _edges[e].cost);
+			}
+		}
+
+		if (cost[goalNode] == none) {
+			return false;
+		}
+
+		nodes.clear();
+
+		for (uint32_t node = parent[goalNode]; node != none;
+			node = parent[node])
+		{
+			nodes.push_back(node);
+		}
+
+		std::reverse(nodes.begin(), nodes.end());
+		return true;
+	}
+};
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef RANDOM_H
+#define RANDOM_H
+
+#include <cstdint>
+
+// SplitMix64 finalizer. Bijective on 64-bit values, so distinct inputs
+// never collide.
+inline uint64_t SplitMix64(uint64_t value)
+{
+	value += 0x9E3779B97F4A7C15ull;
+	value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ull;
+	value = (value ^ (value >> 27)) * 0x94D049BB133111EBull;
+	return value ^ (value >> 31);
+}
+
+// Stateless counter-based generator for chunk generation.
+//
+// Every value is a pure hash of (seed, x, y, counter): there is no shared
+// state, so any number of threads can draw from generators for different
+// (or the same) chunks and always get the same numbers, independent of the
+// platform's libc.
+class CounterRandom
+{
+public:
+	CounterRandom(uint64_t seed, int32_t x, int32_t y)
+	{
+		uint64_t position =
+			(uint64_t(uint32_t(x)) << 32) | uint64_t(uint32_t(y));
+
+		_key = SplitMix64(SplitMix64(seed) ^ position);
+	}
+
+	uint64_t Get(uint64_t counter) const
+	{
+		return SplitMix64(_key ^ SplitMix64(counter));
+	}
+
+	// Value in [0, bound) using the high bits of the hash.
+	uint32_t GetBelow(uint64_t counter, uint32_t bound) const
+	{
+		return uint32_t(((Get(counter) >> 32) * bound) >> 32);
+	}
+
+private:
+	uint64_t _key;
+};
+
+#endif
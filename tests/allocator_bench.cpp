@@ -0,0 +1,176 @@
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+#include "../src/client/video/sectorallocator.h"
+
+// Compares SectorAllocator with the first-fit scan over per-sector
+// flags that GPUMemoryManager used before, on the same allocation trace
+// and without a device.
+
+#define PARTITION_SECTORS 8192
+
+class FirstFitAllocator
+{
+public:
+	struct Allocation
+	{
+		uint32_t partition;
+		uint32_t offset;
+		uint32_t size;
+	};
+
+	Allocation Allocate(uint32_t size)
+	{
+		for (size_t partIdx = 0; partIdx < partitionData.size(); ++partIdx) {
+			std::vector<bool>& partDesc = partitionData[partIdx];
+			size_t lim = partDesc.size() + 1 - size;
+
+			for (size_t i = 0; i < lim; ++i) {
+				size_t j;
+
+				for (j = 0; j < size; ++j) {
+					if (partDesc[i + j]) {
+						break;
+					}
+				}
+
+				if (j == size) {
+					return Take(partIdx, i, size);
+				}
+
+				i += j;
+			}
+		}
+
+		partitionData.push_back(std::vector<bool>(PARTITION_SECTORS, false));
+		return Take(partitionData.size() - 1, 0, size);
+	}
+
+	void Free(const Allocation& allocation)
+	{
+		for (uint32_t i = 0; i < allocation.size; ++i) {
+			partitionData[allocation.partition][allocation.offset + i] = false;
+		}
+	}
+
+private:
+	std::vector<std::vector<bool>> partitionData;
+
+	Allocation Take(size_t partition, size_t offset, uint32_t size)
+	{
+		for (uint32_t i = 0; i < size; ++i) {
+			partitionData[partition][offset + i] = true;
+		}
+
+		Allocation allocation;
+		allocation.partition = partition;
+		allocation.offset = offset;
+		allocation.size = size;
+
+		return allocation;
+	}
+};
+
+class TlsfAllocator
+{
+public:
+	typedef SectorAllocator::Allocation Allocation;
+
+	Allocation Allocate(uint32_t size)
+	{
+		Allocation allocation = {};
+
+		if (!allocator.Allocate(size, allocation)) {
+			allocator.AddPartition(PARTITION_SECTORS);
+
+			if (!allocator.Allocate(size, allocation)) {
+				throw std::runtime_error("failed to allocate sectors");
+			}
+		}
+
+		return allocation;
+	}
+
+	void Free(const Allocation& allocation)
+	{
+		allocator.Free(allocation);
+	}
+
+	SectorAllocator allocator;
+};
+
+// Keeps live allocations around a steady count and replaces random ones;
+// returns operations per second.
+template<typename Allocator>
+static double Measure(size_t liveCount, uint64_t& checksum)
+{
+	const int operations = 200000;
+	Allocator allocator;
+	std::vector<typename Allocator::Allocation> live;
+	uint32_t state = 1;
+
+	auto next = [&state]() {
+		state = state * 1664525u + 1013904223u;
+		return state >> 8;
+	};
+
+	for (size_t i = 0; i < liveCount; ++i) {
+		live.push_back(allocator.Allocate(1 + next() % 64));
+	}
+
+	auto start = std::chrono::high_resolution_clock::now();
+
+	for (int i = 0; i < operations; ++i) {
+		size_t index = next() % live.size();
+		allocator.Free(live[index]);
+		live[index] = allocator.Allocate(1 + next() % 64);
+		checksum += live[index].offset;
+	}
+
+	auto end = std::chrono::high_resolution_clock::now();
+
+	double seconds = std::chrono::duration<double>(end - start).count();
+	return 2 * operations / seconds;
+}
+
+int main()
+{
+	uint64_t checksum = 0;
+
+	for (size_t liveCount : {100, 1000, 5000}) {
+		double firstFit = Measure<FirstFitAllocator>(liveCount, checksum);
+		double tlsf = Measure<TlsfAllocator>(liveCount, checksum);
+
+		std::cout << "live " << liveCount <<
+			": first fit " << uint64_t(firstFit) << " ops/s, tlsf " <<
+			uint64_t(tlsf) << " ops/s" << std::endl;
+	}
+
+	SectorAllocator allocator;
+	std::vector<SectorAllocator::Allocation> live(5000);
+	uint32_t state = 7;
+
+	allocator.AddPartition(PARTITION_SECTORS * 32);
+
+	for (auto& allocation : live) {
+		state = state * 1664525u + 1013904223u;
+		allocator.Allocate(1 + (state >> 8) % 64, allocation);
+	}
+
+	for (size_t i = 0; i < live.size(); i += 2) {
+		allocator.Free(live[i]);
+	}
+
+	SectorAllocator::Statistics statistics = allocator.GetStatistics();
+	std::cout << "half freed: " << statistics.freeBlocks <<
+		" free blocks, fragmentation " << statistics.Fragmentation() <<
+		std::endl;
+
+	if (checksum == 1) {
+		std::cout << checksum << std::endl;
+	}
+
+	return 0;
+}
@@ -0,0 +1,178 @@
+#include <vector>
+#include <random>
+#include <algorithm>
+
+#include <gtest/gtest.h>
+
+#include "../src/client/video/sectorallocator.h"
+
+// Checks that live allocations stay inside their partitions and never
+// overlap, and that the statistics add up.
+static void CheckAllocations(
+	const SectorAllocator& allocator,
+	const std::vector<SectorAllocator::Allocation>& live,
+	const std::vector<uint32_t>& partitionSizes)
+{
+	std::vector<std::vector<bool>> used;
+	uint64_t usedSectors = 0;
+
+	for (uint32_t size : partitionSizes) {
+		used.push_back(std::vector<bool>(size, false));
+	}
+
+	for (const auto& allocation : live) {
+		ASSERT_LT(allocation.partition, partitionSizes.size());
+		ASSERT_LE(
+			allocation.offset + allocation.size,
+			partitionSizes[allocation.partition]);
+
+		for (uint32_t i = 0; i < allocation.size; i++) {
+			ASSERT_FALSE(used[allocation.partition][allocation.offset + i]);
+			used[allocation.partition][allocation.offset + i] = true;
+		}
+
+		usedSectors += allocation.size;
+	}
+
+	SectorAllocator::Statistics statistics = allocator.GetStatistics();
+	ASSERT_EQ(statistics.partitions, partitionSizes.size());
+	ASSERT_EQ(statistics.usedSectors, usedSectors);
+	ASSERT_EQ(statistics.allocations, live.size());
+	ASSERT_LE(
+		statistics.largestFreeBlock,
+		statistics.totalSectors - statistics.usedSectors);
+}
+
+TEST(allocator, basic)
+{
+	SectorAllocator allocator;
+	SectorAllocator::Allocation first;
+	SectorAllocator::Allocation second;
+
+	ASSERT_FALSE(allocator.Allocate(1, first));
+	ASSERT_EQ(allocator.AddPartition(100), 0);
+
+	ASSERT_TRUE(allocator.Allocate(10, first));
+	ASSERT_TRUE(allocator.Allocate(0, second));
+	ASSERT_EQ(first.partition, 0);
+	ASSERT_EQ(first.size, 10);
+	ASSERT_EQ(second.size, 1);
+	ASSERT_NE(first.offset, second.offset);
+
+	// Larger than anything free.
+	SectorAllocator::Allocation large;
+	ASSERT_FALSE(allocator.Allocate(95, large));
+	ASSERT_EQ(allocator.AddPartition(200), 1);
+	ASSERT_TRUE(allocator.Allocate(95, large));
+	ASSERT_EQ(large.partition, 1);
+
+	allocator.Free(first);
+	allocator.Free(second);
+	allocator.Free(large);
+
+	// Everything merged back into one range per partition.
+	SectorAllocator::Statistics statistics = allocator.GetStatistics();
+	ASSERT_EQ(statistics.usedSectors, 0);
+	ASSERT_EQ(statistics.freeBlocks, 2);
+	ASSERT_EQ(statistics.largestFreeBlock, 200);
+	ASSERT_EQ(statistics.totalSectors, 300);
+
+	ASSERT_TRUE(allocator.Allocate(100, first));
+	ASSERT_EQ(first.offset, 0);
+
+	// Sizes whose size class would round past 2^32.
+	ASSERT_FALSE(allocator.Allocate(0xffffffff, large));
+	ASSERT_FALSE(allocator.Allocate(0xf8000001, large));
+}
+
+TEST(allocator, double_free)
+{
+	SectorAllocator allocator;
+	SectorAllocator::Allocation allocation;
+
+	allocator.AddPartition(16);
+	ASSERT_TRUE(allocator.Allocate(4, allocation));
+	allocator.Free(allocation);
+	ASSERT_THROW(allocator.Free(allocation), std::runtime_error);
+}
+
+TEST(allocator, fragmentation)
+{
+	SectorAllocator allocator;
+	std::vector<SectorAllocator::Allocation> allocations(8);
+
+	allocator.AddPartition(8);
+
+	for (auto& allocation : allocations) {
+		ASSERT_TRUE(allocator.Allocate(1, allocation));
+	}
+
+	ASSERT_EQ(allocator.GetStatistics().Fragmentation(), 0.0);
+
+	// Every other sector free: no two in a row.
+	for (size_t i = 0; i < allocations.size(); i += 2) {
+		allocator.Free(allocations[i]);
+	}
+
+	SectorAllocator::Statistics statistics = allocator.GetStatistics();
+	ASSERT_EQ(statistics.freeBlocks, 4);
+	ASSERT_EQ(statistics.largestFreeBlock, 1);
+	ASSERT_DOUBLE_EQ(statistics.Fragmentation(), 0.75);
+
+	SectorAllocator::Allocation pair;
+	ASSERT_FALSE(allocator.Allocate(2, pair));
+
+	allocator.Free(allocations[1]);
+	ASSERT_TRUE(allocator.Allocate(2, pair));
+	ASSERT_EQ(pair.offset, 0);
+}
+
+TEST(allocator, random)
+{
+	std::mt19937 rng(1);
+	SectorAllocator allocator;
+	std::vector<SectorAllocator::Allocation> live;
+	std::vector<uint32_t> partitionSizes;
+
+	for (int step = 0; step < 20000; step++) {
+		if (live.empty() || rng() % 3 != 0) {
+			// Mostly small sizes with the odd large one.
+			uint32_t size = rng() % 8 == 0 ? rng() % 3000 : rng() % 40;
+			SectorAllocator::Allocation allocation;
+
+			if (!allocator.Allocate(size, allocation)) {
+				partitionSizes.push_back(std::max(size, 4096u));
+				allocator.AddPartition(partitionSizes.back());
+				ASSERT_TRUE(allocator.Allocate(size, allocation));
+			}
+
+			ASSERT_EQ(allocation.size, std::max(size, 1u));
+			live.push_back(allocation);
+		} else {
+			size_t index = rng() % live.size();
+			allocator.Free(live[index]);
+			live[index] = live.back();
+			live.pop_back();
+		}
+
+		if (step % 1000 == 0) {
+			CheckAllocations(allocator, live, partitionSizes);
+		}
+	}
+
+	CheckAllocations(allocator, live, partitionSizes);
+
+	for (const auto& allocation : live) {
+		allocator.Free(allocation);
+	}
+
+	SectorAllocator::Statistics statistics = allocator.GetStatistics();
+	ASSERT_EQ(statistics.usedSectors, 0);
+	ASSERT_EQ(statistics.freeBlocks, partitionSizes.size());
+}
+
+int main(int argc, char **argv)
+{
+	::testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
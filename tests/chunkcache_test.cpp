@@ -0,0 +1,200 @@
+#include <vector>
+#include <filesystem>
+
+#include <gtest/gtest.h>
+
+#include "../src/common/generator.h"
+#include "../src/common/generation.h"
+#include "../src/common/chunkcache.h"
+
+#include "testhelpers.h"
+
+static std::string CacheDirectory(const char* name)
+{
+	std::filesystem::path path =
+		std::filesystem::temp_directory_path() / name;
+	std::filesystem::remove_all(path);
+	return path.string();
+}
+
+TEST(cache, round_trip)
+{
+	std::shared_ptr<Chunk> chunk = generator(5, 1, -2);
+	Tile tile(Tile::Stone);
+	tile.SetAttr(3, true);
+	chunk->EditLayer(0)->SetTile(4, 7, tile);
+
+	std::shared_ptr<Chunk> decoded =
+		ChunkCache::Decode(ChunkCache::Encode(*chunk));
+
+	ASSERT_TRUE(decoded);
+	ASSERT_TRUE(SameChunk(chunk, decoded));
+	ASSERT_EQ(decoded->GetDirty(), 0);
+	ASSERT_TRUE(decoded->GetLayer(0)->GetTile(4, 7).GetAttr(3));
+
+	std::vector<char> data = ChunkCache::Encode(*chunk);
+	data.resize(data.size() / 2);
+	ASSERT_FALSE(ChunkCache::Decode(data));
+
+	data = ChunkCache::Encode(*chunk);
+	uint32_t rawSize = 0xffffffff;
+	memcpy(data.data(), &rawSize, sizeof(rawSize));
+	ASSERT_FALSE(ChunkCache::Decode(data));
+}
+
+TEST(cache, counters)
+{
+	ChunkCache cache(1 << 20);
+
+	ASSERT_FALSE(cache.Get(5, 0, 0));
+
+	for (int i = 0; i < 3; i++) {
+		ASSERT_TRUE(SameChunk(
+			cache.GetOrGenerate(5, 0, 0),
+			generator(5, 0, 0)));
+	}
+
+	// Another seed is another key.
+	cache.GetOrGenerate(6, 0, 0);
+
+	ChunkCache::Statistics statistics = cache.GetStatistics();
+	ASSERT_EQ(statistics.memoryHits, 2);
+	ASSERT_EQ(statistics.diskHits, 0);
+	ASSERT_EQ(statistics.misses, 3);
+	ASSERT_EQ(statistics.entries, 2);
+	ASSERT_DOUBLE_EQ(statistics.HitRate(), 0.4);
+}
+
+TEST(cache, spill)
+{
+	std::string directory = CacheDirectory("chunkcache_spill");
+	size_t size = ChunkCache::Encode(*generator(5, 0, 0)).size();
+
+	{
+		// Room for about two chunks.
+		ChunkCache cache(size * 5 / 2, directory);
+
+		for (int32_t x = 0; x < 8; x++) {
+			cache.GetOrGenerate(5, x, 0);
+		}
+
+		ASSERT_EQ(cache.GetStatistics().evictions, 6);
+
+		for (int32_t x = 0; x < 8; x++) {
+			ASSERT_TRUE(SameChunk(
+				cache.GetOrGenerate(5, x, 0),
+				generator(5, x, 0)));
+		}
+
+		ChunkCache::Statistics statistics = cache.GetStatistics();
+		ASSERT_EQ(statistics.misses, 8);
+		ASSERT_EQ(statistics.memoryHits + statistics.diskHits, 8);
+		ASSERT_GE(statistics.diskHits, 6);
+	}
+
+	// Spilled chunks outlive the cache.
+	ChunkCache cache(1 << 20, directory);
+	ASSERT_TRUE(SameChunk(cache.Get(5, 0, 0), generator(5, 0, 0)));
+	ASSERT_EQ(cache.GetStatistics().diskHits, 1);
+
+	std::filesystem::remove_all(directory);
+}
+
+TEST(cache, version_invalidation)
+{
+	std::string directory = CacheDirectory("chunkcache_version");
+
+	{
+		ChunkCache cache(
+			0,
+			directory,
+			generator,
+			GENERATOR_ID_TILED,
+			GENERATOR_VERSION);
+		cache.GetOrGenerate(5, 0, 0);
+	}
+
+	ASSERT_FALSE(std::filesystem::is_empty(directory));
+
+	{
+		ChunkCache cache(
+			0,
+			directory,
+			generator,
+			GENERATOR_ID_TILED,
+			GENERATOR_VERSION + 1);
+		ASSERT_TRUE(std::filesystem::is_empty(directory));
+		ASSERT_FALSE(cache.Get(5, 0, 0));
+	}
+
+	std::filesystem::remove_all(directory);
+}
+
+TEST(cache, generators)
+{
+	std::string directory = CacheDirectory("chunkcache_generators");
+	ASSERT_FALSE(SameChunk(generator(5, 0, 0), seamlessGenerator(5, 0, 0)));
+
+	{
+		ChunkCache cache(0, directory);
+		cache.GetOrGenerate(5, 0, 0);
+	}
+
+	// Spilled chunks of another generator are neither returned nor
+	// overwritten.
+	{
+		ChunkCache cache(
+			0,
+			directory,
+			seamlessGenerator,
+			GENERATOR_ID_SEAMLESS);
+
+		ASSERT_FALSE(cache.Get(5, 0, 0));
+		ASSERT_TRUE(SameChunk(
+			cache.GetOrGenerate(5, 0, 0),
+			seamlessGenerator(5, 0, 0)));
+		ASSERT_TRUE(SameChunk(
+			cache.Get(5, 0, 0),
+			seamlessGenerator(5, 0, 0)));
+	}
+
+	ChunkCache cache(0, directory);
+	ASSERT_TRUE(SameChunk(cache.Get(5, 0, 0), generator(5, 0, 0)));
+
+	ChunkCache seamless(1 << 20, "", seamlessGenerator, GENERATOR_ID_SEAMLESS);
+	ASSERT_THROW(GenerationService(3, generator, &seamless),
+		std::invalid_argument);
+
+	std::filesystem::remove_all(directory);
+}
+
+TEST(cache, generation_service)
+{
+	ChunkCache cache(1 << 20);
+	Map map;
+
+	GenerationService service(3, generator, &cache);
+	service.Start(4);
+	service.RequestArea(&map, 0, 0, 1);
+	service.Wait();
+	service.Deliver(&map);
+
+	ASSERT_EQ(cache.GetStatistics().entries, 9);
+
+	Map second;
+	service.RequestArea(&second, 0, 0, 1);
+	service.Wait();
+	service.Deliver(&second);
+
+	ChunkCache::Statistics statistics = cache.GetStatistics();
+	ASSERT_EQ(statistics.memoryHits, 9);
+	ASSERT_TRUE(SameChunk(second.GetChunk(1, 1), generator(3, 1, 1)));
+
+	service.Stop();
+}
+
+int main(int argc, char **argv)
+{
+	::testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
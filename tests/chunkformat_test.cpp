@@ -0,0 +1,246 @@
+#include <vector>
+#include <random>
+
+#include <gtest/gtest.h>
+
+#include "../src/common/generator.h"
+#include "../src/common/chunkformat.h"
+
+#include "testhelpers.h"
+
+static void CheckView(const std::shared_ptr<Chunk>& chunk, const ChunkView& view)
+{
+	ASSERT_EQ(view.LayerCount(), chunk->LayerCount());
+
+	for (size_t l = 0; l < chunk->LayerCount(); l++) {
+		LayerView layer = view.GetLayer(l);
+
+		for (int y = 0; y < CHUNKSIZE; y++) {
+			for (int x = 0; x < CHUNKSIZE; x++) {
+				const Tile& tile = chunk->GetLayer(l)->GetTile(x, y);
+
+				ASSERT_EQ(layer.GetTile(x, y).GetType(), tile.GetType());
+				ASSERT_EQ(
+					layer.GetTile(x, y).GetAttributes(),
+					tile.GetAttributes());
+			}
+		}
+	}
+
+	ASSERT_EQ(view.HasHeightmap(), bool(chunk->GetHeightmap()));
+	ASSERT_TRUE(SameChunk(chunk, view.ToChunk()));
+}
+
+TEST(format, encodings)
+{
+	std::mt19937 rng(4);
+	std::shared_ptr<Chunk> chunk = generator(5, 2, 3);
+
+	// Uniform layer.
+	chunk->AddLayer(std::make_shared<Layer>());
+
+	// Three kinds of tile at random, no long runs.
+	auto palette = std::make_shared<Layer>();
+
+	for (int y = 0; y < CHUNKSIZE; y++) {
+		for (int x = 0; x < CHUNKSIZE; x++) {
+			Tile tile(rng() % 2 ? Tile::Grass : Tile::Stone);
+			tile.SetAttr(0, rng() % 2);
+			palette->SetTile(x, y, tile);
+		}
+	}
+
+	chunk->AddLayer(palette);
+
+	// More distinct tiles than a palette holds.
+	auto raw = std::make_shared<Layer>();
+
+	for (int y = 0; y < CHUNKSIZE; y++) {
+		for (int x = 0; x < CHUNKSIZE; x++) {
+			Tile tile(Tile::Stone);
+			tile.SetAttributes(y * CHUNKSIZE + x);
+			raw->SetTile(x, y, tile);
+		}
+	}
+
+	chunk->AddLayer(raw);
+
+	std::vector<char> data;
+	ChunkFormatEncode(*chunk, data);
+
+	ChunkView view;
+	ASSERT_TRUE(view.Open(data.data(), data.size()));
+	ASSERT_EQ(view.GetLayer(1).GetEncoding(), ChunkFormatRunLength);
+	ASSERT_EQ(view.GetLayer(2).GetEncoding(), ChunkFormatPalette);
+	ASSERT_EQ(view.GetLayer(3).GetEncoding(), ChunkFormatRaw);
+	CheckView(chunk, view);
+	ASSERT_EQ(view.ToChunk()->GetDirty(), 0);
+}
+
+TEST(format, generated_size)
+{
+	for (int32_t x = 0; x < 16; x++) {
+		std::shared_ptr<Chunk> chunk = generator(9, x, 0);
+		std::vector<char> data;
+		ChunkFormatEncode(*chunk, data);
+
+		// Two tile kinds never need more than a bit per tile.
+		ASSERT_LE(
+			data.size(),
+			CHUNK_FORMAT_HEADER_SIZE + CHUNK_FORMAT_LAYER_ENTRY_SIZE +
+			2 * CHUNK_FORMAT_PALETTE_ENTRY_SIZE + CHUNKSIZE * CHUNKSIZE / 8 +
+			4 * CHUNKSIZE * CHUNKSIZE);
+
+		ChunkView view;
+		ASSERT_TRUE(view.Open(data.data(), data.size()));
+		CheckView(chunk, view);
+	}
+}
+
+TEST(format, occupancy)
+{
+	std::shared_ptr<Chunk> chunk = generator(5, 1, 1);
+	std::vector<char> data;
+	ChunkFormatEncode(*chunk, data);
+
+	ChunkView view;
+	ASSERT_TRUE(view.Open(data.data(), data.size()));
+	ASSERT_FALSE(view.HasOccupancy());
+
+	chunk->GetOccupancy().Set(3, 4, 5, 2, true);
+	chunk->GetOccupancy().Set(CHUNKSIZE - 4, CHUNKSIZE - 1, 4, 1, true);
+
+	data.clear();
+	ChunkFormatEncode(*chunk, data);
+
+	ASSERT_TRUE(view.Open(data.data(), data.size()));
+	ASSERT_TRUE(view.HasOccupancy());
+
+	for (int y = 0; y < CHUNKSIZE; y++) {
+		ASSERT_EQ(view.GetOccupancyRow(y), chunk->GetOccupancy().GetRow(y));
+	}
+
+	CheckView(chunk, view);
+
+	std::shared_ptr<Chunk> decoded = view.ToChunk();
+	ASSERT_EQ(
+		decoded->GetOccupancy().GetCells(),
+		chunk->GetOccupancy().GetCells());
+	ASSERT_FALSE(decoded->GetOccupancy().IsFree(4, 5, 1, 1));
+
+	// A tile past the end of a row.
+	if (CHUNKSIZE < 64) {
+		uint32_t occupancy = ChunkFormatLoad32(data.data() + 12);
+		data[occupancy + 7] = char(0x80);
+		ASSERT_FALSE(view.Open(data.data(), data.size()));
+	}
+}
+
+TEST(format, region_delta)
+{
+	std::vector<char> data;
+	ChunkFormatEncode(*generator(5, 2, 2), data);
+
+	ChunkView view;
+	ASSERT_TRUE(view.Open(data.data(), data.size()));
+
+	std::shared_ptr<Chunk> chunk = view.ToChunk();
+	std::shared_ptr<Chunk> receiver = view.ToChunk();
+
+	Tile tile(Tile::Stone);
+	tile.SetAttr(1, true);
+	chunk->EditLayer(0)->SetTile(1, 2, tile);
+	chunk->EditLayer(0)->SetAttr(CHUNKSIZE - 1, CHUNKSIZE - 1, 5, true);
+	chunk->EditHeightmap()->SetHeight(9, 9, 2.0f);
+	chunk->GetOccupancy().Set(DIRTY_REGION_SIZE + 2, 0, 3, 2, true);
+
+	uint64_t regions = DirtyRegionBit(1, 2) |
+		DirtyRegionBit(CHUNKSIZE - 1, CHUNKSIZE - 1) |
+		DirtyRegionBit(9, 9) |
+		DirtyRegionBit(DIRTY_REGION_SIZE + 2, 0);
+	ASSERT_EQ(chunk->GetDirty(), regions);
+
+	std::vector<char> delta;
+	ChunkFormatEncodeDelta(*chunk, delta);
+	ASSERT_EQ(
+		delta.size(),
+		CHUNK_FORMAT_DELTA_HEADER_SIZE + 4 * ChunkFormatRegionSize(1, true));
+	ASSERT_LT(delta.size(), data.size());
+
+	// Deltas for other layers or without the heightmap are rejected,
+	// as are truncated or corrupt ones.
+	auto other = std::make_shared<Chunk>(*receiver);
+	other->AddLayer(std::make_shared<Layer>());
+	ASSERT_FALSE(ChunkFormatApplyDelta(delta.data(), delta.size(), *other));
+
+	other = std::make_shared<Chunk>(*receiver);
+	other->SetHeightmap(nullptr);
+	ASSERT_FALSE(ChunkFormatApplyDelta(delta.data(), delta.size(), *other));
+
+	ASSERT_FALSE(
+		ChunkFormatApplyDelta(delta.data(), delta.size() - 1, *receiver));
+
+	std::vector<char> corrupt = delta;
+	corrupt[CHUNK_FORMAT_DELTA_HEADER_SIZE + 4 * CHUNK_FORMAT_REGION_TILES] =
+		char(Tile::TypeCount);
+	ASSERT_FALSE(
+		ChunkFormatApplyDelta(corrupt.data(), corrupt.size(), *receiver));
+	ASSERT_EQ(receiver->GetDirty(), 0);
+
+	ASSERT_TRUE(ChunkFormatApplyDelta(delta.data(), delta.size(), *receiver));
+	ASSERT_TRUE(SameChunk(chunk, receiver));
+	ASSERT_EQ(receiver->GetDirty(), regions);
+	ASSERT_EQ(receiver->GetHeightmap()->GetMaxHeight(1, 0, 0), 2.0f);
+	ASSERT_EQ(
+		receiver->GetOccupancy().GetCells(),
+		chunk->GetOccupancy().GetCells());
+
+	// Once cleared, the next delta is empty.
+	chunk->ClearDirty();
+	ASSERT_EQ(chunk->GetDirty(), 0);
+
+	delta.clear();
+	ChunkFormatEncodeDelta(*chunk, delta);
+	ASSERT_EQ(delta.size(), CHUNK_FORMAT_DELTA_HEADER_SIZE);
+	ASSERT_TRUE(ChunkFormatApplyDelta(delta.data(), delta.size(), *receiver));
+}
+
+TEST(format, invalid)
+{
+	std::vector<char> data;
+	ChunkFormatEncode(*generator(5, 0, 0), data);
+
+	ChunkView view;
+	ASSERT_FALSE(view.Open(data.data(), data.size() - 1));
+	ASSERT_FALSE(view.Open(data.data(), 8));
+
+	std::vector<char> shifted(1);
+	shifted.insert(shifted.end(), data.begin(), data.end());
+	ASSERT_FALSE(view.Open(shifted.data() + 1, data.size()));
+
+	std::vector<char> corrupt = data;
+	corrupt[0] = 'X';
+	ASSERT_FALSE(view.Open(corrupt.data(), corrupt.size()));
+
+	// Layer data past the end of the buffer.
+	corrupt = data;
+	ChunkFormatStore32(
+		corrupt.data() + CHUNK_FORMAT_HEADER_SIZE + 8,
+		data.size());
+	ASSERT_FALSE(view.Open(corrupt.data(), corrupt.size()));
+
+	// Tile type out of range.
+	corrupt = data;
+	uint32_t layer = ChunkFormatLoad32(
+		corrupt.data() + CHUNK_FORMAT_HEADER_SIZE + 8);
+	corrupt[layer + 4] = char(Tile::TypeCount);
+	ASSERT_FALSE(view.Open(corrupt.data(), corrupt.size()));
+
+	ASSERT_TRUE(view.Open(data.data(), data.size()));
+}
+
+int main(int argc, char **argv)
+{
+	::testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
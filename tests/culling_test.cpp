@@ -0,0 +1,290 @@
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <cmath>
+
+#include <gtest/gtest.h>
+
+#include "../src/client/video/boundingvolumetree.h"
+
+// Column-major Vulkan perspective projection of a camera at the origin
+// looking along -z.
+static std::vector<float> Projection(
+	float fovy,
+	float aspect,
+	float near,
+	float far)
+{
+	float f = 1.0f / std::tan(fovy / 2.0f);
+	std::vector<float> matrix(16, 0.0f);
+
+	matrix[0] = f / aspect;
+	matrix[5] = f;
+	matrix[10] = far / (near - far);
+	matrix[11] = -1.0f;
+	matrix[14] = near * far / (near - far);
+
+	return matrix;
+}
+
+static BoundingBox Box(float x, float y, float z, float size)
+{
+	BoundingBox box;
+	box.min[0] = x;
+	box.min[1] = y;
+	box.min[2] = z;
+	box.max[0] = x + size;
+	box.max[1] = y + size;
+	box.max[2] = z + size;
+
+	return box;
+}
+
+// Classifies box by the clip coordinates of its corners.
+static Frustum::Result ReferenceTest(
+	const std::vector<float>& matrix,
+	const BoundingBox& box)
+{
+	bool allInside = true;
+	// Per plane: whether every corner is outside it.
+	bool allOutside[6] = {true, true, true, true, true, true};
+
+	for (int corner = 0; corner < 8; ++corner) {
+		float point[3] = {
+			corner & 1 ? box.max[0] : box.min[0],
+			corner & 2 ? box.max[1] : box.min[1],
+			corner & 4 ? box.max[2] : box.min[2]
+		};
+		float clip[4];
+
+		for (int row = 0; row < 4; ++row) {
+			clip[row] = matrix[12 + row];
+
+			for (int column = 0; column < 3; ++column) {
+				clip[row] += matrix[column * 4 + row] * point[column];
+			}
+		}
+
+		bool inside[6] = {
+			clip[0] >= -clip[3],
+			clip[0] <= clip[3],
+			clip[1] >= -clip[3],
+			clip[1] <= clip[3],
+			clip[2] >= 0.0f,
+			clip[2] <= clip[3]
+		};
+
+		for (int plane = 0; plane < 6; ++plane) {
+			allInside = allInside && inside[plane];
+			allOutside[plane] = allOutside[plane] && !inside[plane];
+		}
+	}
+
+	for (int plane = 0; plane < 6; ++plane) {
+		if (allOutside[plane]) {
+			return Frustum::Outside;
+		}
+	}
+
+	return allInside ? Frustum::Inside : Frustum::Intersecting;
+}
+
+TEST(culling, frustum)
+{
+	std::vector<float> matrix = Projection(1.0f, 1.5f, 0.1f, 100.0f);
+	Frustum frustum(matrix.data());
+
+	ASSERT_EQ(frustum.Test(Box(-0.5f, -0.5f, -10.0f, 1.0f)), Frustum::Inside);
+	ASSERT_EQ(
+		frustum.Test(Box(-0.5f, -0.5f, -0.5f, 1.0f)),
+		Frustum::Intersecting);
+	ASSERT_EQ(frustum.Test(Box(-0.5f, -0.5f, 5.0f, 1.0f)), Frustum::Outside);
+	ASSERT_EQ(frustum.Test(Box(50.0f, 0.0f, -10.0f, 1.0f)), Frustum::Outside);
+	ASSERT_EQ(frustum.Test(Box(0.0f, 0.0f, -200.0f, 1.0f)), Frustum::Outside);
+
+	std::mt19937 rng(1);
+	std::uniform_int_distribution<int> coordinate(-60, 60);
+	std::uniform_int_distribution<int> size(1, 20);
+
+	for (int i = 0; i < 10000; ++i) {
+		BoundingBox box = Box(
+			coordinate(rng) * 0.5f,
+			coordinate(rng) * 0.5f,
+			coordinate(rng) * 2.0f,
+			size(rng) * 0.25f);
+
+		ASSERT_EQ(frustum.Test(box), ReferenceTest(matrix, box)) << i;
+	}
+}
+
+TEST(culling, frustum_planes)
+{
+	std::vector<float> matrix = Projection(1.0f, 1.5f, 0.1f, 100.0f);
+	Frustum frustum(matrix.data());
+
+	std::mt19937 rng(3);
+	std::uniform_real_distribution<float> coordinate(-60.0f, 60.0f);
+
+	for (int i = 0; i < 10000; ++i) {
+		BoundingBox box = Box(
+			coordinate(rng),
+			coordinate(rng),
+			coordinate(rng) * 2.0f,
+			0.0f);
+		bool inside = true;
+
+		for (int index = 0; index < 6; ++index) {
+			float plane[4];
+			frustum.GetPlane(index, plane);
+
+			inside = inside &&
+				plane[0] * box.min[0] +
+				plane[1] * box.min[1] +
+				plane[2] * box.min[2] +
+				plane[3] >= 0.0f;
+		}
+
+		ASSERT_EQ(inside, frustum.Test(box) != Frustum::Outside) << i;
+	}
+}
+
+// Checks the grown boxes contain the boxes and that culling returns
+// exactly the leaves whose grown box is not outside the frustum.
+static void CheckCull(
+	const BoundingVolumeTree<int>& tree,
+	const std::vector<uint32_t>& proxies,
+	const std::vector<BoundingBox>& boxes,
+	const Frustum& frustum)
+{
+	std::vector<int> expected;
+	std::vector<int> visible;
+
+	for (size_t i = 0; i < proxies.size(); ++i) {
+		if (proxies[i] == BoundingVolumeTree<int>::None) {
+			continue;
+		}
+
+		ASSERT_TRUE(tree.GetBox(proxies[i]).Contains(boxes[i]));
+		ASSERT_EQ(tree.GetValue(proxies[i]), int(i));
+
+		if (frustum.Test(tree.GetBox(proxies[i])) != Frustum::Outside) {
+			expected.push_back(i);
+		}
+	}
+
+	tree.Cull(frustum, visible);
+
+	std::sort(expected.begin(), expected.end());
+	std::sort(visible.begin(), visible.end());
+	ASSERT_EQ(visible, expected);
+}
+
+TEST(culling, tree)
+{
+	std::vector<float> matrix = Projection(1.0f, 1.5f, 0.1f, 100.0f);
+	Frustum frustum(matrix.data());
+
+	std::mt19937 rng(2);
+	std::uniform_real_distribution<float> coordinate(-100.0f, 100.0f);
+	std::uniform_real_distribution<float> step(-0.3f, 0.3f);
+
+	BoundingVolumeTree<int> tree(0.5f);
+	std::vector<uint32_t> proxies;
+	std::vector<BoundingBox> boxes;
+
+	for (int i = 0; i < 2000; ++i) {
+		boxes.push_back(Box(
+			coordinate(rng),
+			coordinate(rng) * 0.1f,
+			coordinate(rng),
+			1.0f));
+		proxies.push_back(tree.Insert(boxes.back(), i));
+	}
+
+	ASSERT_EQ(tree.GetLeafCount(), 2000);
+	CheckCull(tree, proxies, boxes, frustum);
+
+	uint32_t moved = 0;
+
+	for (int round = 0; round < 50; ++round) {
+		for (size_t i = 0; i < boxes.size(); ++i) {
+			if (proxies[i] == BoundingVolumeTree<int>::None) {
+				continue;
+			}
+
+			float dx = step(rng);
+			float dz = step(rng);
+
+			for (int axis = 0; axis < 3; axis += 2) {
+				float d = axis == 0 ? dx : dz;
+				boxes[i].min[axis] += d;
+				boxes[i].max[axis] += d;
+			}
+
+			moved += tree.Move(proxies[i], boxes[i]);
+		}
+
+		// Drop and add back some leaves.
+		for (int j = 0; j < 20; ++j) {
+			size_t i = rng() % boxes.size();
+
+			if (proxies[i] == BoundingVolumeTree<int>::None) {
+				proxies[i] = tree.Insert(boxes[i], i);
+			} else {
+				tree.Remove(proxies[i]);
+				proxies[i] = BoundingVolumeTree<int>::None;
+			}
+		}
+
+		CheckCull(tree, proxies, boxes, frustum);
+	}
+
+	// Small steps mostly stay inside the grown boxes.
+	ASSERT_GT(moved, 0);
+	ASSERT_LT(moved, 50 * 2000 / 2);
+
+	// Balanced: a few times the height of a perfect tree.
+	ASSERT_LE(tree.GetHeight(), 4 * std::log2(tree.GetLeafCount()));
+}
+
+TEST(culling, tree_invalid_proxy)
+{
+	BoundingVolumeTree<int> tree;
+	uint32_t proxy = tree.Insert(Box(0.0f, 0.0f, 0.0f, 1.0f), 0);
+	uint32_t other = tree.Insert(Box(5.0f, 0.0f, 0.0f, 1.0f), 1);
+
+	tree.Remove(proxy);
+	ASSERT_THROW(tree.Remove(proxy), std::runtime_error);
+	ASSERT_THROW(tree.GetValue(100), std::runtime_error);
+	ASSERT_EQ(tree.GetValue(other), 1);
+}
+
+TEST(culling, tree_inside_subtree)
+{
+	std::vector<float> matrix = Projection(1.5f, 1.0f, 0.1f, 1000.0f);
+	Frustum frustum(matrix.data());
+	BoundingVolumeTree<int> tree(0.0f);
+
+	// A cluster far in front of the camera and one behind it.
+	for (int i = 0; i < 64; ++i) {
+		tree.Insert(Box(i % 8 - 4.0f, i / 8 - 4.0f, -100.0f, 0.5f), i);
+		tree.Insert(Box(i % 8 - 4.0f, i / 8 - 4.0f, 100.0f, 0.5f), 64 + i);
+	}
+
+	std::vector<int> visible;
+	uint32_t tested = tree.Cull(frustum, visible);
+
+	std::sort(visible.begin(), visible.end());
+	ASSERT_EQ(visible.size(), 64);
+	ASSERT_EQ(visible.front(), 0);
+	ASSERT_EQ(visible.back(), 63);
+
+	// The clusters separate near the root, so few nodes are tested.
+	ASSERT_LT(tested, 16);
+}
+
+int main(int argc, char **argv)
+{
+	::testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
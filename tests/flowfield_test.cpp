@@ -0,0 +1,152 @@
+#include <vector>
+#include <random>
+#include <map>
+#include <queue>
+
+#include <gtest/gtest.h>
+
+#include "../src/common/pathfinder.h"
+#include "../src/common/flowfield.h"
+
+#include "testhelpers.h"
+
+TEST(flow, reference)
+{
+	std::mt19937 rng(17);
+	Map map;
+
+	for (int32_t y = -1; y <= 1; y++) {
+		for (int32_t x = -1; x <= 1; x++) {
+			map.AddChunk(x, y, MazeChunk(rng));
+		}
+	}
+
+	std::shared_ptr<const MapSnapshot> snapshot = map.Publish();
+	FlowField::Point target(5, 3);
+	FlowField field(*snapshot, target, 1);
+	int reachable = 0;
+
+	for (int64_t y = -CHUNKSIZE; y < 2 * CHUNKSIZE; y += 7) {
+		for (int64_t x = -CHUNKSIZE; x < 2 * CHUNKSIZE; x += 7) {
+			FlowField::Point point(x, y);
+			int32_t cost = field.GetCost(point);
+
+			ASSERT_EQ(cost, ReferencePathLength(*snapshot, point, target));
+
+			if (cost <= 0) {
+				ASSERT_EQ(field.GetDirection(point), FlowField::None);
+				continue;
+			}
+
+			// Following the directions never takes more steps than the
+			// distance and only crosses walkable tiles.
+			int steps = 0;
+
+			while (point != target) {
+				FlowField::Direction direction = field.GetDirection(point);
+				ASSERT_NE(direction, FlowField::None);
+
+				point.first += FlowField::StepX[direction];
+				point.second += FlowField::StepY[direction];
+				ASSERT_GE(field.GetCost(point), 0);
+				steps++;
+			}
+
+			ASSERT_LE(steps, cost);
+			reachable++;
+		}
+	}
+
+	ASSERT_GT(reachable, 100);
+	ASSERT_FALSE(field.Contains(FlowField::Point(2 * CHUNKSIZE, 0)));
+	ASSERT_EQ(field.GetCost(FlowField::Point(2 * CHUNKSIZE, 0)), -1);
+	ASSERT_THROW(
+		FlowField(*snapshot, target, FLOW_FIELD_MAX_RADIUS + 1),
+		std::invalid_argument);
+}
+
+TEST(flow, blocked_target)
+{
+	Map map;
+	std::shared_ptr<Chunk> chunk = std::make_shared<Chunk>();
+	chunk->AddLayer(std::make_shared<Layer>());
+
+	for (int y = 0; y < CHUNKSIZE; y++) {
+		for (int x = 0; x < CHUNKSIZE; x++) {
+			chunk->EditLayer(0)->SetTile(x, y, Tile(Tile::Grass));
+		}
+	}
+
+	map.AddChunk(0, 0, chunk);
+	map.PlaceBuilding(2, 2, 1, 1);
+
+	// Units head for the building even though nobody can stand on it.
+	FlowField::Point target(2 * BUILD_CELL, 2 * BUILD_CELL);
+	FlowField field(*map.Publish(), target, 0);
+	FlowField::Point above(2 * BUILD_CELL, 2 * BUILD_CELL - 1);
+	FlowField::Point inside(2 * BUILD_CELL + 1, 2 * BUILD_CELL + 1);
+
+	ASSERT_EQ(field.GetCost(target), 0);
+	ASSERT_EQ(
+		field.GetCost(FlowField::Point(2 * BUILD_CELL, 0)),
+		2 * BUILD_CELL);
+	ASSERT_EQ(field.GetDirection(above), FlowField::South);
+	ASSERT_EQ(field.GetCost(inside), -1);
+	ASSERT_EQ(field.GetDirection(inside), FlowField::None);
+}
+
+TEST(flow, cache)
+{
+	std::mt19937 rng(23);
+	Map map;
+	const int32_t length = 5;
+
+	for (int32_t x = 0; x < length; x++) {
+		map.AddChunk(x, 0, MazeChunk(rng));
+	}
+
+	FlowFieldCache cache(1, 2);
+	cache.Update(map.Publish());
+
+	FlowField::Point west(3, 3);
+	FlowField::Point east((length - 1) * CHUNKSIZE + 3, 3);
+
+	std::shared_ptr<const FlowField> westField = cache.Get(west);
+	std::shared_ptr<const FlowField> eastField = cache.Get(east);
+	ASSERT_EQ(cache.Get(west), westField);
+	ASSERT_EQ(cache.GetStatistics().builds, 2);
+	ASSERT_EQ(cache.GetStatistics().hits, 1);
+
+	// An edit only drops the fields covering the edited chunk.
+	map.GetChunk(length - 1, 0)->EditLayer(0)->SetTile(
+		0,
+		0,
+		Tile(Tile::Stone));
+	cache.Update(map.Publish());
+	ASSERT_EQ(cache.GetStatistics().invalidations, 1);
+	ASSERT_EQ(cache.Get(west), westField);
+	ASSERT_NE(cache.Get(east), eastField);
+
+	// Chunks appearing under a field drop it as well.
+	map.AddChunk(-1, 0, MazeChunk(rng));
+	cache.Update(map.Publish());
+	ASSERT_NE(cache.Get(west), westField);
+
+	// The least recently used field goes when the limit is reached.
+	FlowField::Point middle(2 * CHUNKSIZE, 3);
+	cache.Get(middle);
+	ASSERT_EQ(cache.GetStatistics().fields, 2);
+	uint64_t builds = cache.GetStatistics().builds;
+	cache.Get(middle);
+	cache.Get(east);
+	ASSERT_EQ(cache.GetStatistics().builds, builds + 1);
+
+	// Dropped fields stay usable.
+	ASSERT_EQ(eastField->GetTarget(), east);
+}
+
+int main(int argc, char **argv)
+{
+	::testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
@@ -0,0 +1,144 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "../src/common/generator.h"
+#include "../src/common/generation.h"
+
+static double MeasureKernel(AutomatonKernel kernel, const uint8_t* padded)
+{
+	const int iterations = 200000;
+	uint8_t result[CHUNKSIZE * CHUNKSIZE];
+	uint64_t checksum = 0;
+
+	for (int i = 0; i < 1000; i++) {
+		kernel(padded, result);
+	}
+
+	auto start = std::chrono::high_resolution_clock::now();
+
+	for (int i = 0; i < iterations; i++) {
+		kernel(padded, result);
+		checksum += result[i % (CHUNKSIZE * CHUNKSIZE)];
+	}
+
+	auto end = std::chrono::high_resolution_clock::now();
+
+	if (checksum == uint64_t(-1)) {
+		std::cout << checksum << std::endl;
+	}
+
+	double seconds = std::chrono::duration<double>(end - start).count();
+	return iterations / seconds;
+}
+
+static double MeasureGenerator(GenerationService::Generator generate)
+{
+	const int iterations = 20000;
+
+	auto start = std::chrono::high_resolution_clock::now();
+
+	for (int i = 0; i < iterations; i++) {
+		std::shared_ptr<Chunk> chunk = generate(1, i, -i);
+	}
+
+	auto end = std::chrono::high_resolution_clock::now();
+
+	double seconds = std::chrono::duration<double>(end - start).count();
+	return iterations / seconds;
+}
+
+static double MeasureHeights(NoiseKernel kernel)
+{
+	const int iterations = 100000;
+	std::vector<float> heights(CHUNKSIZE * CHUNKSIZE);
+	double checksum = 0.0;
+
+	for (int i = 0; i < 1000; i++) {
+		GenerateHeights(1, i, i, heights.data(), kernel);
+	}
+
+	auto start = std::chrono::high_resolution_clock::now();
+
+	for (int i = 0; i < iterations; i++) {
+		GenerateHeights(1, i, -i, heights.data(), kernel);
+		checksum += heights[i % heights.size()];
+	}
+
+	auto end = std::chrono::high_resolution_clock::now();
+
+	if (checksum == 1e300) {
+		std::cout << checksum << std::endl;
+	}
+
+	double ms = std::chrono::duration<double, std::milli>(
+		end - start).count();
+	return double(iterations) * CHUNKSIZE * CHUNKSIZE / ms;
+}
+
+int main()
+{
+	std::mt19937 rng(1);
+	std::vector<uint8_t> grid(CHUNKSIZE * CHUNKSIZE);
+
+	for (auto& cell : grid) {
+		cell = rng() % 3;
+	}
+
+	uint8_t padded[AUTOMATON_PADDED_SIZE];
+	AutomatonPadToroidal(grid.data(), padded);
+
+	std::cout << "automaton scalar: " <<
+		MeasureKernel(AutomatonStepScalar, padded) <<
+		" chunks/s" << std::endl;
+
+#ifdef AUTOMATON_X86
+	std::cout << "automaton sse2:   " <<
+		MeasureKernel(AutomatonStepSSE2, padded) <<
+		" chunks/s" << std::endl;
+
+	if (__builtin_cpu_supports("avx2")) {
+		std::cout << "automaton avx2:   " <<
+			MeasureKernel(AutomatonStepAVX2, padded) <<
+			" chunks/s" << std::endl;
+	}
+#endif
+
+	std::cout << "generator:        " << MeasureGenerator(generator) <<
+		" chunks/s" << std::endl;
+	std::cout << "seamless:         " <<
+		MeasureGenerator(seamlessGenerator) <<
+		" chunks/s" << std::endl;
+
+	// The heightmap falls short of this, see NoiseRowsAVX2().
+	const double heightTarget = 1e6;
+	double heights = MeasureHeights(NoiseScalar);
+	double bestHeights = heights;
+
+	std::cout << "heightmap scalar: " << heights << " samples/ms" <<
+		std::endl;
+
+#ifdef NOISE_X86
+	if (__builtin_cpu_supports("avx2")) {
+		heights = MeasureHeights(NoiseAVX2);
+		bestHeights = std::max(bestHeights, heights);
+		std::cout << "heightmap avx2:   " << heights << " samples/ms" <<
+			std::endl;
+	}
+
+	if (__builtin_cpu_supports("avx512f")) {
+		heights = MeasureHeights(NoiseAVX512);
+		bestHeights = std::max(bestHeights, heights);
+		std::cout << "heightmap avx512: " << heights << " samples/ms" <<
+			std::endl;
+	}
+#endif
+
+	std::cout << "heightmap target: " << heightTarget <<
+		" samples/ms, best kernel at " <<
+		100.0 * bestHeights / heightTarget << "%" << std::endl;
+
+	return 0;
+}
@@ -0,0 +1,503 @@
+#include <vector>
+#include <random>
+#include <thread>
+#include <cmath>
+
+#include <gtest/gtest.h>
+
+#include "../src/common/generator.h"
+#include "../src/common/generation.h"
+
+// Original per-tile neighbour loop with wrap-around branches.
+static std::vector<uint8_t> ReferenceAutomaton(const std::vector<uint8_t>& pregen)
+{
+	std::vector<uint8_t> result(CHUNKSIZE * CHUNKSIZE);
+
+	for (int i = 0; i < CHUNKSIZE * CHUNKSIZE; i++) {
+		int lu = i - CHUNKSIZE - 1, mu = i - CHUNKSIZE,
+			ru = i - CHUNKSIZE + 1, rm = i + 1,
+			rd = i + CHUNKSIZE + 1, md = i + CHUNKSIZE,
+			ld = i + CHUNKSIZE - 1, lm = i - 1;
+
+		if (i % CHUNKSIZE == 0) {
+			lu += CHUNKSIZE;
+			lm += CHUNKSIZE;
+			ld += CHUNKSIZE;
+		} else if (i % CHUNKSIZE == CHUNKSIZE - 1) {
+			ru -= CHUNKSIZE;
+			rm -= CHUNKSIZE;
+			rd -= CHUNKSIZE;
+		}
+
+		if (i / CHUNKSIZE == 0) {
+			lu += CHUNKSIZE * CHUNKSIZE;
+			mu += CHUNKSIZE * CHUNKSIZE;
+			ru += CHUNKSIZE * CHUNKSIZE;
+		} else if (i / CHUNKSIZE == CHUNKSIZE - 1) {
+			ld -= CHUNKSIZE * CHUNKSIZE;
+			md -= CHUNKSIZE * CHUNKSIZE;
+			rd -= CHUNKSIZE * CHUNKSIZE;
+		}
+
+		int sum = pregen[lu] + pregen[mu] + pregen[ru] + pregen[rm] +
+			pregen[rd] + pregen[md] + pregen[ld] + pregen[lm];
+
+		result[i] = sum > 3 && sum < 13;
+	}
+
+	return result;
+}
+
+static std::vector<uint8_t> RandomGrid(std::mt19937& rng)
+{
+	std::vector<uint8_t> grid(CHUNKSIZE * CHUNKSIZE);
+
+	for (auto& cell : grid) {
+		cell = rng() % 3;
+	}
+
+	return grid;
+}
+
+static void CheckKernel(AutomatonKernel kernel)
+{
+	std::mt19937 rng(42);
+
+	for (int iteration = 0; iteration < 200; iteration++) {
+		std::vector<uint8_t> grid = RandomGrid(rng);
+		std::vector<uint8_t> expected = ReferenceAutomaton(grid);
+
+		uint8_t padded[AUTOMATON_PADDED_SIZE];
+		std::vector<uint8_t> result(CHUNKSIZE * CHUNKSIZE);
+
+		AutomatonPadToroidal(grid.data(), padded);
+		kernel(padded, result.data());
+
+		ASSERT_EQ(expected, result) << "iteration " << iteration;
+	}
+}
+
+TEST(generator, automaton_scalar)
+{
+	CheckKernel(AutomatonStepScalar);
+}
+
+#ifdef AUTOMATON_X86
+TEST(generator, automaton_sse2)
+{
+	CheckKernel(AutomatonStepSSE2);
+}
+
+TEST(generator, automaton_avx2)
+{
+	if (!__builtin_cpu_supports("avx2")) {
+		GTEST_SKIP() << "AVX2 is not supported";
+	}
+
+	CheckKernel(AutomatonStepAVX2);
+}
+#endif
+
+TEST(generator, automaton_selected)
+{
+	CheckKernel(AutomatonSelectKernel());
+}
+
+TEST(generator, matches_reference)
+{
+	CounterRandom random(1, 0, 0);
+	std::vector<uint8_t> pregen(CHUNKSIZE * CHUNKSIZE);
+
+	for (size_t i = 0; i < pregen.size(); i++) {
+		pregen[i] = random.GetBelow(i, 3);
+	}
+
+	std::vector<uint8_t> expected = ReferenceAutomaton(pregen);
+	std::shared_ptr<Chunk> chunk = generator(1, 0, 0);
+
+	for (int i = 0; i < CHUNKSIZE * CHUNKSIZE; i++) {
+		Tile::Type type = expected[i] ? Tile::Grass : Tile::Stone;
+		ASSERT_EQ(
+			chunk->GetLayer(0)->GetTile(
+				i % CHUNKSIZE,
+				i / CHUNKSIZE).GetType(),
+			type) << "tile " << i;
+	}
+}
+
+TEST(generator, deterministic)
+{
+	std::shared_ptr<Chunk> first = generator(7, -3, 12);
+	std::shared_ptr<Chunk> second = generator(7, -3, 12);
+
+	ASSERT_EQ(first->LayerCount(), 1);
+	ASSERT_EQ(second->LayerCount(), 1);
+
+	for (int y = 0; y < CHUNKSIZE; y++) {
+		for (int x = 0; x < CHUNKSIZE; x++) {
+			ASSERT_EQ(
+				first->GetLayer(0)->GetTile(x, y).GetType(),
+				second->GetLayer(0)->GetTile(x, y).GetType());
+		}
+	}
+}
+
+TEST(generator, random_reference_values)
+{
+	// Values must not depend on the platform or libc.
+	ASSERT_EQ(SplitMix64(0), 0xE220A8397B1DCDAFull);
+
+	CounterRandom first(1, 2, 3);
+	CounterRandom second(1, 2, 3);
+	CounterRandom other(1, 3, 2);
+
+	for (uint64_t counter = 0; counter < 1000; counter++) {
+		ASSERT_EQ(first.Get(counter), second.Get(counter));
+		ASSERT_NE(first.Get(counter), other.Get(counter));
+		ASSERT_LT(first.GetBelow(counter, 3), 3);
+	}
+}
+
+TEST(generator, parallel)
+{
+	const int count = 64;
+	std::vector<std::shared_ptr<Chunk>> serial(count);
+	std::vector<std::shared_ptr<Chunk>> parallel(count);
+
+	for (int i = 0; i < count; i++) {
+		serial[i] = generator(5, i, -i);
+	}
+
+	std::vector<std::thread> threads;
+
+	for (int t = 0; t < 4; t++) {
+		threads.emplace_back([t, &parallel]() {
+			for (int i = t; i < count; i += 4) {
+				parallel[i] = generator(5, i, -i);
+			}
+		});
+	}
+
+	for (auto& thread : threads) {
+		thread.join();
+	}
+
+	for (int i = 0; i < count; i++) {
+		for (int y = 0; y < CHUNKSIZE; y++) {
+			for (int x = 0; x < CHUNKSIZE; x++) {
+				ASSERT_EQ(
+					serial[i]->GetLayer(0)->GetTile(x, y).GetType(),
+					parallel[i]->GetLayer(0)->GetTile(x, y).GetType());
+			}
+		}
+	}
+}
+
+TEST(generator, seamless)
+{
+	// Pre-noise of a 5x5 block of chunks, automaton applied to the 3x3
+	// block in the middle without any wrapping.
+	const int size = 5 * CHUNKSIZE;
+	std::vector<uint8_t> world(size * size);
+
+	for (int cy = 0; cy < 5; cy++) {
+		for (int cx = 0; cx < 5; cx++) {
+			CounterRandom random(9, cx - 2, cy - 2);
+
+			for (int i = 0; i < CHUNKSIZE * CHUNKSIZE; i++) {
+				int wx = cx * CHUNKSIZE + i % CHUNKSIZE;
+				int wy = cy * CHUNKSIZE + i / CHUNKSIZE;
+				world[wy * size + wx] = random.GetBelow(i, 3);
+			}
+		}
+	}
+
+	for (int cy = 1; cy < 4; cy++) {
+		for (int cx = 1; cx < 4; cx++) {
+			std::shared_ptr<Chunk> chunk =
+				seamlessGenerator(9, cx - 2, cy - 2);
+
+			for (int y = 0; y < CHUNKSIZE; y++) {
+				for (int x = 0; x < CHUNKSIZE; x++) {
+					int wx = cx * CHUNKSIZE + x;
+					int wy = cy * CHUNKSIZE + y;
+					int sum = 0;
+
+					for (int dy = -1; dy <= 1; dy++) {
+						for (int dx = -1; dx <= 1; dx++) {
+							if (dx || dy) {
+								sum += world[(wy + dy) * size +
+									wx + dx];
+							}
+						}
+					}
+
+					Tile::Type type = sum > 3 && sum < 13 ?
+						Tile::Grass : Tile::Stone;
+
+					ASSERT_EQ(
+						chunk->GetLayer(0)->GetTile(x, y).GetType(),
+						type);
+				}
+			}
+		}
+	}
+}
+
+TEST(generator, seamless_interior)
+{
+	std::shared_ptr<Chunk> wrapped = generator(4, 1, 1);
+	std::shared_ptr<Chunk> seamless = seamlessGenerator(4, 1, 1);
+
+	for (int y = 1; y < CHUNKSIZE - 1; y++) {
+		for (int x = 1; x < CHUNKSIZE - 1; x++) {
+			ASSERT_EQ(
+				wrapped->GetLayer(0)->GetTile(x, y).GetType(),
+				seamless->GetLayer(0)->GetTile(x, y).GetType());
+		}
+	}
+}
+
+// Textbook gradient noise evaluated directly at a world tile.
+static double ReferenceHeight(uint64_t seed, int64_t wx, int64_t wy)
+{
+	double height = 0.0;
+	double amplitude = 0.5;
+
+	for (int octave = 0; octave < NOISE_OCTAVES; octave++) {
+		int shift = NOISE_LARGEST_CELL_SHIFT - octave;
+		int64_t size = int64_t(1) << shift;
+		int64_t cx = wx >> shift;
+		int64_t cy = wy >> shift;
+		double fx = double(wx & (size - 1)) / size;
+		double fy = double(wy & (size - 1)) / size;
+
+		float g[2][2][2];
+
+		for (int j = 0; j < 2; j++) {
+			for (int i = 0; i < 2; i++) {
+				NoiseGradient(
+					NoiseOctaveKey(seed, octave),
+					cx + i,
+					cy + j,
+					g[j][i][0],
+					g[j][i][1]);
+			}
+		}
+
+		double n00 = g[0][0][0] * fx + g[0][0][1] * fy;
+		double n10 = g[0][1][0] * (fx - 1) + g[0][1][1] * fy;
+		double n01 = g[1][0][0] * fx + g[1][0][1] * (fy - 1);
+		double n11 = g[1][1][0] * (fx - 1) + g[1][1][1] * (fy - 1);
+		double u = NoiseFade(fx);
+		double v = NoiseFade(fy);
+		double nx0 = n00 + u * (n10 - n00);
+		double nx1 = n01 + u * (n11 - n01);
+
+		height += amplitude * (nx0 + v * (nx1 - nx0));
+		amplitude *= 0.5;
+	}
+
+	return height;
+}
+
+TEST(generator, heightmap_reference)
+{
+	std::vector<float> heights(CHUNKSIZE * CHUNKSIZE);
+
+	for (int32_t cy = -2; cy <= 1; cy++) {
+		for (int32_t cx = -2; cx <= 1; cx++) {
+			GenerateHeights(11, cx, cy, heights.data());
+
+			for (int y = 0; y < CHUNKSIZE; y++) {
+				for (int x = 0; x < CHUNKSIZE; x++) {
+					double expected = ReferenceHeight(
+						11,
+						int64_t(cx) * CHUNKSIZE + x,
+						int64_t(cy) * CHUNKSIZE + y);
+
+					ASSERT_NEAR(
+						heights[y * CHUNKSIZE + x],
+						expected,
+						1e-5);
+					ASSERT_LE(std::abs(expected), 1.0);
+				}
+			}
+		}
+	}
+}
+
+static void CheckNoiseKernel(NoiseKernel kernel)
+{
+	std::vector<float> expected(CHUNKSIZE * CHUNKSIZE);
+	std::vector<float> heights(CHUNKSIZE * CHUNKSIZE);
+
+	for (int32_t c = -20; c < 20; c++) {
+		GenerateHeights(12, c, 3 * c, expected.data(), NoiseScalar);
+		GenerateHeights(12, c, 3 * c, heights.data(), kernel);
+
+		ASSERT_EQ(expected, heights);
+	}
+}
+
+#ifdef NOISE_X86
+TEST(generator, heightmap_avx2)
+{
+	if (!__builtin_cpu_supports("avx2")) {
+		GTEST_SKIP() << "AVX2 is not supported";
+	}
+
+	CheckNoiseKernel(NoiseAVX2);
+}
+
+TEST(generator, heightmap_avx512)
+{
+	if (!__builtin_cpu_supports("avx512f")) {
+		GTEST_SKIP() << "AVX-512 is not supported";
+	}
+
+	CheckNoiseKernel(NoiseAVX512);
+}
+#endif
+
+TEST(generator, heightmap_attached)
+{
+	std::shared_ptr<Chunk> chunk = generator(11, -1, 0);
+	std::vector<float> heights(CHUNKSIZE * CHUNKSIZE);
+	GenerateHeights(11, -1, 0, heights.data());
+
+	ASSERT_TRUE(chunk->GetHeightmap());
+
+	for (int y = 0; y < CHUNKSIZE; y++) {
+		for (int x = 0; x < CHUNKSIZE; x++) {
+			ASSERT_EQ(
+				chunk->GetHeightmap()->GetHeight(x, y),
+				heights[y * CHUNKSIZE + x]);
+		}
+	}
+}
+
+static bool SameTiles(
+	const std::shared_ptr<Chunk>& first,
+	const std::shared_ptr<Chunk>& second)
+{
+	for (int y = 0; y < CHUNKSIZE; y++) {
+		for (int x = 0; x < CHUNKSIZE; x++) {
+			if (first->GetLayer(0)->GetTile(x, y).GetType() !=
+				second->GetLayer(0)->GetTile(x, y).GetType())
+			{
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+TEST(generation, area)
+{
+	Map map;
+	map.AddChunk(0, 0, generator(3, 0, 0));
+
+	GenerationService service(3);
+	service.Start(4);
+	service.RequestArea(&map, 0, 0, 2);
+	service.Wait();
+
+	ASSERT_EQ(service.Deliver(&map), 24);
+	ASSERT_EQ(map.ChunkCount(), 25);
+
+	for (int32_t y = -2; y <= 2; y++) {
+		for (int32_t x = -2; x <= 2; x++) {
+			ASSERT_TRUE(SameTiles(
+				map.GetChunk(x, y),
+				generator(3, x, y)));
+		}
+	}
+
+	service.Stop();
+}
+
+TEST(generation, focus_order)
+{
+	GenerationService service(3);
+
+	std::vector<GenerationService::Position> positions;
+
+	for (int32_t x = 0; x < 10; x++) {
+		positions.push_back(GenerationService::Position(x, 0));
+	}
+
+	service.Request(positions);
+	service.Request(positions);
+	service.SetFocus({GenerationService::Position(9, 0)});
+
+	service.Start(1);
+	service.Wait();
+
+	GenerationService::Result result;
+	int32_t expected = 9;
+
+	while (service.TakeResult(result)) {
+		ASSERT_EQ(result.x, expected);
+		expected--;
+	}
+
+	ASSERT_EQ(expected, -1);
+}
+
+static std::shared_ptr<Chunk> FailingGenerator(
+	uint64_t seed,
+	int32_t x,
+	int32_t y)
+{
+	if (x == 2) {
+		throw std::runtime_error("failed to generate chunk");
+	}
+
+	return generator(seed, x, y);
+}
+
+TEST(generation, errors)
+{
+	GenerationService service(3, FailingGenerator);
+
+	// Not running: nothing will finish the queue.
+	service.Request({GenerationService::Position(0, 0)});
+	service.Wait();
+
+	service.Start(2);
+	service.Request({
+		GenerationService::Position(1, 0),
+		GenerationService::Position(2, 0),
+		GenerationService::Position(3, 0)
+	});
+
+	// Idle implies the failing chunk is done, so the first call throws.
+	ASSERT_THROW(service.Wait(), std::runtime_error);
+	service.Wait();
+
+	GenerationService::Result result;
+	size_t results = 0;
+
+	while (service.TakeResult(result)) {
+		ASSERT_NE(result.x, 2);
+		results++;
+	}
+
+	ASSERT_EQ(results, 3);
+
+	// The failed chunk may be requested again.
+	service.Request({GenerationService::Position(2, 0)});
+	ASSERT_THROW(service.Wait(), std::runtime_error);
+
+	service.Stop();
+	service.Request({GenerationService::Position(4, 0)});
+	service.Wait();
+}
+
+int main(int argc, char **argv)
+{
+	::testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
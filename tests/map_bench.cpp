@@ -0,0 +1,476 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <malloc.h>
+
+#include "../src/common/generator.h"
+#include "../src/common/chunkformat.h"
+#include "../src/common/pathfinder.h"
+#include "../src/common/flowfield.h"
+
+// Storage and generation microbenchmarks.
+//
+// Every benchmark runs once as warmup and then RUNS times; the median
+// rate is reported together with the spread. Results can be saved with
+// --save FILE and compared against a saved file with --baseline FILE.
+//
+//     make map_bench BENCH_ARGS="--save before.txt"
+//     make map_bench BENCH_ARGS="--baseline before.txt"
+
+#define RUNS 7
+
+struct Result
+{
+	std::string name;
+	std::string unit;
+	double value;
+	double low;
+	double high;
+};
+
+typedef uint64_t (*Benchmark)(int run);
+
+static uint64_t Checksum = 0;
+
+// Runs a benchmark returning the number of operations it performed and
+// reports operations per second.
+static Result Measure(
+	const std::string& name,
+	const std::string& unit,
+	Benchmark benchmark)
+{
+	benchmark(-1);
+
+	std::vector<double> rates;
+
+	for (int run = 0; run < RUNS; run++) {
+		auto start = std::chrono::high_resolution_clock::now();
+		uint64_t operations = benchmark(run);
+		auto end = std::chrono::high_resolution_clock::now();
+
+		double seconds =
+			std::chrono::duration<double>(end - start).count();
+		rates.push_back(operations / seconds);
+	}
+
+	std::sort(rates.begin(), rates.end());
+
+	Result result;
+	result.name = name;
+	result.unit = unit;
+	result.value = rates[RUNS / 2];
+	result.low = rates.front();
+	result.high = rates.back();
+
+	return result;
+}
+
+static uint64_t GenerateChunks(int run)
+{
+	const int32_t count = 2000;
+
+	for (int32_t i = 0; i < count; i++) {
+		std::shared_ptr<Chunk> chunk = generator(run + 2, i, -i);
+		Checksum += chunk->GetLayer(0)->GetTile(i % CHUNKSIZE, 0).GetType();
+	}
+
+	return count;
+}
+
+static uint64_t SetTiles(int run)
+{
+	const int passes = 2000;
+	Layer layer;
+	Tile grass(Tile::Grass);
+	Tile stone(Tile::Stone);
+
+	for (int pass = 0; pass < passes; pass++) {
+		for (int y = 0; y < CHUNKSIZE; y++) {
+			for (int x = 0; x < CHUNKSIZE; x++) {
+				layer.SetTile(x, y, ((x ^ y ^ pass) & 1) ? stone : grass);
+			}
+		}
+	}
+
+	Checksum += layer.GetTile(run & (CHUNKSIZE - 1), 0).GetType();
+	return uint64_t(passes) * CHUNKSIZE * CHUNKSIZE;
+}
+
+static uint64_t GetTiles(int run)
+{
+	static std::shared_ptr<Chunk> chunk = generator(1, 0, 0);
+	const int passes = 2000;
+	const Layer& layer = *chunk->GetLayer(0);
+	uint64_t stones = 0;
+
+	for (int pass = 0; pass < passes; pass++) {
+		for (int y = 0; y < CHUNKSIZE; y++) {
+			for (int x = 0; x < CHUNKSIZE; x++) {
+				stones += layer.GetTile(x, y).GetType() == Tile::Stone;
+			}
+		}
+	}
+
+	Checksum += stones + run;
+	return uint64_t(passes) * CHUNKSIZE * CHUNKSIZE;
+}
+
+// Side of the square of chunks used by the map benchmarks.
+#define MAP_SIDE 256
+
+static uint64_t AddChunks(int run)
+{
+	static std::shared_ptr<Chunk> chunk = std::make_shared<Chunk>();
+	Map map;
+
+	for (int32_t y = 0; y < MAP_SIDE; y++) {
+		for (int32_t x = 0; x < MAP_SIDE; x++) {
+			map.AddChunk(x - MAP_SIDE / 2, y - MAP_SIDE / 2, chunk);
+		}
+	}
+
+	Checksum += map.ChunkCount() + run;
+	return uint64_t(MAP_SIDE) * MAP_SIDE;
+}
+
+static uint64_t LookupChunks(int run)
+{
+	static Map* map = nullptr;
+
+	if (!map) {
+		map = new Map;
+		std::shared_ptr<Chunk> chunk = std::make_shared<Chunk>();
+
+		for (int32_t y = 0; y < MAP_SIDE; y++) {
+			for (int32_t x = 0; x < MAP_SIDE; x++) {
+				map->AddChunk(x - MAP_SIDE / 2, y - MAP_SIDE / 2, chunk);
+			}
+		}
+	}
+
+	const uint64_t lookups = 1000000;
+	uint64_t found = 0;
+	uint32_t state = run + 1;
+
+	for (uint64_t i = 0; i < lookups; i++) {
+		// Scattered coordinates, a quarter of them outside the map.
+		state = state * 1664525u + 1013904223u;
+		int32_t x = int32_t((state >> 8) % (MAP_SIDE * 2)) - MAP_SIDE;
+		int32_t y = int32_t((state >> 20) % MAP_SIDE) - MAP_SIDE / 2;
+
+		found += map->GetChunk(x, y) != nullptr;
+	}
+
+	Checksum += found;
+	return lookups;
+}
+
+static uint64_t PlacementQueries(int run)
+{
+	static Map* map = nullptr;
+	const int32_t side = 16;
+
+	if (!map) {
+		map = new Map;
+
+		for (int32_t y = 0; y < side; y++) {
+			for (int32_t x = 0; x < side; x++) {
+				map->AddChunk(x, y, std::make_shared<Chunk>());
+			}
+		}
+
+		// Scattered equipment on about a tenth of the tiles.
+		uint32_t state = 7;
+
+		for (int i = 0; i < side * side * CHUNKSIZE * 10; i++) {
+			state = state * 1664525u + 1013904223u;
+			map->Place(
+				(state >> 8) % (side * CHUNKSIZE),
+				(state >> 20) % (side * CHUNKSIZE),
+				1,
+				1);
+		}
+	}
+
+	const uint64_t queries = 1000000;
+	uint64_t fits = 0;
+	uint32_t state = run + 1;
+
+	for (uint64_t i = 0; i < queries; i++) {
+		state = state * 1664525u + 1013904223u;
+		int64_t x = (state >> 8) % (side * CHUNKSIZE - 4);
+		int64_t y = (state >> 20) % (side * CHUNKSIZE - 4);
+
+		fits += map->CanPlace(x, y, 3, 3);
+		fits += map->CanPlaceBuilding(x / BUILD_CELL, y / BUILD_CELL, 1, 1);
+	}
+
+	Checksum += fits;
+	return 2 * queries;
+}
+
+static uint64_t EncodeChunks(int run)
+{
+	static std::shared_ptr<Chunk> chunk = generator(1, 0, 0);
+	const int count = 20000;
+	std::vector<char> data;
+
+	for (int i = 0; i < count; i++) {
+		data.clear();
+		ChunkFormatEncode(*chunk, data);
+	}
+
+	Checksum += data.size() + run;
+	return count;
+}
+
+static uint64_t DecodeChunks(int run)
+{
+	static std::vector<char> data;
+
+	if (data.empty()) {
+		ChunkFormatEncode(*generator(1, 0, 0), data);
+	}
+
+	const int count = 20000;
+
+	for (int i = 0; i < count; i++) {
+		ChunkView view;
+		view.Open(data.data(), data.size());
+		Checksum += view.ToChunk()->LayerCount();
+	}
+
+	Checksum += run;
+	return count;
+}
+
+static uint64_t PathQueries(int run)
+{
+	static Pathfinder* pathfinder = nullptr;
+	const int32_t side = 16;
+
+	if (!pathfinder) {
+		Map map;
+
+		for (int32_t y = 0; y < side; y++) {
+			for (int32_t x = 0; x < side; x++) {
+				map.AddChunk(x, y, generator(1, x, y));
+			}
+		}
+
+		pathfinder = new Pathfinder;
+		pathfinder->Update(map.Publish());
+	}
+
+	const uint64_t queries = 200;
+	std::vector<Pathfinder::Point> path;
+	uint32_t state = run + 1;
+
+	for (uint64_t i = 0; i < queries; i++) {
+		state = state * 1664525u + 1013904223u;
+		Pathfinder::Point start(
+			(state >> 8) % (side * CHUNKSIZE),
+			(state >> 20) % (side * CHUNKSIZE));
+		state = state * 1664525u + 1013904223u;
+		Pathfinder::Point goal(
+			(state >> 8) % (side * CHUNKSIZE),
+			(state >> 20) % (side * CHUNKSIZE));
+
+		pathfinder->FindPath(start, goal, path);
+		Checksum += path.size();
+	}
+
+	return queries;
+}
+
+static std::shared_ptr<const MapSnapshot> FlowSnapshot()
+{
+	static std::shared_ptr<const MapSnapshot> snapshot;
+
+	if (!snapshot) {
+		Map map;
+
+		for (int32_t y = -8; y <= 8; y++) {
+			for (int32_t x = -8; x <= 8; x++) {
+				map.AddChunk(x, y, generator(1, x, y));
+			}
+		}
+
+		snapshot = map.Publish();
+	}
+
+	return snapshot;
+}
+
+static uint64_t BuildFlowFields(int run)
+{
+	const int count = 5;
+
+	for (int i = 0; i < count; i++) {
+		FlowField field(
+			*FlowSnapshot(),
+			FlowField::Point(i, run),
+			FLOW_FIELD_MAX_RADIUS);
+		Checksum += field.GetCost(FlowField::Point(100, 100));
+	}
+
+	return count;
+}
+
+// Thousands of units stepping along one field.
+static uint64_t SampleFlowField(int run)
+{
+	static FlowField field(
+		*FlowSnapshot(),
+		FlowField::Point(0, 0),
+		FLOW_FIELD_MAX_RADIUS);
+	const int64_t extent = FLOW_FIELD_MAX_RADIUS * CHUNKSIZE;
+	const int units = 10000;
+	const int steps = 100;
+	std::vector<FlowField::Point> positions(units);
+	uint32_t state = run + 1;
+
+	for (FlowField::Point& position : positions) {
+		state = state * 1664525u + 1013904223u;
+		position.first = int64_t((state >> 8) % (2 * extent)) - extent;
+		position.second = int64_t((state >> 20) % (2 * extent)) - extent;
+	}
+
+	for (int step = 0; step < steps; step++) {
+		for (FlowField::Point& position : positions) {
+			FlowField::Direction direction = field.GetDirection(position);
+			position.first += FlowField::StepX[direction];
+			position.second += FlowField::StepY[direction];
+		}
+	}
+
+	Checksum += positions[run].first;
+	return uint64_t(units) * steps;
+}
+
+// Heap bytes held by generated chunks stored in a map.
+static double MemoryPerChunk()
+{
+	const int32_t side = 32;
+
+	size_t before = mallinfo2().uordblks;
+	Map map;
+
+	for (int32_t y = 0; y < side; y++) {
+		for (int32_t x = 0; x < side; x++) {
+			map.AddChunk(x, y, generator(1, x, y));
+		}
+	}
+
+	size_t after = mallinfo2().uordblks;
+	return double(after - before) / (side * side);
+}
+
+static std::map<std::string, double> LoadBaseline(const std::string& path)
+{
+	std::map<std::string, double> baseline;
+	std::ifstream file(path);
+
+	if (!file) {
+		throw std::runtime_error("failed to open baseline " + path);
+	}
+
+	std::string name;
+	double value;
+
+	while (file >> name >> value) {
+		baseline[name] = value;
+	}
+
+	return baseline;
+}
+
+int main(int argc, char** argv)
+{
+	std::string baselinePath;
+	std::string savePath;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--baseline") && i + 1 < argc) {
+			baselinePath = argv[++i];
+		} else if (!strcmp(argv[i], "--save") && i + 1 < argc) {
+			savePath = argv[++i];
+		} else {
+			std::cerr << "usage: " << argv[0] <<
+				" [--baseline FILE] [--save FILE]" << std::endl;
+			return 1;
+		}
+	}
+
+	std::vector<Result> results;
+
+	results.push_back(Measure("generator", "chunks/s", GenerateChunks));
+	results.push_back(Measure("layer_set_tile", "tiles/s", SetTiles));
+	results.push_back(Measure("layer_get_tile", "tiles/s", GetTiles));
+	results.push_back(Measure("map_add_chunk", "chunks/s", AddChunks));
+	results.push_back(Measure("map_get_chunk", "lookups/s", LookupChunks));
+	results.push_back(Measure("placement_query", "queries/s", PlacementQueries));
+	results.push_back(Measure("path_query", "paths/s", PathQueries));
+	results.push_back(Measure("flow_build", "fields/s", BuildFlowFields));
+	results.push_back(Measure("flow_sample", "steps/s", SampleFlowField));
+	results.push_back(Measure("format_encode", "chunks/s", EncodeChunks));
+	results.push_back(Measure("format_decode", "chunks/s", DecodeChunks));
+
+	Result memory;
+	memory.name = "memory_per_chunk";
+	memory.unit = "bytes";
+	memory.value = MemoryPerChunk();
+	memory.low = memory.value;
+	memory.high = memory.value;
+	results.push_back(memory);
+
+	std::map<std::string, double> baseline;
+
+	if (!baselinePath.empty()) {
+		baseline = LoadBaseline(baselinePath);
+	}
+
+	std::cout << std::fixed << std::setprecision(0);
+
+	for (const Result& result : results) {
+		std::cout << std::left << std::setw(18) << result.name <<
+			std::right << std::setw(14) << result.value << " " <<
+			std::left << std::setw(10) << result.unit <<
+			" [" << result.low << " .. " << result.high << "]";
+
+		auto it = baseline.find(result.name);
+
+		if (it != baseline.end() && it->second != 0.0) {
+			double change = (result.value / it->second - 1.0) * 100.0;
+
+			std::cout << std::showpos << std::setprecision(1) <<
+				"  " << change << "% vs baseline" <<
+				std::noshowpos << std::setprecision(0);
+		}
+
+		std::cout << std::endl;
+	}
+
+	if (!savePath.empty()) {
+		std::ofstream file(savePath);
+		file << std::fixed;
+
+		for (const Result& result : results) {
+			file << result.name << " " << result.value << std::endl;
+		}
+	}
+
+	if (Checksum == 1) {
+		std::cout << Checksum << std::endl;
+	}
+
+	return 0;
+}
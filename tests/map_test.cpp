@@ -0,0 +1,478 @@
+#include <vector>
+#include <random>
+#include <thread>
+#include <atomic>
+
+#include <gtest/gtest.h>
+
+#include "../src/common/generator.h"
+
+TEST(map, dirty_regions)
+{
+	std::shared_ptr<Chunk> chunk = generator(5, 0, 0);
+	ASSERT_EQ(chunk->GetDirty(), 0);
+
+	auto second = std::make_shared<Layer>();
+	second->ClearDirty();
+	chunk->AddLayer(second);
+
+	chunk->EditLayer(0)->SetTile(0, 0, Tile(Tile::Stone));
+	chunk->EditLayer(0)->SetTile(DIRTY_REGION_SIZE - 1, 1, Tile(Tile::Stone));
+	second->SetAttr(CHUNKSIZE - 1, CHUNKSIZE - 1, 2, true);
+
+	uint64_t last = uint64_t(1) << (DIRTY_REGIONS - 1);
+	ASSERT_EQ(chunk->GetLayer(0)->GetDirty(), 1);
+	ASSERT_EQ(second->GetDirty(), last);
+	ASSERT_EQ(chunk->GetDirty(), 1 | last);
+	ASSERT_TRUE(second->GetTile(CHUNKSIZE - 1, CHUNKSIZE - 1).GetAttr(2));
+
+	size_t x;
+	size_t y;
+	DirtyRegionOrigin(DIRTY_REGIONS - 1, x, y);
+	ASSERT_EQ(x, CHUNKSIZE - DIRTY_REGION_SIZE);
+	ASSERT_EQ(y, CHUNKSIZE - DIRTY_REGION_SIZE);
+
+	for (int region = 0; region < DIRTY_REGIONS; region++) {
+		DirtyRegionOrigin(region, x, y);
+		ASSERT_EQ(DirtyRegionBit(x, y), uint64_t(1) << region);
+		ASSERT_EQ(
+			DirtyRegionBit(
+				x + DIRTY_REGION_SIZE - 1,
+				y + DIRTY_REGION_SIZE - 1),
+			uint64_t(1) << region);
+	}
+
+	chunk->ClearDirty();
+	ASSERT_EQ(chunk->GetDirty(), 0);
+
+	// Heights and build grid occupancy are tracked as well.
+	chunk->EditHeightmap()->SetHeight(DIRTY_REGION_SIZE, 0, 0.5f);
+	ASSERT_EQ(chunk->GetDirty(), DirtyRegionBit(DIRTY_REGION_SIZE, 0));
+
+	chunk->ClearDirty();
+	chunk->GetOccupancy().Set(DIRTY_REGION_SIZE - 1, 0, 2, 1, true);
+	ASSERT_EQ(
+		chunk->GetDirty(),
+		DirtyRegionBit(0, 0) | DirtyRegionBit(DIRTY_REGION_SIZE, 0));
+
+	chunk->ClearDirty();
+	ASSERT_EQ(chunk->GetDirty(), 0);
+}
+
+// Summary of a square of world tiles computed from the tiles themselves.
+static bool ReferenceSummary(
+	const Map& map,
+	int64_t x0,
+	int64_t y0,
+	int64_t size,
+	TileSummary& summary)
+{
+	size_t counts[Tile::TypeCount] = {};
+	bool found = false;
+
+	for (int64_t y = y0; y < y0 + size; y++) {
+		for (int64_t x = x0; x < x0 + size; x++) {
+			int64_t cx = x >= 0 ? x / CHUNKSIZE : (x + 1) / CHUNKSIZE - 1;
+			int64_t cy = y >= 0 ? y / CHUNKSIZE : (y + 1) / CHUNKSIZE - 1;
+			auto chunk = map.GetChunk(cx, cy);
+
+			if (!chunk) {
+				continue;
+			}
+
+			size_t tx = x - cx * CHUNKSIZE;
+			size_t ty = y - cy * CHUNKSIZE;
+			float height = chunk->GetHeightmap()->GetHeight(tx, ty);
+
+			if (!found) {
+				summary.minHeight = height;
+				summary.maxHeight = height;
+				found = true;
+			}
+
+			summary.minHeight = std::min(summary.minHeight, height);
+			summary.maxHeight = std::max(summary.maxHeight, height);
+			counts[chunk->GetLayer(0)->GetTile(tx, ty).GetType()]++;
+		}
+	}
+
+	summary.dominantType = 0;
+
+	for (int type = 1; type < Tile::TypeCount; type++) {
+		if (counts[type] > counts[summary.dominantType]) {
+			summary.dominantType = type;
+		}
+	}
+
+	return found;
+}
+
+TEST(map, summaries)
+{
+	std::mt19937 rng(6);
+	Map map;
+
+	for (int32_t y = -2; y < 1; y++) {
+		for (int32_t x = -2; x < 2; x++) {
+			map.AddChunk(x, y, generator(8, x, y));
+		}
+	}
+
+	// Incremental edits.
+	for (int i = 0; i < 2000; i++) {
+		auto chunk = map.GetChunk(rng() % 4 - 2, -int32_t(rng() % 3));
+		size_t x = rng() % CHUNKSIZE;
+		size_t y = rng() % CHUNKSIZE;
+
+		if (rng() % 2) {
+			chunk->EditLayer(0)->SetTile(
+				x,
+				y,
+				Tile(rng() % 2 ? Tile::Grass : Tile::Stone));
+		} else {
+			float height = (rng() % 2001) / 1000.0f - 1.0f;
+			chunk->EditHeightmap()->SetHeight(x, y, height);
+		}
+	}
+
+	for (int level = 0; level < SUMMARY_LEVELS; level++) {
+		int64_t size = SummaryBlockSize(level);
+		int64_t from = -2 * CHUNKSIZE / size;
+		int64_t to = 2 * CHUNKSIZE / size;
+
+		for (int64_t by = from; by < to; by++) {
+			for (int64_t bx = from; bx < to; bx++) {
+				TileSummary expected;
+				TileSummary summary;
+
+				bool present = ReferenceSummary(
+					map,
+					bx * size,
+					by * size,
+					size,
+					expected);
+
+				ASSERT_EQ(map.GetSummary(level, bx, by, summary), present);
+
+				if (!present) {
+					continue;
+				}
+
+				ASSERT_EQ(summary.dominantType, expected.dominantType);
+				ASSERT_EQ(summary.minHeight, expected.minHeight);
+				ASSERT_EQ(summary.maxHeight, expected.maxHeight);
+			}
+		}
+	}
+}
+
+TEST(map, placement)
+{
+	Map map;
+
+	for (int32_t y = -1; y <= 0; y++) {
+		for (int32_t x = -1; x <= 0; x++) {
+			map.AddChunk(x, y, std::make_shared<Chunk>());
+		}
+	}
+
+	// Equipment across all four chunks.
+	ASSERT_TRUE(map.Place(-2, -3, 5, 6));
+	ASSERT_FALSE(map.CanPlace(2, 2, 1, 1));
+	ASSERT_TRUE(map.CanPlace(3, 2, 1, 1));
+	ASSERT_FALSE(map.Place(-4, -4, 3, 2));
+	ASSERT_TRUE(map.Place(-4, -4, 2, 2));
+
+	// The big cells holding that equipment are taken for buildings.
+	ASSERT_FALSE(map.CanPlaceBuilding(-1, -1, 1, 1));
+	ASSERT_FALSE(map.CanPlaceBuilding(0, 0, 1, 1));
+	ASSERT_TRUE(map.CanPlaceBuilding(1, 0, 2, 2));
+	ASSERT_TRUE(map.PlaceBuilding(1, 0, 2, 2));
+	ASSERT_FALSE(map.CanPlace(
+		BUILD_CELL * 3 - 1,
+		BUILD_CELL * 2 - 1,
+		1,
+		1));
+	ASSERT_TRUE(map.CanPlace(BUILD_CELL * 3, 0, 1, 1));
+
+	// Missing chunks never fit.
+	ASSERT_FALSE(map.CanPlace(CHUNKSIZE - 1, 0, 2, 1));
+	ASSERT_FALSE(map.CanPlaceBuilding(-BUILD_CELLS_PER_SIDE - 1, 0, 1, 1));
+
+	map.Release(-2, -3, 5, 6);
+	ASSERT_TRUE(map.CanPlaceBuilding(0, 0, 1, 1));
+	ASSERT_FALSE(map.CanPlaceBuilding(-1, -1, 1, 1));
+
+	map.Release(-4, -4, 2, 2);
+	ASSERT_TRUE(map.CanPlaceBuilding(-1, -1, 2, 1));
+
+	map.ReleaseBuilding(1, 0, 2, 2);
+	ASSERT_TRUE(map.Place(0, 0, CHUNKSIZE, CHUNKSIZE));
+	ASSERT_EQ(map.GetChunk(0, 0)->GetOccupancy().GetCells(),
+		Occupancy::RowMask(0, BUILD_CELLS_PER_SIDE * BUILD_CELLS_PER_SIDE));
+}
+
+TEST(map, occupancy_reference)
+{
+	std::mt19937 rng(11);
+	Occupancy occupancy;
+	bool tiles[CHUNKSIZE][CHUNKSIZE] = {};
+
+	for (int i = 0; i < 2000; i++) {
+		size_t x = rng() % CHUNKSIZE;
+		size_t y = rng() % CHUNKSIZE;
+		size_t width = 1 + rng() % (CHUNKSIZE - x);
+		size_t height = 1 + rng() % std::min<size_t>(4, CHUNKSIZE - y);
+
+		bool free = true;
+
+		for (size_t j = y; j < y + height; j++) {
+			for (size_t k = x; k < x + width; k++) {
+				free = free && !tiles[j][k];
+			}
+		}
+
+		ASSERT_EQ(occupancy.IsFree(x, y, width, height), free);
+
+		bool occupied = rng() % 3 != 0;
+		occupancy.Set(x, y, width, height, occupied);
+
+		for (size_t j = y; j < y + height; j++) {
+			for (size_t k = x; k < x + width; k++) {
+				tiles[j][k] = occupied;
+			}
+		}
+
+		for (int cy = 0; cy < BUILD_CELLS_PER_SIDE; cy++) {
+			for (int cx = 0; cx < BUILD_CELLS_PER_SIDE; cx++) {
+				ASSERT_EQ(
+					occupancy.IsCellFree(cx, cy, 1, 1),
+					occupancy.IsFree(
+						cx * BUILD_CELL,
+						cy * BUILD_CELL,
+						BUILD_CELL,
+						BUILD_CELL));
+			}
+		}
+	}
+}
+
+TEST(map, attribute_summaries)
+{
+	std::mt19937 rng(12);
+	Layer layer;
+
+	for (int i = 0; i < 5000; i++) {
+		size_t x = rng() % CHUNKSIZE;
+		size_t y = rng() % CHUNKSIZE;
+
+		// Mostly one attribute flipped at a time, sometimes a whole tile.
+		if (rng() % 4) {
+			layer.SetAttr(x, y, rng() % 4, rng() % 8 != 0);
+		} else {
+			Tile tile(Tile::Stone);
+			tile.SetAttributes(rng() % 16);
+			layer.SetTile(x, y, tile);
+		}
+
+		uint32_t layerOr = 0;
+		uint32_t layerAnd = ~uint32_t(0);
+
+		for (int j = 0; j < CHUNKSIZE; j++) {
+			uint32_t rowOr = 0;
+			uint32_t rowAnd = ~uint32_t(0);
+
+			for (int k = 0; k < CHUNKSIZE; k++) {
+				rowOr |= layer.GetTile(k, j).GetAttributes();
+				rowAnd &= layer.GetTile(k, j).GetAttributes();
+			}
+
+			ASSERT_EQ(layer.GetRowOr(j), rowOr);
+			ASSERT_EQ(layer.GetRowAnd(j), rowAnd);
+			layerOr |= rowOr;
+			layerAnd &= rowAnd;
+		}
+
+		ASSERT_EQ(layer.GetAttributesOr(), layerOr);
+		ASSERT_EQ(layer.GetAttributesAnd(), layerAnd);
+
+		size_t qx = rng() % CHUNKSIZE;
+		size_t qy = rng() % CHUNKSIZE;
+		size_t width = 1 + rng() % (CHUNKSIZE - qx);
+		size_t height = 1 + rng() % (CHUNKSIZE - qy);
+		int attr = rng() % 5;
+		bool any = false;
+		bool all = true;
+
+		for (size_t j = qy; j < qy + height; j++) {
+			for (size_t k = qx; k < qx + width; k++) {
+				any = any || layer.GetTile(k, j).GetAttr(attr);
+				all = all && layer.GetTile(k, j).GetAttr(attr);
+			}
+		}
+
+		ASSERT_EQ(layer.AnyAttr(attr, qx, qy, width, height), any);
+		ASSERT_EQ(layer.AllAttr(attr, qx, qy, width, height), all);
+	}
+}
+
+TEST(map, attribute_queries)
+{
+	Map map;
+	map.AddChunk(0, 0, generator(5, 0, 0));
+	map.AddChunk(1, 0, generator(5, 1, 0));
+
+	ASSERT_FALSE(map.AnyAttr(1, 0, 0, 2 * CHUNKSIZE, CHUNKSIZE));
+	ASSERT_EQ(map.GetChunk(0, 0)->GetAttributesOr(), 0);
+
+	map.GetChunk(1, 0)->EditLayer(0)->SetAttr(3, 5, 1, true);
+	ASSERT_EQ(map.GetChunk(1, 0)->GetAttributesOr(), 2);
+	ASSERT_TRUE(map.AnyAttr(1, CHUNKSIZE - 2, 4, 6, 2));
+	ASSERT_FALSE(map.AnyAttr(1, CHUNKSIZE - 2, 4, 5, 2));
+	ASSERT_FALSE(map.AnyAttr(1, 0, 0, 2 * CHUNKSIZE, CHUNKSIZE, 1));
+
+	// Missing chunks have no attributes.
+	ASSERT_TRUE(map.AnyAttr(1, -CHUNKSIZE, 0, 3 * CHUNKSIZE, CHUNKSIZE));
+	ASSERT_FALSE(map.AllAttr(1, -1, 5, 2, 1));
+
+	for (int y = 0; y < 2; y++) {
+		for (int x = 0; x < 2 * CHUNKSIZE; x++) {
+			map.GetChunk(x / CHUNKSIZE, 0)->EditLayer(0)->SetAttr(
+				x % CHUNKSIZE,
+				y,
+				4,
+				true);
+		}
+	}
+
+	ASSERT_TRUE(map.AllAttr(4, 0, 0, 2 * CHUNKSIZE, 2));
+	ASSERT_FALSE(map.AllAttr(4, 0, 0, 2 * CHUNKSIZE, 3));
+}
+
+TEST(map, snapshots)
+{
+	Map map;
+	map.AddChunk(0, 0, generator(5, 0, 0));
+	map.AddChunk(1, 0, generator(5, 1, 0));
+	map.GetChunk(0, 0)->AddLayer(std::make_shared<Layer>());
+
+	ASSERT_EQ(map.GetSnapshot()->ChunkCount(), 0);
+
+	std::shared_ptr<const MapSnapshot> first = map.Publish();
+	ASSERT_EQ(first->GetEpoch(), 1);
+	ASSERT_EQ(first->ChunkCount(), 2);
+	ASSERT_EQ(map.GetSnapshot(), first);
+
+	// Nothing changed, nothing to publish.
+	ASSERT_EQ(map.Publish(), first);
+
+	Tile::Type before =
+		first->GetChunk(0, 0)->GetLayer(0)->GetTile(3, 3).GetType();
+	Tile::Type after = before == Tile::Grass ? Tile::Stone : Tile::Grass;
+	map.GetChunk(0, 0)->EditLayer(0)->SetTile(3, 3, Tile(after));
+
+	std::shared_ptr<const MapSnapshot> second = map.Publish();
+	ASSERT_EQ(second->GetEpoch(), 2);
+
+	// The old snapshot still sees the old tile.
+	ASSERT_EQ(
+		first->GetChunk(0, 0)->GetLayer(0)->GetTile(3, 3).GetType(),
+		before);
+	ASSERT_EQ(
+		second->GetChunk(0, 0)->GetLayer(0)->GetTile(3, 3).GetType(),
+		after);
+
+	// Only the edited layer was copied; the other chunk is shared as is.
+	std::shared_ptr<const Chunk> old = first->GetChunk(0, 0);
+	std::shared_ptr<const Chunk> current = second->GetChunk(0, 0);
+	ASSERT_NE(old->GetLayer(0), current->GetLayer(0));
+	ASSERT_EQ(old->GetLayer(1), current->GetLayer(1));
+	ASSERT_EQ(old->GetHeightmap(), current->GetHeightmap());
+	ASSERT_EQ(first->GetChunk(1, 0), second->GetChunk(1, 0));
+
+	// With only the map's own snapshot left, the first edit of a layer
+	// still copies it away from that snapshot; later edits do not.
+	first.reset();
+	second.reset();
+	old.reset();
+	current.reset();
+	map.Publish();
+	const Layer* layer = map.GetChunk(1, 0)->GetLayer(0);
+	ASSERT_NE(map.GetChunk(1, 0)->EditLayer(0), layer);
+	ASSERT_EQ(map.GetChunk(1, 0)->EditLayer(0), map.GetChunk(1, 0)->GetLayer(0));
+
+	map.AddChunk(2, 0, generator(5, 2, 0));
+	ASSERT_EQ(map.Publish()->ChunkCount(), 3);
+}
+
+TEST(map, snapshot_readers)
+{
+	Map map;
+	const int32_t side = 4;
+
+	for (int32_t y = 0; y < side; y++) {
+		for (int32_t x = 0; x < side; x++) {
+			map.AddChunk(x, y, generator(5, x, y));
+		}
+	}
+
+	map.Publish();
+
+	std::atomic<bool> work(true);
+	std::atomic<int> failures(0);
+	std::vector<std::thread> readers;
+
+	// The writer fills a whole chunk layer with one type per epoch, so a
+	// consistent snapshot never mixes types inside a layer it rewrote.
+	for (int t = 0; t < 3; t++) {
+		readers.emplace_back([&map, &work, &failures]() {
+			while (work) {
+				std::shared_ptr<const MapSnapshot> snapshot =
+					map.GetSnapshot();
+
+				if (snapshot->GetEpoch() < 2) {
+					continue;
+				}
+
+				const Layer* layer = snapshot->GetChunk(0, 0)->GetLayer(0);
+				Tile::Type type = layer->GetTile(0, 0).GetType();
+
+				for (int y = 0; y < CHUNKSIZE; y++) {
+					for (int x = 0; x < CHUNKSIZE; x++) {
+						if (layer->GetTile(x, y).GetType() != type) {
+							failures++;
+						}
+					}
+				}
+			}
+		});
+	}
+
+	for (int epoch = 0; epoch < 500; epoch++) {
+		Tile tile(epoch % 2 ? Tile::Stone : Tile::Grass);
+		Layer* layer = map.GetChunk(0, 0)->EditLayer(0);
+
+		for (int y = 0; y < CHUNKSIZE; y++) {
+			for (int x = 0; x < CHUNKSIZE; x++) {
+				layer->SetTile(x, y, tile);
+			}
+		}
+
+		map.Publish();
+	}
+
+	work = false;
+
+	for (auto& reader : readers) {
+		reader.join();
+	}
+
+	ASSERT_EQ(failures, 0);
+	ASSERT_EQ(map.GetSnapshot()->GetEpoch(), 501);
+}
+
+int main(int argc, char **argv)
+{
+	::testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
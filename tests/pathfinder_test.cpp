@@ -0,0 +1,236 @@
+#include <vector>
+#include <random>
+#include <map>
+#include <queue>
+#include <cstdlib>
+
+#include <gtest/gtest.h>
+
+#include "../src/common/pathfinder.h"
+
+#include "testhelpers.h"
+
+// Checks that path leads from start to goal over walkable neighbours.
+static void CheckPath(
+	const MapSnapshot& snapshot,
+	Pathfinder::Point start,
+	Pathfinder::Point goal,
+	const std::vector<Pathfinder::Point>& path)
+{
+	ASSERT_FALSE(path.empty());
+	ASSERT_EQ(path.front(), start);
+	ASSERT_EQ(path.back(), goal);
+
+	for (size_t i = 0; i < path.size(); i++) {
+		ASSERT_EQ(ReferencePathLength(snapshot, path[i], path[i]), 0);
+
+		if (i > 0) {
+			ASSERT_EQ(
+				std::llabs(path[i].first - path[i - 1].first) +
+				std::llabs(path[i].second - path[i - 1].second),
+				1);
+		}
+	}
+}
+
+TEST(path, reference)
+{
+	std::mt19937 rng(11);
+	Map map;
+	const int32_t side = 4;
+
+	for (int32_t y = -1; y < side - 1; y++) {
+		for (int32_t x = -1; x < side - 1; x++) {
+			map.AddChunk(x, y, MazeChunk(rng));
+		}
+	}
+
+	std::shared_ptr<const MapSnapshot> snapshot = map.Publish();
+	Pathfinder pathfinder;
+	pathfinder.Update(snapshot);
+	ASSERT_GT(pathfinder.NodeCount(), 0);
+
+	std::uniform_int_distribution<int64_t> coordinate(
+		-CHUNKSIZE,
+		(side - 1) * CHUNKSIZE - 1);
+	int found = 0;
+
+	for (int i = 0; i < 100; i++) {
+		Pathfinder::Point start(coordinate(rng), coordinate(rng));
+		Pathfinder::Point goal(coordinate(rng), coordinate(rng));
+		int64_t length = ReferencePathLength(*snapshot, start, goal);
+		std::vector<Pathfinder::Point> path;
+
+		ASSERT_EQ(pathfinder.FindPath(start, goal, path), length >= 0);
+
+		if (length < 0) {
+			ASSERT_TRUE(path.empty());
+			continue;
+		}
+
+		CheckPath(*snapshot, start, goal, path);
+
+		// Paths through portals may be a bit longer than the shortest.
+		ASSERT_GE(int64_t(path.size()) - 1, length);
+		ASSERT_LE(int64_t(path.size()) - 1, length + length / 2 + 16);
+		found++;
+	}
+
+	ASSERT_GT(found, 50);
+}
+
+TEST(path, unreachable)
+{
+	Map map;
+	std::shared_ptr<Chunk> left = std::make_shared<Chunk>();
+	std::shared_ptr<Chunk> right = std::make_shared<Chunk>();
+	left->AddLayer(std::make_shared<Layer>());
+	right->AddLayer(std::make_shared<Layer>());
+
+	for (int y = 0; y < CHUNKSIZE; y++) {
+		for (int x = 0; x < CHUNKSIZE; x++) {
+			left->EditLayer(0)->SetTile(x, y, Tile(Tile::Grass));
+			right->EditLayer(0)->SetTile(x, y, Tile(Tile::Grass));
+		}
+
+		left->EditLayer(0)->SetTile(CHUNKSIZE - 1, y, Tile(Tile::Stone));
+	}
+
+	map.AddChunk(0, 0, left);
+	map.AddChunk(1, 0, right);
+
+	Pathfinder pathfinder;
+	pathfinder.Update(map.Publish());
+
+	std::vector<Pathfinder::Point> path;
+	Pathfinder::Point start(1, 1);
+	Pathfinder::Point goal(CHUNKSIZE + 1, 1);
+
+	ASSERT_FALSE(pathfinder.FindPath(start, goal, path));
+	ASSERT_TRUE(path.empty());
+	ASSERT_FALSE(pathfinder.FindPath(start, Pathfinder::Point(-5, 1), path));
+	ASSERT_FALSE(
+		pathfinder.FindPath(start, Pathfinder::Point(CHUNKSIZE - 1, 1), path));
+
+	// Opening the wall and placing equipment on the gap.
+	map.GetChunk(0, 0)->EditLayer(0)->SetTile(
+		CHUNKSIZE - 1,
+		7,
+		Tile(Tile::Grass));
+	map.Place(CHUNKSIZE - 1, 7, 1, 1);
+	pathfinder.Update(map.Publish());
+	ASSERT_FALSE(pathfinder.FindPath(start, goal, path));
+
+	map.Release(CHUNKSIZE - 1, 7, 1, 1);
+	std::shared_ptr<const MapSnapshot> snapshot = map.Publish();
+	pathfinder.Update(snapshot);
+	ASSERT_TRUE(pathfinder.FindPath(start, goal, path));
+	CheckPath(*snapshot, start, goal, path);
+	ASSERT_EQ(path.size() - 1, ReferencePathLength(*snapshot, start, goal));
+}
+
+TEST(path, incremental_update)
+{
+	std::mt19937 rng(5);
+	Map map;
+	const int32_t side = 3;
+
+	for (int32_t y = 0; y < side; y++) {
+		for (int32_t x = 0; x < side; x++) {
+			map.AddChunk(x, y, MazeChunk(rng));
+		}
+	}
+
+	Pathfinder incremental;
+	incremental.Update(map.Publish());
+
+	std::uniform_int_distribution<int64_t> coordinate(
+		0,
+		side * CHUNKSIZE - 1);
+
+	for (int round = 0; round < 10; round++) {
+		for (int i = 0; i < 20; i++) {
+			int64_t x = coordinate(rng);
+			int64_t y = coordinate(rng);
+			Tile tile(rng() % 2 ? Tile::Grass : Tile::Stone);
+
+			map.GetChunk(x / CHUNKSIZE, y / CHUNKSIZE)->EditLayer(0)->SetTile(
+				x % CHUNKSIZE,
+				y % CHUNKSIZE,
+				tile);
+		}
+
+		if (round == 5) {
+			map.AddChunk(side, 0, MazeChunk(rng));
+		}
+
+		std::shared_ptr<const MapSnapshot> snapshot = map.Publish();
+		incremental.Update(snapshot);
+
+		Pathfinder fresh;
+		fresh.Update(snapshot);
+		ASSERT_EQ(incremental.NodeCount(), fresh.NodeCount());
+
+		for (int i = 0; i < 10; i++) {
+			Pathfinder::Point start(coordinate(rng), coordinate(rng));
+			Pathfinder::Point goal(coordinate(rng), coordinate(rng));
+			std::vector<Pathfinder::Point> expected;
+			std::vector<Pathfinder::Point> path;
+
+			bool found = fresh.FindPath(start, goal, expected);
+			ASSERT_EQ(incremental.FindPath(start, goal, path), found);
+
+			// Node numbers differ, so ties between equally short
+			// routes may be broken differently.
+			ASSERT_EQ(path.size(), expected.size());
+
+			if (found) {
+				CheckPath(*snapshot, start, goal, path);
+			}
+
+			ASSERT_EQ(found, ReferencePathLength(*snapshot, start, goal) >= 0);
+		}
+	}
+}
+
+TEST(path, parallel)
+{
+	std::mt19937 rng(3);
+	Map map;
+	const int32_t side = 4;
+
+	for (int32_t y = 0; y < side; y++) {
+		for (int32_t x = 0; x < side; x++) {
+			map.AddChunk(x, y, MazeChunk(rng));
+		}
+	}
+
+	Pathfinder pathfinder;
+	pathfinder.Update(map.Publish());
+
+	std::uniform_int_distribution<int64_t> coordinate(
+		0,
+		side * CHUNKSIZE - 1);
+	std::vector<Pathfinder::Request> requests(300);
+
+	for (Pathfinder::Request& request : requests) {
+		request.start = Pathfinder::Point(coordinate(rng), coordinate(rng));
+		request.goal = Pathfinder::Point(coordinate(rng), coordinate(rng));
+	}
+
+	std::vector<std::vector<Pathfinder::Point>> paths;
+	pathfinder.FindPaths(requests, paths, 4);
+	ASSERT_EQ(paths.size(), requests.size());
+
+	for (size_t i = 0; i < requests.size(); i++) {
+		std::vector<Pathfinder::Point> path;
+		pathfinder.FindPath(requests[i].start, requests[i].goal, path);
+		ASSERT_EQ(paths[i], path);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	::testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
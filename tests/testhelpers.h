@@ -0,0 +1,152 @@
+#ifndef TESTHELPERS_H
+#define TESTHELPERS_H
+
+// Helpers shared by the test suites.
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <queue>
+#include <random>
+
+#include "../src/common/pathfinder.h"
+
+inline bool SameChunk(
+	const std::shared_ptr<Chunk>& first,
+	const std::shared_ptr<Chunk>& second)
+{
+	if (first->LayerCount() != second->LayerCount()) {
+		return false;
+	}
+
+	for (size_t l = 0; l < first->LayerCount(); l++) {
+		for (int y = 0; y < CHUNKSIZE; y++) {
+			for (int x = 0; x < CHUNKSIZE; x++) {
+				const Tile& a = first->GetLayer(l)->GetTile(x, y);
+				const Tile& b = second->GetLayer(l)->GetTile(x, y);
+
+				if (a.GetType() != b.GetType() ||
+					a.GetAttributes() != b.GetAttributes())
+				{
+					return false;
+				}
+			}
+		}
+	}
+
+	for (int y = 0; y < CHUNKSIZE; y++) {
+		if (first->GetOccupancy().GetRow(y) !=
+			second->GetOccupancy().GetRow(y))
+		{
+			return false;
+		}
+	}
+
+	if (!first->GetHeightmap() || !second->GetHeightmap()) {
+		return !first->GetHeightmap() && !second->GetHeightmap();
+	}
+
+	for (int y = 0; y < CHUNKSIZE; y++) {
+		for (int x = 0; x < CHUNKSIZE; x++) {
+			if (first->GetHeightmap()->GetHeight(x, y) !=
+				second->GetHeightmap()->GetHeight(x, y))
+			{
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+// Chunks of grass with walls of stone; every wall has a few gaps.
+inline std::shared_ptr<Chunk> MazeChunk(std::mt19937& rng)
+{
+	std::shared_ptr<Chunk> chunk = std::make_shared<Chunk>();
+	std::shared_ptr<Layer> layer = std::make_shared<Layer>();
+
+	for (int y = 0; y < CHUNKSIZE; y++) {
+		for (int x = 0; x < CHUNKSIZE; x++) {
+			layer->SetTile(x, y, Tile(Tile::Grass));
+		}
+	}
+
+	for (int wall = 0; wall < 6; wall++) {
+		bool vertical = rng() % 2;
+		int line = 2 + rng() % (CHUNKSIZE - 4);
+
+		for (int i = 0; i < CHUNKSIZE; i++) {
+			if (rng() % 8 == 0) {
+				continue;
+			}
+
+			if (vertical) {
+				layer->SetTile(line, i, Tile(Tile::Stone));
+			} else {
+				layer->SetTile(i, line, Tile(Tile::Stone));
+			}
+		}
+	}
+
+	chunk->AddLayer(layer);
+	return chunk;
+}
+
+// Length of the shortest path over the whole snapshot, -1 if none.
+inline int64_t ReferencePathLength(
+	const MapSnapshot& snapshot,
+	Pathfinder::Point start,
+	Pathfinder::Point goal)
+{
+	auto walkable = [&snapshot](Pathfinder::Point point) {
+		int32_t cx = point.first >= 0 ?
+			point.first / CHUNKSIZE : (point.first + 1) / CHUNKSIZE - 1;
+		int32_t cy = point.second >= 0 ?
+			point.second / CHUNKSIZE : (point.second + 1) / CHUNKSIZE - 1;
+		std::shared_ptr<const Chunk> chunk = snapshot.GetChunk(cx, cy);
+
+		if (!chunk) {
+			return false;
+		}
+
+		int x = point.first - int64_t(cx) * CHUNKSIZE;
+		int y = point.second - int64_t(cy) * CHUNKSIZE;
+
+		return chunk->GetLayer(0)->GetTile(x, y).GetType() == Tile::Grass &&
+			chunk->GetOccupancy().IsFree(x, y, 1, 1);
+	};
+
+	std::map<Pathfinder::Point, int64_t> distance;
+	std::queue<Pathfinder::Point> queue;
+
+	if (!walkable(start) || !walkable(goal)) {
+		return -1;
+	}
+
+	distance[start] = 0;
+	queue.push(start);
+
+	while (!queue.empty()) {
+		Pathfinder::Point point = queue.front();
+		queue.pop();
+
+		if (point == goal) {
+			return distance[point];
+		}
+
+		const int steps[4][2] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
+
+		for (const auto& step : steps) {
+			Pathfinder::Point next(point.first + step[0], point.second + step[1]);
+
+			if (!distance.count(next) && walkable(next)) {
+				distance[next] = distance[point] + 1;
+				queue.push(next);
+			}
+		}
+	}
+
+	return -1;
+}
+
+#endif